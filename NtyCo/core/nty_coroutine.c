@@ -175,6 +175,7 @@ extern int nty_schedule_create(int stack_size);
 void nty_coroutine_free(nty_coroutine *co) {
 	if (co == NULL) return ;
 	co->sched->spawned_coroutines --;
+	__atomic_sub_fetch(&co->sched->live, 1, __ATOMIC_RELAXED);
 #if 1
 	if (co->stack) {
 		free(co->stack);
@@ -276,6 +277,153 @@ void nty_coroutine_sleep(uint64_t msecs) {
 	}
 }
 
+// wait for a nty_coroutine_wake(), returns at once for one that came early
+void nty_coroutine_park(void) {
+	nty_coroutine *co = nty_coroutine_get_sched()->curr_thread;
+
+	if (co->wakeups > 0) {
+		co->wakeups --;
+		return ;
+	}
+
+	co->status |= BIT(NTY_COROUTINE_STATUS_PARKED);
+	co->sched->parked ++;
+	nty_coroutine_yield(co);
+}
+
+// on the thread of co's scheduler
+static void nty_coroutine_unpark(void *arg) {
+	nty_coroutine *co = (nty_coroutine *)arg;
+
+	if (co->status & BIT(NTY_COROUTINE_STATUS_PARKED)) {
+		co->status &= CLEARBIT(NTY_COROUTINE_STATUS_PARKED);
+		co->sched->parked --;
+		TAILQ_INSERT_TAIL(&co->sched->ready, co, ready_next);
+	} else {
+		co->wakeups ++;
+	}
+}
+
+// from any thread. co must not exit before it parked and was woken
+int nty_coroutine_wake(nty_coroutine *co) {
+	if (co->sched == nty_coroutine_get_sched()) {
+		nty_coroutine_unpark(co);
+		return 0;
+	}
+	return nty_schedule_post(co->sched, nty_coroutine_unpark, co);
+}
+
+// compute threads. a coroutine hands fn(arg) to one and parks, the thread
+// runs it and wakes the coroutine through its scheduler's inbox. the
+// coroutine does not move: with ucontext its saved stack only fits the
+// scheduler's stack, which the other coroutines use meanwhile
+static LIST_HEAD(_nty_coroutine_compute_list, _nty_coroutine_compute_sched) compute_scheds =
+	LIST_HEAD_INITIALIZER(compute_scheds);
+static unsigned int compute_rr = 0;
+
+static void *nty_coroutine_compute_run(void *arg) {
+	nty_coroutine_compute_sched *cs = (nty_coroutine_compute_sched *)arg;
+
+	while (1) {
+		pthread_mutex_lock(&cs->run_mutex);
+		while (TAILQ_EMPTY(&cs->coroutines)) {
+			__atomic_store_n(&cs->compute_status, NTY_COROUTINE_COMPUTE_FREE, __ATOMIC_RELAXED);
+			pthread_cond_wait(&cs->run_cond, &cs->run_mutex);
+		}
+		nty_coroutine *co = TAILQ_FIRST(&cs->coroutines);
+		TAILQ_REMOVE(&cs->coroutines, co, compute_next);
+		__atomic_store_n(&cs->compute_status, NTY_COROUTINE_COMPUTE_BUSY, __ATOMIC_RELAXED);
+		cs->curr_coroutine = co;
+		pthread_mutex_unlock(&cs->run_mutex);
+
+		co->compute_fn(co->compute_arg);
+
+		cs->curr_coroutine = NULL;
+		while (nty_coroutine_wake(co) != 0) {
+			usleep(1000); // out of memory for the message, the coroutine must not be lost
+		}
+	}
+
+	return NULL;
+}
+
+// before the schedulers run. the number of threads started
+int nty_coroutine_compute_create(int threads) {
+
+	int i = 0;
+	for (i = 0;i < threads;i ++) {
+		nty_coroutine_compute_sched *cs = calloc(1, sizeof(nty_coroutine_compute_sched));
+		if (cs == NULL) break;
+
+		TAILQ_INIT(&cs->coroutines);
+		pthread_mutex_init(&cs->run_mutex, NULL);
+		pthread_cond_init(&cs->run_cond, NULL);
+		pthread_mutex_init(&cs->co_mutex, NULL);
+		cs->compute_status = NTY_COROUTINE_COMPUTE_FREE;
+
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, nty_coroutine_compute_run, cs) != 0) {
+			free(cs);
+			break;
+		}
+		pthread_detach(tid);
+
+		LIST_INSERT_HEAD(&compute_scheds, cs, compute_next);
+	}
+
+	return i;
+}
+
+// an idle compute thread, else the next one in turn. NULL: none started
+static nty_coroutine_compute_sched *nty_coroutine_compute_pick(void) {
+	nty_coroutine_compute_sched *cs = NULL;
+	int n = 0;
+
+	LIST_FOREACH(cs, &compute_scheds, compute_next) {
+		if (__atomic_load_n(&cs->compute_status, __ATOMIC_RELAXED) == NTY_COROUTINE_COMPUTE_FREE) return cs;
+		n ++;
+	}
+	if (n == 0) return NULL;
+
+	int skip = __atomic_fetch_add(&compute_rr, 1, __ATOMIC_RELAXED) % n;
+	LIST_FOREACH(cs, &compute_scheds, compute_next) {
+		if (skip -- == 0) break;
+	}
+	return cs;
+}
+
+// run fn(arg) on a compute thread while the calling coroutine parks, the
+// other coroutines of its scheduler keep running. fn gets no scheduler,
+// hooked calls block there. outside a coroutine or without compute threads
+// fn runs right here. 1: ran on a compute thread
+int nty_coroutine_compute(proc_coroutine fn, void *arg) {
+	nty_schedule *sched = nty_coroutine_get_sched();
+	nty_coroutine *co = sched ? sched->curr_thread : NULL;
+	nty_coroutine_compute_sched *cs = co ? nty_coroutine_compute_pick() : NULL;
+
+	if (cs == NULL) {
+		fn(arg);
+		return 0;
+	}
+
+	co->compute_fn = fn;
+	co->compute_arg = arg;
+	co->compute_sched = cs;
+	co->status |= BIT(NTY_COROUTINE_STATUS_PENDING_RUNCOMPUTE);
+
+	pthread_mutex_lock(&cs->run_mutex);
+	TAILQ_INSERT_TAIL(&cs->coroutines, co, compute_next);
+	pthread_cond_signal(&cs->run_cond);
+	pthread_mutex_unlock(&cs->run_mutex);
+
+	nty_coroutine_park();
+
+	co->status &= CLEARBIT(NTY_COROUTINE_STATUS_PENDING_RUNCOMPUTE);
+	co->compute_sched = NULL;
+
+	return 1;
+}
+
 void nty_coroutine_detach(void) {
 	nty_coroutine *co = nty_coroutine_get_sched()->curr_thread;
 	co->status |= BIT(NTY_COROUTINE_STATUS_DETACH);
@@ -343,7 +491,10 @@ int nty_coroutine_create(nty_coroutine **new_co, proc_coroutine func, void *arg)
 	co->birth = nty_coroutine_usec_now();
 	*new_co = co;
 
-	TAILQ_INSERT_TAIL(&co->sched->ready, co, ready_next);
+	__atomic_add_fetch(&sched->live, 1, __ATOMIC_RELAXED);
+	if (nty_schedule_runnable_push(sched, co) != 0) {
+		TAILQ_INSERT_TAIL(&co->sched->ready, co, ready_next);
+	}
 
 	return 0;
 }
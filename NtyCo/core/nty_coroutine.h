@@ -88,6 +88,13 @@
 
 typedef void (*proc_coroutine)(void *);
 
+// work handed to a scheduler by any thread, run on the scheduler's thread
+typedef struct _nty_message {
+	struct _nty_message *next;
+	proc_coroutine fn;
+	void *arg;
+} nty_message;
+
 
 typedef enum {
 	NTY_COROUTINE_STATUS_WAIT_READ,
@@ -105,7 +112,8 @@ typedef enum {
 	NTY_COROUTINE_STATUS_RUNCOMPUTE,
 	NTY_COROUTINE_STATUS_WAIT_IO_READ,
 	NTY_COROUTINE_STATUS_WAIT_IO_WRITE,
-	NTY_COROUTINE_STATUS_WAIT_MULTI
+	NTY_COROUTINE_STATUS_WAIT_MULTI,
+	NTY_COROUTINE_STATUS_PARKED
 } nty_coroutine_status;
 
 typedef enum {
@@ -151,6 +159,26 @@ typedef struct _nty_cpu_ctx {
 #endif
 
 ///
+#define NTY_STEAL_DEQUE_SIZE	256		// power of two
+#define NTY_STEAL_GROUP_MAX		64
+
+// chase-lev deque of coroutines not started yet: the owner pushes and pops
+// at the bottom, the other schedulers of the steal group take from the top
+typedef struct _nty_deque {
+	int64_t top;
+	int64_t bottom;
+	struct _nty_coroutine *buf[NTY_STEAL_DEQUE_SIZE];
+} nty_deque;
+
+typedef struct _nty_steal_stats {
+	uint64_t steals;		// coroutines this scheduler took from peers
+	uint64_t stolen;		// taken from it by peers
+	uint64_t wakes;			// idle peers it woke to come and steal
+	uint64_t sheds;			// times nty_schedule_overloaded() said yes
+	int live;				// coroutines it owns now
+	int queued;				// of them not started, in the deque
+} nty_steal_stats;
+
 typedef struct _nty_schedule {
 	uint64_t birth;
 #ifdef _USE_UCONTEXT
@@ -181,6 +209,22 @@ typedef struct _nty_schedule {
 	nty_coroutine_rbtree_sleep sleeping;
 	nty_coroutine_rbtree_wait waiting;
 
+	nty_message *inbox;		// mpsc stack, any thread pushes, the owner takes it whole
+	int parked;				// coroutines waiting for nty_coroutine_wake()
+
+	proc_coroutine quiescent;	// every round, with no coroutine running
+	void *quiescent_arg;
+
+	// work stealing, for schedulers of the steal group (steal_id >= 0)
+	nty_deque runnable;		// new coroutines, where nty_coroutine_create() puts them
+	int steal_id;
+	int idle;				// blocked in epoll with nothing to run
+	int live;
+	uint64_t steals;
+	uint64_t stolen;
+	uint64_t wakes;
+	uint64_t sheds;
+
 	//private 
 
 } nty_schedule;
@@ -202,6 +246,7 @@ typedef struct _nty_coroutine {
 	
 	nty_coroutine_status status;
 	nty_schedule *sched;
+	int wakeups;			// wakes that came before the park
 
 	uint64_t birth;
 	uint64_t id;
@@ -241,6 +286,8 @@ typedef struct _nty_coroutine {
 	} io;
 
 	struct _nty_coroutine_compute_sched *compute_sched;
+	proc_coroutine compute_fn;	// what the compute thread runs for it
+	void *compute_arg;
 	int ready_fds;
 	struct pollfd *pfds;
 	nfds_t nfds;
@@ -298,6 +345,15 @@ void nty_schedule_sched_wait(nty_coroutine *co, int fd, unsigned short events, u
 
 void nty_schedule_run(void);
 
+int nty_schedule_post(nty_schedule *sched, proc_coroutine fn, void *arg);
+void nty_schedule_drain(nty_schedule *sched);
+void nty_schedule_quiescent(proc_coroutine fn, void *arg);
+
+int nty_schedule_steal_join(void);
+int nty_schedule_runnable_push(nty_schedule *sched, nty_coroutine *co);
+int nty_schedule_overloaded(void);
+void nty_schedule_steal_stats(nty_schedule *sched, nty_steal_stats *stats);
+
 int nty_epoller_ev_register_trigger(void);
 int nty_epoller_wait(struct timespec t);
 int nty_coroutine_resume(nty_coroutine *co);
@@ -307,6 +363,12 @@ void nty_coroutine_yield(nty_coroutine *co);
 
 void nty_coroutine_sleep(uint64_t msecs);
 
+void nty_coroutine_park(void);
+int nty_coroutine_wake(nty_coroutine *co);
+
+int nty_coroutine_compute_create(int threads);
+int nty_coroutine_compute(proc_coroutine fn, void *arg);
+
 
 int nty_socket(int domain, int type, int protocol);
 int nty_accept(int fd, struct sockaddr *addr, socklen_t *len);
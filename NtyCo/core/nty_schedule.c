@@ -125,7 +125,7 @@ nty_coroutine *nty_schedule_search_wait(int fd) {
 	nty_schedule *sched = nty_coroutine_get_sched();
 	
 	nty_coroutine *co = RB_FIND(_nty_coroutine_rbtree_wait, &sched->waiting, &find_it);
-	co->status = 0;
+	if (co != NULL) co->status = 0;
 
 	return co;
 }
@@ -182,6 +182,8 @@ void nty_schedule_cancel_wait(nty_coroutine *co) {
 	RB_REMOVE(_nty_coroutine_rbtree_wait, &co->sched->waiting, co);
 }
 
+static void nty_schedule_steal_leave(nty_schedule *sched);
+
 void nty_schedule_free(nty_schedule *sched) {
 	if (sched->poller_fd > 0) {
 		close(sched->poller_fd);
@@ -189,6 +191,9 @@ void nty_schedule_free(nty_schedule *sched) {
 	if (sched->eventfd > 0) {
 		close(sched->eventfd);
 	}
+	if (sched->steal_id >= 0) {
+		nty_schedule_steal_leave(sched);
+	}
 	if (sched->stack != NULL) {
 		free(sched->stack);
 	}
@@ -242,6 +247,8 @@ int nty_schedule_create(int stack_size) {
 	TAILQ_INIT(&sched->defer);
 	LIST_INIT(&sched->busy);
 
+	sched->steal_id = -1;
+
 }
 
 
@@ -258,11 +265,285 @@ static nty_coroutine *nty_schedule_expired(nty_schedule *sched) {
 	return NULL;
 }
 
+static int nty_deque_size(nty_deque *dq) {
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+	return b > t ? (int)(b - t) : 0;
+}
+
+// owner only. -1: full
+static int nty_deque_push(nty_deque *dq, nty_coroutine *co) {
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	if (b - t >= NTY_STEAL_DEQUE_SIZE) return -1;
+
+	__atomic_store_n(&dq->buf[b & (NTY_STEAL_DEQUE_SIZE - 1)], co, __ATOMIC_RELAXED);
+	__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// owner only, newest first. the last one goes to whoever wins the cas on top
+static nty_coroutine *nty_deque_pop(nty_deque *dq) {
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	nty_coroutine *co = __atomic_load_n(&dq->buf[b & (NTY_STEAL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (t == b) {
+		if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			co = NULL;
+		}
+		__atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return co;
+}
+
+// any thread, oldest first. NULL: empty, or another thief was faster
+static nty_coroutine *nty_deque_steal(nty_deque *dq) {
+	int64_t t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) return NULL;
+
+	nty_coroutine *co = __atomic_load_n(&dq->buf[t & (NTY_STEAL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return co;
+}
+
+// the schedulers that steal from each other. a coroutine that has run once
+// stays where it is: with ucontext its saved stack only fits the stack of
+// its own scheduler, so only new ones move. members must not exit while
+// the others run
+static nty_schedule *steal_group[NTY_STEAL_GROUP_MAX];
+static int steal_group_size = 0;
+static int steal_idle = 0;				// members with idle set
+
+// the calling thread's scheduler joins, coroutines it creates from now on
+// can be stolen. the member index, -1: no scheduler or the group is full
+int nty_schedule_steal_join(void) {
+	nty_schedule *sched = nty_coroutine_get_sched();
+	if (sched == NULL || sched->steal_id >= 0) return sched ? sched->steal_id : -1;
+
+	int id = __atomic_fetch_add(&steal_group_size, 1, __ATOMIC_ACQ_REL);
+	if (id >= NTY_STEAL_GROUP_MAX) {
+		__atomic_sub_fetch(&steal_group_size, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
+
+	sched->steal_id = id;
+	__atomic_store_n(&steal_group[id], sched, __ATOMIC_RELEASE);
+	return id;
+}
+
+static void nty_schedule_steal_leave(nty_schedule *sched) {
+	__atomic_store_n(&steal_group[sched->steal_id], NULL, __ATOMIC_RELEASE);
+	if (__atomic_exchange_n(&sched->idle, 0, __ATOMIC_ACQ_REL)) {
+		__atomic_sub_fetch(&steal_idle, 1, __ATOMIC_RELAXED);
+	}
+	sched->steal_id = -1;
+}
+
+// one coroutine from the first peer with any, into the ready queue
+static int nty_schedule_steal(nty_schedule *sched) {
+
+	int n = __atomic_load_n(&steal_group_size, __ATOMIC_ACQUIRE);
+	if (n > NTY_STEAL_GROUP_MAX) n = NTY_STEAL_GROUP_MAX;
+
+	int i = 0;
+	for (i = 1;i < n;i ++) {
+		nty_schedule *peer = __atomic_load_n(&steal_group[(sched->steal_id + i) % n], __ATOMIC_ACQUIRE);
+		if (peer == NULL || peer == sched) continue;
+
+		nty_coroutine *co = nty_deque_steal(&peer->runnable);
+		if (co == NULL) continue;
+
+		__atomic_sub_fetch(&peer->live, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&peer->stolen, 1, __ATOMIC_RELAXED);
+
+		co->sched = sched;
+		__atomic_add_fetch(&sched->live, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&sched->steals, 1, __ATOMIC_RELAXED);
+
+		TAILQ_INSERT_TAIL(&sched->ready, co, ready_next);
+		return 1;
+	}
+
+	return 0;
+}
+
+// posted to an idle member by a peer with work in its deque
+static void nty_schedule_steal_msg(void *arg) {
+	nty_schedule_steal((nty_schedule *)arg);
+}
+
+static int nty_schedule_idle_enter(nty_schedule *sched) {
+	if (sched->steal_id < 0) return 0;
+
+	__atomic_store_n(&sched->idle, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&steal_idle, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+static void nty_schedule_idle_leave(nty_schedule *sched) {
+	if (__atomic_exchange_n(&sched->idle, 0, __ATOMIC_ACQ_REL)) {
+		__atomic_sub_fetch(&steal_idle, 1, __ATOMIC_RELAXED);
+	}
+}
+
+// wake one idle member to steal from sched, the one that clears its idle
+// flag gets the message
+static void nty_schedule_wake_thief(nty_schedule *sched) {
+
+	// the push before against the idle flag set before a thief's last look
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&steal_idle, __ATOMIC_SEQ_CST) == 0) return ;
+
+	int n = __atomic_load_n(&steal_group_size, __ATOMIC_ACQUIRE);
+	if (n > NTY_STEAL_GROUP_MAX) n = NTY_STEAL_GROUP_MAX;
+
+	int i = 0;
+	for (i = 1;i < n;i ++) {
+		nty_schedule *peer = __atomic_load_n(&steal_group[(sched->steal_id + i) % n], __ATOMIC_ACQUIRE);
+		if (peer == NULL || peer == sched) continue;
+		if (!__atomic_load_n(&peer->idle, __ATOMIC_RELAXED)) continue;
+		if (!__atomic_exchange_n(&peer->idle, 0, __ATOMIC_ACQ_REL)) continue;
+
+		__atomic_sub_fetch(&steal_idle, 1, __ATOMIC_RELAXED);
+		if (nty_schedule_post(peer, nty_schedule_steal_msg, peer) == 0) {
+			__atomic_add_fetch(&sched->wakes, 1, __ATOMIC_RELAXED);
+		}
+		return ;
+	}
+}
+
+// a new coroutine into the deque of a member. -1: not a member or full,
+// it belongs in the ready queue
+int nty_schedule_runnable_push(nty_schedule *sched, nty_coroutine *co) {
+	if (sched->steal_id < 0) return -1;
+	if (nty_deque_push(&sched->runnable, co) != 0) return -1;
+
+	nty_schedule_wake_thief(sched);
+	return 0;
+}
+
+// 1: a peer sits idle owning at least two coroutines less than this
+// scheduler. a coroutine between two pieces of work can then end and pass
+// what it was doing to a new one, which the peer will steal
+int nty_schedule_overloaded(void) {
+	nty_schedule *sched = nty_coroutine_get_sched();
+	if (sched == NULL || sched->steal_id < 0) return 0;
+	if (__atomic_load_n(&steal_idle, __ATOMIC_RELAXED) == 0) return 0;
+
+	int live = __atomic_load_n(&sched->live, __ATOMIC_RELAXED);
+	int n = __atomic_load_n(&steal_group_size, __ATOMIC_ACQUIRE);
+	if (n > NTY_STEAL_GROUP_MAX) n = NTY_STEAL_GROUP_MAX;
+
+	int i = 0;
+	for (i = 0;i < n;i ++) {
+		nty_schedule *peer = __atomic_load_n(&steal_group[i], __ATOMIC_ACQUIRE);
+		if (peer == NULL || peer == sched) continue;
+		if (!__atomic_load_n(&peer->idle, __ATOMIC_RELAXED)) continue;
+
+		if (__atomic_load_n(&peer->live, __ATOMIC_RELAXED) + 2 <= live) {
+			__atomic_add_fetch(&sched->sheds, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// any thread, the counters are read one by one
+void nty_schedule_steal_stats(nty_schedule *sched, nty_steal_stats *stats) {
+	stats->steals = __atomic_load_n(&sched->steals, __ATOMIC_RELAXED);
+	stats->stolen = __atomic_load_n(&sched->stolen, __ATOMIC_RELAXED);
+	stats->wakes = __atomic_load_n(&sched->wakes, __ATOMIC_RELAXED);
+	stats->sheds = __atomic_load_n(&sched->sheds, __ATOMIC_RELAXED);
+	stats->live = __atomic_load_n(&sched->live, __ATOMIC_RELAXED);
+	stats->queued = nty_deque_size(&sched->runnable);
+}
+
 static inline int nty_schedule_isdone(nty_schedule *sched) {
 	return (RB_EMPTY(&sched->waiting) && 
 		LIST_EMPTY(&sched->busy) &&
 		RB_EMPTY(&sched->sleeping) &&
-		TAILQ_EMPTY(&sched->ready));
+		TAILQ_EMPTY(&sched->ready) &&
+		nty_deque_size(&sched->runnable) == 0 &&
+		sched->parked == 0);
+}
+
+// any thread. a treiber stack: only the push that finds it empty writes the
+// eventfd, the owner takes everything pushed until then on that one wakeup
+int nty_schedule_post(nty_schedule *sched, proc_coroutine fn, void *arg) {
+
+	nty_message *msg = (nty_message *)malloc(sizeof(nty_message));
+	if (msg == NULL) return -1;
+
+	msg->fn = fn;
+	msg->arg = arg;
+
+	nty_message *head = __atomic_load_n(&sched->inbox, __ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&sched->inbox, &head, msg, 1,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	if (head == NULL) {
+		uint64_t one = 1;
+		if (!write_f) init_hook();
+		write_f(sched->eventfd, &one, sizeof(one)); // not the hooked write, it may be off any scheduler
+	}
+
+	return 0;
+}
+
+// owner thread, outside of any coroutine. runs the posted messages oldest
+// first, a message must not block or yield
+void nty_schedule_drain(nty_schedule *sched) {
+
+	if (__atomic_load_n(&sched->inbox, __ATOMIC_RELAXED) == NULL) return ;
+
+	nty_message *msg = __atomic_exchange_n(&sched->inbox, NULL, __ATOMIC_ACQUIRE);
+	nty_message *fifo = NULL;
+	while (msg) {
+		nty_message *next = msg->next;
+		msg->next = fifo;
+		fifo = msg;
+		msg = next;
+	}
+
+	while (fifo) {
+		nty_message *next = fifo->next;
+		fifo->fn(fifo->arg);
+		free(fifo);
+		fifo = next;
+	}
+}
+
+// the calling thread's scheduler calls fn(arg) once a round, after the
+// coroutines ran and before it waits in epoll: nothing of theirs is half
+// done on the thread then. fn must not block or yield
+void nty_schedule_quiescent(proc_coroutine fn, void *arg) {
+	nty_schedule *sched = nty_coroutine_get_sched();
+	if (sched == NULL) return ;
+
+	sched->quiescent = fn;
+	sched->quiescent_arg = arg;
+}
+
+static void nty_schedule_trigger(nty_schedule *sched) {
+	uint64_t count = 0;
+	if (!read_f) init_hook();
+	read_f(sched->eventfd, &count, sizeof(count));
+
+	nty_schedule_drain(sched);
 }
 
 static uint64_t nty_schedule_min_timeout(nty_schedule *sched) {
@@ -286,7 +567,7 @@ static int nty_schedule_epoll(nty_schedule *sched) {
 
 	struct timespec t = {0, 0};
 	uint64_t usecs = nty_schedule_min_timeout(sched);
-	if (usecs && TAILQ_EMPTY(&sched->ready)) {
+	if (usecs && TAILQ_EMPTY(&sched->ready) && nty_deque_size(&sched->runnable) == 0) {
 		t.tv_sec = usecs / 1000000u;
 		if (t.tv_sec != 0) {
 			t.tv_nsec = (usecs % 1000u) * 1000u;
@@ -319,6 +600,9 @@ void nty_schedule_run(void) {
 	if (sched == NULL) return ;
 
 	while (!nty_schedule_isdone(sched)) {
+
+		// 0. inbox, may wake parked coroutines into the ready queue
+		nty_schedule_drain(sched);
 		
 		// 1. expired --> sleep rbtree
 		nty_coroutine *expired = NULL;
@@ -340,13 +624,43 @@ void nty_schedule_run(void) {
 			if (co == last_co_ready) break;
 		}
 
+		// 2.1 new coroutines not stolen meanwhile, those queued from here on
+		// wait for the next round
+		int queued = nty_deque_size(&sched->runnable);
+		while (queued -- > 0) {
+			nty_coroutine *co = nty_deque_pop(&sched->runnable);
+			if (co == NULL) break;
+			nty_coroutine_resume(co);
+		}
+
+		// 2.2 nothing to run: steal, and look once more after saying idle
+		int idle = 0;
+		if (sched->steal_id >= 0 && TAILQ_EMPTY(&sched->ready) && nty_deque_size(&sched->runnable) == 0) {
+			if (!nty_schedule_steal(sched)) {
+				idle = nty_schedule_idle_enter(sched);
+				if (nty_schedule_steal(sched)) {
+					nty_schedule_idle_leave(sched);
+					idle = 0;
+				}
+			}
+		}
+
+		// 2.3 between two rounds
+		if (sched->quiescent) sched->quiescent(sched->quiescent_arg);
+
 		// 3. wait rbtree
 		nty_schedule_epoll(sched);
+		if (idle) nty_schedule_idle_leave(sched);
 		while (sched->num_new_events) {
 			int idx = --sched->num_new_events;
 			struct epoll_event *ev = sched->eventlist+idx;
 			
 			int fd = ev->data.fd;
+			if (fd == sched->eventfd) {
+				nty_schedule_trigger(sched);
+				continue;
+			}
+
 			int is_eof = ev->events & EPOLLHUP;
 			if (is_eof) errno = ECONNRESET;
 
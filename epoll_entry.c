@@ -7,6 +7,8 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <pthread.h>
@@ -20,22 +22,51 @@
 
 
 // listenfd
-// EPOLLIN --> 
+// EPOLLIN -->
 int accept_cb(int fd);
 // clientfd
-// 
+//
 int recv_cb(int fd);
 int send_cb(int fd);
 
 // conn, fd, buffer, callback
 
 
-int epfd = 0;
-struct conn_item connlist[1048576] = {0}; // 1024  2G     2 * 512 * 1024 * 1024 
-// list
-struct timeval zvoice_king;
-// 
-// 1000000
+// kvstore -w <n>: n event loops, worker i runs loop i on a thread of its
+// own, the calling thread is loop 0.
+//
+//   - every loop has its epfd, its listeners and its connections. each
+//     loop binds the same ports with SO_REUSEPORT, the kernel hashes a new
+//     connection to one listener and the connection stays on that loop.
+//   - a loop owns the shard of the same number, as an ntyco worker does. a
+//     key of another shard is read without the lock where ENABLE_RCU_READS
+//     allows it, otherwise the loop takes that shard's mutex and runs the
+//     command itself: a loop has no coroutine to park while the owner does
+//     it.
+//   - a loop's connection table is indexed by fd. fds are unique in the
+//     process, a slot is set in the one table of the loop that accepted it.
+
+#define EPOLL_PORT_BASE			2048
+#define EPOLL_PORT_COUNT		20
+#define EPOLL_MAX_FDS			1048576
+#define EPOLL_EVENTS			1024
+
+
+typedef struct epoll_loop_s {
+	int id;
+	int epfd;
+	int listenfds[EPOLL_PORT_COUNT];	// -1: the port could not be bound
+	struct conn_item **connlist;		// by fd, NULL: not this loop's
+	int connections;
+	unsigned long accepted;
+	unsigned long requests;
+	struct timeval zvoice_king;
+} epoll_loop_t;
+
+static epoll_loop_t loops[KVS_MAX_SHARDS];
+static pthread_barrier_t loops_ready;
+
+static __thread epoll_loop_t *loop = NULL;		// this thread's
 
 #define TIME_SUB_MS(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000 + (tv1.tv_usec - tv2.tv_usec) / 1000)
 
@@ -46,47 +77,70 @@ int set_event(int fd, int event, int flag) {
 		struct epoll_event ev;
 		ev.events = event ;
 		ev.data.fd = fd;
-		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+		return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
 	} else {
-	
+
 		struct epoll_event ev;
 		ev.events = event;
 		ev.data.fd = fd;
-		epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+		return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
 	}
 
-	
+}
+
+static void close_conn(int fd) {
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+	close(fd);
 
+	free(loop->connlist[fd]);
+	loop->connlist[fd] = NULL;
+	__atomic_store_n(&loop->connections, loop->connections - 1, __ATOMIC_RELAXED);
 }
 
 int accept_cb(int fd) {
 
 	struct sockaddr_in clientaddr;
 	socklen_t len = sizeof(clientaddr);
-	
+
 	int clientfd = accept(fd, (struct sockaddr*)&clientaddr, &len);
 	if (clientfd < 0) {
 		return -1;
 	}
-	set_event(clientfd, EPOLLIN, 1);
+	if (clientfd >= EPOLL_MAX_FDS) {
+		close(clientfd);
+		return -1;
+	}
+
+	struct conn_item *conn = (struct conn_item *)calloc(1, sizeof(struct conn_item));
+	if (!conn) {
+		close(clientfd);
+		return -1;
+	}
+
+	conn->fd = clientfd;
+	conn->recv_t.recv_callback = recv_cb;
+	conn->send_callback = send_cb;
+
+	loop->connlist[clientfd] = conn;
+	if (set_event(clientfd, EPOLLIN, 1) < 0) {
+		loop->connlist[clientfd] = NULL;
+		free(conn);
+		close(clientfd);
+		return -1;
+	}
 
-	connlist[clientfd].fd = clientfd;
-	memset(connlist[clientfd].rbuffer, 0, BUFFER_LENGTH);
-	connlist[clientfd].rlen = 0;
-	memset(connlist[clientfd].wbuffer, 0, BUFFER_LENGTH);
-	connlist[clientfd].wlen = 0;
-	
-	connlist[clientfd].recv_t.recv_callback = recv_cb;
-	connlist[clientfd].send_callback = send_cb;
+	__atomic_store_n(&loop->connections, loop->connections + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&loop->accepted, loop->accepted + 1, __ATOMIC_RELAXED);
 
 	if ((clientfd % 1000) == 999) {
 		struct timeval tv_cur;
 		gettimeofday(&tv_cur, NULL);
-		int time_used = TIME_SUB_MS(tv_cur, zvoice_king);
+		int time_used = TIME_SUB_MS(tv_cur, loop->zvoice_king);
+
+		memcpy(&loop->zvoice_king, &tv_cur, sizeof(struct timeval));
 
-		memcpy(&zvoice_king, &tv_cur, sizeof(struct timeval));
-		
-		printf("clientfd : %d, time_used: %d\n", clientfd, time_used);
+		printf("loop : %d, clientfd : %d, time_used: %d\n", loop->id, clientfd, time_used);
 	}
 
 	return clientfd;
@@ -94,43 +148,45 @@ int accept_cb(int fd) {
 
 int recv_cb(int fd) { // fd --> EPOLLIN
 
-	char *buffer = connlist[fd].rbuffer;
-	int idx = connlist[fd].rlen;
-	
-	int count = recv(fd, buffer, BUFFER_LENGTH, 0);
-	if (count == 0) {
+	struct conn_item *conn = loop->connlist[fd];
+	char *buffer = conn->rbuffer;
+
+	int count = recv(fd, buffer, BUFFER_LENGTH - 1, 0);
+	if (count < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+	if (count <= 0) {
 		printf("disconnect\n");
 
-		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);		
-		close(fd);
-		
+		close_conn(fd);
+
 		return -1;
 	}
 
-	
-	connlist[fd].rlen = count;
+	buffer[count] = '\0'; // no tail of a longer request before it
+	conn->rlen = count;
 
 #if 0 //echo: need to send
-	memcpy(connlist[fd].wbuffer, connlist[fd].rbuffer, connlist[fd].rlen);
-	connlist[fd].wlen = connlist[fd].rlen;
-	connlist[fd].rlen -= connlist[fd].rlen;
+	memcpy(conn->wbuffer, conn->rbuffer, conn->rlen);
+	conn->wlen = conn->rlen;
+	conn->rlen -= conn->rlen;
 #else
 
-	kvstore_request(&connlist[fd]);
-	connlist[fd].wlen = strlen(connlist[fd].wbuffer);
+	kvstore_request(conn);
+	conn->wlen = strlen(conn->wbuffer);
 #endif
 
+	__atomic_store_n(&loop->requests, loop->requests + 1, __ATOMIC_RELAXED);
 	set_event(fd, EPOLLOUT, 0);
 
-	
+
 	return count;
 }
 
 
 int send_cb(int fd) {
 
-	char *buffer = connlist[fd].wbuffer;
-	int idx = connlist[fd].wlen;
+	struct conn_item *conn = loop->connlist[fd];
+	char *buffer = conn->wbuffer;
+	int idx = conn->wlen;
 
 	int count = send(fd, buffer, idx, 0);
 
@@ -145,6 +201,13 @@ int send_cb(int fd) {
 int init_server(unsigned short port) {
 
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sockfd < 0) return -1;
+
+	// every loop listens on the port, the kernel spreads the connections
+	if (kvs_nshards > 1) {
+		int reuse = 1;
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, (char *)&reuse, sizeof(reuse));
+	}
 
 	struct sockaddr_in serveraddr;
 	memset(&serveraddr, 0, sizeof(struct sockaddr_in));
@@ -155,6 +218,7 @@ int init_server(unsigned short port) {
 
 	if (-1 == bind(sockfd, (struct sockaddr*)&serveraddr, sizeof(struct sockaddr))) {
 		perror("bind");
+		close(sockfd);
 		return -1;
 	}
 
@@ -164,109 +228,134 @@ int init_server(unsigned short port) {
 }
 
 
-#if 0
-// tcp 
-int main() {
+// one loop, on its worker's thread. its shard and table are made there,
+// every loop has its shard before any of them takes a request
+static void *epoll_loop(void *arg) {
+
+	int id = (int)(intptr_t)arg;
+
+	kvs_worker = id;
+	kvs_shard = id;
+	loop = &loops[id];
+
+#if ENABLE_NUMA
+	// on its cpu before the shard, the table or a connection is made
+	kvs_numa_pin(id);
+	if (id > 0 && kvstore_shard_init(id) != 0) exit(1);
+#endif
+
+	loop->epfd = epoll_create(1); // int size
+	loop->connlist = (struct conn_item **)calloc(EPOLL_MAX_FDS, sizeof(struct conn_item *));
+	if (loop->epfd < 0 || !loop->connlist) {
+		perror("epoll loop");
+		exit(1);
+	}
 
-	int port_count = 20;
-	unsigned short port = 2048;
 	int i = 0;
+	for (i = 0;i < EPOLL_PORT_COUNT;i ++) {
+		int sockfd = loop->listenfds[i];
+		if (sockfd < 0) continue;
 
-	
-	epfd = epoll_create(1); // int size
+		struct conn_item *listener = (struct conn_item *)calloc(1, sizeof(struct conn_item));
+		if (!listener) exit(1);
 
-	for (i = 0;i < port_count;i ++) {
-		int sockfd = init_server(port + i);  // 2048, 2049, 2050, 2051 ... 2057
-		connlist[sockfd].fd = sockfd;
-		connlist[sockfd].recv_t.accept_callback = accept_cb;
+		listener->fd = sockfd;
+		listener->recv_t.accept_callback = accept_cb;
+		loop->connlist[sockfd] = listener;
 		set_event(sockfd, EPOLLIN, 1);
 	}
 
-	gettimeofday(&zvoice_king, NULL);
+	gettimeofday(&loop->zvoice_king, NULL);
+	pthread_barrier_wait(&loops_ready);
+
+	struct epoll_event events[EPOLL_EVENTS];
 
-	struct epoll_event events[1024] = {0};
-	
 	while (1) { // mainloop();
 
-		int nready = epoll_wait(epfd, events, 1024, -1); // 
+		int nready = epoll_wait(loop->epfd, events, EPOLL_EVENTS, KVS_CRON_INTERVAL_MS); // wake up for kvstore_cron
 
-		int i = 0;
 		for (i = 0;i < nready;i ++) {
 
 			int connfd = events[i].data.fd;
-			if (events[i].events & EPOLLIN) { //
+			struct conn_item *conn = loop->connlist[connfd];
+			if (!conn) continue;
+
+			if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) { //
 
-				int count = connlist[connfd].recv_t.recv_callback(connfd);
-				//printf("recv count: %d <-- buffer: %s\n", count, connlist[connfd].rbuffer);
+				conn->recv_t.recv_callback(connfd);
 
-			} else if (events[i].events & EPOLLOUT) { 
-				// printf("send --> buffer: %s\n",  connlist[connfd].wbuffer);
-				
-				int count = connlist[connfd].send_callback(connfd);
+			} else if (events[i].events & EPOLLOUT) {
+
+				conn->send_callback(connfd);
 			}
 
 		}
 
-	}
+		kvstore_quiescent();
+		kvstore_cron();
 
+	}
 
-	getchar();
-	//close(clientfd);
-
+	return NULL;
 }
 
-#else
+// a summary, then a line per loop
+int epoll_stats(char *buf, int len) {
 
-int epoll_entry(void) {
+	int connections = 0;
+	unsigned long accepted = 0, requests = 0;
 
-	int port_count = 20;
-	unsigned short port = 2048;
 	int i = 0;
+	for (i = 0;i < kvs_nshards;i ++) {
+		connections += __atomic_load_n(&loops[i].connections, __ATOMIC_RELAXED);
+		accepted += __atomic_load_n(&loops[i].accepted, __ATOMIC_RELAXED);
+		requests += __atomic_load_n(&loops[i].requests, __ATOMIC_RELAXED);
+	}
 
-	
-	epfd = epoll_create(1); // int size
+	int n = snprintf(buf, len, "epoll loops:%d connections:%d accepted:%lu requests:%lu\n",
+		kvs_nshards, connections, accepted, requests);
 
-	for (i = 0;i < port_count;i ++) {
-		int sockfd = init_server(port + i);  // 2048, 2049, 2050, 2051 ... 2057
-		connlist[sockfd].fd = sockfd;
-		connlist[sockfd].recv_t.accept_callback = accept_cb;
-		set_event(sockfd, EPOLLIN, 1);
+	for (i = 0;i < kvs_nshards && n < len;i ++) {
+		n += snprintf(buf + n, len - n, "loop:%d connections:%d accepted:%lu requests:%lu\n", i,
+			__atomic_load_n(&loops[i].connections, __ATOMIC_RELAXED),
+			__atomic_load_n(&loops[i].accepted, __ATOMIC_RELAXED),
+			__atomic_load_n(&loops[i].requests, __ATOMIC_RELAXED));
 	}
 
-	gettimeofday(&zvoice_king, NULL);
-
-	struct epoll_event events[1024] = {0};
-	
-	while (1) { // mainloop();
+	return n;
+}
 
-		int nready = epoll_wait(epfd, events, 1024, -1); // 
+// kvs_nshards loops, the calling thread is the first. the listeners are
+// made here, in loop order, before any loop runs
+int epoll_entry(void) {
 
-		int i = 0;
-		for (i = 0;i < nready;i ++) {
+	int i = 0, p = 0;
 
-			int connfd = events[i].data.fd;
-			if (events[i].events & EPOLLIN) { //
+	// no coroutine to park: RANGE and BACKUP run on the loop, and one loop
+	// alone keeps its shard without the lock
+	kvs_ncompute = 0;
 
-				int count = connlist[connfd].recv_t.recv_callback(connfd);
-				//printf("recv count: %d <-- buffer: %s\n", count, connlist[connfd].rbuffer);
+	for (i = 0;i < kvs_nshards;i ++) {
+		loops[i].id = i;
+		for (p = 0;p < EPOLL_PORT_COUNT;p ++) {
+			loops[i].listenfds[p] = init_server(EPOLL_PORT_BASE + p);  // 2048, 2049, 2050, 2051 ... 2067
+		}
+	}
 
-			} else if (events[i].events & EPOLLOUT) { 
-				// printf("send --> buffer: %s\n",  connlist[connfd].wbuffer);
-				
-				int count = connlist[connfd].send_callback(connfd);
-			}
+	pthread_barrier_init(&loops_ready, NULL, kvs_nshards);
 
+	for (i = 1;i < kvs_nshards;i ++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, epoll_loop, (void *)(intptr_t)i) != 0) {
+			perror("pthread_create");
+			return -1;
 		}
-
+		pthread_detach(tid);
 	}
+	printf("epoll loops : %d, ports : %d-%d\n", kvs_nshards, EPOLL_PORT_BASE, EPOLL_PORT_BASE + EPOLL_PORT_COUNT - 1);
 
+	epoll_loop((void *)(intptr_t)0);
 
-	//getchar();
-	//close(clientfd);
-
+	return 0;
 }
 
-
-#endif
-
-
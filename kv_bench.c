@@ -0,0 +1,204 @@
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <getopt.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+
+
+// throughput of a kvstore server: -c connections, one thread each, every
+// one sends -n requests and waits for each reply before the next. a
+// request is a GET with probability -r percent, else a SET, on a key of
+// its own connection's range. run it against kvstore -w 1, -w 2, ... on
+// as many cores to see how the workers scale.
+//
+// ./kv_bench -s 127.0.0.1 -p 9096 -c 8 -n 100000 -r 80 -e H
+
+#define MAX_MAS_LENGTH		512
+#define BENCH_KEYS			10000		// per connection
+#define TIME_SUB_US(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000000 + (tv1.tv_usec - tv2.tv_usec))
+
+
+typedef struct bench_conn_s {
+	pthread_t tid;
+	int id;
+	int connfd;
+	long errors;
+} bench_conn_t;
+
+static char ip[16] = "127.0.0.1";
+static int port = 9096;
+static int requests = 100000;
+static int read_ratio = 80;
+static char *engine = "H";			// command prefix: "" array, R, H, S, B, C, L
+
+static pthread_barrier_t barrier;
+
+
+int connect_tcpserver(const char *ip, unsigned short port) {
+
+	int connfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in tcpserver_addr;
+	memset(&tcpserver_addr, 0, sizeof(struct sockaddr_in));
+
+	tcpserver_addr.sin_family = AF_INET;
+	tcpserver_addr.sin_addr.s_addr = inet_addr(ip);
+	tcpserver_addr.sin_port = htons(port);
+
+	int ret = connect(connfd, (struct sockaddr*)&tcpserver_addr, sizeof(struct sockaddr_in));
+	if (ret) {
+		perror("connect");
+		return -1;
+	}
+
+	int nodelay = 1;
+	setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	return connfd;
+}
+
+// one request, one reply. -1: the connection broke
+static int request(int connfd, char *msg, char *result) {
+
+	if (send(connfd, msg, strlen(msg), 0) <= 0) return -1;
+
+	int res = recv(connfd, result, MAX_MAS_LENGTH - 1, 0);
+	if (res <= 0) return -1;
+	result[res] = '\0';
+
+	return 0;
+}
+
+static void *bench_conn(void *arg) {
+
+	bench_conn_t *conn = (bench_conn_t *)arg;
+
+	char msg[MAX_MAS_LENGTH];
+	char result[MAX_MAS_LENGTH];
+	unsigned int seed = conn->id * 2654435761U + 1;
+
+	// every key exists before the clock starts, a GET is never a miss
+	int i = 0;
+	for (i = 0;i < BENCH_KEYS;i ++) {
+		snprintf(msg, MAX_MAS_LENGTH, "%sSET bench%d:%d value%d", engine, conn->id, i, i);
+		if (request(conn->connfd, msg, result) < 0) break;
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	for (i = 0;i < requests;i ++) {
+		int key = rand_r(&seed) % BENCH_KEYS;
+		if ((int)(rand_r(&seed) % 100) < read_ratio) {
+			snprintf(msg, MAX_MAS_LENGTH, "%sGET bench%d:%d", engine, conn->id, key);
+		} else {
+			snprintf(msg, MAX_MAS_LENGTH, "%sMOD bench%d:%d value%d", engine, conn->id, key, i);
+		}
+
+		if (request(conn->connfd, msg, result) < 0) {
+			conn->errors += requests - i;
+			break;
+		}
+		if (strncmp(result, "ERROR", 5) == 0 || strcmp(result, "NO EXIST") == 0) conn->errors ++;
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	return NULL;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	int conns = 4;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:c:n:r:e:?")) != -1) {
+
+		switch (opt) {
+
+			case 's':
+				snprintf(ip, sizeof(ip), "%s", optarg);
+				break;
+
+			case 'p':
+				port = atoi(optarg);
+				break;
+
+			case 'c':
+				conns = atoi(optarg);
+				break;
+
+			case 'n':
+				requests = atoi(optarg);
+				break;
+
+			case 'r':
+				read_ratio = atoi(optarg);
+				break;
+
+			case 'e':
+				engine = strcmp(optarg, "A") == 0 ? "" : optarg;
+				break;
+
+			default:
+				fprintf(stderr, "usage: %s -s ip -p port -c conns -n requests -r read%% -e A|R|H|S|B|C|L\n", argv[0]);
+				return -1;
+		}
+	}
+
+	if (conns < 1 || requests < 1 || read_ratio < 0 || read_ratio > 100) return -1;
+
+	bench_conn_t *all = calloc(conns, sizeof(bench_conn_t));
+	if (!all) return -1;
+
+	pthread_barrier_init(&barrier, NULL, conns + 1);
+
+	int i = 0;
+	for (i = 0;i < conns;i ++) {
+		all[i].id = i;
+		all[i].connfd = connect_tcpserver(ip, port);
+		if (all[i].connfd < 0) return -1;
+	}
+	for (i = 0;i < conns;i ++) {
+		pthread_create(&all[i].tid, NULL, bench_conn, &all[i]);
+	}
+
+	struct timeval tv_begin, tv_end;
+
+	pthread_barrier_wait(&barrier); // loaded
+	gettimeofday(&tv_begin, NULL);
+	pthread_barrier_wait(&barrier); // done
+	gettimeofday(&tv_end, NULL);
+
+	long errors = 0;
+	for (i = 0;i < conns;i ++) {
+		pthread_join(all[i].tid, NULL);
+		close(all[i].connfd);
+		errors += all[i].errors;
+	}
+
+	long long us = TIME_SUB_US(tv_end, tv_begin);
+	long long total = (long long)conns * requests;
+
+	printf("conns:%d requests:%lld read:%d%% engine:%s time_us:%lld ops_per_sec:%.0f avg_latency_us:%.1f errors:%ld\n",
+		conns, total, read_ratio, engine[0] ? engine : "A", us,
+		us ? total * 1000000.0 / us : 0.0,
+		total ? (double)us * conns / total : 0.0, errors);
+
+	free(all);
+	pthread_barrier_destroy(&barrier);
+
+	return errors ? 1 : 0;
+}
@@ -3,10 +3,15 @@
 
 
 
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+
 #include "kvstore.h"
 
 
 #define KVSTORE_MAX_TOKENS 128
+#define KVS_CMD_GROUP		5	// SET GET DEL MOD COUNT
 
 const char *commands[] = {
 	"SET", "GET", "DEL", "MOD", "COUNT",
@@ -14,6 +19,11 @@ const char *commands[] = {
 	"HSET", "HGET", "HDEL", "HMOD", "HCOUNT",
 	"SSET", "SGET", "SDEL", "SMOD", "SCOUNT",
 	"BSET", "BGET", "BDEL", "BMOD", "BCOUNT",
+	"CSET", "CGET", "CDEL", "CMOD", "CCOUNT",
+	"LSET", "LGET", "LDEL", "LMOD", "LCOUNT",
+	"BLSET", "BLGET", "BLDEL", "BLMOD", "BLCOUNT",
+	"PSET", "PGET", "PDEL", "PMOD", "PCOUNT",
+	"STATS", "CONFIG", "CLIENT", "MEMORY", "RANGE", "BACKUP",
 };
 
 enum {
@@ -47,22 +57,399 @@ enum {
 	KVS_CMD_BDEL,
 	KVS_CMD_BMOD,
 	KVS_CMD_BCOUNT,
+
+	KVS_CMD_CSET,
+	KVS_CMD_CGET,
+	KVS_CMD_CDEL,
+	KVS_CMD_CMOD,
+	KVS_CMD_CCOUNT,
+
+	KVS_CMD_LSET,
+	KVS_CMD_LGET,
+	KVS_CMD_LDEL,
+	KVS_CMD_LMOD,
+	KVS_CMD_LCOUNT,
+
+	KVS_CMD_BLSET,
+	KVS_CMD_BLGET,
+	KVS_CMD_BLDEL,
+	KVS_CMD_BLMOD,
+	KVS_CMD_BLCOUNT,
+
+	KVS_CMD_PSET,
+	KVS_CMD_PGET,
+	KVS_CMD_PDEL,
+	KVS_CMD_PMOD,
+	KVS_CMD_PCOUNT,
+
+	KVS_CMD_STATS,
+	KVS_CMD_CONFIG,
+	KVS_CMD_CLIENT,
+	KVS_CMD_MEMORY,
+	KVS_CMD_RANGE,
+	KVS_CMD_BACKUP,
 	
 	KVS_CMD_SIZE,
 };
 
+__thread int kvs_mem_engine = KVS_ENGINE_OTHER;
+size_t kvs_mem_used[KVS_ENGINE_SIZE][KVS_MEM_KINDS] = {{0}};
+
+const char *kvs_engine_names[KVS_ENGINE_SIZE] = {
+	"array", "rbtree", "hash", "skiptable", "btree", "cuckoo", "lsm", "blink", "cow", "other",
+};
+
+const char *kvs_mem_kind_names[KVS_MEM_KINDS] = {
+	"node", "key", "value", "index",
+};
+
+size_t kvs_mem_engine_used(int engine) {
+
+	size_t used = 0;
+	int k = 0;
+	for (k = 0;k < KVS_MEM_KINDS;k ++) {
+		used += __atomic_load_n(&kvs_mem_used[engine][k], __ATOMIC_RELAXED);
+	}
+	return used;
+}
+
+size_t kvs_mem_total(void) {
+
+	size_t total = 0;
+	int i = 0;
+	for (i = 0;i < KVS_ENGINE_SIZE;i ++) {
+		total += kvs_mem_engine_used(i);
+	}
+	return total;
+}
+
+size_t kvstore_usable_size(void *ptr) {
+#if ENABLE_MEM_POOL
+	return ptr ? mp_usable_size(ptr) : 0;
+#else
+	return ptr ? malloc_usable_size(ptr) : 0;
+#endif
+}
+
 /// 
+void *kvstore_malloc_tag(size_t size, int tag) {
+#if ENABLE_MEM_POOL
+	void *ptr = mp_alloc(size);
+#else
+	void *ptr = malloc(size);
+#endif
+	if (ptr) {
+		__atomic_add_fetch(&kvs_mem_used[kvs_mem_engine][tag], kvstore_usable_size(ptr), __ATOMIC_RELAXED);
+	}
+	return ptr;
+}
+
 void *kvstore_malloc(size_t size) {
+	return kvstore_malloc_tag(size, KVS_MEM_INDEX);
+}
+
+// kvstore_malloc for objects linked by 32 bit references: NULL unless the
+// memory came from the slab's reserved range (not a large or arena-less one)
+void *kvstore_malloc_ref(size_t size, int tag) {
+	void *ptr = kvstore_malloc_tag(size, tag);
+#if ENABLE_COMPACT_REFS
+	if (ptr && !mp_ref_ok(ptr)) {
+		kvstore_free_tag(ptr, tag);
+		return NULL;
+	}
+#endif
+	return ptr;
+}
+
+// kvstore_malloc_tag on an align boundary, a power of 2. the block it was
+// cut from is kept in the word before, kvstore_free_aligned gives it back
+void *kvstore_malloc_aligned(size_t size, size_t align, int tag) {
+	char *raw = kvstore_malloc_tag(size + align - 1 + sizeof(void *), tag);
+	if (!raw) return NULL;
+
+	char *ptr = (char *)(((uintptr_t)raw + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1));
+	((void **)ptr)[-1] = raw;
+
+	return ptr;
+}
+
+void kvstore_free_aligned(void *ptr, int tag) {
+	if (ptr) kvstore_free_tag(((void **)ptr)[-1], tag);
+}
+
+void kvstore_free_tag(void *ptr, int tag) {
+#if ENABLE_EBR
+	// a lockless reader of the shard may still be looking at it
+	if (ptr && kvs_ebr_defer) {
+		kvs_ebr_retire(ptr, tag);
+		return ;
+	}
+#endif
+	if (ptr) {
+		__atomic_sub_fetch(&kvs_mem_used[kvs_mem_engine][tag], kvstore_usable_size(ptr), __ATOMIC_RELAXED);
+	}
 #if ENABLE_MEM_POOL
+	mp_free(ptr);
 #else
-	return malloc(size);
+	free(ptr);
 #endif
 }
 
 void kvstore_free(void *ptr) {
-#if ENABLE_MEM_POOL
+	kvstore_free_tag(ptr, KVS_MEM_INDEX);
+}
+
+// NULL: ptr stays put. otherwise ptr was copied to the result and freed, or
+// retired when other workers read the shard, the caller swaps its pointer.
+// same size class, accounting is unchanged
+void *kvstore_defrag_move(void *ptr) {
+#if ENABLE_MEM_DEFRAG
+#if ENABLE_EBR
+	// a lockless reader of the shard may still be on the old copy
+	if (kvs_ebr_defer) {
+		void *moved = mp_defrag_copy(ptr);
+		if (moved) kvs_ebr_retire_fn(ptr, mp_free, mp_usable_size(ptr));
+		return moved;
+	}
+#endif
+	return mp_defrag_move(ptr);
+#else
+	return NULL;
+#endif
+}
+
+// copy str into an inline string, on the heap when it does not fit.
+// -1: out of memory, s is left empty
+int kvs_str_set(char *s, size_t size, const char *str, int tag) {
+
+	size_t len = strlen(str);
+	if (len < size) {
+		memcpy(s, str, len + 1);
+		s[size - 1] = 0;
+		return 0;
+	}
+
+	char *ptr = kvstore_malloc_tag(len + 1, tag);
+	if (!ptr) {
+		s[0] = '\0';
+		s[size - 1] = 0;
+		return -1;
+	}
+	memcpy(ptr, str, len + 1);
+
+	*(char **)s = ptr;
+	s[size - 1] = 1;
+
+	return 0;
+}
+
+// a value: the shared copy when dedup has an equal one, else an entry in
+// the value log when it is on, else kvs_str_set()
+int kvs_str_intern(char *s, size_t size, const char *str) {
+#if ENABLE_VALUE_DEDUP
+	char *shared = kvs_dedup_intern(str);
+	if (shared) {
+		*(char **)s = shared;
+		s[size - 1] = KVS_STR_SHARED;
+		kvs_compress_hold(str);
+		return 0;
+	}
+#endif
+#if ENABLE_VALUE_LOG
+	char *logged = kvs_vlog_append(str);
+	if (logged) {
+		*(char **)s = logged;
+		s[size - 1] = KVS_STR_LOG;
+		kvs_compress_hold(str);
+		return 0;
+	}
+#endif
+	if (kvs_str_set(s, size, str, KVS_MEM_VALUE) != 0) return -1;
+
+	kvs_compress_hold(str);
+	return 0;
+}
+
+void kvs_str_free(char *s, size_t size, int tag) {
+
+	if (tag == KVS_MEM_VALUE) kvs_compress_drop(kvs_str_get(s, size));
+
+	if (s[size - 1] == 1) kvstore_free_tag(*(char **)s, tag);
+#if ENABLE_VALUE_DEDUP
+	else if (s[size - 1] == KVS_STR_SHARED) kvs_dedup_release(*(char **)s);
+#endif
+#if ENABLE_VALUE_LOG
+	else if (s[size - 1] == KVS_STR_LOG) kvs_vlog_free(*(char **)s);
+#endif
+
+	s[0] = '\0';
+	s[size - 1] = 0;
+}
+
+// 1: the heap copy moved, pointers to the old string are stale.
+// shared values stay put, log entries move when their segment is cleaned
+int kvs_str_defrag(char *s, size_t size) {
+
+	char *ptr = NULL;
+#if ENABLE_VALUE_LOG
+	if (s[size - 1] == KVS_STR_LOG) {
+		ptr = kvs_vlog_move(*(char **)s);
+		if (!ptr) return 0;
+
+		*(char **)s = ptr;
+		return 1;
+	}
+#endif
+
+	if (s[size - 1] != 1) return 0;
+
+	ptr = kvstore_defrag_move(*(char **)s);
+	if (!ptr) return 0;
+
+	*(char **)s = ptr;
+	return 1;
+}
+
+// bytes the string holds outside its node: the heap copy, a share of an
+// interned value, or its log entry
+size_t kvs_str_usage(char *s, size_t size) {
+
+	if (s[size - 1] == 1) return kvstore_usable_size(*(char **)s);
+#if ENABLE_VALUE_DEDUP
+	if (s[size - 1] == KVS_STR_SHARED) return kvs_dedup_usage(*(char **)s);
+#endif
+#if ENABLE_VALUE_LOG
+	if (s[size - 1] == KVS_STR_LOG) return kvs_vlog_usage(*(char **)s);
+#endif
+	return 0;
+}
+
+
+// multi-core mode, kvstore -w <workers>: every worker thread runs its own
+// scheduler and listener, and every engine exists once per shard, one shard
+// per worker. a key lives in shard fnv(key) % kvs_nshards. a connection may
+// ask any worker for any key: the request is posted to the inbox of the
+// worker owning the key's shard and runs there, the connection's coroutine
+// parks until the reply is written. the shard mutex stays for COUNT, STATS
+// and MEMORY, which read every shard from whichever worker got them, so on
+// the key path it is only taken by the owner, or by a compute thread
+// between the steps of a RANGE, and is rarely contended; with one worker and
+// no compute threads it is skipped. COUNT adds up the shards. the lsm engine
+// stays one instance with its own flush thread, all of its commands go to
+// shard 0.
+typedef struct kvs_shard_s {
+
+	pthread_mutex_t lock;
+
+#if ENABLE_ARRAY_KVENGINE
+	array_t array;
+#endif
+#if ENABLE_RBTREE_KVENGINE
+	rbtree_t *rbtree;
+#endif
+#if ENABLE_HASH_KVENGINE
+	hashtable_t *hash;
+#endif
+#if ENABLE_CUCKOO_KVENGINE
+	cuckoo_t *cuckoo;
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+	skiplist *skiplist;
+#endif
+#if ENABLE_BTREE_KVENGINE
+	btree *btree;
+#endif
+
+#if ENABLE_RBTREE_BLOOM
+	kvs_bloom_t *rbtree_bloom;
+#endif
+#if ENABLE_SKIPTABLE_BLOOM
+	kvs_bloom_t *skiptable_bloom;
+#endif
+#if ENABLE_BTREE_BLOOM
+	kvs_bloom_t *btree_bloom;
+#endif
+
+#if ENABLE_RBTREE_CACHE
+	kvs_cache_t *rbtree_cache;
+#endif
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_cache_t *skiptable_cache;
+#endif
+#if ENABLE_BTREE_CACHE
+	kvs_cache_t *btree_cache;
+#endif
+
+} kvs_shard_t;
+
+static kvs_shard_t Shards[KVS_MAX_SHARDS];
+
+int kvs_nshards = 1;
+__thread int kvs_shard = 0;		// the shard the engine wrappers work on
+__thread int kvs_worker = 0;	// the shard this thread owns
+
+#define SHARD		(&Shards[kvs_shard])
+
+#if ENABLE_COMPUTE_OFFLOAD
+int kvs_ncompute = 1;
 #else
-	return free(ptr);
+int kvs_ncompute = 0;
+#endif
+
+// a compute thread works on the shards beside their worker
+#define SHARD_LOCKED	(kvs_nshards > 1 || kvs_ncompute > 0)
+
+
+int kvstore_shard_of(char *key) {
+
+	if (!key || kvs_nshards == 1) return 0;
+
+	uint32_t hash = 2166136261U;
+	while (*key) {
+		hash ^= (uint8_t)*key ++;
+		hash *= 16777619U;
+	}
+
+	return (int)(hash % kvs_nshards);
+}
+
+void kvstore_shard_enter(int shard) {
+
+	kvs_shard = shard;
+#if ENABLE_MULTI_CORE || ENABLE_COMPUTE_OFFLOAD
+	if (SHARD_LOCKED) pthread_mutex_lock(&Shards[shard].lock);
+#endif
+#if ENABLE_EBR
+	// other workers read the trees without the lock, frees wait for them
+	if (kvs_nshards > 1) kvs_ebr_defer = 1;
+#endif
+}
+
+void kvstore_shard_leave(void) {
+#if ENABLE_MULTI_CORE || ENABLE_COMPUTE_OFFLOAD
+	if (SHARD_LOCKED) pthread_mutex_unlock(&Shards[kvs_shard].lock);
+#endif
+#if ENABLE_EBR
+	kvs_ebr_defer = 0;
+#endif
+}
+
+
+// periodic work, from the event loop between requests
+void kvstore_cron(void) {
+#if ENABLE_MEM_DEFRAG
+	// the worker's own shard, whose objects come from its own arena
+	kvstore_shard_enter(kvs_worker);
+	kvs_defrag_cron();
+	kvstore_shard_leave();
+#endif
+}
+
+// no lookup of this thread is running, whatever it retired since the last
+// round is sealed, and what no other thread can still see goes back
+void kvstore_quiescent(void) {
+#if ENABLE_EBR
+	kvs_ebr_quiescent();
 #endif
 }
 
@@ -71,156 +458,1062 @@ void kvstore_free(void *ptr) {
 #if ENABLE_HASH_KVENGINE
 
 int kvstore_hash_set(char *key, char *value) {
-	return kvs_hash_set(&Hash, key, value);
+	return kvs_hash_set(SHARD->hash, key, value);
 }
 char *kvstore_hash_get(char *key) {
-	return kvs_hash_get(&Hash, key);
+	return kvs_hash_get(SHARD->hash, key);
 }
 int kvstore_hash_delete(char *key) {
-	return kvs_hash_delete(&Hash, key);
+	return kvs_hash_delete(SHARD->hash, key);
 }
 int kvstore_hash_modify(char *key, char *value) {
-	return kvs_hash_modify(&Hash, key, value);
+	return kvs_hash_modify(SHARD->hash, key, value);
 }
 int kvstore_hash_count(void) {
-	return kvs_hash_count(&Hash);
+	return kvs_hash_count(SHARD->hash);
+}
+int kvstore_hash_sample(char **key, unsigned int *lru) {
+	return kvs_hash_sample(SHARD->hash, key, lru);
 }
+#if ENABLE_MEM_DEFRAG
+int kvstore_hash_defrag(char *cursor, int budget) {
+	return kvs_hash_defrag(SHARD->hash, cursor, budget);
+}
+#endif
+
+
 
+#endif
+
+#if ENABLE_CUCKOO_KVENGINE
 
+int kvstore_cuckoo_set(char *key, char *value) {
+	return kvs_cuckoo_set(SHARD->cuckoo, key, value);
+}
+char *kvstore_cuckoo_get(char *key) {
+	return kvs_cuckoo_get(SHARD->cuckoo, key);
+}
+int kvstore_cuckoo_delete(char *key) {
+	return kvs_cuckoo_delete(SHARD->cuckoo, key);
+}
+int kvstore_cuckoo_modify(char *key, char *value) {
+	return kvs_cuckoo_modify(SHARD->cuckoo, key, value);
+}
+int kvstore_cuckoo_count(void) {
+	return kvs_cuckoo_count(SHARD->cuckoo);
+}
+int kvstore_cuckoo_sample(char **key, unsigned int *lru) {
+	return kvs_cuckoo_sample(SHARD->cuckoo, key, lru);
+}
 
 #endif
 
 #if ENABLE_SKIPTABLE_KVENGINE
 
 int kvstore_skiptable_set(char *key, char *value) {
-	return kvs_skiptable_set(&Skiplist, key, value);
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_cache_invalidate(SHARD->skiptable_cache, key);
+#endif
+	int res = kvs_skiptable_set(SHARD->skiplist, key, value);
+#if ENABLE_SKIPTABLE_BLOOM
+	if (res == 0) kvs_bloom_add(SHARD->skiptable_bloom, key);
+#endif
+	return res;
 }
 char *kvstore_skiptable_get(char *key) {
-	return kvs_skiptable_get(&Skiplist, key);
+
+	char *value = NULL;
+
+#if ENABLE_SKIPTABLE_CACHE
+	value = kvs_cache_get(SHARD->skiptable_cache, key);
+	if (value) return value;
+#endif
+
+#if ENABLE_SKIPTABLE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->skiptable_bloom, key)) return NULL;
+#endif
+
+	value = kvs_skiptable_get(SHARD->skiplist, key);
+
+#if ENABLE_SKIPTABLE_BLOOM
+	if (!value) kvs_bloom_false_positive(SHARD->skiptable_bloom);
+#endif
+#if ENABLE_SKIPTABLE_CACHE
+	if (value) kvs_cache_put(SHARD->skiptable_cache, key, value);
+#endif
+
+	return value;
 }
 int kvstore_skiptable_delete(char *key) {
-	return kvs_skiptable_delete(&Skiplist, key);
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_cache_invalidate(SHARD->skiptable_cache, key);
+#endif
+#if ENABLE_SKIPTABLE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->skiptable_bloom, key)) return -1;
+
+	int res = kvs_skiptable_delete(SHARD->skiplist, key);
+	if (res == 0) kvs_bloom_delete(SHARD->skiptable_bloom);
+	else kvs_bloom_false_positive(SHARD->skiptable_bloom);
+	return res;
+#else
+	return kvs_skiptable_delete(SHARD->skiplist, key);
+#endif
 }
 int kvstore_skiptable_modify(char *key, char *value) {
-	return kvs_skiptable_modify(&Skiplist, key, value);
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_cache_invalidate(SHARD->skiptable_cache, key);
+#endif
+#if ENABLE_SKIPTABLE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->skiptable_bloom, key)) return -1;
+#endif
+	return kvs_skiptable_modify(SHARD->skiplist, key, value);
 }
 int kvstore_skiptable_count(void) {
-	return kvs_skiptable_count(&Skiplist);
+	return kvs_skiptable_count(SHARD->skiplist);
+}
+int kvstore_skiptable_scan(char *start, SCAN_CALLBACK cb, void *arg) {
+	return kvs_skiptable_scan(SHARD->skiplist, start, cb, arg);
+}
+int kvstore_skiptable_sample(char **key, unsigned int *lru) {
+	int res = kvs_skiptable_sample(SHARD->skiplist, key, lru);
+#if ENABLE_SKIPTABLE_CACHE
+	// reads served by the cache never touch the engine's clock
+	if (res == 0 && kvs_cache_contains(SHARD->skiptable_cache, *key)) return 1;
+#endif
+	return res;
+}
+
+#if ENABLE_MEM_DEFRAG
+#if ENABLE_SKIPTABLE_CACHE
+// the cache holds the old value pointer
+static void kvstore_skiptable_defrag_moved(char *key) {
+	kvs_cache_invalidate(SHARD->skiptable_cache, key);
+}
+#endif
+int kvstore_skiptable_defrag(char *cursor, int budget) {
+#if ENABLE_SKIPTABLE_CACHE
+	return kvs_skiptable_defrag(SHARD->skiplist, cursor, budget, kvstore_skiptable_defrag_moved);
+#else
+	return kvs_skiptable_defrag(SHARD->skiplist, cursor, budget, NULL);
+#endif
 }
+#endif
 
 #endif
 
 #if ENABLE_BTREE_KVENGINE
 
 int kvstore_btree_set(char *key, char *value) {
-	return kvs_btree_set(&Btree, key, value);
+#if ENABLE_BTREE_CACHE
+	kvs_cache_invalidate(SHARD->btree_cache, key);
+#endif
+	int res = kvs_btree_set(SHARD->btree, key, value);
+#if ENABLE_BTREE_BLOOM
+	if (res == 0) kvs_bloom_add(SHARD->btree_bloom, key);
+#endif
+	return res;
 }
 char *kvstore_btree_get(char *key) {
-	return kvs_btree_get(&Btree, key);
+
+	char *value = NULL;
+
+#if ENABLE_BTREE_CACHE
+	value = kvs_cache_get(SHARD->btree_cache, key);
+	if (value) return value;
+#endif
+
+#if ENABLE_BTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->btree_bloom, key)) return NULL;
+#endif
+
+	value = kvs_btree_get(SHARD->btree, key);
+
+#if ENABLE_BTREE_BLOOM
+	if (!value) kvs_bloom_false_positive(SHARD->btree_bloom);
+#endif
+#if ENABLE_BTREE_CACHE
+	if (value) kvs_cache_put(SHARD->btree_cache, key, value);
+#endif
+
+	return value;
 }
 int kvstore_btree_delete(char *key) {
-	return kvs_btree_delete(&Btree, key);
+#if ENABLE_BTREE_CACHE
+	kvs_cache_invalidate(SHARD->btree_cache, key);
+#endif
+#if ENABLE_BTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->btree_bloom, key)) return -1;
+
+	int res = kvs_btree_delete(SHARD->btree, key);
+	if (res == 0) kvs_bloom_delete(SHARD->btree_bloom);
+	else kvs_bloom_false_positive(SHARD->btree_bloom);
+	return res;
+#else
+	return kvs_btree_delete(SHARD->btree, key);
+#endif
 }
 int kvstore_btree_modify(char *key, char *value) {
-	return kvs_btree_modify(&Btree, key, value);
+#if ENABLE_BTREE_CACHE
+	kvs_cache_invalidate(SHARD->btree_cache, key);
+#endif
+#if ENABLE_BTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->btree_bloom, key)) return -1;
+#endif
+	return kvs_btree_modify(SHARD->btree, key, value);
 }
 int kvstore_btree_count(void) {
-	return kvs_btree_count(&Btree);
+	return kvs_btree_count(SHARD->btree);
+}
+int kvstore_btree_scan(char *start, SCAN_CALLBACK cb, void *arg) {
+	return kvs_btree_scan(SHARD->btree, start, cb, arg);
+}
+int kvstore_btree_sample(char **key, unsigned int *lru) {
+	int res = kvs_btree_sample(SHARD->btree, key, lru);
+#if ENABLE_BTREE_CACHE
+	// reads served by the cache never touch the engine's clock
+	if (res == 0 && kvs_cache_contains(SHARD->btree_cache, *key)) return 1;
+#endif
+	return res;
 }
 
+#if ENABLE_MEM_DEFRAG
+#if ENABLE_BTREE_CACHE
+// the cache holds the old value pointer
+static void kvstore_btree_defrag_moved(char *key) {
+	kvs_cache_invalidate(SHARD->btree_cache, key);
+}
+#endif
+int kvstore_btree_defrag(char *cursor, int budget) {
+#if ENABLE_BTREE_CACHE
+	return kvs_btree_defrag(SHARD->btree, cursor, budget, kvstore_btree_defrag_moved);
+#else
+	return kvs_btree_defrag(SHARD->btree, cursor, budget, NULL);
+#endif
+}
 #endif
 
-#if ENABLE_RBTREE_KVENGINE 
+#endif
 
+#if ENABLE_LSM_KVENGINE
 
-int kvstore_rbtree_set(char *key, char *value) {
-	return kvs_rbtree_set(&Tree, key, value);
+int kvstore_lsm_set(char *key, char *value) {
+	return kvs_lsm_set(&Lsm, key, value);
 }
-
-char* kvstore_rbtree_get(char *key) {
-	return kvs_rbtree_get(&Tree, key);
+char *kvstore_lsm_get(char *key) {
+	return kvs_lsm_get(&Lsm, key);
 }
-int kvstore_rbtree_delete(char *key) {
-
-	return kvs_rbtree_delete(&Tree, key);
-
+int kvstore_lsm_delete(char *key) {
+	return kvs_lsm_delete(&Lsm, key);
 }
-int kvstore_rbtree_modify(char *key, char *value) {
-	return kvs_rbtree_modify(&Tree, key, value);
+int kvstore_lsm_modify(char *key, char *value) {
+	return kvs_lsm_modify(&Lsm, key, value);
 }
-
-int kvstore_rbtree_count(void) {
-	return kvs_rbtree_count(&Tree);
+int kvstore_lsm_count(void) {
+	return kvs_lsm_count(&Lsm);
 }
 
 #endif
 
-#if ENABLE_ARRAY_KVENGINE
-
-int kvstore_array_set(char *key, char *value) {
-	return kvs_array_set(&Array, key, value);
+#if ENABLE_BLINK_KVENGINE
 
+// no shard: every worker goes to the tree itself
+int kvstore_blink_set(char *key, char *value) {
+	return kvs_blink_set(&Blink, key, value);
 }
-char *kvstore_array_get(char *key) {
+int kvstore_blink_get(char *key, char *buf, int len) {
+	return kvs_blink_get(&Blink, key, buf, len);
+}
+int kvstore_blink_delete(char *key) {
+	return kvs_blink_delete(&Blink, key);
+}
+int kvstore_blink_modify(char *key, char *value) {
+	return kvs_blink_modify(&Blink, key, value);
+}
+int kvstore_blink_count(void) {
+	return kvs_blink_count(&Blink);
+}
+int kvstore_blink_scan(char *start, SCAN_CALLBACK cb, void *arg) {
+	return kvs_blink_scan(&Blink, start, cb, arg);
+}
+
+#endif
 
-	return kvs_array_get(&Array, key);
+#if ENABLE_COW_KVENGINE
 
+// no shard either: the writers queue on the tree's mutex, readers take a root
+int kvstore_cow_set(char *key, char *value) {
+	return kvs_cow_set(&Cow, key, value);
 }
-int kvstore_array_delete(char *key) {
-	return kvs_array_delete(&Array, key);
+int kvstore_cow_get(char *key, char *buf, int len) {
+	return kvs_cow_get(&Cow, key, buf, len);
 }
-int kvstore_array_modify(char *key, char *value) {
-	return kvs_array_modify(&Array, key, value);
+int kvstore_cow_delete(char *key) {
+	return kvs_cow_delete(&Cow, key);
 }
-int kvstore_array_count(void) {
-	return kvs_array_count(&Array);
+int kvstore_cow_modify(char *key, char *value) {
+	return kvs_cow_modify(&Cow, key, value);
+}
+int kvstore_cow_count(void) {
+	return kvs_cow_count(&Cow);
+}
+int kvstore_cow_scan(char *start, SCAN_CALLBACK cb, void *arg) {
+	return kvs_cow_scan(&Cow, start, cb, arg);
 }
-
 
 #endif
 
+#if ENABLE_RBTREE_KVENGINE 
 
-// rbuffer
 
+int kvstore_rbtree_set(char *key, char *value) {
+#if ENABLE_RBTREE_CACHE
+	kvs_cache_invalidate(SHARD->rbtree_cache, key);
+#endif
+	int res = kvs_rbtree_set(SHARD->rbtree, key, value);
+#if ENABLE_RBTREE_BLOOM
+	if (res == 0) kvs_bloom_add(SHARD->rbtree_bloom, key);
+#endif
+	return res;
+}
 
-// wbuffer
+char *kvstore_rbtree_get(char *key) {
 
-int kvstore_split_token(char *msg, char **tokens) {
+	char *value = NULL;
 
-	if (msg == NULL || tokens == NULL) return -1;
+#if ENABLE_RBTREE_CACHE
+	value = kvs_cache_get(SHARD->rbtree_cache, key);
+	if (value) return value;
+#endif
 
-	int idx = 0;
+#if ENABLE_RBTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->rbtree_bloom, key)) return NULL;
+#endif
 
-	char *token = strtok(msg, " ");
+	value = kvs_rbtree_get(SHARD->rbtree, key);
 
-	while (token != NULL) {
-		tokens[idx ++] = token;
-		token = strtok(NULL, " ");
-	}
-	return idx;
+#if ENABLE_RBTREE_BLOOM
+	if (!value) kvs_bloom_false_positive(SHARD->rbtree_bloom);
+#endif
+#if ENABLE_RBTREE_CACHE
+	if (value) kvs_cache_put(SHARD->rbtree_cache, key, value);
+#endif
+
+	return value;
 }
+int kvstore_rbtree_delete(char *key) {
 
-// crud
+#if ENABLE_RBTREE_CACHE
+	kvs_cache_invalidate(SHARD->rbtree_cache, key);
+#endif
+#if ENABLE_RBTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->rbtree_bloom, key)) return -1;
 
-int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
+	int res = kvs_rbtree_delete(SHARD->rbtree, key);
+	if (res == 0) kvs_bloom_delete(SHARD->rbtree_bloom);
+	else kvs_bloom_false_positive(SHARD->rbtree_bloom);
+	return res;
+#else
+	return kvs_rbtree_delete(SHARD->rbtree, key);
+#endif
+
+}
+int kvstore_rbtree_modify(char *key, char *value) {
+#if ENABLE_RBTREE_CACHE
+	kvs_cache_invalidate(SHARD->rbtree_cache, key);
+#endif
+#if ENABLE_RBTREE_BLOOM
+	if (!kvs_bloom_may_contain(SHARD->rbtree_bloom, key)) return -1;
+#endif
+	return kvs_rbtree_modify(SHARD->rbtree, key, value);
+}
+
+int kvstore_rbtree_count(void) {
+	return kvs_rbtree_count(SHARD->rbtree);
+}
+
+int kvstore_rbtree_scan(char *start, SCAN_CALLBACK cb, void *arg) {
+	return kvs_rbtree_scan(SHARD->rbtree, start, cb, arg);
+}
+
+int kvstore_rbtree_sample(char **key, unsigned int *lru) {
+	int res = kvs_rbtree_sample(SHARD->rbtree, key, lru);
+#if ENABLE_RBTREE_CACHE
+	// reads served by the cache never touch the engine's clock
+	if (res == 0 && kvs_cache_contains(SHARD->rbtree_cache, *key)) return 1;
+#endif
+	return res;
+}
+
+#if ENABLE_MEM_DEFRAG
+#if ENABLE_RBTREE_CACHE
+// the cache holds the old value pointer
+static void kvstore_rbtree_defrag_moved(char *key) {
+	kvs_cache_invalidate(SHARD->rbtree_cache, key);
+}
+#endif
+int kvstore_rbtree_defrag(char *cursor, int budget) {
+#if ENABLE_RBTREE_CACHE
+	return kvs_rbtree_defrag(SHARD->rbtree, cursor, budget, kvstore_rbtree_defrag_moved);
+#else
+	return kvs_rbtree_defrag(SHARD->rbtree, cursor, budget, NULL);
+#endif
+}
+#endif
+
+#endif
+
+#if ENABLE_ARRAY_KVENGINE
+
+int kvstore_array_set(char *key, char *value) {
+	return kvs_array_set(&SHARD->array, key, value);
+
+}
+char *kvstore_array_get(char *key) {
+
+	return kvs_array_get(&SHARD->array, key);
+
+}
+int kvstore_array_delete(char *key) {
+	return kvs_array_delete(&SHARD->array, key);
+}
+int kvstore_array_modify(char *key, char *value) {
+	return kvs_array_modify(&SHARD->array, key, value);
+}
+int kvstore_array_count(void) {
+	return kvs_array_count(&SHARD->array);
+}
+
+
+#endif
+
+
+// STATS [section], all sections when none is given
+int kvstore_stats(char *section, char *buf, int len) {
+
+	int n = 0;
+
+#if ENABLE_BLOOM_FILTER
+	// a line per filter and shard
+	if (section == NULL || strcmp(section, "BLOOM") == 0) {
+		int i = 0;
+		for (i = 0;i < kvs_nshards;i ++) {
+			kvstore_shard_enter(i);
+#if ENABLE_RBTREE_BLOOM
+			if (n < len) n += kvs_bloom_stats(SHARD->rbtree_bloom, buf + n, len - n);
+#endif
+#if ENABLE_SKIPTABLE_BLOOM
+			if (n < len) n += kvs_bloom_stats(SHARD->skiptable_bloom, buf + n, len - n);
+#endif
+#if ENABLE_BTREE_BLOOM
+			if (n < len) n += kvs_bloom_stats(SHARD->btree_bloom, buf + n, len - n);
+#endif
+			kvstore_shard_leave();
+		}
+	}
+#endif
+
+#if ENABLE_MAXMEMORY
+	if (section == NULL || strcmp(section, "MEMORY") == 0) {
+		if (n < len) n += kvs_evict_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_MEM_POOL
+	if (section == NULL || strcmp(section, "SLAB") == 0) {
+		if (n < len) n += mp_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_MEM_DEFRAG
+	if (section == NULL || strcmp(section, "DEFRAG") == 0) {
+		if (n < len) n += kvs_defrag_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_COMPRESSION
+	if (section == NULL || strcmp(section, "COMPRESSION") == 0) {
+		if (n < len) n += kvs_compress_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_VALUE_DEDUP
+	if (section == NULL || strcmp(section, "DEDUP") == 0) {
+		if (n < len) n += kvs_dedup_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_VALUE_LOG
+	if (section == NULL || strcmp(section, "VLOG") == 0) {
+		if (n < len) n += kvs_vlog_stats(buf + n, len - n);
+	}
+#endif
+
+#if (ENABLE_NETWORK_SELECT == NETWORK_EPOLL)
+	if (section == NULL || strcmp(section, "EPOLL") == 0) {
+		if (n < len) n += epoll_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_WORK_STEALING
+	if (section == NULL || strcmp(section, "SCHED") == 0) {
+		if (n < len) n += kvstore_sched_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_EBR
+	if (section == NULL || strcmp(section, "EBR") == 0) {
+		if (n < len) n += kvs_ebr_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_NUMA
+	if (section == NULL || strcmp(section, "NUMA") == 0) {
+		if (n < len) n += kvs_numa_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_RCU_READS
+	if (section == NULL || strcmp(section, "RCU") == 0) {
+		if (n < len) n += kvs_rcu_stats(buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_BLINK_KVENGINE
+	if (section == NULL || strcmp(section, "BLINK") == 0) {
+		if (n < len) n += kvs_blink_stats(&Blink, buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_COW_KVENGINE
+	if (section == NULL || strcmp(section, "COW") == 0) {
+		if (n < len) n += kvs_cow_stats(&Cow, buf + n, len - n);
+	}
+#endif
+
+#if ENABLE_HOTKEY_CACHE
+	if (section == NULL || strcmp(section, "CACHE") == 0) {
+		int i = 0;
+		for (i = 0;i < kvs_nshards;i ++) {
+			kvstore_shard_enter(i);
+#if ENABLE_RBTREE_CACHE
+			if (n < len) n += kvs_cache_stats(SHARD->rbtree_cache, buf + n, len - n);
+#endif
+#if ENABLE_SKIPTABLE_CACHE
+			if (n < len) n += kvs_cache_stats(SHARD->skiptable_cache, buf + n, len - n);
+#endif
+#if ENABLE_BTREE_CACHE
+			if (n < len) n += kvs_cache_stats(SHARD->btree_cache, buf + n, len - n);
+#endif
+			kvstore_shard_leave();
+		}
+	}
+#endif
+
+	return n;
+}
+
+#if ENABLE_COW_KVENGINE
+
+#define KVS_BACKUP_DIR		"."
+
+// where BACKUP writes, kvstore -b <dir>. CONFIG GET backup-dir, a client
+// cannot move it
+static char kvs_backup_dir[BUFFER_LENGTH] = KVS_BACKUP_DIR;
+
+#endif
+
+// CONFIG SET <name> <value>: each subsystem parses its own keys.
+// -1: no such key or a bad value
+static int kvstore_config_set(char *name, char *value) {
+
+	if (!name || !value) return -1;
+
+#if ENABLE_MAXMEMORY
+	if (strncmp(name, "maxmemory", strlen("maxmemory")) == 0) {
+		return kvs_evict_config_set(name, value);
+	}
+#endif
+
+#if ENABLE_HUGE_PAGES
+	if (strcmp(name, "hugepages") == 0) {
+		return mp_set_hugepages(value);
+	}
+#endif
+
+#if ENABLE_MEM_DEFRAG
+	if (strcmp(name, "activedefrag") == 0) {
+		return kvs_defrag_config_set(value);
+	}
+#endif
+
+#if ENABLE_COMPRESSION
+	if (strncmp(name, "compression", strlen("compression")) == 0) {
+		return kvs_compress_config_set(name, value);
+	}
+#endif
+
+#if ENABLE_VALUE_DEDUP
+	if (strncmp(name, "dedup", strlen("dedup")) == 0) {
+		return kvs_dedup_config_set(name, value);
+	}
+#endif
+
+#if ENABLE_VALUE_LOG
+	if (strncmp(name, "value-log", strlen("value-log")) == 0) {
+		return kvs_vlog_config_set(name, value);
+	}
+#endif
+
+#if ENABLE_RCU_READS
+	if (strcmp(name, "rcu-reads") == 0) {
+		return kvs_rcu_config_set(value);
+	}
+#endif
+
+	return -1;
+}
+
+// CONFIG GET <name>, -1: no such key
+static int kvstore_config_get(char *name, char *buf, int len) {
+
+	if (!name) return -1;
+
+#if ENABLE_MAXMEMORY
+	if (strncmp(name, "maxmemory", strlen("maxmemory")) == 0) {
+		return kvs_evict_config_get(name, buf, len);
+	}
+#endif
+
+#if ENABLE_HUGE_PAGES
+	if (strcmp(name, "hugepages") == 0) {
+		return snprintf(buf, len, "%s", mp_get_hugepages());
+	}
+#endif
+
+#if ENABLE_MEM_DEFRAG
+	if (strcmp(name, "activedefrag") == 0) {
+		return snprintf(buf, len, "%s", kvs_defrag_config_get());
+	}
+#endif
+
+#if ENABLE_COMPRESSION
+	if (strncmp(name, "compression", strlen("compression")) == 0) {
+		return kvs_compress_config_get(name, buf, len);
+	}
+#endif
+
+#if ENABLE_VALUE_DEDUP
+	if (strncmp(name, "dedup", strlen("dedup")) == 0) {
+		return kvs_dedup_config_get(name, buf, len);
+	}
+#endif
+
+#if ENABLE_VALUE_LOG
+	if (strncmp(name, "value-log", strlen("value-log")) == 0) {
+		return kvs_vlog_config_get(name, buf, len);
+	}
+#endif
+
+#if ENABLE_RCU_READS
+	if (strcmp(name, "rcu-reads") == 0) {
+		return snprintf(buf, len, "%s", kvs_rcu_config_get());
+	}
+#endif
+
+#if ENABLE_COW_KVENGINE
+	if (strcmp(name, "backup-dir") == 0) {
+		return snprintf(buf, len, "%s", kvs_backup_dir);
+	}
+#endif
+
+	return -1;
+}
+
+
+static int kvstore_shard_count(int engine) {
+
+	switch (engine) {
+#if ENABLE_ARRAY_KVENGINE
+		case KVS_ENGINE_ARRAY: return kvstore_array_count();
+#endif
+#if ENABLE_RBTREE_KVENGINE
+		case KVS_ENGINE_RBTREE: return kvstore_rbtree_count();
+#endif
+#if ENABLE_HASH_KVENGINE
+		case KVS_ENGINE_HASH: return kvstore_hash_count();
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+		case KVS_ENGINE_SKIPTABLE: return kvstore_skiptable_count();
+#endif
+#if ENABLE_BTREE_KVENGINE
+		case KVS_ENGINE_BTREE: return kvstore_btree_count();
+#endif
+#if ENABLE_CUCKOO_KVENGINE
+		case KVS_ENGINE_CUCKOO: return kvstore_cuckoo_count();
+#endif
+#if ENABLE_LSM_KVENGINE
+		case KVS_ENGINE_LSM: return kvstore_lsm_count();
+#endif
+		default: return 0;
+	}
+}
+
+// keys in an engine, the shards added up
+static int kvstore_engine_count(int engine) {
+
+#if ENABLE_BLINK_KVENGINE
+	if (engine == KVS_ENGINE_BLINK) return kvstore_blink_count();
+#endif
+#if ENABLE_COW_KVENGINE
+	if (engine == KVS_ENGINE_COW) return kvstore_cow_count();
+#endif
+
+	int shards = engine == KVS_ENGINE_LSM ? 1 : kvs_nshards;
+	int total = 0;
+
+	int i = 0;
+	for (i = 0;i < shards;i ++) {
+		kvstore_shard_enter(i);
+		int count = kvstore_shard_count(engine);
+		kvstore_shard_leave();
+
+		if (count < 0) return count;
+		total += count;
+	}
+
+	return total;
+}
+
+static long kvstore_shard_usage(int engine, char *key) {
+
+	switch (engine) {
+#if ENABLE_ARRAY_KVENGINE
+		case KVS_ENGINE_ARRAY: return kvs_array_usage(&SHARD->array, key);
+#endif
+#if ENABLE_RBTREE_KVENGINE
+		case KVS_ENGINE_RBTREE: return kvs_rbtree_usage(SHARD->rbtree, key);
+#endif
+#if ENABLE_HASH_KVENGINE
+		case KVS_ENGINE_HASH: return kvs_hash_usage(SHARD->hash, key);
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+		case KVS_ENGINE_SKIPTABLE: return kvs_skiptable_usage(SHARD->skiplist, key);
+#endif
+#if ENABLE_BTREE_KVENGINE
+		case KVS_ENGINE_BTREE: return kvs_btree_usage(SHARD->btree, key);
+#endif
+#if ENABLE_CUCKOO_KVENGINE
+		case KVS_ENGINE_CUCKOO: return kvs_cuckoo_usage(SHARD->cuckoo, key);
+#endif
+#if ENABLE_LSM_KVENGINE
+		case KVS_ENGINE_LSM: return kvs_lsm_usage(&Lsm, key);
+#endif
+		default: return -1;
+	}
+}
+
+static long kvstore_engine_usage(int engine, char *key) {
+
+#if ENABLE_BLINK_KVENGINE
+	if (engine == KVS_ENGINE_BLINK) return kvs_blink_usage(&Blink, key);
+#endif
+#if ENABLE_COW_KVENGINE
+	if (engine == KVS_ENGINE_COW) return kvs_cow_usage(&Cow, key);
+#endif
+
+	kvstore_shard_enter(engine == KVS_ENGINE_LSM ? 0 : kvstore_shard_of(key));
+	long usage = kvstore_shard_usage(engine, key);
+	kvstore_shard_leave();
+
+	return usage;
+}
+
+// MEMORY STATS <engine>: its bytes by allocation tag. heap key and value
+// copies are the payload, node and index bytes the overhead. slab chunks
+// are shared by all engines, an engine's frag_bytes is its share, by used
+// bytes, of what the slab holds reserved but unused
+static int kvstore_memory_engine(int e, double ratio, char *buf, int len) {
+
+	size_t kinds[KVS_MEM_KINDS];
+	size_t total = 0;
+
+	int k = 0;
+	for (k = 0;k < KVS_MEM_KINDS;k ++) {
+		kinds[k] = __atomic_load_n(&kvs_mem_used[e][k], __ATOMIC_RELAXED);
+		total += kinds[k];
+	}
+
+	int keys = kvstore_engine_count(e);
+	if (keys < 0) keys = 0;
+
+	size_t overhead = kinds[KVS_MEM_NODE] + kinds[KVS_MEM_INDEX];
+
+	int n = snprintf(buf, len, "engine:%s keys:%d used:%zu", kvs_engine_names[e], keys, total);
+	for (k = 0;k < KVS_MEM_KINDS && n < len;k ++) {
+		n += snprintf(buf + n, len - n, " %s:%zu", kvs_mem_kind_names[k], kinds[k]);
+	}
+	if (n < len) {
+		n += snprintf(buf + n, len - n, " bytes_per_key:%.1f overhead_per_key:%.1f frag_bytes:%zu\n",
+			keys ? (double)total / keys : 0.0, keys ? (double)overhead / keys : 0.0,
+			(size_t)(total * (ratio - 1.0)));
+	}
+
+	return n;
+}
+
+// MEMORY STATS [engine]: the allocator and bytes per engine, or the
+// breakdown of one engine. -1: no such engine
+int kvstore_memory_stats(char *engine, char *buf, int len) {
+
+	size_t reserved = 0, used = 0;
+	double ratio = 1.0;
+#if ENABLE_MEM_POOL
+	ratio = mp_fragmentation(&reserved, &used);
+#endif
+
+	int e = 0;
+	if (engine) {
+		for (e = 0;e < KVS_ENGINE_SIZE;e ++) {
+			if (strcmp(engine, kvs_engine_names[e]) == 0) break;
+		}
+		if (e == KVS_ENGINE_SIZE) return -1;
+
+		return kvstore_memory_engine(e, ratio, buf, len);
+	}
+
+	int n = snprintf(buf, len, "allocator:%s used_memory:%zu slab_reserved:%zu slab_used:%zu fragmentation:%.2f\n",
+		ENABLE_MEM_POOL ? "slab" : "libc", kvs_mem_total(), reserved, used, ratio);
+
+	for (e = 0;e < KVS_ENGINE_SIZE && n < len;e ++) {
+		n += snprintf(buf + n, len - n, "%s:%zu%s", kvs_engine_names[e], kvs_mem_engine_used(e),
+			e == KVS_ENGINE_SIZE - 1 ? "\n" : " ");
+	}
+
+	return n;
+}
+
+#define KVS_RANGE_STEP		1024	// keys per hold of the shard lock
+
+// RANGE <engine> <start> <end>: how many keys of an ordered engine fall in
+// [start, end]. runs on a compute thread, a step of KVS_RANGE_STEP keys at a
+// time with the shard locked, the worker takes the shard between the steps.
+// the b-link and the copy-on-write tree are one for all shards and go in one
+// pass: the first latches its own leaves, the second walks a snapshot, the
+// count is that of a single version
+typedef struct kvs_range_s {
+	KVS_ENGINE_SCAN scan;
+	int sharded;
+	char start[BUFFER_LENGTH];
+	char end[BUFFER_LENGTH];
+	char last[BUFFER_LENGTH];	// where the step stopped
+	int resumed;
+	int step;
+	int done;
+	long count;
+} kvs_range_t;
+
+static KVS_ENGINE_SCAN kvstore_range_engine(char *engine) {
+#if ENABLE_RBTREE_KVENGINE
+	if (strcmp(engine, "rbtree") == 0) return kvstore_rbtree_scan;
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+	if (strcmp(engine, "skiptable") == 0) return kvstore_skiptable_scan;
+#endif
+#if ENABLE_BTREE_KVENGINE
+	if (strcmp(engine, "btree") == 0) return kvstore_btree_scan;
+#endif
+#if ENABLE_BLINK_KVENGINE
+	if (strcmp(engine, "blink") == 0) return kvstore_blink_scan;
+#endif
+#if ENABLE_COW_KVENGINE
+	if (strcmp(engine, "cow") == 0) return kvstore_cow_scan;
+#endif
+	return NULL;
+}
+
+static int kvstore_range_key(char *key, char *value, void *arg) {
+
+	(void)value;
+	kvs_range_t *range = (kvs_range_t *)arg;
+
+	// a step starts at the key the last one stopped on, unless it is gone
+	if (range->resumed && strcmp(key, range->last) == 0) return 0;
+
+	if (strcmp(key, range->end) > 0) {
+		range->done = 1;
+		return 1;
+	}
+
+	range->count ++;
+	if (range->sharded && -- range->step == 0) {
+		snprintf(range->last, BUFFER_LENGTH, "%s", key);
+		range->resumed = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static void kvstore_range_run(void *arg) {
+
+	kvs_range_t *range = (kvs_range_t *)arg;
+
+	int shards = range->sharded ? kvs_nshards : 1;
+
+	int i = 0;
+	for (i = 0;i < shards;i ++) {
+		snprintf(range->last, BUFFER_LENGTH, "%s", range->start);
+		range->resumed = 0;
+		range->done = 0;
+
+		while (!range->done) {
+			range->step = KVS_RANGE_STEP;
+
+			if (range->sharded) kvstore_shard_enter(i);
+			int res = range->scan(range->last, kvstore_range_key, range);
+			if (range->sharded) kvstore_shard_leave();
+
+			if (res <= 0) break; // walked off the end
+		}
+	}
+}
+
+// -1: no such ordered engine
+static long kvstore_range(char *engine, char *start, char *end) {
+
+	KVS_ENGINE_SCAN scan = kvstore_range_engine(engine);
+	if (!scan) return -1;
+
+	kvs_range_t *range = (kvs_range_t *)malloc(sizeof(kvs_range_t));
+	if (!range) return -1;
+
+	memset(range, 0, sizeof(kvs_range_t));
+	range->scan = scan;
+	range->sharded = strcmp(engine, "blink") != 0 && strcmp(engine, "cow") != 0;
+	snprintf(range->start, BUFFER_LENGTH, "%s", start);
+	snprintf(range->end, BUFFER_LENGTH, "%s", end);
+
+	kvstore_compute(kvstore_range_run, range);
+
+	long count = range->count;
+	free(range);
+
+	return count;
+}
+
+#if ENABLE_COW_KVENGINE
+
+// BACKUP <name>: the copy-on-write tree as one version into a file of the
+// backup directory, PSET lines a client replays to restore it. on a compute
+// thread, the writers go on meanwhile
+typedef struct kvs_backup_s {
+	char path[BUFFER_LENGTH];
+	long keys;
+} kvs_backup_t;
+
+static void kvstore_backup_run(void *arg) {
+
+	kvs_backup_t *backup = (kvs_backup_t *)arg;
+	backup->keys = kvs_cow_backup(&Cow, backup->path);
+}
+
+// the keys written, -1: no file. name is a plain file name, no directory
+// of the client's choosing
+static long kvstore_backup(char *name) {
+
+	if (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -1;
+
+	kvs_backup_t *backup = (kvs_backup_t *)malloc(sizeof(kvs_backup_t));
+	if (!backup) return -1;
 
-	if (item == NULL || tokens[0] == NULL || count == 0) return -1;
+	if (snprintf(backup->path, BUFFER_LENGTH, "%s/%s", kvs_backup_dir, name) >= BUFFER_LENGTH) {
+		free(backup);
+		return -1;
+	}
+	backup->keys = -1;
 
-	int cmd = KVS_CMD_START;
+	kvstore_compute(kvstore_backup_run, backup);
 
-	
-	for (cmd = KVS_CMD_START; cmd < KVS_CMD_SIZE; cmd ++) {
-		//printf("cmd: %s, %s, %ld, %ld\n",commands[cmd], tokens[0], strlen(commands[cmd]), strlen(tokens[0]));
-		if (strcmp(commands[cmd], tokens[0]) == 0) {
-			break;
-		}
+	long keys = backup->keys;
+	free(backup);
+
+	return keys;
+}
+
+#endif
+
+// MEMORY USAGE <key>: what the key costs in each engine holding it, its own
+// allocations without a share of the engine's index. 0: none has it
+int kvstore_memory_usage(char *key, char *buf, int len) {
+
+	int n = 0;
+
+	int e = 0;
+	for (e = 0;e < KVS_ENGINE_SIZE && n < len;e ++) {
+		long usage = kvstore_engine_usage(e, key);
+		if (usage < 0) continue;
+
+		n += snprintf(buf + n, len - n, "%s%s:%ld", n ? " " : "", kvs_engine_names[e], usage);
+	}
+
+	return n;
+}
+
+
+// rbuffer
+
+
+// wbuffer
+
+int kvstore_split_token(char *msg, char **tokens) {
+
+	if (msg == NULL || tokens == NULL) return -1;
+
+	int idx = 0;
+	char *saveptr = NULL;
+
+	char *token = strtok_r(msg, " ", &saveptr);
+
+	while (token != NULL) {
+		tokens[idx ++] = token;
+		token = strtok_r(NULL, " ", &saveptr);
 	}
+	return idx;
+}
+
+// crud
+
+static int kvstore_execute(struct conn_item *item, int cmd, char **tokens, int count) {
 
 	char *msg = item->wbuffer;
 	char *key = tokens[1];
 	char *value = tokens[2];
 	memset(msg, 0, BUFFER_LENGTH);
 
+	// commands come in groups of five per engine, charge its allocations there
+	kvs_mem_engine = cmd < KVS_CMD_STATS ? cmd / KVS_CMD_GROUP : KVS_ENGINE_OTHER;
+
+	int op = cmd % KVS_CMD_GROUP;
+
+#if ENABLE_MAXMEMORY
+	if (cmd < KVS_CMD_STATS && (op == KVS_CMD_SET || op == KVS_CMD_MOD)) {
+		if (kvs_evict_perform() < 0) {
+			snprintf(msg, BUFFER_LENGTH, "ERROR OOM");
+			return 0;
+		}
+	}
+#endif
+
+#if ENABLE_COMPRESSION
+	char packed[BUFFER_LENGTH];
+	if (cmd < KVS_CMD_STATS && (op == KVS_CMD_SET || op == KVS_CMD_MOD) && value) {
+		value = kvs_compress_pack(kvs_mem_engine, value, packed, BUFFER_LENGTH);
+		if (!value) {
+			snprintf(msg, BUFFER_LENGTH, "FAILED");
+			return 0;
+		}
+	}
+#endif
+
 	switch (cmd) {
 		// array
 		case KVS_CMD_SET: {
@@ -276,7 +1569,7 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 		}
 
 		case KVS_CMD_COUNT: {
-			int count = kvstore_array_count();
+			int count = kvstore_engine_count(KVS_ENGINE_ARRAY);
 			if (count < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else {
@@ -317,12 +1610,226 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			} else {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
-			
+			
+			break;
+		}
+		case KVS_CMD_RMOD: {
+
+			int res = kvstore_rbtree_modify(key, value);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			
+			break;
+		}
+
+		case KVS_CMD_RCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_RBTREE);
+			if (count < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%d", count);
+			}
+			break;
+		}
+
+		case KVS_CMD_HSET: {
+
+			int res = kvstore_hash_set(key, value);
+			if (!res) {
+				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "FAILED");
+			}
+			break;
+		}
+		// hash
+		case KVS_CMD_HGET: {
+
+			char *val = kvstore_hash_get(key);
+			if (val) {
+				snprintf(msg, BUFFER_LENGTH, "%s", val);
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			
+			break;
+		}
+		case KVS_CMD_HDEL: {
+
+			int res = kvstore_hash_delete(key);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			
+			break;
+		}
+		case KVS_CMD_HMOD: {
+
+			int res = kvstore_hash_modify(key, value);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			
+			break;
+		}
+
+		case KVS_CMD_HCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_HASH);
+			if (count < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%d", count);
+			}
+			break;
+		}
+
+		// skip list
+		case KVS_CMD_SSET: {
+			int res = kvstore_skiptable_set(key, value);
+			if (!res) {
+				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "FAILED");
+			}
+			break;
+		}
+		case KVS_CMD_SGET: {
+			char *val = kvstore_skiptable_get(key);
+			if (val) {
+				snprintf(msg, BUFFER_LENGTH, "%s", val);
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_SDEL: {
+			int res = kvstore_skiptable_delete(key);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_SMOD: {
+			int res = kvstore_skiptable_modify(key, value);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_SCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_SKIPTABLE);
+			if (count < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%d", count);
+			}
+			break;
+		}
+
+		// B-tree
+		case KVS_CMD_BSET: {
+			int res = kvstore_btree_set(key, value);
+			if (!res) {
+				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "FAILED");
+			}
+			break;
+		}
+		case KVS_CMD_BGET: {
+			char *val = kvstore_btree_get(key);
+			if (val) {
+				snprintf(msg, BUFFER_LENGTH, "%s", val);
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_BDEL: {
+			int res = kvstore_btree_delete(key);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_BMOD: {
+			int res = kvstore_btree_modify(key, value);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_BCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_BTREE);
+			if (count < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%d", count);
+			}
+			break;
+		}
+
+		// cuckoo hash
+		case KVS_CMD_CSET: {
+			int res = kvstore_cuckoo_set(key, value);
+			if (!res) {
+				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "FAILED");
+			}
+			break;
+		}
+		case KVS_CMD_CGET: {
+			char *val = kvstore_cuckoo_get(key);
+			if (val) {
+				snprintf(msg, BUFFER_LENGTH, "%s", val);
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+		case KVS_CMD_CDEL: {
+			int res = kvstore_cuckoo_delete(key);
+			if (res < 0) {  // server
+				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
+			} else if (res == 0) {
+				snprintf(msg, BUFFER_LENGTH, "%s", "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
 			break;
 		}
-		case KVS_CMD_RMOD: {
-
-			int res = kvstore_rbtree_modify(key, value);
+		case KVS_CMD_CMOD: {
+			int res = kvstore_cuckoo_modify(key, value);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -330,12 +1837,10 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			} else {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
-			
 			break;
 		}
-
-		case KVS_CMD_RCOUNT: {
-			int count = kvstore_rbtree_count();
+		case KVS_CMD_CCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_CUCKOO);
 			if (count < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else {
@@ -344,9 +1849,9 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			break;
 		}
 
-		case KVS_CMD_HSET: {
-
-			int res = kvstore_hash_set(key, value);
+		// lsm tree
+		case KVS_CMD_LSET: {
+			int res = kvstore_lsm_set(key, value);
 			if (!res) {
 				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
 			} else {
@@ -354,21 +1859,17 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		// hash
-		case KVS_CMD_HGET: {
-
-			char *val = kvstore_hash_get(key);
+		case KVS_CMD_LGET: {
+			char *val = kvstore_lsm_get(key);
 			if (val) {
 				snprintf(msg, BUFFER_LENGTH, "%s", val);
 			} else {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
-			
 			break;
 		}
-		case KVS_CMD_HDEL: {
-
-			int res = kvstore_hash_delete(key);
+		case KVS_CMD_LDEL: {
+			int res = kvstore_lsm_delete(key);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -376,12 +1877,10 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			} else {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
-			
 			break;
 		}
-		case KVS_CMD_HMOD: {
-
-			int res = kvstore_hash_modify(key, value);
+		case KVS_CMD_LMOD: {
+			int res = kvstore_lsm_modify(key, value);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -389,12 +1888,10 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			} else {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
-			
 			break;
 		}
-
-		case KVS_CMD_HCOUNT: {
-			int count = kvstore_hash_count();
+		case KVS_CMD_LCOUNT: {
+			int count = kvstore_lsm_count();
 			if (count < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else {
@@ -403,9 +1900,10 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			break;
 		}
 
-		// skip list
-		case KVS_CMD_SSET: {
-			int res = kvstore_skiptable_set(key, value);
+#if ENABLE_BLINK_KVENGINE
+		// b-link tree
+		case KVS_CMD_BLSET: {
+			int res = kvstore_blink_set(key, value);
 			if (!res) {
 				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
 			} else {
@@ -413,17 +1911,15 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_SGET: {
-			char *val = kvstore_skiptable_get(key);
-			if (val) {
-				snprintf(msg, BUFFER_LENGTH, "%s", val);
-			} else {
+		case KVS_CMD_BLGET: {
+			int res = kvstore_blink_get(key, msg, BUFFER_LENGTH);
+			if (res != 0) {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
 			break;
 		}
-		case KVS_CMD_SDEL: {
-			int res = kvstore_skiptable_delete(key);
+		case KVS_CMD_BLDEL: {
+			int res = kvstore_blink_delete(key);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -433,8 +1929,8 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_SMOD: {
-			int res = kvstore_skiptable_modify(key, value);
+		case KVS_CMD_BLMOD: {
+			int res = kvstore_blink_modify(key, value);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -444,8 +1940,8 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_SCOUNT: {
-			int count = kvstore_skiptable_count();
+		case KVS_CMD_BLCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_BLINK);
 			if (count < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else {
@@ -453,10 +1949,12 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
+#endif
 
-		// B-tree
-		case KVS_CMD_BSET: {
-			int res = kvstore_btree_set(key, value);
+#if ENABLE_COW_KVENGINE
+		// copy-on-write b+tree
+		case KVS_CMD_PSET: {
+			int res = kvstore_cow_set(key, value);
 			if (!res) {
 				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
 			} else {
@@ -464,17 +1962,15 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_BGET: {
-			char *val = kvstore_btree_get(key);
-			if (val) {
-				snprintf(msg, BUFFER_LENGTH, "%s", val);
-			} else {
+		case KVS_CMD_PGET: {
+			int res = kvstore_cow_get(key, msg, BUFFER_LENGTH);
+			if (res != 0) {
 				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
 			}
 			break;
 		}
-		case KVS_CMD_BDEL: {
-			int res = kvstore_btree_delete(key);
+		case KVS_CMD_PDEL: {
+			int res = kvstore_cow_delete(key);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -484,8 +1980,8 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_BMOD: {
-			int res = kvstore_btree_modify(key, value);
+		case KVS_CMD_PMOD: {
+			int res = kvstore_cow_modify(key, value);
 			if (res < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else if (res == 0) {
@@ -495,8 +1991,8 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
-		case KVS_CMD_BCOUNT: {
-			int count = kvstore_btree_count();
+		case KVS_CMD_PCOUNT: {
+			int count = kvstore_engine_count(KVS_ENGINE_COW);
 			if (count < 0) {  // server
 				snprintf(msg, BUFFER_LENGTH, "%s", "ERROR");
 			} else {
@@ -504,7 +2000,89 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 			}
 			break;
 		}
+#endif
+
+		case KVS_CMD_STATS: {
+			int res = kvstore_stats(key, msg, BUFFER_LENGTH);
+			if (res <= 0) {
+				snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+			}
+			break;
+		}
+
+		// CONFIG SET <name> <value>, CONFIG GET <name>
+		case KVS_CMD_CONFIG: {
+			if (key && strcmp(key, "SET") == 0 && count == 4) {
+				int res = kvstore_config_set(tokens[2], tokens[3]);
+				if (!res) {
+					snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+				} else {
+					snprintf(msg, BUFFER_LENGTH, "FAILED");
+				}
+			} else if (key && strcmp(key, "GET") == 0 && count == 3) {
+				if (kvstore_config_get(tokens[2], msg, BUFFER_LENGTH) < 0) {
+					snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+				}
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "ERROR");
+			}
+			break;
+		}
+
+#if ENABLE_COMPRESSION
+		// CLIENT COMPRESSED yes|no, take GET replies packed on this connection
+		case KVS_CMD_CLIENT: {
+			if (key && strcmp(key, "COMPRESSED") == 0 && count == 3
+				&& (strcmp(tokens[2], "yes") == 0 || strcmp(tokens[2], "no") == 0)) {
+				item->packed = (strcmp(tokens[2], "yes") == 0);
+				snprintf(msg, BUFFER_LENGTH, "SUCCESS");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "ERROR");
+			}
+			break;
+		}
+#endif
 		
+		// MEMORY STATS [engine], MEMORY USAGE <key>
+		case KVS_CMD_MEMORY: {
+			if (key && strcmp(key, "STATS") == 0 && count <= 3) {
+				if (kvstore_memory_stats(count == 3 ? tokens[2] : NULL, msg, BUFFER_LENGTH) < 0) {
+					snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+				}
+			} else if (key && strcmp(key, "USAGE") == 0 && count == 3) {
+				if (kvstore_memory_usage(tokens[2], msg, BUFFER_LENGTH) <= 0) {
+					snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+				}
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "ERROR");
+			}
+			break;
+		}
+
+		// RANGE <engine> <start> <end>
+		case KVS_CMD_RANGE: {
+			long res = count == 4 ? kvstore_range(key, tokens[2], tokens[3]) : -1;
+			if (res < 0) {
+				snprintf(msg, BUFFER_LENGTH, "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%ld", res);
+			}
+			break;
+		}
+
+#if ENABLE_COW_KVENGINE
+		// BACKUP <name>
+		case KVS_CMD_BACKUP: {
+			long res = count == 2 ? kvstore_backup(key) : -1;
+			if (res < 0) {
+				snprintf(msg, BUFFER_LENGTH, "ERROR");
+			} else {
+				snprintf(msg, BUFFER_LENGTH, "%ld", res);
+			}
+			break;
+		}
+#endif
+
 		default: {
 			printf("cmd: %s\n", commands[cmd]);
 			assert(0);
@@ -513,6 +2091,161 @@ int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
 
 	}
 
+#if ENABLE_COMPRESSION
+	if (cmd < KVS_CMD_STATS && op == KVS_CMD_GET) {
+		kvs_compress_reply(msg, BUFFER_LENGTH, item->packed);
+	}
+#endif
+
+	return 0;
+}
+
+// key commands run in the key's shard, lsm ones in shard 0. -1: COUNT, the
+// commands that are not about one key enter the shards they read, and the
+// b-link and the copy-on-write tree take every worker as it is
+static int kvstore_route(int cmd, char *key) {
+
+	if (cmd >= KVS_CMD_STATS) return -1;
+	if (cmd / KVS_CMD_GROUP == KVS_ENGINE_LSM) return 0;
+	if (cmd / KVS_CMD_GROUP == KVS_ENGINE_BLINK) return -1;
+	if (cmd / KVS_CMD_GROUP == KVS_ENGINE_COW) return -1;
+	if (cmd % KVS_CMD_GROUP == KVS_CMD_COUNT) return -1;
+
+	return kvstore_shard_of(key);
+}
+
+#if ENABLE_MULTI_CORE && (ENABLE_NETWORK_SELECT == NETWORK_NTYCO)
+
+// a key command on its way to the worker owning the shard. tokens point into
+// item->rbuffer, both outlive the parked coroutine, the array is copied
+typedef struct kvs_forward_s {
+	struct conn_item *item;
+	int cmd;
+	int count;
+	int shard;
+	int res;
+	char *tokens[KVSTORE_MAX_TOKENS];
+} kvs_forward_t;
+
+static void kvstore_forward_run(void *arg) {
+
+	kvs_forward_t *fwd = (kvs_forward_t *)arg;
+
+	kvstore_shard_enter(fwd->shard);
+	fwd->res = kvstore_execute(fwd->item, fwd->cmd, fwd->tokens, fwd->count);
+	kvstore_shard_leave();
+}
+
+// -2: could not be forwarded, nothing ran
+static int kvstore_forward(struct conn_item *item, int shard, int cmd, char **tokens, int count) {
+
+	kvs_forward_t *fwd = (kvs_forward_t *)malloc(sizeof(kvs_forward_t));
+	if (!fwd) return -2;
+
+	fwd->item = item;
+	fwd->cmd = cmd;
+	fwd->count = count;
+	fwd->shard = shard;
+	fwd->res = -1;
+	memcpy(fwd->tokens, tokens, sizeof(fwd->tokens));
+
+	int res = kvstore_shard_call(shard, kvstore_forward_run, fwd) == 0 ? fwd->res : -2;
+	free(fwd);
+
+	return res;
+}
+
+#endif
+
+#if ENABLE_RCU_READS
+
+// RGET, SGET and BGET of a key in another worker's shard, answered here
+// without its lock: no hop through the owner's inbox, the shard's readers
+// run on every core that has a connection asking. the cache and bloom
+// filter in front of the tree are the owner's, they are left out. -1: not
+// such a read, or the writer kept changing the tree, the caller takes the
+// locked path
+static int kvstore_rcu_get(struct conn_item *item, int shard, int cmd, char **tokens, int count) {
+
+	if (cmd != KVS_CMD_RGET && cmd != KVS_CMD_SGET && cmd != KVS_CMD_BGET) return -1;
+	if (count != 2 || !__atomic_load_n(&kvs_rcu_reads, __ATOMIC_RELAXED)) return -1;
+#if ENABLE_MAXMEMORY
+	// a lockless read leaves the access clock alone, under a ceiling the
+	// owner has to see the read or it evicts the hot keys
+	if (kvs_evict_active()) return -1;
+#endif
+
+	kvs_shard_t *s = &Shards[shard];
+	char *msg = item->wbuffer;
+	int res = -1;
+	int tries = 0;
+
+	kvs_rcu_read_lock();
+	for (tries = 0;tries < KVS_RCU_RETRIES && res < 0;tries ++) {
+		switch (cmd) {
+#if ENABLE_RBTREE_KVENGINE
+			case KVS_CMD_RGET: res = kvs_rbtree_read(s->rbtree, tokens[1], msg, BUFFER_LENGTH); break;
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+			case KVS_CMD_SGET: res = kvs_skiptable_read(s->skiplist, tokens[1], msg, BUFFER_LENGTH); break;
+#endif
+#if ENABLE_BTREE_KVENGINE
+			case KVS_CMD_BGET: res = kvs_btree_read(s->btree, tokens[1], msg, BUFFER_LENGTH); break;
+#endif
+			default: break;
+		}
+	}
+	kvs_rcu_read_unlock(res < 0 ? tries : tries - 1, res >= 0);
+
+	if (res < 0) return -1;
+	if (res == 1) snprintf(msg, BUFFER_LENGTH, "NO EXIST");
+
+#if ENABLE_COMPRESSION
+	kvs_compress_reply(msg, BUFFER_LENGTH, item->packed);
+#endif
+
+	return 0;
+}
+
+#endif
+
+int kvstore_parser_protocol(struct conn_item *item, char **tokens, int count) {
+
+	if (item == NULL || tokens[0] == NULL || count == 0) return -1;
+
+	int cmd = KVS_CMD_START;
+
+	
+	for (cmd = KVS_CMD_START; cmd < KVS_CMD_SIZE; cmd ++) {
+		//printf("cmd: %s, %s, %ld, %ld\n",commands[cmd], tokens[0], strlen(commands[cmd]), strlen(tokens[0]));
+		if (strcmp(commands[cmd], tokens[0]) == 0) {
+			break;
+		}
+	}
+
+	int shard = kvstore_route(cmd, tokens[1]);
+	if (shard < 0) return kvstore_execute(item, cmd, tokens, count);
+
+#if ENABLE_MULTI_CORE
+	if (shard != kvs_worker) {
+#if ENABLE_RCU_READS
+		if (kvstore_rcu_get(item, shard, cmd, tokens, count) == 0) return 0;
+#endif
+#if (ENABLE_NETWORK_SELECT == NETWORK_NTYCO)
+		int res = kvstore_forward(item, shard, cmd, tokens, count);
+		if (res != -2) return res;
+		// inbox unreachable, the shard mutex still makes it safe from here
+#endif
+		// an epoll loop has nothing to park, it runs the command under the
+		// owner's shard mutex
+	}
+#endif
+
+	kvstore_shard_enter(shard);
+	int res = kvstore_execute(item, cmd, tokens, count);
+	kvstore_shard_leave();
+
+	return res;
 }
 
 
@@ -542,69 +2275,339 @@ int kvstore_request(struct conn_item *item) {
 
 
 
-int init_kvengine(void) {
+// one instance of every sharded engine, with its filters and caches
+static int kvstore_shard_create(kvs_shard_t *shard) {
 
+	pthread_mutex_init(&shard->lock, NULL);
 
 #if ENABLE_ARRAY_KVENGINE
-	kvstore_array_create(&Array);
+	kvs_mem_engine = KVS_ENGINE_ARRAY;
+	if (kvstore_array_create(&shard->array) != 0) return -1;
 #endif
 
 #if ENABLE_RBTREE_KVENGINE
-	kvstore_rbtree_create(&Tree);
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	shard->rbtree = kvstore_rbtree_new();
+	if (!shard->rbtree) return -1;
 #endif
 
 #if ENABLE_HASH_KVENGINE
-	kvstore_hash_create(&Hash);
+	kvs_mem_engine = KVS_ENGINE_HASH;
+	shard->hash = kvstore_hash_new();
+	if (!shard->hash) return -1;
+#endif
+
+#if ENABLE_CUCKOO_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_CUCKOO;
+	shard->cuckoo = kvstore_cuckoo_new();
+	if (!shard->cuckoo) return -1;
 #endif
 
 #if ENABLE_SKIPTABLE_KVENGINE
-	kvstore_skiptable_create(&Skiplist);
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	shard->skiplist = kvstore_skiptable_new();
+	if (!shard->skiplist) return -1;
 #endif
 
 #if ENABLE_BTREE_KVENGINE
-	kvstore_btree_create(&Btree);
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	shard->btree = kvstore_btree_new();
+	if (!shard->btree) return -1;
 #endif
 
-}
+	// the rebuild scans go through the wrappers, into the shard being worked on
+#if ENABLE_RBTREE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	shard->rbtree_bloom = kvs_bloom_new("rbtree", kvstore_rbtree_scan);
+	if (!shard->rbtree_bloom) return -1;
+#endif
 
+#if ENABLE_SKIPTABLE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	shard->skiptable_bloom = kvs_bloom_new("skiptable", kvstore_skiptable_scan);
+	if (!shard->skiptable_bloom) return -1;
+#endif
 
-int exit_kvengine(void) {
+#if ENABLE_BTREE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	shard->btree_bloom = kvs_bloom_new("btree", kvstore_btree_scan);
+	if (!shard->btree_bloom) return -1;
+#endif
+
+#if ENABLE_RBTREE_CACHE
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	shard->rbtree_cache = kvs_cache_new("rbtree");
+	if (!shard->rbtree_cache) return -1;
+#endif
+
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	shard->skiptable_cache = kvs_cache_new("skiptable");
+	if (!shard->skiptable_cache) return -1;
+#endif
+
+#if ENABLE_BTREE_CACHE
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	shard->btree_cache = kvs_cache_new("btree");
+	if (!shard->btree_cache) return -1;
+#endif
+
+	kvs_mem_engine = KVS_ENGINE_OTHER;
 
+	return 0;
+}
+
+static void kvstore_shard_destory(kvs_shard_t *shard) {
 
 #if ENABLE_ARRAY_KVENGINE
-	kvstore_array_destory(&Array);
+	kvs_mem_engine = KVS_ENGINE_ARRAY;
+	kvstore_array_destory(&shard->array);
 #endif
 
 #if ENABLE_RBTREE_KVENGINE
-	kvstore_rbtree_destory(&Tree);
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	kvstore_rbtree_free(shard->rbtree);
 #endif
 
 #if ENABLE_HASH_KVENGINE
-	kvstore_hash_destory(&Hash);
+	kvs_mem_engine = KVS_ENGINE_HASH;
+	kvstore_hash_free(shard->hash);
+#endif
+
+#if ENABLE_CUCKOO_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_CUCKOO;
+	kvstore_cuckoo_free(shard->cuckoo);
+#endif
+
+#if ENABLE_SKIPTABLE_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	kvstore_skiptable_free(shard->skiplist);
+#endif
+
+#if ENABLE_BTREE_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	kvstore_btree_free(shard->btree);
+#endif
+
+#if ENABLE_RBTREE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	kvs_bloom_free(shard->rbtree_bloom);
+#endif
+
+#if ENABLE_RBTREE_CACHE
+	kvs_mem_engine = KVS_ENGINE_RBTREE;
+	kvs_cache_free(shard->rbtree_cache);
+#endif
+
+#if ENABLE_SKIPTABLE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	kvs_bloom_free(shard->skiptable_bloom);
+#endif
+
+#if ENABLE_SKIPTABLE_CACHE
+	kvs_mem_engine = KVS_ENGINE_SKIPTABLE;
+	kvs_cache_free(shard->skiptable_cache);
+#endif
+
+#if ENABLE_BTREE_BLOOM
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	kvs_bloom_free(shard->btree_bloom);
+#endif
+
+#if ENABLE_BTREE_CACHE
+	kvs_mem_engine = KVS_ENGINE_BTREE;
+	kvs_cache_free(shard->btree_cache);
+#endif
+
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+
+	pthread_mutex_destroy(&shard->lock);
+}
+
+
+int kvstore_shard_init(int shard) {
+
+	if (kvstore_shard_create(&Shards[shard]) != 0) {
+		fprintf(stderr, "kvstore: out of memory creating shard %d\n", shard);
+		return -1;
+	}
+	return 0;
+}
+
+int init_kvengine(void) {
+
+	// with ENABLE_NUMA the other workers make their own shards, first touch
+	// puts them on their nodes. this thread is worker 0
+	int shards = ENABLE_NUMA ? 1 : kvs_nshards;
+
+	int i = 0;
+	for (i = 0;i < shards;i ++) {
+		if (kvstore_shard_init(i) != 0) return -1;
+	}
+#if ENABLE_NUMA
+	// the threads started from here on, the lsm flush, the compute threads
+	// and the other workers, do not inherit worker 0's cpu. it pins itself
+	// again when it enters its event loop
+	kvs_numa_unpin();
+#endif
+
+#if ENABLE_LSM_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_LSM;
+	kvstore_lsm_create(&Lsm);
 #endif
 
+#if ENABLE_BLINK_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_BLINK;
+	if (kvstore_blink_create(&Blink) != 0) return -1;
+#endif
+
+#if ENABLE_COW_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_COW;
+	if (kvstore_cow_create(&Cow) != 0) return -1;
+#endif
+
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+
+#if ENABLE_MAXMEMORY
+	// array, lsm, blink and cow are not evictable, see kvstore_evict.c
+#if ENABLE_RBTREE_KVENGINE
+	kvs_evict_register(KVS_ENGINE_RBTREE, kvstore_rbtree_sample, kvstore_rbtree_delete);
+#endif
+#if ENABLE_HASH_KVENGINE
+	kvs_evict_register(KVS_ENGINE_HASH, kvstore_hash_sample, kvstore_hash_delete);
+#endif
 #if ENABLE_SKIPTABLE_KVENGINE
-	kvstore_skiptable_destory(&Skiplist);
+	kvs_evict_register(KVS_ENGINE_SKIPTABLE, kvstore_skiptable_sample, kvstore_skiptable_delete);
+#endif
+#if ENABLE_BTREE_KVENGINE
+	kvs_evict_register(KVS_ENGINE_BTREE, kvstore_btree_sample, kvstore_btree_delete);
+#endif
+#if ENABLE_CUCKOO_KVENGINE
+	kvs_evict_register(KVS_ENGINE_CUCKOO, kvstore_cuckoo_sample, kvstore_cuckoo_delete);
+#endif
 #endif
 
+#if ENABLE_MEM_DEFRAG
+#if ENABLE_RBTREE_KVENGINE
+	kvs_defrag_register(KVS_ENGINE_RBTREE, kvstore_rbtree_defrag);
+#endif
+#if ENABLE_HASH_KVENGINE
+	kvs_defrag_register(KVS_ENGINE_HASH, kvstore_hash_defrag);
+#endif
+#if ENABLE_SKIPTABLE_KVENGINE
+	kvs_defrag_register(KVS_ENGINE_SKIPTABLE, kvstore_skiptable_defrag);
+#endif
 #if ENABLE_BTREE_KVENGINE
-	kvstore_btree_destory(&Btree);
+	kvs_defrag_register(KVS_ENGINE_BTREE, kvstore_btree_defrag);
+#endif
+#endif
+
+	return 0;
+}
+
+
+int exit_kvengine(void) {
+
+	int i = 0;
+	for (i = 0;i < kvs_nshards;i ++) {
+		kvstore_shard_destory(&Shards[i]);
+	}
+
+#if ENABLE_LSM_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_LSM;
+	kvstore_lsm_destory(&Lsm);
+#endif
+
+#if ENABLE_BLINK_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_BLINK;
+	kvstore_blink_destory(&Blink);
 #endif
 
+#if ENABLE_COW_KVENGINE
+	kvs_mem_engine = KVS_ENGINE_COW;
+	kvstore_cow_destory(&Cow);
+#endif
+
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+
+	return 0;
 }
 
 int init_ctx(void) {
 
 #if ENABLE_MEM_POOL
-	mp_init(&m, 4096);
+	mp_init();
 #endif
 
+	return 0;
 }
 
-int main() {
+// kvstore [-w workers] [-c compute threads] [-a spread|compact|off] [-b backup dir]
+int main(int argc, char *argv[]) {
+
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "w:c:a:b:")) != -1) {
+		switch (opt) {
+			case 'w': {
+				int workers = atoi(optarg);
+				if (workers < 1 || workers > KVS_MAX_SHARDS) {
+					fprintf(stderr, "kvstore: -w takes 1 to %d workers\n", KVS_MAX_SHARDS);
+					return 1;
+				}
+				kvs_nshards = workers;
+				break;
+			}
+			case 'c': {
+				int threads = atoi(optarg);
+				if (threads < 0 || threads > KVS_MAX_COMPUTE) {
+					fprintf(stderr, "kvstore: -c takes 0 to %d compute threads\n", KVS_MAX_COMPUTE);
+					return 1;
+				}
+				kvs_ncompute = threads;
+				break;
+			}
+#if ENABLE_NUMA
+			case 'a':
+				if (kvs_numa_policy_set(optarg) != 0) {
+					fprintf(stderr, "kvstore: -a takes spread, compact or off\n");
+					return 1;
+				}
+				break;
+#endif
+#if ENABLE_COW_KVENGINE
+			case 'b':
+				if (optarg[0] == '\0' || strlen(optarg) >= sizeof(kvs_backup_dir)) {
+					fprintf(stderr, "kvstore: -b takes a directory\n");
+					return 1;
+				}
+				snprintf(kvs_backup_dir, sizeof(kvs_backup_dir), "%s", optarg);
+				break;
+#endif
+			default:
+				fprintf(stderr, "usage: %s [-w workers] [-c compute threads] [-a spread|compact|off] [-b backup dir]\n", argv[0]);
+				return 1;
+		}
+	}
+
+#if (ENABLE_NETWORK_SELECT == NETWORK_IOURING)
+	if (kvs_nshards > 1) {
+		fprintf(stderr, "kvstore: multiple workers need the ntyco or epoll network, running one\n");
+		kvs_nshards = 1;
+	}
+#endif
+#if (ENABLE_NETWORK_SELECT == NETWORK_IOURING)
+	kvs_ncompute = 0; // nothing to park while they run
+#endif
 
+#if ENABLE_NUMA
+	// pinned before the first allocation, worker 0 runs here
+	kvs_numa_init(kvs_nshards);
+	kvs_numa_report(kvs_nshards);
+	kvs_numa_pin(0);
+#endif
 
-	init_kvengine();
+	init_ctx();
+	if (init_kvengine() != 0) return 1;
 	
 #if (ENABLE_NETWORK_SELECT == NETWORK_EPOLL)
 	epoll_entry();
@@ -5,6 +5,7 @@
 #define __KVSTORE_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -31,6 +32,17 @@
 
 typedef int (*RCALLBACK)(int fd);
 
+// ordered walk over an engine, return non-zero to stop
+typedef int (*SCAN_CALLBACK)(char *key, char *value, void *arg);
+// walk one engine from the first key >= start, 1: stopped by cb, 0: done
+typedef int (*KVS_ENGINE_SCAN)(char *start, SCAN_CALLBACK cb, void *arg);
+
+// defrag: an engine walk moved the value of key, caches holding it must drop it
+typedef void (*KVS_DEFRAG_MOVED)(char *key);
+// one defrag step over an engine. cursor: BUFFER_LENGTH bytes, "" to start,
+// on return where to resume. 1: stopped after budget keys, 0: walked everything
+typedef int (*KVS_ENGINE_DEFRAG)(char *cursor, int budget);
+
 
 struct conn_item {
 	int fd;
@@ -45,17 +57,119 @@ struct conn_item {
 		RCALLBACK recv_callback;
 	} recv_t;
 	RCALLBACK send_callback;
+
+	int packed;			// CLIENT COMPRESSED yes: GET replies keep packed values
 };
 // libevent --> 
 
 int epoll_entry(void);
 int ntyco_entry(void);
+// STATS EPOLL: connections and requests per event loop. epoll_entry.c
+int epoll_stats(char *buf, int len);
 
 
 int kvstore_request(struct conn_item *item);
 
 void *kvstore_malloc(size_t size);
+void *kvstore_malloc_tag(size_t size, int tag);
+void *kvstore_malloc_ref(size_t size, int tag);
+void *kvstore_malloc_aligned(size_t size, size_t align, int tag);
+void kvstore_free_aligned(void *ptr, int tag);
 void kvstore_free(void *ptr);
+void kvstore_free_tag(void *ptr, int tag);
+size_t kvstore_usable_size(void *ptr);
+void *kvstore_defrag_move(void *ptr);
+
+#define KVS_CRON_INTERVAL_MS	100
+void kvstore_cron(void);
+// the event loop between two rounds, no request half done on this thread
+void kvstore_quiescent(void);
+
+
+// short keys and values live in the engine node in place of a pointer. the
+// last byte tells which: 0 the string is inline (that byte is its terminator
+// or padding), 1 it is on the heap and the first bytes hold the pointer,
+// KVS_STR_SHARED it is a value interned by kvstore_dedup.c, KVS_STR_LOG a
+// value in a kvstore_vlog.c segment.
+#define KVS_KEY_INLINE			16	// keys shorter than this are inline
+#define KVS_VALUE_INLINE		24	// values shorter than this are inline
+#define KVS_STR_SHARED			2
+#define KVS_STR_LOG				3
+
+#if KVS_KEY_INLINE <= 8 || KVS_VALUE_INLINE <= 8
+#error "an inline string needs room for a pointer and the tag byte"
+#endif
+
+typedef union kvs_key_u {
+	char s[KVS_KEY_INLINE];
+	char *ptr;
+} kvs_key_t;
+
+typedef union kvs_value_u {
+	char s[KVS_VALUE_INLINE];
+	char *ptr;
+} kvs_value_t;
+
+static inline char *kvs_str_get(char *s, size_t size) {
+	return s[size - 1] ? *(char **)s : s;
+}
+
+int kvs_str_set(char *s, size_t size, const char *str, int tag);
+int kvs_str_intern(char *s, size_t size, const char *str);
+void kvs_str_free(char *s, size_t size, int tag);
+int kvs_str_defrag(char *s, size_t size);
+size_t kvs_str_usage(char *s, size_t size);
+
+#define kvs_key_get(k)			kvs_str_get((k)->s, KVS_KEY_INLINE)
+#define kvs_key_set(k, str)		kvs_str_set((k)->s, KVS_KEY_INLINE, (str), KVS_MEM_KEY)
+#define kvs_key_free(k)			kvs_str_free((k)->s, KVS_KEY_INLINE, KVS_MEM_KEY)
+#define kvs_key_defrag(k)		kvs_str_defrag((k)->s, KVS_KEY_INLINE)
+#define kvs_key_usage(k)		kvs_str_usage((k)->s, KVS_KEY_INLINE)
+
+#define kvs_value_get(v)		kvs_str_get((v)->s, KVS_VALUE_INLINE)
+#define kvs_value_set(v, str)	kvs_str_intern((v)->s, KVS_VALUE_INLINE, (str))
+#define kvs_value_free(v)		kvs_str_free((v)->s, KVS_VALUE_INLINE, KVS_MEM_VALUE)
+#define kvs_value_defrag(v)		kvs_str_defrag((v)->s, KVS_VALUE_INLINE)
+#define kvs_value_usage(v)		kvs_str_usage((v)->s, KVS_VALUE_INLINE)
+
+
+// memory accounting: kvstore_malloc charges malloc_usable_size() to the engine
+// the calling thread is working for, kvstore_free credits the same engine.
+// same order as the command groups in kvstore.c, so the parser maps cmd / 5.
+// within an engine the bytes are split by the tag of kvstore_malloc_tag(),
+// a free must pass the tag its allocation was made with. plain
+// kvstore_malloc is KVS_MEM_INDEX: tables, filters, everything not per key.
+enum {
+	KVS_MEM_NODE = 0,		// per key structure: tree, list and hash nodes
+	KVS_MEM_KEY,			// key copies too long to be inline
+	KVS_MEM_VALUE,			// the same for values, shared and logged ones
+	KVS_MEM_INDEX,
+
+	KVS_MEM_KINDS,
+};
+
+enum {
+	KVS_ENGINE_ARRAY = 0,
+	KVS_ENGINE_RBTREE,
+	KVS_ENGINE_HASH,
+	KVS_ENGINE_SKIPTABLE,
+	KVS_ENGINE_BTREE,
+	KVS_ENGINE_CUCKOO,
+	KVS_ENGINE_LSM,
+	KVS_ENGINE_BLINK,
+	KVS_ENGINE_COW,
+	KVS_ENGINE_OTHER,
+
+	KVS_ENGINE_SIZE,
+};
+
+extern __thread int kvs_mem_engine;
+extern size_t kvs_mem_used[KVS_ENGINE_SIZE][KVS_MEM_KINDS];
+extern const char *kvs_engine_names[KVS_ENGINE_SIZE];
+extern const char *kvs_mem_kind_names[KVS_MEM_KINDS];
+
+size_t kvs_mem_total(void);
+size_t kvs_mem_engine_used(int engine);
 
 
 
@@ -65,43 +179,371 @@ void kvstore_free(void *ptr);
 
 #define ENABLE_NETWORK_SELECT	NETWORK_NTYCO
 
+// kvstore -w <n>: n worker threads, each with its own scheduler (ntyco) or
+// event loop (epoll), SO_REUSEPORT listeners and shard of every engine, keys
+// hashed to shards. kvstore.c
+#define ENABLE_MULTI_CORE		1
+
+#if ENABLE_MULTI_CORE
+#define KVS_MAX_SHARDS			64
+#else
+#define KVS_MAX_SHARDS			1
+#endif
+
+extern int kvs_nshards;
+extern __thread int kvs_shard;
+extern __thread int kvs_worker;
+
+int kvstore_shard_of(char *key);
+// make a worker's shard, on that worker's thread before it takes requests
+// when ENABLE_NUMA. -1: out of memory
+int kvstore_shard_init(int shard);
+void kvstore_shard_enter(int shard);
+void kvstore_shard_leave(void);
+// run fn(arg) on the worker owning shard while the calling coroutine waits.
+// arg must not be on the caller's stack, ntyco swaps it out meanwhile.
+// -1: not posted, fn did not run. ntyco_entry.c
+int kvstore_shard_call(int shard, void (*fn)(void *), void *arg);
+
+// idle workers steal new connection coroutines from busy ones, and a busy
+// worker's reader hands its connection on between requests, ntyco_entry.c
+#define ENABLE_WORK_STEALING	1
+
+// STATS SCHED: steals and load per worker. ntyco_entry.c
+int kvstore_sched_stats(char *buf, int len);
+
+// kvstore -c <n>: n compute threads for the heavy commands (RANGE), the
+// connection's coroutine parks while they run. kvstore.c
+#define ENABLE_COMPUTE_OFFLOAD	1
+
+#define KVS_MAX_COMPUTE			64
+
+extern int kvs_ncompute;
+// run fn(arg) on a compute thread, here when there is none. the same rule
+// for arg as kvstore_shard_call. ntyco_entry.c
+int kvstore_compute(void (*fn)(void *), void *arg);
+
+// epoch-based reclamation: what a structure read without its lock frees is
+// parked on per-thread limbo lists and goes back in batches, at the
+// quiescent points of the event loops, once no reader can hold it.
+// kvstore_ebr.c
+#define ENABLE_EBR				1
+
+// RGET, SGET and BGET of a key in another worker's shard are answered by the
+// worker that got them, without the shard lock or a hop to the owner (CONFIG
+// SET rcu-reads). the tree engines count their changes in a sequence number,
+// a reader checks it at every node, and what a shard's writer frees goes
+// through ENABLE_EBR. kvstore_rcu.c
+#define ENABLE_RCU_READS		1
+
+// kvstore -a spread|compact|off: every worker pinned to a cpu of its numa
+// node, its scheduler, shard and connections made on it after pinning so
+// first touch keeps them there. a topology report at startup, STATS NUMA.
+// kvstore_numa.c
+#define ENABLE_NUMA				1
+
+
 
 #define ENABLE_ARRAY_KVENGINE	1
 #define ENABLE_RBTREE_KVENGINE		1
 #define ENABLE_SKIPTABLE_KVENGINE	1
 #define ENABLE_BTREE_KVENGINE	1
+#define ENABLE_LSM_KVENGINE		1	// memtable is the skiplist engine
 #define ENABLE_HASH_KVENGINE	1
+#define ENABLE_CUCKOO_KVENGINE	1
+#define ENABLE_BLINK_KVENGINE	1	// one b-link tree every worker writes, kvstore_blink.c
+#define ENABLE_COW_KVENGINE		1	// copy-on-write b+tree, snapshots for RANGE and BACKUP, kvstore_cow.c
+
+#define ENABLE_MEM_POOL			1	// size-class slab allocator, kvstore_mp.c
+#define ENABLE_HUGE_PAGES		1	// slab chunks from 2MB regions, CONFIG SET hugepages
+#define ENABLE_MEM_DEFRAG		1	// relocate live objects out of sparse slab chunks, kvstore_defrag.c
+#define ENABLE_COMPACT_REFS		1	// 32 bit node links in rbtree, skiplist and hash, kvstore_mp.c
+
+// bloom filter in front of the ordered engines, answers misses without a descent
+#define ENABLE_RBTREE_BLOOM		1
+#define ENABLE_SKIPTABLE_BLOOM	1
+#define ENABLE_BTREE_BLOOM		1
+
+#define ENABLE_BLOOM_FILTER		(ENABLE_RBTREE_BLOOM || ENABLE_SKIPTABLE_BLOOM || ENABLE_BTREE_BLOOM)
+
+// hot-key cache in front of the ordered engines, a hit is one hash probe
+#define ENABLE_RBTREE_CACHE		1
+#define ENABLE_SKIPTABLE_CACHE	1
+#define ENABLE_BTREE_CACHE		1
+
+#define ENABLE_HOTKEY_CACHE		(ENABLE_RBTREE_CACHE || ENABLE_SKIPTABLE_CACHE || ENABLE_BTREE_CACHE)
+
+// memory ceiling (CONFIG SET maxmemory), writes evict sampled LRU/LFU keys
+#define ENABLE_MAXMEMORY		1
+
+// LZ compression of large values, per engine (CONFIG SET compression), kvstore_compress.c
+#define ENABLE_COMPRESSION		1
+
+// equal heap values shared through a refcounted table (CONFIG SET dedup), kvstore_dedup.c
+#define ENABLE_VALUE_DEDUP		1
+
+// values appended to 1MB log segments, cleaned by the defrag walk (CONFIG SET value-log), kvstore_vlog.c
+#define ENABLE_VALUE_LOG		1
+
+
+#if ENABLE_MULTI_CORE && (ENABLE_NETWORK_SELECT == NETWORK_IOURING)
+#warning "ENABLE_MULTI_CORE workers run on ntyco or epoll, io_uring serves one shard"
+#endif
+
+#if ENABLE_WORK_STEALING && !ENABLE_MULTI_CORE
+#error "ENABLE_WORK_STEALING moves connections between the workers of ENABLE_MULTI_CORE"
+#endif
+
+#if ENABLE_RCU_READS && !ENABLE_MULTI_CORE
+#error "ENABLE_RCU_READS reads the shards of other ENABLE_MULTI_CORE workers"
+#endif
+
+#if ENABLE_NUMA && !ENABLE_MULTI_CORE
+#warning "ENABLE_NUMA places the ENABLE_MULTI_CORE workers, only the main thread is pinned"
+#endif
+
+#if ENABLE_RCU_READS && !ENABLE_EBR
+#error "ENABLE_RCU_READS frees what the readers may hold through ENABLE_EBR"
+#endif
+
+#if ENABLE_BLINK_KVENGINE && !ENABLE_EBR
+#error "ENABLE_BLINK_KVENGINE frees what its readers may hold through ENABLE_EBR"
+#endif
+
+#if ENABLE_COW_KVENGINE && !ENABLE_EBR
+#error "ENABLE_COW_KVENGINE frees what its readers may hold through ENABLE_EBR"
+#endif
+
+#if ENABLE_COMPUTE_OFFLOAD && (ENABLE_NETWORK_SELECT != NETWORK_NTYCO)
+#warning "ENABLE_COMPUTE_OFFLOAD needs ntyco, heavy commands run on the event loop"
+#endif
+
+#if ENABLE_LSM_KVENGINE && !ENABLE_SKIPTABLE_KVENGINE
+#error "ENABLE_LSM_KVENGINE needs ENABLE_SKIPTABLE_KVENGINE"
+#endif
+
+#if (ENABLE_RBTREE_BLOOM && !ENABLE_RBTREE_KVENGINE) || (ENABLE_SKIPTABLE_BLOOM && !ENABLE_SKIPTABLE_KVENGINE) \
+	|| (ENABLE_BTREE_BLOOM && !ENABLE_BTREE_KVENGINE)
+#error "a bloom filter needs its engine enabled"
+#endif
 
-#define ENABLE_MEM_POOL			0
+#if ENABLE_HUGE_PAGES && !ENABLE_MEM_POOL
+#error "ENABLE_HUGE_PAGES needs ENABLE_MEM_POOL"
+#endif
+
+#if ENABLE_MEM_DEFRAG && !ENABLE_MEM_POOL
+#error "ENABLE_MEM_DEFRAG needs ENABLE_MEM_POOL"
+#endif
+
+#if ENABLE_VALUE_LOG && !ENABLE_MEM_DEFRAG
+#error "ENABLE_VALUE_LOG needs ENABLE_MEM_DEFRAG, its cleaner is the defrag walk"
+#endif
+
+#if ENABLE_COMPACT_REFS && !ENABLE_MEM_POOL
+#error "ENABLE_COMPACT_REFS needs ENABLE_MEM_POOL"
+#endif
+
+#if (ENABLE_RBTREE_CACHE && !ENABLE_RBTREE_KVENGINE) || (ENABLE_SKIPTABLE_CACHE && !ENABLE_SKIPTABLE_KVENGINE) \
+	|| (ENABLE_BTREE_CACHE && !ENABLE_BTREE_KVENGINE)
+#error "a hot-key cache needs its engine enabled"
+#endif
 
 
 #if ENABLE_MEM_POOL
 
-int mp_init(mempool_t *m, int size);
-void mp_dest(mempool_t *m);
+typedef struct mempool_s mempool_t;
+
+int mp_init(void);
+void mp_dest(void);
+
+void *mp_alloc(size_t size);
+void mp_free(void *ptr);
+size_t mp_usable_size(void *ptr);
+int mp_stats(char *buf, int len);
+
+#if ENABLE_HUGE_PAGES
+int mp_set_hugepages(const char *mode);
+const char *mp_get_hugepages(void);
+#endif
+
+double mp_fragmentation(size_t *reserved, size_t *used);
 
-void *mp_alloc(mempool_t *m);
-void mp_free(mempool_t *m, void *ptr);
+#if ENABLE_MEM_DEFRAG
+int mp_defrag_begin(void);
+void *mp_defrag_copy(void *ptr);
+void *mp_defrag_move(void *ptr);
+size_t mp_defrag_end(void);
+size_t mp_defrag_moves(void);
+#endif
+
+#if ENABLE_COMPACT_REFS
+// a slab object as a 32 bit offset from the reserved range, in 8 byte units.
+// 0 is NULL. only memory from kvstore_malloc_ref() has a reference
+typedef uint32_t kvs_ref_t;
+
+extern char *mp_ref_base;
+int mp_ref_ok(void *ptr);
+
+static inline void *kvs_deref(kvs_ref_t ref) {
+	return ref ? mp_ref_base + ((uintptr_t)ref << 3) : NULL;
+}
+
+static inline kvs_ref_t kvs_ref(void *ptr) {
+	return ptr ? (kvs_ref_t)(((char *)ptr - mp_ref_base) >> 3) : 0;
+}
+#endif
 
 extern mempool_t m;
 
 #endif
 
 
-#if ENABLE_HASH_KVENGINE
+#if ENABLE_MEM_DEFRAG
 
-typedef struct hashtable_s hashtable_t;
+void kvs_defrag_register(int engine, KVS_ENGINE_DEFRAG defrag);
+void kvs_defrag_cron(void);
+int kvs_defrag_stats(char *buf, int len);
+int kvs_defrag_config_set(char *value);
+const char *kvs_defrag_config_get(void);
+
+#endif
+
+
+#if ENABLE_EBR
+
+// a reader of a structure shared without its lock brackets every visit with
+// kvs_ebr_enter() / kvs_ebr_exit() and must not yield in between. a writer
+// that unlinked something hands it to kvs_ebr_retire(), it is freed on the
+// retiring thread two epochs later. the epoch moves on when every thread
+// inside a visit has seen the current one.
+#define KVS_EBR_MAX_THREADS		(KVS_MAX_SHARDS + KVS_MAX_COMPUTE + 2)
+
+typedef void (*KVS_EBR_FREE)(void *ptr);
+
+// set by kvstore_shard_enter() of a multi-worker server: kvstore_free_tag()
+// retires instead of freeing
+extern __thread int kvs_ebr_defer;
+
+void kvs_ebr_enter(void);
+void kvs_ebr_exit(void);
+// later kvstore_free_tag(ptr, tag), charged to the current kvs_mem_engine
+void kvs_ebr_retire(void *ptr, int tag);
+// later fn(ptr), for what is not a kvstore_malloc_tag() block. bytes: for
+// the stats only
+void kvs_ebr_retire_fn(void *ptr, KVS_EBR_FREE fn, size_t bytes);
+// the event loop between two rounds, no visit open on this thread: move the
+// epoch on if possible and free the limbo lists it made safe
+void kvs_ebr_quiescent(void);
+// wait until everything this thread retired is freed, not inside a visit
+void kvs_ebr_synchronize(void);
+int kvs_ebr_stats(char *buf, int len);
+
+#endif
+
+
+#if ENABLE_NUMA
+
+// the cpu of every worker, before any thread starts. workers: kvs_nshards
+void kvs_numa_init(int workers);
+// the calling thread is worker, pin it to its cpu. 0 with placement off
+int kvs_numa_pin(int worker);
+// the calling thread back on every cpu the process may use
+void kvs_numa_unpin(void);
+void kvs_numa_report(int workers);
+// kvstore -a, before kvs_numa_init(). -1: no such placement
+int kvs_numa_policy_set(const char *name);
+int kvs_numa_stats(char *buf, int len);
+
+#endif
 
 
-extern hashtable_t Hash;
+#if ENABLE_RCU_READS
+
+// a structure read without its lock: the writer makes seq odd while it
+// changes things, a reader that saw seq move throws away what it read.
+// whatever the writer frees meanwhile must outlive the reader, see
+// kvs_ebr_retire()
+typedef struct kvs_seq_read_s {
+	unsigned int *seq;
+	unsigned int start;
+} kvs_seq_read_t;
+
+static inline void kvs_seq_write_begin(unsigned int *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void kvs_seq_write_end(unsigned int *seq) {
+	__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// 0: a writer is inside, try again
+static inline int kvs_seq_read_begin(kvs_seq_read_t *rd, unsigned int *seq) {
+	rd->seq = seq;
+	rd->start = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+	return !(rd->start & 1);
+}
+
+// 1: nothing changed since kvs_seq_read_begin(), what was read holds together
+static inline int kvs_seq_read_valid(kvs_seq_read_t *rd) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(rd->seq, __ATOMIC_RELAXED) == rd->start;
+}
+
+#define KVS_RCU_RETRIES			4	// failed reads of a key before the locked path
+
+extern int kvs_rcu_reads;
+
+// an ebr visit around the lookups of one key, it must not yield in
+// between. retries: reads thrown away, served: 0 when the caller falls back
+// to the lock
+void kvs_rcu_read_lock(void);
+void kvs_rcu_read_unlock(int retries, int served);
+int kvs_rcu_stats(char *buf, int len);
+int kvs_rcu_config_set(char *value);
+const char *kvs_rcu_config_get(void);
+
+#endif
+
+
+#if ENABLE_HASH_KVENGINE
+
+typedef struct hashtable_s hashtable_t;
 
 int kvstore_hash_create(hashtable_t *hash);
 void kvstore_hash_destory(hashtable_t *hash);
+hashtable_t *kvstore_hash_new(void);
+void kvstore_hash_free(hashtable_t *hash);
 int kvs_hash_set(hashtable_t *hash, char *key, char *value);
 char *kvs_hash_get(hashtable_t *hash, char *key);
 int kvs_hash_delete(hashtable_t *hash, char *key);
 int kvs_hash_modify(hashtable_t *hash, char *key, char *value);
 int kvs_hash_count(hashtable_t *hash);
+int kvs_hash_sample(hashtable_t *hash, char **key, unsigned int *lru);
+long kvs_hash_usage(hashtable_t *hash, char *key);
+#if ENABLE_MEM_DEFRAG
+int kvs_hash_defrag(hashtable_t *hash, char *cursor, int budget);
+#endif
+
+#endif
+
+
+
+#if ENABLE_CUCKOO_KVENGINE
+
+typedef struct cuckoo_s cuckoo_t;
+
+int kvstore_cuckoo_create(cuckoo_t *ck);
+void kvstore_cuckoo_destory(cuckoo_t *ck);
+cuckoo_t *kvstore_cuckoo_new(void);
+void kvstore_cuckoo_free(cuckoo_t *ck);
+int kvs_cuckoo_set(cuckoo_t *ck, char *key, char *value);
+char *kvs_cuckoo_get(cuckoo_t *ck, char *key);
+int kvs_cuckoo_delete(cuckoo_t *ck, char *key);
+int kvs_cuckoo_modify(cuckoo_t *ck, char *key, char *value);
+int kvs_cuckoo_count(cuckoo_t *ck);
+int kvs_cuckoo_sample(cuckoo_t *ck, char **key, unsigned int *lru);
+long kvs_cuckoo_usage(cuckoo_t *ck, char *key);
 
 #endif
 
@@ -121,9 +563,6 @@ typedef struct array_s {
 	int array_idx;
 } array_t;
 
-extern array_t Array;
-
-
 int kvstore_array_create(array_t *arr);
 void kvstore_array_destory(array_t *arr); 
 
@@ -132,6 +571,7 @@ char *kvs_array_get(array_t *arr, char *key);
 int kvs_array_delete(array_t *arr, char *key);
 int kvs_array_modify(array_t *arr, char *key, char *value);
 int kvs_array_count(array_t *arr);
+long kvs_array_usage(array_t *arr, char *key);
 
 
 #endif
@@ -141,16 +581,26 @@ int kvs_array_count(array_t *arr);
 
 
 typedef struct _rbtree rbtree_t;
-
-extern rbtree_t Tree;
-
 int kvstore_rbtree_create(rbtree_t *tree);
 void kvstore_rbtree_destory(rbtree_t *tree);
+rbtree_t *kvstore_rbtree_new(void);
+void kvstore_rbtree_free(rbtree_t *tree);
 int kvs_rbtree_set(rbtree_t *tree, char *key, char *value);
 char* kvs_rbtree_get(rbtree_t *tree, char *key);
 int kvs_rbtree_delete(rbtree_t *tree, char *key);
 int kvs_rbtree_modify(rbtree_t *tree, char *key, char *value);
 int kvs_rbtree_count(rbtree_t *tree);
+int kvs_rbtree_scan(rbtree_t *tree, char *start, SCAN_CALLBACK cb, void *arg);
+int kvs_rbtree_sample(rbtree_t *tree, char **key, unsigned int *lru);
+long kvs_rbtree_usage(rbtree_t *tree, char *key);
+#if ENABLE_RCU_READS
+// lookup beside the writer, under kvs_rcu_read_lock(). 0: value copied to
+// buf, 1: no such key, -1: the tree changed under the read, try again
+int kvs_rbtree_read(rbtree_t *tree, char *key, char *buf, int len);
+#endif
+#if ENABLE_MEM_DEFRAG
+int kvs_rbtree_defrag(rbtree_t *tree, char *cursor, int budget, KVS_DEFRAG_MOVED moved);
+#endif
 
 
 
@@ -160,16 +610,26 @@ int kvs_rbtree_count(rbtree_t *tree);
 #if ENABLE_SKIPTABLE_KVENGINE
 
 typedef struct _skiplist skiplist;
-
-extern skiplist Skiplist;
-
 int kvstore_skiptable_create(skiplist *sl);
 void kvstore_skiptable_destory(skiplist *sl);
+skiplist *kvstore_skiptable_new(void);
+void kvstore_skiptable_free(skiplist *sl);
 int kvs_skiptable_set(skiplist *sl, char *key, char *value);
 char *kvs_skiptable_get(skiplist *sl, char *key);
 int kvs_skiptable_delete(skiplist *sl, char *key);
 int kvs_skiptable_modify(skiplist *sl, char *key, char *value);
 int kvs_skiptable_count(skiplist *sl);
+int kvs_skiptable_scan(skiplist *sl, char *start, SCAN_CALLBACK cb, void *arg);
+int kvs_skiptable_sample(skiplist *sl, char **key, unsigned int *lru);
+long kvs_skiptable_usage(skiplist *sl, char *key);
+#if ENABLE_RCU_READS
+// lookup beside the writer, under kvs_rcu_read_lock(). 0: value copied to
+// buf, 1: no such key, -1: the list changed under the read, try again
+int kvs_skiptable_read(skiplist *sl, char *key, char *buf, int len);
+#endif
+#if ENABLE_MEM_DEFRAG
+int kvs_skiptable_defrag(skiplist *sl, char *cursor, int budget, KVS_DEFRAG_MOVED moved);
+#endif
 
 #endif
 
@@ -177,16 +637,221 @@ int kvs_skiptable_count(skiplist *sl);
 #if ENABLE_BTREE_KVENGINE
 
 typedef struct _btree btree;
-
-extern btree Btree;
-
 int kvstore_btree_create(btree *tree);
 void kvstore_btree_destory(btree *tree);
+btree *kvstore_btree_new(void);
+void kvstore_btree_free(btree *tree);
 int kvs_btree_set(btree *tree, char *key, char *value);
 char *kvs_btree_get(btree *tree, char *key);
 int kvs_btree_delete(btree *tree, char *key);
 int kvs_btree_modify(btree *tree, char *key, char *value);
 int kvs_btree_count(btree *tree);
+int kvs_btree_scan(btree *tree, char *start, SCAN_CALLBACK cb, void *arg);
+int kvs_btree_sample(btree *tree, char **key, unsigned int *lru);
+long kvs_btree_usage(btree *tree, char *key);
+#if ENABLE_RCU_READS
+// lookup beside the writer, under kvs_rcu_read_lock(). 0: value copied to
+// buf, 1: no such key, -1: the tree changed under the read, try again
+int kvs_btree_read(btree *tree, char *key, char *buf, int len);
+#endif
+#if ENABLE_MEM_DEFRAG
+int kvs_btree_defrag(btree *tree, char *cursor, int budget, KVS_DEFRAG_MOVED moved);
+#endif
+
+#endif
+
+
+#if ENABLE_LSM_KVENGINE
+
+typedef struct lsm_s lsm_t;
+
+extern lsm_t Lsm;
+
+int kvstore_lsm_create(lsm_t *lsm);
+void kvstore_lsm_destory(lsm_t *lsm);
+int kvs_lsm_set(lsm_t *lsm, char *key, char *value);
+char *kvs_lsm_get(lsm_t *lsm, char *key);
+int kvs_lsm_delete(lsm_t *lsm, char *key);
+int kvs_lsm_modify(lsm_t *lsm, char *key, char *value);
+int kvs_lsm_count(lsm_t *lsm);
+long kvs_lsm_usage(lsm_t *lsm, char *key);
+
+#endif
+
+
+#if ENABLE_BLINK_KVENGINE
+
+// not sharded: any thread reads and writes it without a lock of its own,
+// readers never wait, writers latch the nodes they change
+typedef struct blink_s blink_t;
+
+extern blink_t Blink;
+
+int kvstore_blink_create(blink_t *tree);
+void kvstore_blink_destory(blink_t *tree);
+int kvs_blink_set(blink_t *tree, char *key, char *value);
+// the value copied into buf: the leaf may change as soon as it is read.
+// 0: found, 1: no such key
+int kvs_blink_get(blink_t *tree, char *key, char *buf, int len);
+int kvs_blink_delete(blink_t *tree, char *key);
+int kvs_blink_modify(blink_t *tree, char *key, char *value);
+int kvs_blink_count(blink_t *tree);
+int kvs_blink_scan(blink_t *tree, char *start, SCAN_CALLBACK cb, void *arg);
+long kvs_blink_usage(blink_t *tree, char *key);
+int kvs_blink_stats(blink_t *tree, char *buf, int len);
+
+#endif
+
+
+#if ENABLE_COW_KVENGINE
+
+// not sharded: one writer at a time behind the tree's mutex, readers never
+// wait, a node is copied instead of changed
+typedef struct cow_s cow_t;
+
+extern cow_t Cow;
+
+int kvstore_cow_create(cow_t *tree);
+void kvstore_cow_destory(cow_t *tree);
+int kvs_cow_set(cow_t *tree, char *key, char *value);
+// 0: found, 1: no such key
+int kvs_cow_get(cow_t *tree, char *key, char *buf, int len);
+int kvs_cow_delete(cow_t *tree, char *key);
+int kvs_cow_modify(cow_t *tree, char *key, char *value);
+int kvs_cow_count(cow_t *tree);
+// a version that stays whole while it is held, whatever is written after.
+// -1: too many held
+int kvs_cow_snapshot(cow_t *tree);
+void kvs_cow_release(cow_t *tree, int snap);
+int kvs_cow_snapshot_scan(cow_t *tree, int snap, char *start, SCAN_CALLBACK cb, void *arg);
+int kvs_cow_scan(cow_t *tree, char *start, SCAN_CALLBACK cb, void *arg);
+long kvs_cow_backup(cow_t *tree, const char *path);
+long kvs_cow_usage(cow_t *tree, char *key);
+int kvs_cow_stats(cow_t *tree, char *buf, int len);
+
+#endif
+
+
+#if ENABLE_BLOOM_FILTER
+
+typedef struct kvs_bloom_s kvs_bloom_t;
+
+int kvs_bloom_create(kvs_bloom_t *bf, const char *name, KVS_ENGINE_SCAN scan);
+void kvs_bloom_destory(kvs_bloom_t *bf);
+kvs_bloom_t *kvs_bloom_new(const char *name, KVS_ENGINE_SCAN scan);
+void kvs_bloom_free(kvs_bloom_t *bf);
+void kvs_bloom_add(kvs_bloom_t *bf, char *key);
+void kvs_bloom_delete(kvs_bloom_t *bf);
+int kvs_bloom_may_contain(kvs_bloom_t *bf, char *key);
+void kvs_bloom_false_positive(kvs_bloom_t *bf);
+int kvs_bloom_stats(kvs_bloom_t *bf, char *buf, int len);
+
+#endif
+
+
+#if ENABLE_HOTKEY_CACHE
+
+typedef struct kvs_cache_s kvs_cache_t;
+
+int kvs_cache_create(kvs_cache_t *cache, const char *name);
+void kvs_cache_destory(kvs_cache_t *cache);
+kvs_cache_t *kvs_cache_new(const char *name);
+void kvs_cache_free(kvs_cache_t *cache);
+char *kvs_cache_get(kvs_cache_t *cache, char *key);
+void kvs_cache_put(kvs_cache_t *cache, char *key, char *value);
+void kvs_cache_invalidate(kvs_cache_t *cache, char *key);
+int kvs_cache_stats(kvs_cache_t *cache, char *buf, int len);
+int kvs_cache_contains(kvs_cache_t *cache, char *key);
+
+#endif
+
+
+// 24 bit access clock kept in every evictable key. lru policy: seconds clock
+// of the last access. lfu policy: 16 bit minutes of the last decay and an
+// 8 bit logarithmic access counter.
+#define KVS_LRU_BITS			24
+#define KVS_LRU_MAX				((1U << KVS_LRU_BITS) - 1)
+
+unsigned int kvs_lru_new(void);
+unsigned int kvs_lru_touch(unsigned int lru);
+unsigned int kvs_random(void);
+
+
+#if ENABLE_VALUE_DEDUP
+
+char *kvs_dedup_intern(const char *str);
+void kvs_dedup_release(char *value);
+size_t kvs_dedup_usage(char *value);
+int kvs_dedup_stats(char *buf, int len);
+int kvs_dedup_config_set(char *name, char *value);
+int kvs_dedup_config_get(char *name, char *buf, int len);
+
+#endif
+
+
+#if ENABLE_VALUE_LOG
+
+char *kvs_vlog_append(const char *str);
+void kvs_vlog_free(char *value);
+size_t kvs_vlog_usage(char *value);
+char *kvs_vlog_move(char *value);
+int kvs_vlog_dirty(void);
+int kvs_vlog_clean_begin(void);
+size_t kvs_vlog_clean_end(void);
+int kvs_vlog_stats(char *buf, int len);
+int kvs_vlog_config_set(char *name, char *value);
+int kvs_vlog_config_get(char *name, char *buf, int len);
+
+#endif
+
+
+#if ENABLE_COMPRESSION
+
+// a packed value: KVS_PACK_MAGIC, the raw length in decimal, ':', then the
+// LZ stream. no byte is 0, engines store it like any other string.
+#define KVS_PACK_MAGIC			'\x01'
+
+char *kvs_compress_pack(int engine, char *value, char *buf, int len);
+int kvs_compress_unpack(const char *value, char *buf, int len);
+void kvs_compress_reply(char *msg, int len, int packed);
+int kvs_compress_stats(char *buf, int len);
+int kvs_compress_config_set(char *name, char *value);
+int kvs_compress_config_get(char *name, char *buf, int len);
+
+// a value an engine now stores or no longer does, the live numbers of
+// STATS COMPRESSION count the packed ones. lsm values are not counted
+void kvs_compress_account(const char *value, int sign);
+
+static inline void kvs_compress_hold(const char *value) {
+	if (value[0] == KVS_PACK_MAGIC) kvs_compress_account(value, 1);
+}
+
+static inline void kvs_compress_drop(const char *value) {
+	if (value[0] == KVS_PACK_MAGIC) kvs_compress_account(value, -1);
+}
+
+#else
+
+#define kvs_compress_hold(value)
+#define kvs_compress_drop(value)
+
+#endif
+
+
+#if ENABLE_MAXMEMORY
+
+// random key of one engine and its access clock.
+// 0: sampled, 1: sampled but hot, skip it, -1: engine empty
+typedef int (*KVS_ENGINE_SAMPLE)(char **key, unsigned int *lru);
+typedef int (*KVS_ENGINE_DELETE)(char *key);
+
+void kvs_evict_register(int engine, KVS_ENGINE_SAMPLE sample, KVS_ENGINE_DELETE del);
+int kvs_evict_perform(void);
+int kvs_evict_active(void);
+int kvs_evict_stats(char *buf, int len);
+
+int kvs_evict_config_set(char *name, char *value);
+int kvs_evict_config_get(char *name, char *buf, int len);
 
 #endif
 
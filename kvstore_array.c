@@ -3,7 +3,6 @@
 
 
 
-array_t Array;
 
 // create
 int kvstore_array_create(array_t *arr) {
@@ -38,20 +37,22 @@ int kvs_array_set(array_t *arr, char *key, char *value) {
 	if (arr == NULL || key == NULL || value == NULL) return -1;
 	if (arr->array_idx == KVS_ARRAY_SIZE) return -1;
 
-	char *kcopy = kvstore_malloc(strlen(key) + 1);
+	char *kcopy = kvstore_malloc_tag(strlen(key) + 1, KVS_MEM_KEY);
 	if (kcopy == NULL) return -1;
 	strncpy(kcopy, key, strlen(key)+1);
 	
-	char *vcopy = kvstore_malloc(strlen(value) + 1);
+	char *vcopy = kvstore_malloc_tag(strlen(value) + 1, KVS_MEM_VALUE);
 	if (vcopy == NULL) {
-		kvstore_free(kcopy);
+		kvstore_free_tag(kcopy, KVS_MEM_KEY);
 		return -1;
 	}
 	strncpy(vcopy, value, strlen(value)+1);
+	kvs_compress_hold(vcopy);
 
 	int i = 0;
 	for (i = 0;i < arr->array_idx;i ++) {
-		if (arr->array_table[i].key == NULL) {
+		if (arr->array_table[i].key == NULL) {
+
 			arr->array_table[i].key = kcopy;
 			arr->array_table[i].value = vcopy;
 			arr->array_idx ++;
@@ -99,10 +100,11 @@ int kvs_array_delete(array_t *arr, char *key) {
 
 		if (strcmp(arr->array_table[i].key, key) == 0) {
 			
-			kvstore_free(arr->array_table[i].value);
+			kvs_compress_drop(arr->array_table[i].value);
+			kvstore_free_tag(arr->array_table[i].value, KVS_MEM_VALUE);
 			arr->array_table[i].value = NULL;
 
-			kvstore_free(arr->array_table[i].key);
+			kvstore_free_tag(arr->array_table[i].key, KVS_MEM_KEY);
 			arr->array_table[i].key = NULL;
 
 			arr->array_idx --;
@@ -125,11 +127,13 @@ int kvs_array_modify(array_t *arr, char *key, char *value) {
 
 		if (strcmp(arr->array_table[i].key, key) == 0) {
 
-			kvstore_free(arr->array_table[i].value);
+			kvs_compress_drop(arr->array_table[i].value);
+			kvstore_free_tag(arr->array_table[i].value, KVS_MEM_VALUE);
 			arr->array_table[i].value = NULL;
 
-			char *vcopy = kvstore_malloc(strlen(value) + 1);
+			char *vcopy = kvstore_malloc_tag(strlen(value) + 1, KVS_MEM_VALUE);
 			strncpy(vcopy, value, strlen(value)+1);
+			kvs_compress_hold(vcopy);
 
 			arr->array_table[i].value = vcopy;
 
@@ -148,4 +152,21 @@ int kvs_array_count(array_t *arr) {
 	return arr->array_idx;
 }
 
+// bytes the key costs: its key and value copies, the slot is the table's.
+// -1: no such key
+long kvs_array_usage(array_t *arr, char *key) {
+
+	int i = 0;
+	if (arr == NULL || key == NULL) return -1;
+
+	for (i = 0;i < arr->array_idx;i ++) {
+		if (arr->array_table[i].key && strcmp(arr->array_table[i].key, key) == 0) {
+			return kvstore_usable_size(arr->array_table[i].key)
+				+ kvstore_usable_size(arr->array_table[i].value);
+		}
+	}
+
+	return -1;
+}
+
 
@@ -0,0 +1,890 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+
+#include "kvstore.h"
+
+
+// concurrent b-link tree behind BLSET BLGET BLDEL BLMOD BLCOUNT: one tree
+// for the whole server instead of one per shard, every worker reads and
+// writes it where the request arrived, no shard lock and no forwarding.
+//
+//   - Lehman and Yao: every node has a high key, the largest key its
+//     subtree may hold, and a link to its right sibling. a split moves the
+//     upper half into a new right node and links it in before the parent
+//     knows of it; a descent that finds its key above a node's high key
+//     follows the link. the parent gets the separator after the child is
+//     let go, a writer holds a single latch on its way up.
+//   - optimistic lock coupling (Leis et al.): the latch of a node is a
+//     version word, odd while a writer holds it. a reader remembers the
+//     version, reads, and checks that it did not move before it uses what
+//     it read, a child pointer or a key included. it never writes anything
+//     shared, a reader that lost the race starts again from the root.
+//   - a writer descends the same way and latches only the nodes it
+//     changes: the leaf, by moving the version it read from even to odd,
+//     and the parents a split has to tell. two latches at once only along
+//     a level, left to right.
+//   - deletes leave the nodes underfull, as in Lehman and Yao: a node is
+//     never freed while the tree lives. the keys and values a writer drops
+//     go through kvs_ebr_retire(), readers inside a visit may be copying.
+//   - values are inline or heap strings, not shared or logged: the value
+//     log moves its entries from the defrag walk, under shard locks this
+//     tree does not have.
+
+#if ENABLE_BLINK_KVENGINE
+
+#define BLINK_FANOUT			16		// keys per node
+#define BLINK_MAX_HEIGHT		32
+#define BLINK_SPIN				64		// tries before the latch waiter yields
+
+
+typedef struct blink_node_s {
+	unsigned long version;		// odd while latched, moves on every change
+	int level;					// 0: leaf, fixed
+	int n;
+	int high_set;				// 0: rightmost of its level, no high key
+	kvs_key_t high;
+	struct blink_node_s *next;	// right sibling
+	kvs_key_t keys[BLINK_FANOUT];
+	union {
+		kvs_value_t values[BLINK_FANOUT];
+		// children[i]: keys <= keys[i], children[n]: up to the high key
+		struct blink_node_s *children[BLINK_FANOUT + 1];
+	};
+} blink_node_t;
+
+struct blink_s {
+	blink_node_t *root;			// replaced only under the old root's latch
+	int count;
+	unsigned long nodes;
+	unsigned long splits;
+	unsigned long restarts;		// descents that lost a race
+};
+
+blink_t Blink;
+
+
+static blink_node_t *_blink_node_new(int level) {
+
+	blink_node_t *node = (blink_node_t *)kvstore_malloc_tag(sizeof(blink_node_t), KVS_MEM_NODE);
+	if (!node) return NULL;
+
+	memset(node, 0, sizeof(blink_node_t));
+	node->level = level;
+
+	return node;
+}
+
+static void _blink_node_free(blink_node_t *node) {
+
+	int i = 0;
+	for (i = 0;i < node->n;i ++) {
+		kvs_key_free(&node->keys[i]);
+		if (node->level == 0) kvs_value_free(&node->values[i]);
+	}
+	if (node->high_set) kvs_key_free(&node->high);
+
+	kvstore_free_tag(node, KVS_MEM_NODE);
+}
+
+// a key or value the node no longer points to, a reader may hold it
+static void _blink_retire(char *s, size_t size, int tag) {
+
+	int defer = kvs_ebr_defer;
+	kvs_ebr_defer = 1;
+	kvs_str_free(s, size, tag);
+	kvs_ebr_defer = defer;
+}
+
+
+// --- latches ---
+
+static void _blink_pause(int *spins) {
+	if (++ *spins % BLINK_SPIN == 0) sched_yield();
+}
+
+static inline unsigned long _blink_version(blink_node_t *node) {
+	return __atomic_load_n(&node->version, __ATOMIC_ACQUIRE);
+}
+
+// 1: nothing changed the node since version v was read
+static inline int _blink_valid(blink_node_t *node, unsigned long v) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == v;
+}
+
+// the latch, if the version is still v. 0: a writer got there first
+static inline int _blink_upgrade(blink_node_t *node, unsigned long v) {
+	if (!__atomic_compare_exchange_n(&node->version, &v, v + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return 0;
+	// odd before any change shows, see kvs_seq_write_begin()
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return 1;
+}
+
+static void _blink_lock(blink_node_t *node) {
+
+	int spins = 0;
+	while (1) {
+		unsigned long v = _blink_version(node);
+		if (!(v & 1) && _blink_upgrade(node, v)) return ;
+		_blink_pause(&spins);
+	}
+}
+
+static inline void _blink_unlock(blink_node_t *node) {
+	__atomic_store_n(&node->version, node->version + 1, __ATOMIC_RELEASE);
+}
+
+
+// --- reads at version v, every one checked before it is used ---
+
+// 1: key is above the node's high key, the right sibling has it. 0: it is
+// not, -1: the node changed. key NULL: before every key
+static int _blink_beyond(blink_node_t *node, unsigned long v, const char *key) {
+
+	if (!key) return 0;
+
+	if (!__atomic_load_n(&node->high_set, __ATOMIC_RELAXED)) return _blink_valid(node, v) ? 0 : -1;
+
+	kvs_key_t high = node->high;
+	if (!_blink_valid(node, v)) return -1;
+
+	return strcmp(key, kvs_key_get(&high)) > 0;
+}
+
+// the first i with key <= keys[i], n when there is none, found set when
+// they are equal. -1: the node changed. a writer holding the latch passes
+// the version it made, which stays valid
+static int _blink_search(blink_node_t *node, unsigned long v, const char *key, int *found) {
+
+	*found = 0;
+
+	int n = __atomic_load_n(&node->n, __ATOMIC_RELAXED);
+	if (n < 0 || n > BLINK_FANOUT) return -1;
+	if (!key) return 0;
+
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		kvs_key_t k = node->keys[mid];
+		if (!_blink_valid(node, v)) return -1;
+
+		int cmp = strcmp(key, kvs_key_get(&k));
+		if (cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// one step right or down towards key. NULL: the node changed
+static blink_node_t *_blink_step(blink_node_t *node, unsigned long v, const char *key) {
+
+	int beyond = _blink_beyond(node, v, key);
+	if (beyond < 0) return NULL;
+
+	blink_node_t *next = NULL;
+	if (beyond) {
+		next = __atomic_load_n(&node->next, __ATOMIC_RELAXED);
+	} else {
+		int found = 0;
+		int i = _blink_search(node, v, key, &found);
+		if (i < 0) return NULL;
+		next = __atomic_load_n(&node->children[i], __ATOMIC_RELAXED);
+	}
+
+	return _blink_valid(node, v) ? next : NULL;
+}
+
+static void _blink_restart(blink_t *tree, int *spins) {
+	__atomic_add_fetch(&tree->restarts, 1, __ATOMIC_RELAXED);
+	_blink_pause(spins);
+}
+
+// the node of level on the way to key, not latched: the caller latches it
+// and moves right from there. NULL: the tree is not that tall
+static blink_node_t *_blink_level(blink_t *tree, const char *key, int level) {
+
+	int spins = 0;
+	while (1) {
+		blink_node_t *node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+		if (node->level < level) return NULL;
+
+		while (node && node->level > level) {
+			unsigned long v = _blink_version(node);
+			node = (v & 1) ? NULL : _blink_step(node, v, key);
+		}
+		if (node) return node;
+
+		_blink_restart(tree, &spins);
+	}
+}
+
+// the leaf for key, latched. stack[l] is the node of level l the descent
+// went down from, NULL above the root it started at
+static blink_node_t *_blink_leaf(blink_t *tree, const char *key, blink_node_t **stack) {
+
+	int spins = 0;
+	while (1) {
+		blink_node_t *node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+		unsigned long v = _blink_version(node);
+
+		while (!(v & 1)) {
+			if (node->level == 0) {
+				int beyond = _blink_beyond(node, v, key);
+				if (beyond == 0 && _blink_upgrade(node, v)) return node;
+				if (beyond <= 0) break;
+			}
+
+			blink_node_t *next = _blink_step(node, v, key);
+			if (!next) break;
+
+			if (next->level < node->level) stack[node->level] = node;
+			node = next;
+			v = _blink_version(node);
+		}
+
+		_blink_restart(tree, &spins);
+	}
+}
+
+
+// --- changes, the node latched ---
+
+// keys[i] and values[i] of a leaf from key and value. -1: out of memory
+static int _blink_leaf_insert(blink_node_t *node, int i, const char *key, const char *value) {
+
+	kvs_key_t k;
+	kvs_value_t v;
+	if (kvs_key_set(&k, key) != 0) return -1;
+	if (kvs_str_set(v.s, KVS_VALUE_INLINE, value, KVS_MEM_VALUE) != 0) {
+		kvs_key_free(&k);
+		return -1;
+	}
+
+	memmove(&node->keys[i + 1], &node->keys[i], sizeof(kvs_key_t) * (node->n - i));
+	memmove(&node->values[i + 1], &node->values[i], sizeof(kvs_value_t) * (node->n - i));
+	node->keys[i] = k;
+	node->values[i] = v;
+	node->n ++;
+	kvs_compress_hold(value);
+
+	return 0;
+}
+
+// sep and the node right of it into an inner node, sep is moved in
+static void _blink_inner_insert(blink_node_t *node, kvs_key_t *sep, blink_node_t *right) {
+
+	int found = 0;
+	int i = _blink_search(node, node->version, kvs_key_get(sep), &found);
+
+	memmove(&node->keys[i + 1], &node->keys[i], sizeof(kvs_key_t) * (node->n - i));
+	memmove(&node->children[i + 2], &node->children[i + 1], sizeof(blink_node_t *) * (node->n - i));
+	node->keys[i] = *sep;
+	node->children[i + 1] = right;
+	node->n ++;
+}
+
+// the upper half of a full node into a new right sibling, linked in. sep:
+// a copy of the new high key of node for its parent. -1: out of memory,
+// nothing moved
+static int _blink_split(blink_t *tree, blink_node_t *node, kvs_key_t *sep, blink_node_t **right) {
+
+	int m = BLINK_FANOUT / 2;
+	int leaf = node->level == 0;
+
+	blink_node_t *r = _blink_node_new(node->level);
+	if (!r) return -1;
+
+	// a leaf keeps keys[m - 1] and copies it as its high key, an inner
+	// node hands keys[m] up and keeps it as the high key
+	kvs_key_t high;
+	if (leaf && kvs_key_set(&high, kvs_key_get(&node->keys[m - 1])) != 0) {
+		kvstore_free_tag(r, KVS_MEM_NODE);
+		return -1;
+	}
+	if (kvs_key_set(sep, kvs_key_get(&node->keys[leaf ? m - 1 : m])) != 0) {
+		if (leaf) kvs_key_free(&high);
+		kvstore_free_tag(r, KVS_MEM_NODE);
+		return -1;
+	}
+
+	if (leaf) {
+		r->n = node->n - m;
+		memcpy(r->keys, &node->keys[m], sizeof(kvs_key_t) * r->n);
+		memcpy(r->values, &node->values[m], sizeof(kvs_value_t) * r->n);
+	} else {
+		high = node->keys[m];
+		r->n = node->n - m - 1;
+		memcpy(r->keys, &node->keys[m + 1], sizeof(kvs_key_t) * r->n);
+		memcpy(r->children, &node->children[m + 1], sizeof(blink_node_t *) * (r->n + 1));
+	}
+	r->high_set = node->high_set;
+	r->high = node->high;
+	r->next = node->next;
+
+	node->n = m;
+	node->high = high;
+	node->high_set = 1;
+	// r is whole before a reader can get to it, and none can until the
+	// latch of node goes
+	__atomic_store_n(&node->next, r, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&tree->nodes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tree->splits, 1, __ATOMIC_RELAXED);
+
+	*right = r;
+	return 0;
+}
+
+// node, latched, was split at sep into node and right: a new root above
+// them, or sep into the parent, splitting it in turn. the latch of node is
+// let go. a parent that cannot be told leaves right linked and unindexed,
+// the descents still get there through node
+static void _blink_promote(blink_t *tree, blink_node_t *node, kvs_key_t *sep, blink_node_t *right, blink_node_t **stack) {
+
+	while (1) {
+		int level = node->level + 1;
+
+		// the root only changes under its latch, node's now
+		if (__atomic_load_n(&tree->root, __ATOMIC_RELAXED) == node) {
+			blink_node_t *root = level < BLINK_MAX_HEIGHT ? _blink_node_new(level) : NULL;
+			if (root) {
+				root->n = 1;
+				root->keys[0] = *sep;
+				root->children[0] = node;
+				root->children[1] = right;
+				__atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+				__atomic_add_fetch(&tree->nodes, 1, __ATOMIC_RELAXED);
+			} else {
+				kvs_key_free(sep);
+			}
+			_blink_unlock(node);
+			return ;
+		}
+		_blink_unlock(node);
+
+		char *key = kvs_key_get(sep);
+		blink_node_t *parent = stack[level] ? stack[level] : _blink_level(tree, key, level);
+		if (!parent) {
+			kvs_key_free(sep);
+			return ;
+		}
+
+		_blink_lock(parent);
+		while (parent->high_set && strcmp(key, kvs_key_get(&parent->high)) > 0) {
+			blink_node_t *next = parent->next;
+			_blink_lock(next);
+			_blink_unlock(parent);
+			parent = next;
+		}
+
+		if (parent->n < BLINK_FANOUT) {
+			_blink_inner_insert(parent, sep, right);
+			_blink_unlock(parent);
+			return ;
+		}
+
+		kvs_key_t up;
+		blink_node_t *pright = NULL;
+		if (_blink_split(tree, parent, &up, &pright) != 0) {
+			kvs_key_free(sep);
+			_blink_unlock(parent);
+			return ;
+		}
+
+		if (strcmp(key, kvs_key_get(&up)) <= 0) _blink_inner_insert(parent, sep, right);
+		else _blink_inner_insert(pright, sep, right);
+
+		node = parent;
+		*sep = up;
+		right = pright;
+	}
+}
+
+
+// --- API ---
+
+int kvstore_blink_create(blink_t *tree) {
+	if (!tree) return -1;
+
+	memset(tree, 0, sizeof(blink_t));
+
+	tree->root = _blink_node_new(0);
+	if (!tree->root) return -1;
+	tree->nodes = 1;
+
+	return 0;
+}
+
+// level by level, left to right. no reader or writer left
+void kvstore_blink_destory(blink_t *tree) {
+	if (!tree || !tree->root) return ;
+
+	blink_node_t *first = tree->root;
+	while (first) {
+		blink_node_t *below = first->level ? first->children[0] : NULL;
+
+		blink_node_t *node = first;
+		while (node) {
+			blink_node_t *next = node->next;
+			_blink_node_free(node);
+			node = next;
+		}
+
+		first = below;
+	}
+
+	tree->root = NULL;
+	tree->count = 0;
+	tree->nodes = 0;
+}
+
+int kvs_blink_set(blink_t *tree, char *key, char *value) {
+	if (!tree || !key || !value) return -1;
+
+	blink_node_t *stack[BLINK_MAX_HEIGHT] = {0};
+	blink_node_t *leaf = _blink_leaf(tree, key, stack);
+
+	int found = 0;
+	int i = _blink_search(leaf, leaf->version, key, &found);
+
+	if (found) {
+		kvs_value_t v;
+		if (kvs_str_set(v.s, KVS_VALUE_INLINE, value, KVS_MEM_VALUE) != 0) {
+			_blink_unlock(leaf);
+			return -1;
+		}
+		kvs_value_t old = leaf->values[i];
+		leaf->values[i] = v;
+		_blink_unlock(leaf);
+
+		kvs_compress_hold(value);
+		_blink_retire(old.s, KVS_VALUE_INLINE, KVS_MEM_VALUE);
+		return 0;
+	}
+
+	if (leaf->n < BLINK_FANOUT) {
+		int res = _blink_leaf_insert(leaf, i, key, value);
+		_blink_unlock(leaf);
+
+		if (res == 0) __atomic_add_fetch(&tree->count, 1, __ATOMIC_RELAXED);
+		return res;
+	}
+
+	kvs_key_t sep;
+	blink_node_t *right = NULL;
+	if (_blink_split(tree, leaf, &sep, &right) != 0) {
+		_blink_unlock(leaf);
+		return -1;
+	}
+
+	// right is not reachable yet, nobody else latches it
+	blink_node_t *half = strcmp(key, kvs_key_get(&sep)) <= 0 ? leaf : right;
+	i = _blink_search(half, half->version, key, &found);
+	int res = _blink_leaf_insert(half, i, key, value);
+	if (res == 0) __atomic_add_fetch(&tree->count, 1, __ATOMIC_RELAXED);
+
+	_blink_promote(tree, leaf, &sep, right, stack);
+
+	return res;
+}
+
+// 0: the value copied into buf, 1: no such key. readers do not latch, the
+// descent is retried until it saw a steady path
+int kvs_blink_get(blink_t *tree, char *key, char *buf, int len) {
+	if (!tree || !key || !buf) return -1;
+
+	int spins = 0;
+	int res = -1;
+
+	kvs_ebr_enter();
+	while (res < 0) {
+		blink_node_t *node = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+		unsigned long v = _blink_version(node);
+
+		while (!(v & 1)) {
+			if (node->level == 0) {
+				int beyond = _blink_beyond(node, v, key);
+				if (beyond < 0) break;
+
+				if (beyond == 0) {
+					int found = 0;
+					int i = _blink_search(node, v, key, &found);
+					if (i < 0) break;
+
+					kvs_value_t value;
+					if (found) value = node->values[i];
+					if (!_blink_valid(node, v)) break;
+
+					// retired, not freed, until the visit is over
+					if (found) snprintf(buf, len, "%s", kvs_value_get(&value));
+					res = found ? 0 : 1;
+					break;
+				}
+			}
+
+			node = _blink_step(node, v, key);
+			if (!node) break;
+			v = _blink_version(node);
+		}
+
+		if (res < 0) _blink_restart(tree, &spins);
+	}
+	kvs_ebr_exit();
+
+	return res;
+}
+
+int kvs_blink_modify(blink_t *tree, char *key, char *value) {
+	if (!tree || !key || !value) return -1;
+
+	blink_node_t *stack[BLINK_MAX_HEIGHT] = {0};
+	blink_node_t *leaf = _blink_leaf(tree, key, stack);
+
+	int found = 0;
+	int i = _blink_search(leaf, leaf->version, key, &found);
+
+	kvs_value_t v;
+	if (!found || kvs_str_set(v.s, KVS_VALUE_INLINE, value, KVS_MEM_VALUE) != 0) {
+		_blink_unlock(leaf);
+		return -1;
+	}
+
+	kvs_value_t old = leaf->values[i];
+	leaf->values[i] = v;
+	_blink_unlock(leaf);
+
+	kvs_compress_hold(value);
+	_blink_retire(old.s, KVS_VALUE_INLINE, KVS_MEM_VALUE);
+	return 0;
+}
+
+int kvs_blink_delete(blink_t *tree, char *key) {
+	if (!tree || !key) return -1;
+
+	blink_node_t *stack[BLINK_MAX_HEIGHT] = {0};
+	blink_node_t *leaf = _blink_leaf(tree, key, stack);
+
+	int found = 0;
+	int i = _blink_search(leaf, leaf->version, key, &found);
+	if (!found) {
+		_blink_unlock(leaf);
+		return -1;
+	}
+
+	kvs_key_t k = leaf->keys[i];
+	kvs_value_t v = leaf->values[i];
+
+	int rest = leaf->n - i - 1;
+	memmove(&leaf->keys[i], &leaf->keys[i + 1], sizeof(kvs_key_t) * rest);
+	memmove(&leaf->values[i], &leaf->values[i + 1], sizeof(kvs_value_t) * rest);
+	leaf->n --;
+	_blink_unlock(leaf);
+
+	_blink_retire(k.s, KVS_KEY_INLINE, KVS_MEM_KEY);
+	_blink_retire(v.s, KVS_VALUE_INLINE, KVS_MEM_VALUE);
+
+	__atomic_sub_fetch(&tree->count, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int kvs_blink_count(blink_t *tree) {
+	return tree ? __atomic_load_n(&tree->count, __ATOMIC_RELAXED) : 0;
+}
+
+// in-order walk from the first key >= start (NULL: from the smallest key)
+// along the leaf level, a latch on the leaf whose keys cb is handed, the
+// next one latched before it is let go
+int kvs_blink_scan(blink_t *tree, char *start, SCAN_CALLBACK cb, void *arg) {
+	if (!tree || !tree->root || !cb) return -1;
+
+	blink_node_t *stack[BLINK_MAX_HEIGHT] = {0};
+	blink_node_t *leaf = _blink_leaf(tree, start, stack);
+
+	int found = 0;
+	int i = _blink_search(leaf, leaf->version, start, &found);
+
+	while (1) {
+		for (;i < leaf->n;i ++) {
+			if (cb(kvs_key_get(&leaf->keys[i]), kvs_value_get(&leaf->values[i]), arg)) {
+				_blink_unlock(leaf);
+				return 1;
+			}
+		}
+
+		blink_node_t *next = leaf->next;
+		if (!next) break;
+
+		_blink_lock(next);
+		_blink_unlock(leaf);
+		leaf = next;
+		i = 0;
+	}
+
+	_blink_unlock(leaf);
+	return 0;
+}
+
+// bytes the key costs: its share of the leaf and its heap key and value.
+// -1: no such key
+long kvs_blink_usage(blink_t *tree, char *key) {
+	if (!tree || !tree->root || !key) return -1;
+
+	blink_node_t *stack[BLINK_MAX_HEIGHT] = {0};
+	blink_node_t *leaf = _blink_leaf(tree, key, stack);
+
+	int found = 0;
+	int i = _blink_search(leaf, leaf->version, key, &found);
+
+	long usage = -1;
+	if (found) {
+		usage = kvstore_usable_size(leaf) / leaf->n + kvs_key_usage(&leaf->keys[i])
+			+ kvs_value_usage(&leaf->values[i]);
+	}
+	_blink_unlock(leaf);
+
+	return usage;
+}
+
+int kvs_blink_stats(blink_t *tree, char *buf, int len) {
+
+	blink_node_t *root = __atomic_load_n(&tree->root, __ATOMIC_ACQUIRE);
+
+	return snprintf(buf, len, "blink keys:%d height:%d nodes:%lu splits:%lu restarts:%lu\n",
+		kvs_blink_count(tree), root ? root->level + 1 : 0,
+		__atomic_load_n(&tree->nodes, __ATOMIC_RELAXED),
+		__atomic_load_n(&tree->splits, __ATOMIC_RELAXED),
+		__atomic_load_n(&tree->restarts, __ATOMIC_RELAXED));
+}
+
+
+#ifdef BLINK_BENCH
+
+// make blink_bench && ./blink_bench [max threads] [read percent]
+// the same tree two ways: latched as above, and every operation behind one
+// mutex, the global-lock baseline. the threads get, set and delete random
+// keys of a space twice the preloaded size, the tree keeps its size and
+// splits as it goes. the leaf level is checked for order afterwards
+
+#include <pthread.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <sys/time.h>
+
+#define BENCH_KEYS			200000
+#define BENCH_OPS			500000		// per thread and round
+#define BENCH_MAX_THREADS	64
+
+// what kvstore.c gives the engine, without the accounting
+__thread int kvs_mem_engine = 0;
+
+size_t kvstore_usable_size(void *ptr) {
+	return ptr ? malloc_usable_size(ptr) : 0;
+}
+
+void *kvstore_malloc_tag(size_t size, int tag) {
+	return malloc(size);
+}
+
+void kvstore_free_tag(void *ptr, int tag) {
+	if (ptr && kvs_ebr_defer) {
+		kvs_ebr_retire(ptr, tag);
+		return ;
+	}
+	free(ptr);
+}
+
+int kvs_str_set(char *s, size_t size, const char *str, int tag) {
+
+	size_t len = strlen(str);
+	if (len < size) {
+		memcpy(s, str, len + 1);
+		s[size - 1] = 0;
+		return 0;
+	}
+
+	char *ptr = kvstore_malloc_tag(len + 1, tag);
+	if (!ptr) return -1;
+	memcpy(ptr, str, len + 1);
+
+	*(char **)s = ptr;
+	s[size - 1] = 1;
+
+	return 0;
+}
+
+void kvs_str_free(char *s, size_t size, int tag) {
+	if (s[size - 1] == 1) kvstore_free_tag(*(char **)s, tag);
+	s[0] = '\0';
+	s[size - 1] = 0;
+}
+
+size_t kvs_str_usage(char *s, size_t size) {
+	return s[size - 1] == 1 ? kvstore_usable_size(*(char **)s) : 0;
+}
+
+#if ENABLE_COMPRESSION
+void kvs_compress_account(const char *value, int sign) {
+}
+#endif
+
+
+static int bench_threads = 0;			// running this round
+static int bench_locked = 0;			// 1: behind bench_lock
+static int bench_reads = 80;			// percent, the rest half sets, half deletes
+static int bench_done = 0;
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_barrier_t round_begin, round_end;
+
+static void _bench_op(unsigned int *seed) {
+
+	char key[32], value[64], buf[BUFFER_LENGTH];
+
+	*seed = *seed * 1103515245 + 12345;
+	int k = (*seed >> 4) % (BENCH_KEYS * 2);
+	*seed = *seed * 1103515245 + 12345;
+	int op = (*seed >> 8) % 100;
+
+	snprintf(key, sizeof(key), "bench-key-%08d", k);
+
+	if (bench_locked) pthread_mutex_lock(&bench_lock);
+
+	if (op < bench_reads) {
+		kvs_blink_get(&Blink, key, buf, sizeof(buf));
+	} else if (op < bench_reads + (100 - bench_reads) / 2) {
+		snprintf(value, sizeof(value), "bench-value-%08d-%u", k, *seed);
+		kvs_blink_set(&Blink, key, value);
+	} else {
+		kvs_blink_delete(&Blink, key);
+	}
+
+	if (bench_locked) pthread_mutex_unlock(&bench_lock);
+}
+
+static void *_bench_worker(void *arg) {
+
+	int id = (int)(intptr_t)arg;
+	unsigned int seed = id * 7919 + 1;
+
+	while (1) {
+		pthread_barrier_wait(&round_begin);
+		if (bench_done) break;
+
+		if (id < bench_threads) {
+			int i = 0;
+			for (i = 0;i < BENCH_OPS;i ++) {
+				_bench_op(&seed);
+				// what the event loop does between two rounds
+				if ((i & 1023) == 0) kvs_ebr_quiescent();
+			}
+			kvs_ebr_quiescent();
+		}
+
+		pthread_barrier_wait(&round_end);
+	}
+
+	return NULL;
+}
+
+static double _bench_round(int threads, int locked) {
+
+	struct timeval begin, end;
+
+	bench_threads = threads;
+	bench_locked = locked;
+
+	gettimeofday(&begin, NULL);
+	pthread_barrier_wait(&round_begin);
+	pthread_barrier_wait(&round_end);
+	gettimeofday(&end, NULL);
+
+	double sec = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6;
+	return (double)BENCH_OPS * threads / sec / 1e6;
+}
+
+typedef struct bench_check_s {
+	char last[BUFFER_LENGTH];
+	int keys;
+	int disorder;
+} bench_check_t;
+
+static int _bench_check_key(char *key, char *value, void *arg) {
+
+	bench_check_t *check = (bench_check_t *)arg;
+
+	if (check->keys && strcmp(check->last, key) >= 0) check->disorder ++;
+	snprintf(check->last, BUFFER_LENGTH, "%s", key);
+	check->keys ++;
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	if (max_threads < 1) max_threads = 1;
+	if (max_threads > BENCH_MAX_THREADS) max_threads = BENCH_MAX_THREADS;
+	if (argc > 2) bench_reads = atoi(argv[2]);
+	if (bench_reads < 0 || bench_reads > 100) bench_reads = 80;
+
+	if (kvstore_blink_create(&Blink) != 0) return 1;
+
+	int i = 0;
+	char key[32], value[64];
+	for (i = 0;i < BENCH_KEYS * 2;i += 2) {
+		snprintf(key, sizeof(key), "bench-key-%08d", i);
+		snprintf(value, sizeof(value), "bench-value-%08d", i);
+		kvs_blink_set(&Blink, key, value);
+	}
+
+	pthread_t tid[BENCH_MAX_THREADS];
+	pthread_barrier_init(&round_begin, NULL, max_threads + 1);
+	pthread_barrier_init(&round_end, NULL, max_threads + 1);
+	for (i = 0;i < max_threads;i ++) pthread_create(&tid[i], NULL, _bench_worker, (void *)(intptr_t)i);
+
+	printf("keys: %d, reads: %d%%, %d ops per thread\n", BENCH_KEYS, bench_reads, BENCH_OPS);
+
+	int t = 1;
+	for (t = 1;t <= max_threads;t *= 2) {
+		double blink = _bench_round(t, 0);
+		double locked = _bench_round(t, 1);
+		printf("threads: %2d  blink: %7.2f Mops/s (%6.2f per thread)  global lock: %7.2f Mops/s (%6.2f per thread)  x%.2f\n",
+			t, blink, blink / t, locked, locked / t, blink / locked);
+	}
+
+	bench_done = 1;
+	pthread_barrier_wait(&round_begin);
+	for (i = 0;i < max_threads;i ++) pthread_join(tid[i], NULL);
+
+	bench_check_t check;
+	memset(&check, 0, sizeof(check));
+	kvs_blink_scan(&Blink, NULL, _bench_check_key, &check);
+
+	char stats[256];
+	kvs_blink_stats(&Blink, stats, sizeof(stats));
+	printf("%s", stats);
+
+	if (check.disorder || check.keys != kvs_blink_count(&Blink)) {
+		printf("check: FAILED, %d keys on the leaf level, %d out of order, count %d\n",
+			check.keys, check.disorder, kvs_blink_count(&Blink));
+		return 1;
+	}
+	printf("check: %d keys in order\n", check.keys);
+
+	return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,351 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kvstore.h"
+
+
+// blocked bloom filter in front of an ordered engine. all k bits of a key
+// live in one 512 bit block (one cache line), so a negative lookup costs one
+// hash and one cache miss instead of an O(log n) strcmp descent.
+//
+// bloom filters cannot delete: deleted keys leave stale bits and the false
+// positive rate drifts up, as it does when the key count outgrows the filter.
+// the filter watches both and rebuilds itself incrementally: every engine
+// operation scans a few keys into a fresh filter (like an incremental rehash)
+// while the old one keeps answering. keys set during a rebuild go into both.
+
+#define BLOOM_BLOCK_WORDS		8		// 8 x 64 = 512 bits
+#define BLOOM_BITS_PER_KEY		10
+#define BLOOM_K					7
+#define BLOOM_MIN_KEYS			4096
+#define BLOOM_REBUILD_STEP		128		// keys scanned per operation
+
+#define BLOOM_FPR_TARGET		0.01
+#define BLOOM_FPR_WINDOW		4096	// absent lookups before judging the rate
+
+
+typedef struct kvs_bloom_s {
+
+	const char *name;
+	KVS_ENGINE_SCAN scan;
+
+	uint64_t *bits;
+	uint32_t nblocks;
+	uint64_t capacity;		// keys the filter was sized for
+
+	uint64_t keys;			// keys added since the last build
+	uint64_t deletes;		// stale keys since the last build
+
+	// fpr window: the filter answered "maybe" but the engine had nothing
+	uint64_t negatives;
+	uint64_t false_positives;
+
+	// incremental rebuild
+	int rebuilding;
+	uint64_t *next_bits;
+	uint32_t next_nblocks;
+	uint64_t next_keys;
+	char *cursor;
+	size_t cursor_cap;
+	int cursor_valid;
+
+	// stats
+	uint64_t checks;
+	uint64_t total_negatives;
+	uint64_t total_false_positives;
+	uint64_t rebuilds;
+
+} kvs_bloom_t;
+
+
+
+static uint64_t _bloom_hash(const char *key) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	while (*key) {
+		hash ^= (uint8_t)*key ++;
+		hash *= 1099511628211ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static void _bloom_set(uint64_t *bits, uint32_t nblocks, uint64_t hash) {
+
+	uint64_t *block = bits + (uint64_t)((hash >> 32) % nblocks) * BLOOM_BLOCK_WORDS;
+	uint32_t h = (uint32_t)hash;
+	uint32_t delta = (h >> 17) | (h << 15) | 1;
+
+	int i = 0;
+	for (i = 0;i < BLOOM_K;i ++) {
+		uint32_t bit = h & 511;
+		block[bit >> 6] |= (1ULL << (bit & 63));
+		h += delta;
+	}
+}
+
+static int _bloom_test(uint64_t *bits, uint32_t nblocks, uint64_t hash) {
+
+	uint64_t *block = bits + (uint64_t)((hash >> 32) % nblocks) * BLOOM_BLOCK_WORDS;
+	uint32_t h = (uint32_t)hash;
+	uint32_t delta = (h >> 17) | (h << 15) | 1;
+
+	int i = 0;
+	for (i = 0;i < BLOOM_K;i ++) {
+		uint32_t bit = h & 511;
+		if (!(block[bit >> 6] & (1ULL << (bit & 63)))) return 0;
+		h += delta;
+	}
+	return 1;
+}
+
+static uint64_t *_bloom_alloc(uint64_t capacity, uint32_t *nblocks) {
+
+	uint64_t nbits = capacity * BLOOM_BITS_PER_KEY;
+	uint32_t n = (uint32_t)((nbits + 511) / 512);
+	if (n == 0) n = 1;
+
+	uint64_t *bits = kvstore_malloc(sizeof(uint64_t) * BLOOM_BLOCK_WORDS * n);
+	if (!bits) return NULL;
+	memset(bits, 0, sizeof(uint64_t) * BLOOM_BLOCK_WORDS * n);
+
+	*nblocks = n;
+
+	return bits;
+}
+
+
+static void _bloom_start_rebuild(kvs_bloom_t *bf) {
+
+	if (bf->rebuilding) return ;
+
+	// room to grow while the rebuild runs
+	uint64_t live = bf->keys > bf->deletes ? bf->keys - bf->deletes : 0;
+	uint64_t capacity = live * 2;
+	if (capacity < BLOOM_MIN_KEYS) capacity = BLOOM_MIN_KEYS;
+
+	bf->next_bits = _bloom_alloc(capacity, &bf->next_nblocks);
+	if (!bf->next_bits) return ;
+
+	bf->rebuilding = 1;
+	bf->next_keys = 0;
+	bf->cursor_valid = 0;
+	bf->capacity = capacity; // stop re-triggering on size
+}
+
+static void _bloom_finish_rebuild(kvs_bloom_t *bf) {
+
+	kvstore_free(bf->bits);
+	bf->bits = bf->next_bits;
+	bf->nblocks = bf->next_nblocks;
+	bf->next_bits = NULL;
+
+	bf->keys = bf->next_keys;
+	bf->deletes = 0;
+	bf->negatives = 0;
+	bf->false_positives = 0;
+
+	bf->rebuilding = 0;
+	bf->rebuilds ++;
+}
+
+typedef struct bloom_step_s {
+	kvs_bloom_t *bf;
+	int budget;
+} bloom_step_t;
+
+static int _bloom_step_cb(char *key, char *value, void *arg) {
+
+	(void)value;
+	bloom_step_t *step = (bloom_step_t *)arg;
+	kvs_bloom_t *bf = step->bf;
+
+	// the scan resumes at the cursor key, which is already in
+	if (bf->cursor_valid && strcmp(key, bf->cursor) == 0) return 0;
+
+	if (step->budget -- == 0) return 1;
+
+	_bloom_set(bf->next_bits, bf->next_nblocks, _bloom_hash(key));
+	bf->next_keys ++;
+
+	size_t len = strlen(key) + 1;
+	if (len > bf->cursor_cap) {
+		char *cursor = kvstore_malloc(len * 2);
+		if (!cursor) return 1;
+		if (bf->cursor) kvstore_free(bf->cursor);
+		bf->cursor = cursor;
+		bf->cursor_cap = len * 2;
+	}
+	memcpy(bf->cursor, key, len);
+	bf->cursor_valid = 1;
+
+	return 0;
+}
+
+static void _bloom_step(kvs_bloom_t *bf) {
+
+	bloom_step_t step = {bf, BLOOM_REBUILD_STEP};
+
+	int stopped = bf->scan(bf->cursor_valid ? bf->cursor : NULL, _bloom_step_cb, &step);
+	if (stopped == 0) {
+		_bloom_finish_rebuild(bf);
+	}
+}
+
+static void _bloom_check_drift(kvs_bloom_t *bf) {
+
+	if (bf->rebuilding) return ;
+
+	uint64_t absent = bf->negatives + bf->false_positives;
+	if (absent >= BLOOM_FPR_WINDOW) {
+		if ((double)bf->false_positives / absent > 2 * BLOOM_FPR_TARGET) {
+			_bloom_start_rebuild(bf);
+			return ;
+		}
+		// sliding window
+		bf->negatives >>= 1;
+		bf->false_positives >>= 1;
+	}
+
+	if (bf->keys > bf->capacity || bf->deletes > bf->capacity / 2) {
+		_bloom_start_rebuild(bf);
+	}
+}
+
+
+int kvs_bloom_create(kvs_bloom_t *bf, const char *name, KVS_ENGINE_SCAN scan) {
+
+	if (!bf || !scan) return -1;
+
+	memset(bf, 0, sizeof(kvs_bloom_t));
+	bf->name = name;
+	bf->scan = scan;
+	bf->capacity = BLOOM_MIN_KEYS;
+
+	bf->bits = _bloom_alloc(bf->capacity, &bf->nblocks);
+	if (!bf->bits) return -1;
+
+	return 0;
+}
+
+void kvs_bloom_destory(kvs_bloom_t *bf) {
+
+	if (!bf) return ;
+
+	if (bf->bits) kvstore_free(bf->bits);
+	if (bf->next_bits) kvstore_free(bf->next_bits);
+	if (bf->cursor) kvstore_free(bf->cursor);
+
+	bf->bits = NULL;
+	bf->next_bits = NULL;
+	bf->cursor = NULL;
+}
+
+// heap allocated filter, one per shard of its engine
+kvs_bloom_t *kvs_bloom_new(const char *name, KVS_ENGINE_SCAN scan) {
+
+	kvs_bloom_t *bf = kvstore_malloc(sizeof(kvs_bloom_t));
+	if (!bf) return NULL;
+
+	if (kvs_bloom_create(bf, name, scan) != 0) {
+		kvstore_free(bf);
+		return NULL;
+	}
+	return bf;
+}
+
+void kvs_bloom_free(kvs_bloom_t *bf) {
+
+	if (!bf) return ;
+
+	kvs_bloom_destory(bf);
+	kvstore_free(bf);
+}
+
+// after a successful set
+void kvs_bloom_add(kvs_bloom_t *bf, char *key) {
+
+	if (!bf || !bf->bits || !key) return ;
+
+	uint64_t hash = _bloom_hash(key);
+
+	_bloom_set(bf->bits, bf->nblocks, hash);
+	bf->keys ++;
+
+	if (bf->rebuilding) {
+		_bloom_set(bf->next_bits, bf->next_nblocks, hash);
+		bf->next_keys ++;
+		_bloom_step(bf);
+	} else {
+		_bloom_check_drift(bf);
+	}
+}
+
+// after a successful delete
+void kvs_bloom_delete(kvs_bloom_t *bf) {
+
+	if (!bf || !bf->bits) return ;
+
+	bf->deletes ++;
+
+	if (bf->rebuilding) {
+		_bloom_step(bf);
+	} else {
+		_bloom_check_drift(bf);
+	}
+}
+
+// 0: definitely not in the engine, 1: ask the engine
+int kvs_bloom_may_contain(kvs_bloom_t *bf, char *key) {
+
+	if (!bf || !bf->bits || !key) return 1;
+
+	if (bf->rebuilding) _bloom_step(bf);
+
+	bf->checks ++;
+
+	if (!_bloom_test(bf->bits, bf->nblocks, _bloom_hash(key))) {
+		bf->negatives ++;
+		bf->total_negatives ++;
+		return 0;
+	}
+
+	return 1;
+}
+
+// the filter said maybe, the engine said no
+void kvs_bloom_false_positive(kvs_bloom_t *bf) {
+
+	if (!bf || !bf->bits) return ;
+
+	bf->false_positives ++;
+	bf->total_false_positives ++;
+
+	_bloom_check_drift(bf);
+}
+
+int kvs_bloom_stats(kvs_bloom_t *bf, char *buf, int len) {
+
+	if (!bf || !buf) return 0;
+
+	uint64_t absent = bf->total_negatives + bf->total_false_positives;
+	double fpr = absent ? (double)bf->total_false_positives / absent : 0.0;
+
+	return snprintf(buf, len, "%s keys:%llu stale:%llu bits:%llu checks:%llu negatives:%llu false_positives:%llu fpr:%.4f rebuilds:%llu%s\n",
+		bf->name,
+		(unsigned long long)bf->keys, (unsigned long long)bf->deletes,
+		(unsigned long long)bf->nblocks * 512,
+		(unsigned long long)bf->checks, (unsigned long long)bf->total_negatives,
+		(unsigned long long)bf->total_false_positives, fpr,
+		(unsigned long long)bf->rebuilds, bf->rebuilding ? " rebuilding" : "");
+}
@@ -19,17 +19,40 @@ typedef int KEY_TYPE;
 typedef struct _btree_node {
     int leaf;
     int n;
+#if ENABLE_KEY_CHAR
+    kvs_key_t *keys;        // short ones inline, kvstore.h
+    kvs_value_t *values;
+#else
     KEY_TYPE *keys;
     void **values;
+#endif
+    unsigned int *lru;      // access clock of each key, moves with values
     struct _btree_node **children;
 } btree_node;
 
+#if ENABLE_KEY_CHAR
+#define BT_KEY(x, i)        kvs_key_get(&(x)->keys[i])
+#define BT_VALUE(x, i)      kvs_value_get(&(x)->values[i])
+#else
+#define BT_KEY(x, i)        ((x)->keys[i])
+#define BT_VALUE(x, i)      ((x)->values[i])
+#endif
+
 typedef struct _btree {
     btree_node *root;
     int count;
+    unsigned int seq;       // odd while a writer is inside
 } btree;
 
-btree Btree;
+// every change to the tree, kvs_btree_read() runs beside them
+#if ENABLE_RCU_READS
+#define BT_WRITE_BEGIN(tree)    kvs_seq_write_begin(&(tree)->seq)
+#define BT_WRITE_END(tree)      kvs_seq_write_end(&(tree)->seq)
+#else
+#define BT_WRITE_BEGIN(tree)
+#define BT_WRITE_END(tree)
+#endif
+
 
 // --- Helper Functions Declaration ---
 static btree_node *create_node(int leaf);
@@ -46,29 +69,32 @@ static KEY_TYPE _btree_get_succ(btree_node *x, int i);
 // --- Implementation ---
 
 static btree_node *create_node(int leaf) {
-    btree_node *node = (btree_node *)kvstore_malloc(sizeof(btree_node));
+    btree_node *node = (btree_node *)kvstore_malloc_tag(sizeof(btree_node), KVS_MEM_NODE);
     if (!node) return NULL;
 
     node->leaf = leaf;
     node->n = 0;
     // Keys: max 2*DEGREE - 1
-    node->keys = (KEY_TYPE *)kvstore_malloc(sizeof(KEY_TYPE) * (2 * DEGREE - 1));
+    node->keys = kvstore_malloc_tag(sizeof(*node->keys) * (2 * DEGREE - 1), KVS_MEM_NODE);
     // Values: matches keys
-    node->values = (void **)kvstore_malloc(sizeof(void *) * (2 * DEGREE - 1));
+    node->values = kvstore_malloc_tag(sizeof(*node->values) * (2 * DEGREE - 1), KVS_MEM_NODE);
+    node->lru = (unsigned int *)kvstore_malloc_tag(sizeof(unsigned int) * (2 * DEGREE - 1), KVS_MEM_NODE);
     // Children: max 2*DEGREE
-    node->children = (btree_node **)kvstore_malloc(sizeof(btree_node *) * (2 * DEGREE));
-
-    if (!node->keys || !node->values || !node->children) {
-        if (node->keys) kvstore_free(node->keys);
-        if (node->values) kvstore_free(node->values);
-        if (node->children) kvstore_free(node->children);
-        kvstore_free(node);
+    node->children = (btree_node **)kvstore_malloc_tag(sizeof(btree_node *) * (2 * DEGREE), KVS_MEM_NODE);
+
+    if (!node->keys || !node->values || !node->lru || !node->children) {
+        if (node->keys) kvstore_free_tag(node->keys, KVS_MEM_NODE);
+        if (node->values) kvstore_free_tag(node->values, KVS_MEM_NODE);
+        if (node->lru) kvstore_free_tag(node->lru, KVS_MEM_NODE);
+        if (node->children) kvstore_free_tag(node->children, KVS_MEM_NODE);
+        kvstore_free_tag(node, KVS_MEM_NODE);
         return NULL;
     }
 
     // Initialize pointers to NULL for safety
-    memset(node->keys, 0, sizeof(KEY_TYPE) * (2 * DEGREE - 1));
-    memset(node->values, 0, sizeof(void *) * (2 * DEGREE - 1));
+    memset(node->keys, 0, sizeof(*node->keys) * (2 * DEGREE - 1));
+    memset(node->values, 0, sizeof(*node->values) * (2 * DEGREE - 1));
+    memset(node->lru, 0, sizeof(unsigned int) * (2 * DEGREE - 1));
     memset(node->children, 0, sizeof(btree_node *) * (2 * DEGREE));
 
     return node;
@@ -82,12 +108,14 @@ static void split_child(btree_node *x, int i) {
     // Copy the last (DEGREE-1) keys/values from y to z
     for (int j = 0; j < DEGREE - 1; j++) {
 #if ENABLE_KEY_CHAR
-        z->keys[j] = y->keys[j + DEGREE]; // Pointer copy is enough during split, ownership transfers
+        z->keys[j] = y->keys[j + DEGREE]; // Plain copy is enough during split, ownership transfers
         z->values[j] = y->values[j + DEGREE];
+        z->lru[j] = y->lru[j + DEGREE];
         // Don't free y here, we are moving pointers
 #else
         z->keys[j] = y->keys[j + DEGREE];
         z->values[j] = y->values[j + DEGREE];
+        z->lru[j] = y->lru[j + DEGREE];
 #endif
     }
 
@@ -109,11 +137,13 @@ static void split_child(btree_node *x, int i) {
     for (int j = x->n - 1; j >= i; j--) {
         x->keys[j + 1] = x->keys[j];
         x->values[j + 1] = x->values[j];
+        x->lru[j + 1] = x->lru[j];
     }
 
     // Move middle key to x
     x->keys[i] = y->keys[DEGREE - 1];
     x->values[i] = y->values[DEGREE - 1];
+    x->lru[i] = y->lru[DEGREE - 1];
     
     x->n++;
 }
@@ -123,29 +153,31 @@ static void insert_nonfull(btree_node *x, KEY_TYPE k, void *v) {
 
     if (x->leaf) {
 #if ENABLE_KEY_CHAR
-        while (i >= 0 && strcmp(k, x->keys[i]) < 0) {
+        while (i >= 0 && strcmp(k, BT_KEY(x, i)) < 0) {
             x->keys[i + 1] = x->keys[i];
             x->values[i + 1] = x->values[i];
+            x->lru[i + 1] = x->lru[i];
             i--;
         }
         
-        x->keys[i + 1] = kvstore_malloc(strlen(k) + 1);
-        strcpy(x->keys[i + 1], k);
-        x->values[i + 1] = kvstore_malloc(strlen((char*)v) + 1);
-        strcpy((char*)x->values[i + 1], (char*)v);
+        kvs_key_set(&x->keys[i + 1], k);
+        kvs_value_set(&x->values[i + 1], (char*)v);
+        x->lru[i + 1] = kvs_lru_new();
 #else
         while (i >= 0 && k < x->keys[i]) {
             x->keys[i + 1] = x->keys[i];
             x->values[i + 1] = x->values[i];
+            x->lru[i + 1] = x->lru[i];
             i--;
         }
         x->keys[i + 1] = k;
         x->values[i + 1] = v;
+        x->lru[i + 1] = kvs_lru_new();
 #endif
         x->n++;
     } else {
 #if ENABLE_KEY_CHAR
-        while (i >= 0 && strcmp(k, x->keys[i]) < 0) {
+        while (i >= 0 && strcmp(k, BT_KEY(x, i)) < 0) {
             i--;
         }
 #else
@@ -158,7 +190,7 @@ static void insert_nonfull(btree_node *x, KEY_TYPE k, void *v) {
         if (x->children[i]->n == 2 * DEGREE - 1) {
             split_child(x, i);
 #if ENABLE_KEY_CHAR
-            if (strcmp(k, x->keys[i]) > 0) {
+            if (strcmp(k, BT_KEY(x, i)) > 0) {
                 i++;
             }
 #else
@@ -176,7 +208,7 @@ static btree_node *search_node(btree_node *x, KEY_TYPE k, int *idx) {
     int i = 0;
     while (i < x->n && 
 #if ENABLE_KEY_CHAR
-           strcmp(k, x->keys[i]) > 0
+           strcmp(k, BT_KEY(x, i)) > 0
 #else
            k > x->keys[i]
 #endif
@@ -186,7 +218,7 @@ static btree_node *search_node(btree_node *x, KEY_TYPE k, int *idx) {
     
     if (i < x->n && 
 #if ENABLE_KEY_CHAR
-        strcmp(k, x->keys[i]) == 0
+        strcmp(k, BT_KEY(x, i)) == 0
 #else
         k == x->keys[i]
 #endif
@@ -212,6 +244,7 @@ static void _btree_borrow_from_prev(btree_node *x, int i) {
     for (int j = child->n - 1; j >= 0; j--) {
         child->keys[j + 1] = child->keys[j];
         child->values[j + 1] = child->values[j];
+        child->lru[j + 1] = child->lru[j];
     }
 
     if (!child->leaf) {
@@ -223,6 +256,7 @@ static void _btree_borrow_from_prev(btree_node *x, int i) {
     // Move parent's key[i-1] to child[0]
     child->keys[0] = x->keys[i - 1];
     child->values[0] = x->values[i - 1];
+    child->lru[0] = x->lru[i - 1];
 
     if (!child->leaf) {
         child->children[0] = sibling->children[sibling->n];
@@ -231,6 +265,7 @@ static void _btree_borrow_from_prev(btree_node *x, int i) {
     // Move sibling's last key to parent
     x->keys[i - 1] = sibling->keys[sibling->n - 1];
     x->values[i - 1] = sibling->values[sibling->n - 1];
+    x->lru[i - 1] = sibling->lru[sibling->n - 1];
 
     child->n += 1;
     sibling->n -= 1;
@@ -244,6 +279,7 @@ static void _btree_borrow_from_next(btree_node *x, int i) {
     // Move parent's key[i] to child's end
     child->keys[child->n] = x->keys[i];
     child->values[child->n] = x->values[i];
+    child->lru[child->n] = x->lru[i];
 
     if (!child->leaf) {
         child->children[child->n + 1] = sibling->children[0];
@@ -252,11 +288,13 @@ static void _btree_borrow_from_next(btree_node *x, int i) {
     // Move sibling's first key to parent
     x->keys[i] = sibling->keys[0];
     x->values[i] = sibling->values[0];
+    x->lru[i] = sibling->lru[0];
 
     // Shift sibling left
     for (int j = 1; j < sibling->n; j++) {
         sibling->keys[j - 1] = sibling->keys[j];
         sibling->values[j - 1] = sibling->values[j];
+        sibling->lru[j - 1] = sibling->lru[j];
     }
 
     if (!sibling->leaf) {
@@ -277,11 +315,13 @@ static void _btree_merge(btree_node *x, int i) {
     // Pull down key from parent
     child->keys[DEGREE - 1] = x->keys[i];
     child->values[DEGREE - 1] = x->values[i];
+    child->lru[DEGREE - 1] = x->lru[i];
 
     // Copy keys/values from sibling to child
     for (int j = 0; j < sibling->n; j++) {
         child->keys[j + DEGREE] = sibling->keys[j];
         child->values[j + DEGREE] = sibling->values[j];
+        child->lru[j + DEGREE] = sibling->lru[j];
     }
 
     // Copy children pointers
@@ -295,6 +335,7 @@ static void _btree_merge(btree_node *x, int i) {
     for (int j = i + 1; j < x->n; j++) {
         x->keys[j - 1] = x->keys[j];
         x->values[j - 1] = x->values[j];
+        x->lru[j - 1] = x->lru[j];
     }
 
     for (int j = i + 2; j <= x->n; j++) {
@@ -305,10 +346,11 @@ static void _btree_merge(btree_node *x, int i) {
     x->n--;
 
     // Free sibling struct (keys moved, so just free container)
-    kvstore_free(sibling->keys);
-    kvstore_free(sibling->values);
-    kvstore_free(sibling->children);
-    kvstore_free(sibling);
+    kvstore_free_tag(sibling->keys, KVS_MEM_NODE);
+    kvstore_free_tag(sibling->values, KVS_MEM_NODE);
+    kvstore_free_tag(sibling->lru, KVS_MEM_NODE);
+    kvstore_free_tag(sibling->children, KVS_MEM_NODE);
+    kvstore_free_tag(sibling, KVS_MEM_NODE);
 }
 
 static void _btree_fill(btree_node *x, int i) {
@@ -331,14 +373,8 @@ static KEY_TYPE _btree_get_pred(btree_node *x, int i) {
     while (!cur->leaf) {
         cur = cur->children[cur->n];
     }
-    // Return a copy because the original might be freed or moved
-#if ENABLE_KEY_CHAR
-    char *ret = kvstore_malloc(strlen(cur->keys[cur->n - 1]) + 1);
-    strcpy(ret, cur->keys[cur->n - 1]);
-    return ret;
-#else
-    return cur->keys[cur->n - 1];
-#endif
+    // The leaf's own key, copy it before the leaf changes
+    return BT_KEY(cur, cur->n - 1);
 }
 
 // Get successor key (leftmost key of right child)
@@ -347,20 +383,14 @@ static KEY_TYPE _btree_get_succ(btree_node *x, int i) {
     while (!cur->leaf) {
         cur = cur->children[0];
     }
-#if ENABLE_KEY_CHAR
-    char *ret = kvstore_malloc(strlen(cur->keys[0]) + 1);
-    strcpy(ret, cur->keys[0]);
-    return ret;
-#else
-    return cur->keys[0];
-#endif
+    return BT_KEY(cur, 0);
 }
 
 static void _btree_delete(btree_node *x, KEY_TYPE k) {
     int i = 0;
     while (i < x->n && 
 #if ENABLE_KEY_CHAR
-           strcmp(k, x->keys[i]) > 0
+           strcmp(k, BT_KEY(x, i)) > 0
 #else
            k > x->keys[i]
 #endif
@@ -371,7 +401,7 @@ static void _btree_delete(btree_node *x, KEY_TYPE k) {
     // Case 1: Key found in current node x
     if (i < x->n && 
 #if ENABLE_KEY_CHAR
-        strcmp(k, x->keys[i]) == 0
+        strcmp(k, BT_KEY(x, i)) == 0
 #else
         k == x->keys[i]
 #endif
@@ -380,52 +410,46 @@ static void _btree_delete(btree_node *x, KEY_TYPE k) {
         if (x->leaf) {
             // Case 1a: x is leaf -> just delete
 #if ENABLE_KEY_CHAR
-            kvstore_free(x->keys[i]);
-            kvstore_free(x->values[i]);
+            kvs_key_free(&x->keys[i]);
+            kvs_value_free(&x->values[i]);
 #endif
             for (int j = i + 1; j < x->n; j++) {
                 x->keys[j - 1] = x->keys[j];
                 x->values[j - 1] = x->values[j];
+                x->lru[j - 1] = x->lru[j];
             }
             x->n--;
         } else {
             // Case 1b: x is internal node
-            KEY_TYPE k_copy = x->keys[i]; // Alias for clarity
-
             if (x->children[i]->n >= DEGREE) {
                 // Predecessor is abundant
                 KEY_TYPE pred = _btree_get_pred(x, i);
                 
                 // Replace k with pred
 #if ENABLE_KEY_CHAR
-                kvstore_free(x->keys[i]); // Free old key
-                // Note: values need to be updated too, but we usually store value with key.
-                // In a true key-value store, we should probably fetch the predecessor's VALUE too.
-                // For simplicity here, assuming we delete the key and 'swap' logic handles it recursively.
-                // Wait! B-tree deletion via predecessor swap: we replace key[i] with pred, 
-                // then recursively delete pred from child[i].
-                // We MUST update the value associated with key[i] to be the value of pred!
-                
-                // Correction: Get predecessor value as well
+                kvs_key_free(&x->keys[i]); // Free old key
+                kvs_value_free(&x->values[i]);
+
+                // The predecessor's value moves up with its key. Take the value
+                // itself, not a copy, so a heap value stays at its address for as
+                // long as its key lives (the hot-key cache relies on it); the leaf
+                // slot is left an empty inline string so the recursive delete
+                // below frees nothing.
                 btree_node *curr = x->children[i];
                 while (!curr->leaf) curr = curr->children[curr->n];
-                void *pred_val_ptr = curr->values[curr->n - 1];
-                void *pred_val = kvstore_malloc(strlen((char*)pred_val_ptr) + 1);
-                strcpy((char*)pred_val, (char*)pred_val_ptr);
-                
-                kvstore_free(x->values[i]);
-                x->keys[i] = pred; // Owned by x now
-                x->values[i] = pred_val;
+
+                kvs_key_set(&x->keys[i], pred); // x owns a copy
+                x->values[i] = curr->values[curr->n - 1];
+                x->lru[i] = curr->lru[curr->n - 1];
+                memset(&curr->values[curr->n - 1], 0, sizeof(kvs_value_t));
+
+                // pred lives in the leaf, which the delete below may rebalance
+                pred = BT_KEY(x, i);
 #else
                 x->keys[i] = pred;
                 // Value copy logic needed for int keys too if values are pointers
 #endif
                 _btree_delete(x->children[i], pred);
-#if ENABLE_KEY_CHAR
-                // The _btree_get_pred returned a malloc'd copy, which is now in x->keys[i].
-                // The recursive delete removed the original from the leaf.
-                // Correct.
-#endif
 
             } else if (x->children[i + 1]->n >= DEGREE) {
                 // Successor is abundant
@@ -435,14 +459,13 @@ static void _btree_delete(btree_node *x, KEY_TYPE k) {
                 btree_node *curr = x->children[i+1];
                 while (!curr->leaf) curr = curr->children[0];
 #if ENABLE_KEY_CHAR
-                void *succ_val_ptr = curr->values[0];
-                void *succ_val = kvstore_malloc(strlen((char*)succ_val_ptr) + 1);
-                strcpy((char*)succ_val, (char*)succ_val_ptr);
-
-                kvstore_free(x->keys[i]);
-                kvstore_free(x->values[i]);
-                x->keys[i] = succ;
-                x->values[i] = succ_val;
+                kvs_key_free(&x->keys[i]);
+                kvs_value_free(&x->values[i]);
+                kvs_key_set(&x->keys[i], succ);
+                x->values[i] = curr->values[0]; // moved, see the predecessor case
+                x->lru[i] = curr->lru[0];
+                memset(&curr->values[0], 0, sizeof(kvs_value_t));
+                succ = BT_KEY(x, i);
 #else
                 x->keys[i] = succ;
 #endif
@@ -501,15 +524,16 @@ static void _btree_destory_node(btree_node *node) {
     
     for (int i = 0; i < node->n; i++) {
 #if ENABLE_KEY_CHAR
-        kvstore_free(node->keys[i]);
-        kvstore_free(node->values[i]);
+        kvs_key_free(&node->keys[i]);
+        kvs_value_free(&node->values[i]);
 #endif
     }
     
-    kvstore_free(node->keys);
-    kvstore_free(node->values);
-    kvstore_free(node->children);
-    kvstore_free(node);
+    kvstore_free_tag(node->keys, KVS_MEM_NODE);
+    kvstore_free_tag(node->values, KVS_MEM_NODE);
+    kvstore_free_tag(node->lru, KVS_MEM_NODE);
+    kvstore_free_tag(node->children, KVS_MEM_NODE);
+    kvstore_free_tag(node, KVS_MEM_NODE);
 }
 
 void kvstore_btree_destory(btree *tree) {
@@ -520,6 +544,25 @@ void kvstore_btree_destory(btree *tree) {
     tree->count = 0;
 }
 
+// heap allocated btree, one per shard
+btree *kvstore_btree_new(void) {
+    btree *tree = (btree *)kvstore_malloc(sizeof(btree));
+    if (!tree) return NULL;
+
+    if (kvstore_btree_create(tree) != 0) {
+        kvstore_free(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+void kvstore_btree_free(btree *tree) {
+    if (!tree) return;
+
+    kvstore_btree_destory(tree);
+    kvstore_free(tree);
+}
+
 int kvs_btree_set(btree *tree, char *key, char *value) {
     if (!tree || !key || !value) return -1;
 
@@ -529,6 +572,7 @@ int kvs_btree_set(btree *tree, char *key, char *value) {
         return kvs_btree_modify(tree, key, value);
     }
 
+    BT_WRITE_BEGIN(tree);
     btree_node *r = tree->root;
     if (r->n == 2 * DEGREE - 1) {
         btree_node *s = create_node(0);
@@ -541,6 +585,7 @@ int kvs_btree_set(btree *tree, char *key, char *value) {
     }
 
     tree->count++;
+    BT_WRITE_END(tree);
     return 0;
 }
 
@@ -551,7 +596,8 @@ char *kvs_btree_get(btree *tree, char *key) {
     btree_node *node = search_node(tree->root, key, &idx);
     
     if (node) {
-        return node->values[idx];
+        node->lru[idx] = kvs_lru_touch(node->lru[idx]);
+        return BT_VALUE(node, idx);
     }
     return NULL;
 }
@@ -563,14 +609,19 @@ int kvs_btree_modify(btree *tree, char *key, char *value) {
     btree_node *node = search_node(tree->root, key, &idx);
 
     if (node) {
+        BT_WRITE_BEGIN(tree);
 #if ENABLE_KEY_CHAR
-        kvstore_free(node->values[idx]);
-        node->values[idx] = kvstore_malloc(strlen(value) + 1);
-        strcpy((char*)node->values[idx], value);
+        kvs_value_free(&node->values[idx]);
+        if (kvs_value_set(&node->values[idx], value) != 0) {
+            BT_WRITE_END(tree);
+            return -1;
+        }
+        node->lru[idx] = kvs_lru_touch(node->lru[idx]);
 #else
         // If int keys and pointer values, update pointer
         node->values[idx] = value;
 #endif
+        BT_WRITE_END(tree);
         return 0;
     }
     return -1;
@@ -585,6 +636,7 @@ int kvs_btree_delete(btree *tree, char *key) {
         return -1; // Not found
     }
 
+    BT_WRITE_BEGIN(tree);
     _btree_delete(tree->root, key);
 
     // If root becomes empty (but not NULL, meaning it was internal and merged), replace it
@@ -599,17 +651,179 @@ int kvs_btree_delete(btree *tree, char *key) {
         } else {
             tree->root = tree->root->children[0];
             
-            kvstore_free(tmp->keys);
-            kvstore_free(tmp->values);
-            kvstore_free(tmp->children);
-            kvstore_free(tmp);
+            kvstore_free_tag(tmp->keys, KVS_MEM_NODE);
+            kvstore_free_tag(tmp->values, KVS_MEM_NODE);
+            kvstore_free_tag(tmp->lru, KVS_MEM_NODE);
+            kvstore_free_tag(tmp->children, KVS_MEM_NODE);
+            kvstore_free_tag(tmp, KVS_MEM_NODE);
         }
     }
 
     tree->count--;
+    BT_WRITE_END(tree);
     return 0;
 }
 
 int kvs_btree_count(btree *tree) {
     return tree ? tree->count : 0;
-}
\ No newline at end of file
+}
+
+// bytes the key costs: its share of the node it sits in, arrays included,
+// and its heap key and value. -1: no such key
+long kvs_btree_usage(btree *tree, char *key) {
+    if (!tree || !tree->root || !key) return -1;
+
+    int idx = 0;
+    btree_node *node = search_node(tree->root, key, &idx);
+    if (!node) return -1;
+
+    size_t size = kvstore_usable_size(node) + kvstore_usable_size(node->keys)
+        + kvstore_usable_size(node->values) + kvstore_usable_size(node->lru)
+        + kvstore_usable_size(node->children);
+
+#if ENABLE_KEY_CHAR
+    return size / node->n + kvs_key_usage(&node->keys[idx]) + kvs_value_usage(&node->values[idx]);
+#else
+    return size / node->n;
+#endif
+}
+
+#if ENABLE_RCU_READS
+// the descent of search_node(), with every node's fields and every key
+// copied out and checked against the sequence count before they are used,
+// see kvs_rbtree_read(). a split or merge half done costs a retry. the
+// access clock is left alone, its slot may be moving
+int kvs_btree_read(btree *tree, char *key, char *buf, int len) {
+    kvs_seq_read_t rd;
+    if (!kvs_seq_read_begin(&rd, &tree->seq)) return -1;
+
+    btree_node *x = tree->root;
+
+    while (1) {
+        if (!kvs_seq_read_valid(&rd)) return -1;
+
+        int n = x->n;
+        int leaf = x->leaf;
+        kvs_key_t *keys = x->keys;
+        kvs_value_t *values = x->values;
+        btree_node **children = x->children;
+        if (!kvs_seq_read_valid(&rd)) return -1;
+
+        int i = 0, cmp = 1;
+        for (i = 0; i < n; i++) {
+            kvs_key_t k = keys[i];
+            if (!kvs_seq_read_valid(&rd)) return -1;
+
+            cmp = strcmp(key, kvs_key_get(&k));
+            if (cmp <= 0) break;
+        }
+
+        if (i < n && cmp == 0) {
+            kvs_value_t v = values[i];
+            if (!kvs_seq_read_valid(&rd)) return -1;
+
+            snprintf(buf, len, "%s", kvs_value_get(&v));
+            return kvs_seq_read_valid(&rd) ? 0 : -1;
+        }
+
+        if (leaf) return kvs_seq_read_valid(&rd) ? 1 : -1;
+
+        x = children[i];
+    }
+}
+#endif
+
+static int _btree_scan(btree_node *x, char *start, SCAN_CALLBACK cb, void *arg) {
+    int i = 0;
+    if (start) {
+        while (i < x->n && strcmp(BT_KEY(x, i), start) < 0) i++;
+    }
+
+    for (; i <= x->n; i++) {
+        if (!x->leaf && _btree_scan(x->children[i], start, cb, arg)) return 1;
+        start = NULL; // everything right of children[i] is >= start
+        if (i < x->n && cb(BT_KEY(x, i), BT_VALUE(x, i), arg)) return 1;
+    }
+    return 0;
+}
+
+// in-order walk from the first key >= start (NULL: from the smallest key)
+int kvs_btree_scan(btree *tree, char *start, SCAN_CALLBACK cb, void *arg) {
+    if (!tree || !tree->root || !cb) return -1;
+
+    return _btree_scan(tree->root, start, cb, arg);
+}
+
+#if ENABLE_MEM_DEFRAG
+// slot: where the node pointer lives, the root or the parent's children[i]
+static void _btree_defrag_node(btree_node **slot) {
+    btree_node *x = kvstore_defrag_move(*slot);
+    if (x) *slot = x;
+    x = *slot;
+
+    void *p = NULL;
+    if ((p = kvstore_defrag_move(x->keys)) != NULL) x->keys = p;
+    if ((p = kvstore_defrag_move(x->values)) != NULL) x->values = p;
+    if ((p = kvstore_defrag_move(x->lru)) != NULL) x->lru = p;
+    if ((p = kvstore_defrag_move(x->children)) != NULL) x->children = p;
+}
+
+static int _btree_defrag(btree_node **slot, char *start, char *cursor, int *budget, KVS_DEFRAG_MOVED moved) {
+    _btree_defrag_node(slot);
+    btree_node *x = *slot;
+
+    int i = 0;
+    if (start) {
+        while (i < x->n && strcmp(BT_KEY(x, i), start) < 0) i++;
+    }
+
+    for (; i <= x->n; i++) {
+        if (!x->leaf && _btree_defrag(&x->children[i], start, cursor, budget, moved)) return 1;
+        start = NULL;
+        if (i == x->n) break;
+
+        if ((*budget)-- == 0) {
+            snprintf(cursor, BUFFER_LENGTH, "%s", BT_KEY(x, i));
+            return 1;
+        }
+
+        // inline strings moved with the arrays, only heap ones are left
+        kvs_key_defrag(&x->keys[i]);
+
+        if (kvs_value_defrag(&x->values[i])) {
+            if (moved) moved(BT_KEY(x, i));
+        }
+    }
+    return 0;
+}
+
+// in-order defrag walk of budget keys from the first key >= cursor
+int kvs_btree_defrag(btree *tree, char *cursor, int budget, KVS_DEFRAG_MOVED moved) {
+    if (!tree || !tree->root || !cursor) return -1;
+
+    BT_WRITE_BEGIN(tree);
+    int res = _btree_defrag(&tree->root, cursor[0] ? cursor : NULL, cursor, &budget, moved);
+    BT_WRITE_END(tree);
+
+    return res;
+}
+#endif
+
+// random key for eviction sampling: descend through random children and
+// stop at a random key, internal keys included
+int kvs_btree_sample(btree *tree, char **key, unsigned int *lru) {
+    if (!tree || !tree->root || tree->root->n == 0) return -1;
+
+    btree_node *x = tree->root;
+    while (1) {
+        // leaf: pick a key. internal: one of n keys or n+1 children
+        unsigned int r = kvs_random() % (x->leaf ? x->n : 2 * x->n + 1);
+        if (x->leaf || (r & 1)) {
+            int i = x->leaf ? (int)r : (int)(r >> 1);
+            *key = BT_KEY(x, i);
+            *lru = x->lru[i];
+            return 0;
+        }
+        x = x->children[r >> 1];
+    }
+}
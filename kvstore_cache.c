@@ -0,0 +1,212 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kvstore.h"
+
+
+// hot-key read cache in front of an ordered engine. direct mapped: a key
+// hashes to exactly one 64 byte slot holding a copy of the key and the
+// value, so a hit is one hash and one cache line instead of a root-to-leaf
+// descent.
+//
+// a short value is copied into the slot: the engine keeps it inline in a
+// node, and nodes move on rebalancing. a long one stays the engine's heap
+// string and the slot keeps its pointer. that stays valid until the key is
+// set, modified or deleted, and the wrappers invalidate the slot on all three
+// before the engine runs.
+//
+// admission is a one-slot CLOCK: a hit sets the referenced bit, and a miss
+// that maps onto a referenced slot only clears the bit instead of evicting,
+// so a scan of cold keys cannot flush a hot one on its first pass.
+
+#define CACHE_SLOTS				4096	// power of 2
+#define CACHE_KEY_INLINE		30		// longer keys bypass the cache
+
+
+typedef struct cache_slot_s {
+	uint64_t hash;
+	kvs_value_t value;			// inline copy or the engine's pointer, never freed here
+	char key[CACHE_KEY_INLINE];
+	uint8_t used;
+	uint8_t referenced;
+} __attribute__((aligned(64))) cache_slot_t;
+
+typedef struct kvs_cache_s {
+
+	const char *name;
+	cache_slot_t *slots;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t fills;
+	uint64_t rejects;			// fill skipped, slot was referenced
+	uint64_t invalidations;
+
+} kvs_cache_t;
+
+
+
+static uint64_t _cache_hash(const char *key, size_t *len) {
+
+	const char *p = key;
+	uint64_t hash = 14695981039346656037ULL;
+	while (*p) {
+		hash ^= (uint8_t)*p ++;
+		hash *= 1099511628211ULL;
+	}
+	*len = p - key;
+
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+static cache_slot_t *_cache_slot(kvs_cache_t *cache, uint64_t hash) {
+	return &cache->slots[hash & (CACHE_SLOTS - 1)];
+}
+
+
+int kvs_cache_create(kvs_cache_t *cache, const char *name) {
+
+	if (!cache) return -1;
+
+	memset(cache, 0, sizeof(kvs_cache_t));
+	cache->name = name;
+
+	cache->slots = kvstore_malloc_aligned(sizeof(cache_slot_t) * CACHE_SLOTS, 64, KVS_MEM_INDEX);
+	if (!cache->slots) return -1;
+	memset(cache->slots, 0, sizeof(cache_slot_t) * CACHE_SLOTS);
+
+	return 0;
+}
+
+void kvs_cache_destory(kvs_cache_t *cache) {
+
+	if (!cache) return ;
+
+	kvstore_free_aligned(cache->slots, KVS_MEM_INDEX);
+	cache->slots = NULL;
+}
+
+// heap allocated cache, one per shard of its engine
+kvs_cache_t *kvs_cache_new(const char *name) {
+
+	kvs_cache_t *cache = kvstore_malloc(sizeof(kvs_cache_t));
+	if (!cache) return NULL;
+
+	if (kvs_cache_create(cache, name) != 0) {
+		kvstore_free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void kvs_cache_free(kvs_cache_t *cache) {
+
+	if (!cache) return ;
+
+	kvs_cache_destory(cache);
+	kvstore_free(cache);
+}
+
+// NULL: not cached, ask the engine
+char *kvs_cache_get(kvs_cache_t *cache, char *key) {
+
+	if (!cache || !cache->slots || !key) return NULL;
+
+	size_t len = 0;
+	uint64_t hash = _cache_hash(key, &len);
+	cache_slot_t *slot = _cache_slot(cache, hash);
+
+	if (slot->used && slot->hash == hash && len < CACHE_KEY_INLINE
+		&& memcmp(slot->key, key, len + 1) == 0) {
+		slot->referenced = 1;
+		cache->hits ++;
+		return kvs_value_get(&slot->value);
+	}
+
+	cache->misses ++;
+	return NULL;
+}
+
+// after an engine get found the key
+void kvs_cache_put(kvs_cache_t *cache, char *key, char *value) {
+
+	if (!cache || !cache->slots || !key || !value) return ;
+
+	size_t len = 0;
+	uint64_t hash = _cache_hash(key, &len);
+	if (len >= CACHE_KEY_INLINE) return ;
+
+	cache_slot_t *slot = _cache_slot(cache, hash);
+	if (slot->used && slot->referenced) {
+		slot->referenced = 0;
+		cache->rejects ++;
+		return ;
+	}
+
+	slot->hash = hash;
+	if (strlen(value) < KVS_VALUE_INLINE) {
+		// a copy, not a value the engine stores: no dedup, no log
+		kvs_str_set(slot->value.s, KVS_VALUE_INLINE, value, KVS_MEM_VALUE);
+	} else {
+		slot->value.ptr = value;
+		slot->value.s[KVS_VALUE_INLINE - 1] = 1;
+	}
+	memcpy(slot->key, key, len + 1);
+	slot->used = 1;
+	slot->referenced = 0;
+
+	cache->fills ++;
+}
+
+// before the engine sets, modifies or deletes the key
+void kvs_cache_invalidate(kvs_cache_t *cache, char *key) {
+
+	if (!cache || !cache->slots || !key) return ;
+
+	size_t len = 0;
+	uint64_t hash = _cache_hash(key, &len);
+	cache_slot_t *slot = _cache_slot(cache, hash);
+
+	if (slot->used && slot->hash == hash && len < CACHE_KEY_INLINE
+		&& memcmp(slot->key, key, len + 1) == 0) {
+		slot->used = 0;
+		slot->referenced = 0;
+		cache->invalidations ++;
+	}
+}
+
+// peek without touching the stats: the key was read recently
+int kvs_cache_contains(kvs_cache_t *cache, char *key) {
+
+	if (!cache || !cache->slots || !key) return 0;
+
+	size_t len = 0;
+	uint64_t hash = _cache_hash(key, &len);
+	cache_slot_t *slot = _cache_slot(cache, hash);
+
+	return slot->used && slot->hash == hash && len < CACHE_KEY_INLINE
+		&& memcmp(slot->key, key, len + 1) == 0;
+}
+
+int kvs_cache_stats(kvs_cache_t *cache, char *buf, int len) {
+
+	if (!cache || !buf) return 0;
+
+	uint64_t lookups = cache->hits + cache->misses;
+	double ratio = lookups ? (double)cache->hits / lookups : 0.0;
+
+	return snprintf(buf, len, "%s slots:%d hits:%llu misses:%llu hit_ratio:%.4f fills:%llu rejects:%llu invalidations:%llu\n",
+		cache->name, CACHE_SLOTS,
+		(unsigned long long)cache->hits, (unsigned long long)cache->misses, ratio,
+		(unsigned long long)cache->fills, (unsigned long long)cache->rejects,
+		(unsigned long long)cache->invalidations);
+}
+
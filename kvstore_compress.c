@@ -0,0 +1,355 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kvstore.h"
+
+
+// transparent value compression, opted into per engine with
+// CONFIG SET compression <engine,...|all|none>. a SET/MOD value of at least
+// the threshold is packed before the engine sees it, GET replies unpack it
+// again unless the connection asked for packed values (CLIENT COMPRESSED yes).
+//
+// the codec is a byte oriented LZ77 in the spirit of LZ4: a hash of the next
+// 4 bytes finds one earlier candidate, no chains, no entropy stage. it is
+// written so no output byte is 0, a packed value stays a C string and every
+// engine, the caches and the LSM sstables store it unchanged:
+//
+//   KVS_PACK_MAGIC <raw length in decimal> ':' stream
+//
+//   stream: any byte but 0xFF        literal
+//           0xFF 0x01                literal 0xFF
+//           0xFF L off               L 0x02-0x7F: match of L + 2 bytes, offset off
+//           0xFF L hi lo             L 0x80-0xFF: match of L - 0x7B bytes,
+//                                    offset ((hi - 1) << 7 | (lo - 1))
+
+#if ENABLE_COMPRESSION
+
+#define PACK_ESCAPE			0xFF
+#define PACK_MIN_MATCH		4				// near match costs 3 bytes
+#define PACK_FAR_MIN_MATCH	5				// far match costs 4 bytes
+#define PACK_NEAR_MAX_MATCH	(0x7F + 2)
+#define PACK_FAR_MAX_MATCH	(0xFF - 0x7B)
+#define PACK_NEAR_OFFSET	0xFF
+#define PACK_MAX_OFFSET		((0x7F << 7) | 0x7F)
+#define PACK_HASH_BITS		10
+#define PACK_MIN_SAVING		8				// keep a packed value only if 1/8 smaller
+
+#define PACK_THRESHOLD		64				// default, CONFIG SET compression-threshold
+
+
+typedef struct kvs_compress_s {
+
+	int engines[KVS_ENGINE_SIZE];		// opted in
+	size_t threshold;
+
+	uint64_t packed;					// values packed so far, counters atomic
+	uint64_t skipped;					// above the threshold, did not shrink enough
+	uint64_t raw_bytes;					// of the values packed so far
+	uint64_t packed_bytes;
+	int64_t live;						// packed values the engines hold now
+	int64_t live_raw_bytes;
+	int64_t live_packed_bytes;
+	uint64_t unpacked;					// GET replies unpacked
+	uint64_t passthrough;				// GET replies sent packed
+
+} kvs_compress_t;
+
+static kvs_compress_t Compress = {
+	.threshold = PACK_THRESHOLD,
+};
+
+
+static uint32_t _pack_hash(const unsigned char *p) {
+
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+
+	return (v * 2654435761U) >> (32 - PACK_HASH_BITS);
+}
+
+static int _pack_literal(unsigned char *out, int o, int len, unsigned char c) {
+
+	if (c == PACK_ESCAPE) {
+		if (o + 2 > len) return -1;
+		out[o ++] = PACK_ESCAPE;
+		out[o ++] = 0x01;
+	} else {
+		if (o + 1 > len) return -1;
+		out[o ++] = c;
+	}
+	return o;
+}
+
+// LZ stream of in[0..n) into out, -1 when it does not fit in len
+static int _pack_stream(const unsigned char *in, int n, unsigned char *out, int len) {
+
+	uint32_t table[1 << PACK_HASH_BITS];	// position + 1, 0: empty
+	memset(table, 0, sizeof(table));
+
+	int i = 0, o = 0;
+	while (i < n) {
+		if (i + PACK_MIN_MATCH <= n) {
+			uint32_t h = _pack_hash(in + i);
+			int cand = (int)table[h] - 1;
+			table[h] = i + 1;
+
+			int off = i - cand;
+			if (cand >= 0 && off <= PACK_MAX_OFFSET
+				&& memcmp(in + cand, in + i, PACK_MIN_MATCH) == 0) {
+
+				int near = (off <= PACK_NEAR_OFFSET);
+				int max = near ? PACK_NEAR_MAX_MATCH : PACK_FAR_MAX_MATCH;
+
+				int m = PACK_MIN_MATCH;
+				while (i + m < n && m < max && in[cand + m] == in[i + m]) m ++;
+				if (!near && m < PACK_FAR_MIN_MATCH) goto literal;
+
+				if (o + 4 > len) return -1;
+				out[o ++] = PACK_ESCAPE;
+				if (near) {
+					out[o ++] = (unsigned char)(m - 2);
+					out[o ++] = (unsigned char)off;
+				} else {
+					out[o ++] = (unsigned char)(m + 0x7B);
+					out[o ++] = (unsigned char)((off >> 7) + 1);
+					out[o ++] = (unsigned char)((off & 0x7F) + 1);
+				}
+
+				// index the matched bytes too, small values have few positions
+				int end = i + m;
+				for (i ++;i < end && i + PACK_MIN_MATCH <= n;i ++) {
+					table[_pack_hash(in + i)] = i + 1;
+				}
+				i = end;
+				continue;
+			}
+		}
+
+literal:
+		o = _pack_literal(out, o, len, in[i ++]);
+		if (o < 0) return -1;
+	}
+
+	return o;
+}
+
+
+// the value to hand to the engine: value itself, or its packed form in buf
+char *kvs_compress_pack(int engine, char *value, char *buf, int len) {
+
+	if (!value || engine < 0 || engine >= KVS_ENGINE_SIZE) return value;
+
+	// a raw value must never look packed, those are always encoded
+	int forced = (value[0] == KVS_PACK_MAGIC);
+	if (!forced && !Compress.engines[engine]) return value;
+
+	size_t n = strlen(value);
+	if (!forced && n < Compress.threshold) return value;
+
+	int head = snprintf(buf, len, "%c%zu:", KVS_PACK_MAGIC, n);
+	if (head <= 0 || head >= len) return value;
+
+	int o = _pack_stream((const unsigned char *)value, (int)n,
+		(unsigned char *)buf + head, len - head - 1);
+
+	if (!forced && (o < 0 || (size_t)(head + o) > n - n / PACK_MIN_SAVING)) {
+		__atomic_add_fetch(&Compress.skipped, 1, __ATOMIC_RELAXED);
+		return value;
+	}
+	if (o < 0) return NULL; // magic prefixed and too long to encode
+
+	buf[head + o] = '\0';
+
+	__atomic_add_fetch(&Compress.packed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Compress.raw_bytes, n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Compress.packed_bytes, head + o, __ATOMIC_RELAXED);
+
+	return buf;
+}
+
+// 0: value is not packed. otherwise the raw length, unpacked into buf.
+// -1: corrupt or longer than len
+int kvs_compress_unpack(const char *value, char *buf, int len) {
+
+	if (!value || value[0] != KVS_PACK_MAGIC) return 0;
+
+	char *end = NULL;
+	long n = strtol(value + 1, &end, 10);
+	if (end == value + 1 || *end != ':' || n < 0 || n >= len) return -1;
+
+	const unsigned char *p = (const unsigned char *)end + 1;
+	unsigned char *out = (unsigned char *)buf;
+	long o = 0;
+
+	while (*p) {
+		if (*p != PACK_ESCAPE) {
+			if (o >= n) return -1;
+			out[o ++] = *p ++;
+			continue;
+		}
+
+		if (p[1] == 0x01) {
+			if (o >= n) return -1;
+			out[o ++] = PACK_ESCAPE;
+			p += 2;
+			continue;
+		}
+
+		long m = 0, off = 0;
+		if (!p[1] || !p[2]) return -1;
+		if (p[1] < 0x80) {
+			m = p[1] + 2;
+			off = p[2];
+			p += 3;
+		} else {
+			if (!p[3]) return -1;
+			m = p[1] - 0x7B;
+			off = ((long)(p[2] - 1) << 7) | (p[3] - 1);
+			p += 4;
+		}
+		if (off == 0 || off > o || o + m > n) return -1;
+
+		long k = 0;
+		for (k = 0;k < m;k ++, o ++) out[o] = out[o - off]; // may overlap
+	}
+
+	if (o != n) return -1;
+	buf[n] = '\0';
+
+	return (int)n;
+}
+
+// a GET reply in wbuffer, unpacked in place unless the client takes it packed
+void kvs_compress_reply(char *msg, int len, int packed) {
+
+	if (msg[0] != KVS_PACK_MAGIC) return ;
+
+	if (packed) {
+		__atomic_add_fetch(&Compress.passthrough, 1, __ATOMIC_RELAXED);
+		return ;
+	}
+
+	char raw[BUFFER_LENGTH];
+	int n = kvs_compress_unpack(msg, raw, sizeof(raw));
+	if (n < 0 || n >= len) {
+		snprintf(msg, len, "ERROR");
+		return ;
+	}
+
+	memcpy(msg, raw, n + 1);
+	__atomic_add_fetch(&Compress.unpacked, 1, __ATOMIC_RELAXED);
+}
+
+
+// a packed value an engine took or let go of. the raw length is in its header
+void kvs_compress_account(const char *value, int sign) {
+
+	long n = strtol(value + 1, NULL, 10);
+
+	__atomic_add_fetch(&Compress.live, sign, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Compress.live_raw_bytes, sign * n, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&Compress.live_packed_bytes, sign * (long)strlen(value), __ATOMIC_RELAXED);
+}
+
+
+// CONFIG SET compression rbtree,btree | all | none
+static int _compress_set_engines(char *value) {
+
+	int engines[KVS_ENGINE_SIZE] = {0};
+
+	if (strcmp(value, "all") == 0) {
+		int i = 0;
+		for (i = 0;i < KVS_ENGINE_SIZE;i ++) engines[i] = 1;
+	} else if (strcmp(value, "none") != 0) {
+		char list[BUFFER_LENGTH];
+		snprintf(list, sizeof(list), "%s", value);
+
+		char *save = NULL;
+		char *name = strtok_r(list, ",", &save);
+		while (name) {
+			int i = 0;
+			for (i = 0;i < KVS_ENGINE_SIZE;i ++) {
+				if (strcmp(name, kvs_engine_names[i]) == 0) break;
+			}
+			if (i == KVS_ENGINE_SIZE) return -1;
+
+			engines[i] = 1;
+			name = strtok_r(NULL, ",", &save);
+		}
+	}
+
+	memcpy(Compress.engines, engines, sizeof(engines));
+	return 0;
+}
+
+static int _compress_get_engines(char *buf, int len) {
+
+	int n = 0;
+	int i = 0;
+	for (i = 0;i < KVS_ENGINE_SIZE && n < len;i ++) {
+		if (!Compress.engines[i]) continue;
+		n += snprintf(buf + n, len - n, "%s%s", n ? "," : "", kvs_engine_names[i]);
+	}
+	if (n == 0) n = snprintf(buf, len, "none");
+
+	return n;
+}
+
+int kvs_compress_config_set(char *name, char *value) {
+
+	if (strcmp(name, "compression") == 0) {
+		return _compress_set_engines(value);
+	}
+
+	if (strcmp(name, "compression-threshold") == 0) {
+		char *end = NULL;
+		long threshold = strtol(value, &end, 10);
+		if (end == value || *end || threshold < PACK_MIN_MATCH) return -1;
+
+		Compress.threshold = threshold;
+		return 0;
+	}
+
+	return -1;
+}
+
+int kvs_compress_config_get(char *name, char *buf, int len) {
+
+	if (strcmp(name, "compression") == 0) {
+		return _compress_get_engines(buf, len);
+	}
+
+	if (strcmp(name, "compression-threshold") == 0) {
+		return snprintf(buf, len, "%zu", Compress.threshold);
+	}
+
+	return -1;
+}
+
+int kvs_compress_stats(char *buf, int len) {
+
+	char engines[128];
+	_compress_get_engines(engines, sizeof(engines));
+
+	// saved and ratio of what is stored now, the totals of every value packed
+	long long raw = __atomic_load_n(&Compress.live_raw_bytes, __ATOMIC_RELAXED);
+	long long packed = __atomic_load_n(&Compress.live_packed_bytes, __ATOMIC_RELAXED);
+	double ratio = packed ? (double)raw / packed : 1.0;
+
+	return snprintf(buf, len, "compression:%s threshold:%zu live:%lld raw_bytes:%lld packed_bytes:%lld saved_bytes:%lld ratio:%.2f "
+		"packed_total:%llu skipped_total:%llu raw_bytes_total:%llu packed_bytes_total:%llu unpacked:%llu passthrough:%llu\n",
+		engines, Compress.threshold,
+		(long long)__atomic_load_n(&Compress.live, __ATOMIC_RELAXED), raw, packed, raw - packed, ratio,
+		(unsigned long long)Compress.packed, (unsigned long long)Compress.skipped,
+		(unsigned long long)Compress.raw_bytes, (unsigned long long)Compress.packed_bytes,
+		(unsigned long long)Compress.unpacked, (unsigned long long)Compress.passthrough);
+}
+
+#endif
+
@@ -0,0 +1,772 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "kvstore.h"
+
+
+// copy-on-write b+tree behind PSET PGET PDEL PMOD PCOUNT, after LMDB: one
+// tree for the whole server, a node never changes once a reader can see it.
+//
+//   - a write copies the nodes on the path from its leaf to the root, a
+//     split or an emptied child included, and publishes the new root with
+//     one release store. the writers take turns on the tree's mutex, there
+//     is one at a time as in LMDB, none of them waits for a reader.
+//   - a reader loads the root and descends, nothing it reads can change. a
+//     point read is an ebr visit, see kvstore_ebr.c.
+//   - every root is a snapshot: kvs_cow_snapshot() keeps the current one
+//     and its version for as long as it is held, a RANGE or a BACKUP walks
+//     it while the writers go on.
+//   - what a write no longer points to, the old path and the keys and
+//     values it dropped, is garbage of that version. it stays until no
+//     snapshot of an older version is held and then goes to
+//     kvs_ebr_retire() for the point readers.
+//   - a node is owned by the versions from the one that made it to the one
+//     that copied it, a heap key or value in the same way: the copy takes
+//     the pointer, not the bytes.
+//   - deletes drop emptied nodes and the root over a single child, there is
+//     no merge of nodes that are merely underfull.
+
+#if ENABLE_COW_KVENGINE
+
+#define COW_FANOUT				16		// entries per node
+#define COW_MAX_HEIGHT			16
+#define COW_TXN_BLOCKS			(COW_MAX_HEIGHT * 4)	// made or dropped by one write, at most
+#define COW_MAX_SNAPSHOTS		64
+#define COW_GARBAGE_MIN			256
+
+
+typedef struct cow_node_s {
+	int leaf;
+	int n;
+	// inner nodes: children[i] holds the keys from keys[i] on, keys[0] is
+	// never set
+	kvs_key_t keys[COW_FANOUT];
+	union {
+		kvs_value_t values[COW_FANOUT];
+		struct cow_node_s *children[COW_FANOUT];
+	};
+} cow_node_t;
+
+// a node, or the heap copy of a key or value
+typedef struct cow_block_s {
+	void *ptr;
+	int tag;
+	unsigned long txn;			// garbage: the first version without it
+} cow_block_t;
+
+typedef struct cow_snapshot_s {
+	cow_node_t *root;
+	unsigned long txn;			// 0: the slot is free
+} cow_snapshot_t;
+
+struct cow_s {
+	cow_node_t *root;			// of version txn, published with a release store
+	unsigned long txn;
+	int count;
+	int height;
+	pthread_mutex_t lock;		// the writer, the snapshots and the garbage
+	cow_snapshot_t snapshots[COW_MAX_SNAPSHOTS];
+	int nsnapshots;
+	cow_block_t *garbage;		// by txn
+	int ngarbage;
+	int size;
+	size_t garbage_bytes;
+	unsigned long copied;		// nodes written
+};
+
+cow_t Cow;
+
+// one write: what it made, freed again if it fails, and what the version it
+// makes no longer has
+typedef struct cow_txn_s {
+	cow_block_t fresh[COW_TXN_BLOCKS];
+	int nfresh;
+	cow_block_t dropped[COW_TXN_BLOCKS];
+	int ndropped;
+	int added;					// keys, 1 or -1
+	const char *stored;			// the value the version gains and the one it
+	const char *replaced;		// loses, for STATS COMPRESSION
+} cow_txn_t;
+
+// a node being rebuilt, with room for one entry over the fanout
+typedef struct cow_work_s {
+	int leaf;
+	int n;
+	kvs_key_t keys[COW_FANOUT + 1];
+	kvs_value_t values[COW_FANOUT + 1];
+	cow_node_t *children[COW_FANOUT + 1];
+} cow_work_t;
+
+
+static void _cow_fresh(cow_txn_t *txn, void *ptr, int tag) {
+	if (!txn) return ;
+
+	txn->fresh[txn->nfresh].ptr = ptr;
+	txn->fresh[txn->nfresh].tag = tag;
+	txn->nfresh ++;
+}
+
+static void _cow_drop(cow_txn_t *txn, void *ptr, int tag) {
+	txn->dropped[txn->ndropped].ptr = ptr;
+	txn->dropped[txn->ndropped].tag = tag;
+	txn->ndropped ++;
+}
+
+// an inline string goes with its node, a heap one is a block of its own
+static int _cow_str(cow_txn_t *txn, char *s, size_t size, const char *str, int tag) {
+
+	if (kvs_str_set(s, size, str, tag) != 0) return -1;
+	if (s[size - 1] == 1) _cow_fresh(txn, *(char **)s, tag);
+
+	return 0;
+}
+
+static void _cow_drop_str(cow_txn_t *txn, char *s, size_t size, int tag) {
+	if (s[size - 1] == 1) _cow_drop(txn, *(char **)s, tag);
+}
+
+static cow_node_t *_cow_node_new(cow_t *tree, cow_txn_t *txn, int leaf) {
+
+	cow_node_t *node = (cow_node_t *)kvstore_malloc_tag(sizeof(cow_node_t), KVS_MEM_NODE);
+	if (!node) return NULL;
+
+	memset(node, 0, sizeof(cow_node_t));
+	node->leaf = leaf;
+
+	_cow_fresh(txn, node, KVS_MEM_NODE);
+	__atomic_add_fetch(&tree->copied, 1, __ATOMIC_RELAXED);
+
+	return node;
+}
+
+// the subtree with its keys and values, no version holds any of it
+static void _cow_node_free(cow_node_t *node) {
+
+	int i = 0;
+	for (i = 0;i < node->n;i ++) {
+		if (node->leaf) {
+			kvs_key_free(&node->keys[i]);
+			kvs_value_free(&node->values[i]);
+		} else {
+			if (i) kvs_key_free(&node->keys[i]);
+			_cow_node_free(node->children[i]);
+		}
+	}
+
+	kvstore_free_tag(node, KVS_MEM_NODE);
+}
+
+
+// --- reads, on nodes that do not change ---
+
+// the first i with key <= keys[i] of a leaf, n when there is none, found
+// set when they are equal. key NULL: before every key
+static int _cow_search(cow_node_t *node, const char *key, int *found) {
+
+	*found = 0;
+	if (!key) return 0;
+
+	int lo = 0, hi = node->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		int cmp = strcmp(key, kvs_key_get(&node->keys[mid]));
+		if (cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+		if (cmp < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// the child of an inner node that holds key
+static int _cow_child(cow_node_t *node, const char *key) {
+
+	if (!key) return 0;
+
+	int lo = 1, hi = node->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (strcmp(key, kvs_key_get(&node->keys[mid])) < 0) hi = mid;
+		else lo = mid + 1;
+	}
+
+	return lo - 1;
+}
+
+static cow_node_t *_cow_leaf(cow_node_t *node, const char *key) {
+	while (!node->leaf) node = node->children[_cow_child(node, key)];
+	return node;
+}
+
+// in order from the first key >= start, start NULL: from the smallest
+static int _cow_walk(cow_node_t *node, const char *start, SCAN_CALLBACK cb, void *arg) {
+
+	int found = 0;
+	int i = node->leaf ? _cow_search(node, start, &found) : _cow_child(node, start);
+
+	for (;i < node->n;i ++) {
+		if (node->leaf) {
+			if (cb(kvs_key_get(&node->keys[i]), kvs_value_get(&node->values[i]), arg)) return 1;
+		} else {
+			if (_cow_walk(node->children[i], start, cb, arg)) return 1;
+			start = NULL; // the children right of the first are all above it
+		}
+	}
+
+	return 0;
+}
+
+
+// --- writes, under the tree's mutex ---
+
+static void _cow_load(cow_work_t *w, cow_node_t *node) {
+
+	w->leaf = node->leaf;
+	w->n = node->n;
+
+	memcpy(w->keys, node->keys, sizeof(kvs_key_t) * node->n);
+	if (node->leaf) memcpy(w->values, node->values, sizeof(kvs_value_t) * node->n);
+	else memcpy(w->children, node->children, sizeof(cow_node_t *) * node->n);
+}
+
+static cow_node_t *_cow_fill(cow_t *tree, cow_txn_t *txn, cow_work_t *w, int from, int to) {
+
+	cow_node_t *node = _cow_node_new(tree, txn, w->leaf);
+	if (!node) return NULL;
+
+	node->n = to - from;
+	memcpy(node->keys, &w->keys[from], sizeof(kvs_key_t) * node->n);
+	if (w->leaf) memcpy(node->values, &w->values[from], sizeof(kvs_value_t) * node->n);
+	else memcpy(node->children, &w->children[from], sizeof(cow_node_t *) * node->n);
+
+	return node;
+}
+
+// w as one new node, or as two when it overflowed: *right, and sep, the key
+// the parent tells them apart by. -1: out of memory
+static int _cow_store(cow_t *tree, cow_txn_t *txn, cow_work_t *w, cow_node_t **out, cow_node_t **right, kvs_key_t *sep) {
+
+	*right = NULL;
+
+	if (w->n <= COW_FANOUT) {
+		*out = _cow_fill(tree, txn, w, 0, w->n);
+		return *out ? 0 : -1;
+	}
+
+	int m = w->n / 2;
+	*out = _cow_fill(tree, txn, w, 0, m);
+	*right = _cow_fill(tree, txn, w, m, w->n);
+	if (!*out || !*right) return -1;
+
+	// a leaf keeps its first key and the parent gets a copy, an inner node
+	// hands keys[m] up, its slot 0 is never set
+	if (w->leaf) return _cow_str(txn, sep->s, KVS_KEY_INLINE, kvs_key_get(&w->keys[m]), KVS_MEM_KEY);
+
+	*sep = w->keys[m];
+	memset(&(*right)->keys[0], 0, sizeof(kvs_key_t));
+
+	return 0;
+}
+
+// node copied with key at value into *out, and *right at sep when it split.
+// 0: done, 1: no such key and must_exist, -1: out of memory
+static int _cow_insert(cow_t *tree, cow_txn_t *txn, cow_node_t *node, const char *key, const char *value,
+	int must_exist, cow_node_t **out, cow_node_t **right, kvs_key_t *sep) {
+
+	cow_work_t w;
+
+	if (node->leaf) {
+		int found = 0;
+		int i = _cow_search(node, key, &found);
+		if (!found && must_exist) return 1;
+
+		_cow_load(&w, node);
+
+		kvs_value_t v;
+		if (_cow_str(txn, v.s, KVS_VALUE_INLINE, value, KVS_MEM_VALUE) != 0) return -1;
+
+		txn->stored = value;
+		if (found) {
+			txn->replaced = kvs_value_get(&node->values[i]);
+			_cow_drop_str(txn, w.values[i].s, KVS_VALUE_INLINE, KVS_MEM_VALUE);
+		} else {
+			kvs_key_t k;
+			if (_cow_str(txn, k.s, KVS_KEY_INLINE, key, KVS_MEM_KEY) != 0) return -1;
+
+			memmove(&w.keys[i + 1], &w.keys[i], sizeof(kvs_key_t) * (w.n - i));
+			memmove(&w.values[i + 1], &w.values[i], sizeof(kvs_value_t) * (w.n - i));
+			w.keys[i] = k;
+			w.n ++;
+			txn->added = 1;
+		}
+		w.values[i] = v;
+	} else {
+		int i = _cow_child(node, key);
+
+		cow_node_t *child = NULL, *split = NULL;
+		kvs_key_t up;
+		int res = _cow_insert(tree, txn, node->children[i], key, value, must_exist, &child, &split, &up);
+		if (res != 0) return res;
+
+		_cow_load(&w, node);
+		w.children[i] = child;
+
+		if (split) {
+			memmove(&w.keys[i + 2], &w.keys[i + 1], sizeof(kvs_key_t) * (w.n - i - 1));
+			memmove(&w.children[i + 2], &w.children[i + 1], sizeof(cow_node_t *) * (w.n - i - 1));
+			w.keys[i + 1] = up;
+			w.children[i + 1] = split;
+			w.n ++;
+		}
+	}
+
+	_cow_drop(txn, node, KVS_MEM_NODE);
+	return _cow_store(tree, txn, &w, out, right, sep);
+}
+
+// node copied without key into *out, NULL when nothing is left of it.
+// 0: done, 1: no such key, -1: out of memory
+static int _cow_remove(cow_t *tree, cow_txn_t *txn, cow_node_t *node, const char *key, cow_node_t **out) {
+
+	cow_work_t w;
+
+	if (node->leaf) {
+		int found = 0;
+		int i = _cow_search(node, key, &found);
+		if (!found) return 1;
+
+		_cow_load(&w, node);
+		txn->replaced = kvs_value_get(&node->values[i]);
+		_cow_drop_str(txn, w.keys[i].s, KVS_KEY_INLINE, KVS_MEM_KEY);
+		_cow_drop_str(txn, w.values[i].s, KVS_VALUE_INLINE, KVS_MEM_VALUE);
+
+		memmove(&w.keys[i], &w.keys[i + 1], sizeof(kvs_key_t) * (w.n - i - 1));
+		memmove(&w.values[i], &w.values[i + 1], sizeof(kvs_value_t) * (w.n - i - 1));
+		w.n --;
+		txn->added = -1;
+	} else {
+		int i = _cow_child(node, key);
+
+		cow_node_t *child = NULL;
+		int res = _cow_remove(tree, txn, node->children[i], key, &child);
+		if (res != 0) return res;
+
+		_cow_load(&w, node);
+		w.children[i] = child;
+
+		// an emptied child goes with its key, the first one has none and
+		// takes the key of the next
+		if (!child && w.n > 1) {
+			int k = i ? i : 1;
+			_cow_drop_str(txn, w.keys[k].s, KVS_KEY_INLINE, KVS_MEM_KEY);
+
+			memmove(&w.keys[k], &w.keys[k + 1], sizeof(kvs_key_t) * (w.n - k - 1));
+			memmove(&w.children[i], &w.children[i + 1], sizeof(cow_node_t *) * (w.n - i - 1));
+			w.n --;
+		} else if (!child) {
+			w.n = 0;
+		}
+	}
+
+	_cow_drop(txn, node, KVS_MEM_NODE);
+
+	*out = NULL;
+	if (w.n == 0) return 0;
+
+	// one entry less, it fits
+	cow_node_t *right = NULL;
+	return _cow_store(tree, txn, &w, out, &right, NULL);
+}
+
+static int _cow_garbage_grow(cow_t *tree, int need) {
+
+	int size = tree->size ? tree->size : COW_GARBAGE_MIN;
+	while (size < need) size *= 2;
+	if (size == tree->size) return 0;
+
+	cow_block_t *garbage = (cow_block_t *)realloc(tree->garbage, sizeof(cow_block_t) * size);
+	if (!garbage) return -1;
+
+	tree->garbage = garbage;
+	tree->size = size;
+
+	return 0;
+}
+
+// the garbage no snapshot can reach any more, to the epochs of the point
+// readers, which may still be on an older path
+static void _cow_reclaim(cow_t *tree) {
+
+	unsigned long oldest = ULONG_MAX;
+
+	int i = 0;
+	for (i = 0;i < COW_MAX_SNAPSHOTS;i ++) {
+		unsigned long txn = tree->snapshots[i].txn;
+		if (txn && txn < oldest) oldest = txn;
+	}
+
+	int engine = kvs_mem_engine;
+	kvs_mem_engine = KVS_ENGINE_COW;
+
+	for (i = 0;i < tree->ngarbage && tree->garbage[i].txn <= oldest;i ++) {
+		tree->garbage_bytes -= kvstore_usable_size(tree->garbage[i].ptr);
+		kvs_ebr_retire(tree->garbage[i].ptr, tree->garbage[i].tag);
+	}
+
+	kvs_mem_engine = engine;
+
+	memmove(tree->garbage, &tree->garbage[i], sizeof(cow_block_t) * (tree->ngarbage - i));
+	tree->ngarbage -= i;
+}
+
+static int _cow_begin(cow_t *tree, cow_txn_t *txn) {
+
+	txn->nfresh = 0;
+	txn->ndropped = 0;
+	txn->added = 0;
+	txn->stored = NULL;
+	txn->replaced = NULL;
+
+	pthread_mutex_lock(&tree->lock);
+
+	// room for what the write drops before it makes anything
+	if (_cow_garbage_grow(tree, tree->ngarbage + COW_TXN_BLOCKS) != 0) {
+		pthread_mutex_unlock(&tree->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+// nothing the write made was published, no reader has seen it
+static void _cow_abort(cow_t *tree, cow_txn_t *txn) {
+
+	int i = 0;
+	for (i = 0;i < txn->nfresh;i ++) {
+		kvstore_free_tag(txn->fresh[i].ptr, txn->fresh[i].tag);
+	}
+
+	pthread_mutex_unlock(&tree->lock);
+}
+
+static void _cow_commit(cow_t *tree, cow_txn_t *txn, cow_node_t *root, int height) {
+
+	unsigned long version = tree->txn + 1;
+
+	int i = 0;
+	for (i = 0;i < txn->ndropped;i ++) {
+		cow_block_t *block = &tree->garbage[tree->ngarbage ++];
+		*block = txn->dropped[i];
+		block->txn = version;
+		tree->garbage_bytes += kvstore_usable_size(block->ptr);
+	}
+
+	// the replaced value is still whole, it is freed after an epoch at least
+	if (txn->replaced) kvs_compress_drop(txn->replaced);
+	if (txn->stored) kvs_compress_hold(txn->stored);
+
+	// the new nodes are whole before a reader can load the root
+	__atomic_store_n(&tree->root, root, __ATOMIC_RELEASE);
+	__atomic_store_n(&tree->txn, version, __ATOMIC_RELAXED);
+	__atomic_store_n(&tree->count, tree->count + txn->added, __ATOMIC_RELAXED);
+	tree->height = height;
+
+	_cow_reclaim(tree);
+
+	pthread_mutex_unlock(&tree->lock);
+}
+
+// 0: done, 1: no such key and must_exist, -1: out of memory
+static int _cow_write(cow_t *tree, char *key, char *value, int must_exist) {
+
+	cow_txn_t txn;
+	if (_cow_begin(tree, &txn) != 0) return -1;
+
+	int height = tree->height;
+	cow_node_t *root = NULL, *right = NULL;
+	kvs_key_t sep;
+
+	int res = _cow_insert(tree, &txn, tree->root, key, value, must_exist, &root, &right, &sep);
+	if (res == 0 && right) {
+		cow_node_t *top = height < COW_MAX_HEIGHT ? _cow_node_new(tree, &txn, 0) : NULL;
+		if (top) {
+			top->n = 2;
+			top->keys[1] = sep;
+			top->children[0] = root;
+			top->children[1] = right;
+			root = top;
+			height ++;
+		} else {
+			res = -1;
+		}
+	}
+
+	if (res != 0) {
+		_cow_abort(tree, &txn);
+		return res;
+	}
+
+	_cow_commit(tree, &txn, root, height);
+	return 0;
+}
+
+
+// --- API ---
+
+int kvstore_cow_create(cow_t *tree) {
+	if (!tree) return -1;
+
+	memset(tree, 0, sizeof(cow_t));
+	pthread_mutex_init(&tree->lock, NULL);
+
+	tree->root = _cow_node_new(tree, NULL, 1);
+	if (!tree->root) return -1;
+	tree->txn = 1;
+	tree->height = 1;
+
+	return 0;
+}
+
+// the current version and the garbage of the older ones. no reader left
+void kvstore_cow_destory(cow_t *tree) {
+	if (!tree || !tree->root) return ;
+
+	_cow_node_free(tree->root);
+
+	int i = 0;
+	for (i = 0;i < tree->ngarbage;i ++) {
+		kvstore_free_tag(tree->garbage[i].ptr, tree->garbage[i].tag);
+	}
+	free(tree->garbage);
+
+	tree->garbage = NULL;
+	tree->ngarbage = 0;
+	tree->size = 0;
+	tree->root = NULL;
+	tree->count = 0;
+
+	pthread_mutex_destroy(&tree->lock);
+}
+
+int kvs_cow_set(cow_t *tree, char *key, char *value) {
+	if (!tree || !key || !value) return -1;
+	return _cow_write(tree, key, value, 0);
+}
+
+// 0: the value copied into buf, 1: no such key
+int kvs_cow_get(cow_t *tree, char *key, char *buf, int len) {
+	if (!tree || !key || !buf) return -1;
+
+	kvs_ebr_enter();
+
+	cow_node_t *leaf = _cow_leaf(__atomic_load_n(&tree->root, __ATOMIC_ACQUIRE), key);
+
+	int found = 0;
+	int i = _cow_search(leaf, key, &found);
+	if (found) snprintf(buf, len, "%s", kvs_value_get(&leaf->values[i]));
+
+	kvs_ebr_exit();
+
+	return found ? 0 : 1;
+}
+
+// 0: done, 1: no such key
+int kvs_cow_modify(cow_t *tree, char *key, char *value) {
+	if (!tree || !key || !value) return -1;
+	return _cow_write(tree, key, value, 1);
+}
+
+// 0: done, 1: no such key
+int kvs_cow_delete(cow_t *tree, char *key) {
+	if (!tree || !key) return -1;
+
+	cow_txn_t txn;
+	if (_cow_begin(tree, &txn) != 0) return -1;
+
+	int height = tree->height;
+	cow_node_t *root = NULL;
+
+	int res = _cow_remove(tree, &txn, tree->root, key, &root);
+	if (res == 0 && !root) {
+		root = _cow_node_new(tree, &txn, 1);
+		height = 1;
+		if (!root) res = -1;
+	}
+
+	if (res != 0) {
+		_cow_abort(tree, &txn);
+		return res;
+	}
+
+	// an inner root over a single child gives way to it
+	while (!root->leaf && root->n == 1) {
+		_cow_drop(&txn, root, KVS_MEM_NODE);
+		root = root->children[0];
+		height --;
+	}
+
+	_cow_commit(tree, &txn, root, height);
+	return 0;
+}
+
+int kvs_cow_count(cow_t *tree) {
+	return tree ? __atomic_load_n(&tree->count, __ATOMIC_RELAXED) : 0;
+}
+
+// the current version, kept until kvs_cow_release(). -1: all taken
+int kvs_cow_snapshot(cow_t *tree) {
+	if (!tree) return -1;
+
+	pthread_mutex_lock(&tree->lock);
+
+	int snap = 0;
+	for (snap = 0;snap < COW_MAX_SNAPSHOTS;snap ++) {
+		if (tree->snapshots[snap].txn == 0) break;
+	}
+
+	if (snap < COW_MAX_SNAPSHOTS) {
+		tree->snapshots[snap].root = tree->root;
+		tree->snapshots[snap].txn = tree->txn;
+		tree->nsnapshots ++;
+	}
+
+	pthread_mutex_unlock(&tree->lock);
+
+	return snap < COW_MAX_SNAPSHOTS ? snap : -1;
+}
+
+void kvs_cow_release(cow_t *tree, int snap) {
+	if (!tree || snap < 0 || snap >= COW_MAX_SNAPSHOTS) return ;
+
+	pthread_mutex_lock(&tree->lock);
+
+	if (tree->snapshots[snap].txn) {
+		tree->snapshots[snap].txn = 0;
+		tree->snapshots[snap].root = NULL;
+		tree->nsnapshots --;
+		_cow_reclaim(tree);
+	}
+
+	pthread_mutex_unlock(&tree->lock);
+
+	// what was retired here, a compute thread has no event loop to pass it on
+	kvs_ebr_quiescent();
+}
+
+// no lock and no visit, nothing of a held snapshot goes away
+int kvs_cow_snapshot_scan(cow_t *tree, int snap, char *start, SCAN_CALLBACK cb, void *arg) {
+	if (!tree || snap < 0 || snap >= COW_MAX_SNAPSHOTS || !tree->snapshots[snap].txn || !cb) return -1;
+	return _cow_walk(tree->snapshots[snap].root, start, cb, arg);
+}
+
+// one walk over the version current when it starts
+int kvs_cow_scan(cow_t *tree, char *start, SCAN_CALLBACK cb, void *arg) {
+
+	int snap = kvs_cow_snapshot(tree);
+	if (snap < 0) return -1;
+
+	int res = kvs_cow_snapshot_scan(tree, snap, start, cb, arg);
+	kvs_cow_release(tree, snap);
+
+	return res;
+}
+
+typedef struct cow_backup_s {
+	FILE *fp;
+	long keys;
+	int error;
+} cow_backup_t;
+
+static int _cow_backup_key(char *key, char *value, void *arg) {
+
+	cow_backup_t *backup = (cow_backup_t *)arg;
+
+	if (fprintf(backup->fp, "PSET %s %s\n", key, value) < 0) {
+		backup->error = 1;
+		return 1;
+	}
+	backup->keys ++;
+
+	return 0;
+}
+
+// the tree as it is when the call starts into path, one PSET command per
+// line in key order, the writers go on meanwhile. written to path.tmp and
+// renamed over path. the keys written, -1: nothing was
+long kvs_cow_backup(cow_t *tree, const char *path) {
+	if (!tree || !path) return -1;
+
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+
+	cow_backup_t backup;
+	memset(&backup, 0, sizeof(backup));
+
+	backup.fp = fopen(tmp, "w");
+	if (!backup.fp) return -1;
+
+	int snap = kvs_cow_snapshot(tree);
+	if (snap < 0) backup.error = 1;
+	else {
+		kvs_cow_snapshot_scan(tree, snap, NULL, _cow_backup_key, &backup);
+		kvs_cow_release(tree, snap);
+	}
+
+	if (fclose(backup.fp) != 0) backup.error = 1;
+	if (backup.error || rename(tmp, path) != 0) {
+		remove(tmp);
+		return -1;
+	}
+
+	return backup.keys;
+}
+
+// bytes the key costs: its share of the leaf and its heap key and value.
+// -1: no such key
+long kvs_cow_usage(cow_t *tree, char *key) {
+	if (!tree || !key) return -1;
+
+	kvs_ebr_enter();
+
+	cow_node_t *leaf = _cow_leaf(__atomic_load_n(&tree->root, __ATOMIC_ACQUIRE), key);
+
+	int found = 0;
+	int i = _cow_search(leaf, key, &found);
+
+	long usage = -1;
+	if (found) {
+		usage = kvstore_usable_size(leaf) / leaf->n + kvs_key_usage(&leaf->keys[i])
+			+ kvs_value_usage(&leaf->values[i]);
+	}
+
+	kvs_ebr_exit();
+
+	return usage;
+}
+
+int kvs_cow_stats(cow_t *tree, char *buf, int len) {
+
+	pthread_mutex_lock(&tree->lock);
+
+	int n = snprintf(buf, len, "cow txn:%lu keys:%d height:%d snapshots:%d garbage:%d garbage_bytes:%zu copied:%lu\n",
+		tree->txn, tree->count, tree->height, tree->nsnapshots, tree->ngarbage, tree->garbage_bytes,
+		__atomic_load_n(&tree->copied, __ATOMIC_RELAXED));
+
+	pthread_mutex_unlock(&tree->lock);
+
+	return n;
+}
+
+#endif
@@ -0,0 +1,535 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "kvstore.h"
+
+
+// bucketized cuckoo hash: 4-way buckets, two candidate buckets per key.
+// a lookup probes at most two buckets (one cache line each) plus a tiny stash,
+// so reads are O(1) in the worst case, unlike the chain walk of kvstore_hash.c
+
+#define CUCKOO_SLOTS			4
+#define CUCKOO_INIT_BUCKETS		16384	// power of 2
+#define CUCKOO_MAX_KICKS		128
+#define CUCKOO_STASH_SIZE		8
+
+
+// key and value live in one allocation behind the access clock:
+// [uint32 lru]"key\0value\0", so the clock moves with the entry on a kick
+typedef struct cuckoo_bucket_s {
+	uint32_t tags[CUCKOO_SLOTS];	// 0: empty slot
+	char *entries[CUCKOO_SLOTS];
+} __attribute__((aligned(64))) cuckoo_bucket_t;
+
+typedef struct cuckoo_stash_s {
+	uint32_t tag;
+	uint32_t idx;	// primary bucket, the alternate is derived from the tag
+	char *entry;
+} cuckoo_stash_t;
+
+typedef struct cuckoo_s {
+
+	cuckoo_bucket_t *buckets;
+	uint32_t mask;
+
+	cuckoo_stash_t stash[CUCKOO_STASH_SIZE];
+	int stash_count;
+
+	int count;
+
+} cuckoo_t;
+
+
+
+
+// FNV-1a 64, low half picks the primary bucket, high half is the tag
+static uint64_t _cuckoo_hash(const char *key) {
+
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*key) {
+		hash ^= (uint8_t)*key ++;
+		hash *= 1099511628211ULL;
+	}
+
+	// finalizer, spreads the bits so both halves are usable
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+static inline uint32_t _cuckoo_tag(uint64_t hash) {
+	uint32_t tag = (uint32_t)(hash >> 32);
+	return tag ? tag : 1;
+}
+
+// second hash function, symmetric: alt(alt(i)) == i
+static inline uint32_t _cuckoo_alt(cuckoo_t *ck, uint32_t idx, uint32_t tag) {
+	return (idx ^ (tag * 0x5bd1e995U)) & ck->mask;
+}
+
+static inline char *_cuckoo_key(char *entry) {
+	return entry + sizeof(uint32_t);
+}
+
+static inline char *_cuckoo_value(char *entry) {
+	char *key = _cuckoo_key(entry);
+	return key + strlen(key) + 1;
+}
+
+static inline uint32_t *_cuckoo_lru(char *entry) {
+	return (uint32_t *)entry;
+}
+
+static char *_cuckoo_create_entry(char *key, char *value) {
+
+	size_t klen = strlen(key);
+	size_t vlen = strlen(value);
+
+	char *entry = kvstore_malloc_tag(sizeof(uint32_t) + klen + vlen + 2, KVS_MEM_NODE);
+	if (!entry) return NULL;
+
+	*_cuckoo_lru(entry) = kvs_lru_new();
+	memcpy(_cuckoo_key(entry), key, klen + 1);
+	memcpy(_cuckoo_key(entry) + klen + 1, value, vlen + 1);
+
+	return entry;
+}
+
+// an entry the table lets go of
+static void _cuckoo_free_entry(char *entry) {
+
+	kvs_compress_drop(_cuckoo_value(entry));
+	kvstore_free_tag(entry, KVS_MEM_NODE);
+}
+
+
+static int _cuckoo_alloc_buckets(cuckoo_t *ck, uint32_t nbuckets) {
+
+	ck->buckets = kvstore_malloc(sizeof(cuckoo_bucket_t) * nbuckets);
+	if (!ck->buckets) return -1;
+	memset(ck->buckets, 0, sizeof(cuckoo_bucket_t) * nbuckets);
+
+	ck->mask = nbuckets - 1;
+
+	return 0;
+}
+
+
+// returns the slot holding the key, NULL if no exist
+static char **_cuckoo_find(cuckoo_t *ck, char *key) {
+
+	uint64_t hash = _cuckoo_hash(key);
+	uint32_t tag = _cuckoo_tag(hash);
+	uint32_t i1 = (uint32_t)hash & ck->mask;
+	uint32_t i2 = _cuckoo_alt(ck, i1, tag);
+
+	cuckoo_bucket_t *b = &ck->buckets[i1];
+	int i = 0;
+	for (i = 0;i < CUCKOO_SLOTS;i ++) {
+		if (b->tags[i] == tag && strcmp(_cuckoo_key(b->entries[i]), key) == 0) {
+			return &b->entries[i];
+		}
+	}
+
+	b = &ck->buckets[i2];
+	for (i = 0;i < CUCKOO_SLOTS;i ++) {
+		if (b->tags[i] == tag && strcmp(_cuckoo_key(b->entries[i]), key) == 0) {
+			return &b->entries[i];
+		}
+	}
+
+	for (i = 0;i < ck->stash_count;i ++) {
+		if (ck->stash[i].tag == tag && strcmp(_cuckoo_key(ck->stash[i].entry), key) == 0) {
+			return &ck->stash[i].entry;
+		}
+	}
+
+	return NULL;
+}
+
+static int _cuckoo_try_bucket(cuckoo_bucket_t *b, uint32_t tag, char *entry) {
+
+	int i = 0;
+	for (i = 0;i < CUCKOO_SLOTS;i ++) {
+		if (b->tags[i] == 0) {
+			b->tags[i] = tag;
+			b->entries[i] = entry;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// place an entry that is known not to be in the table.
+// 0: placed, -1: stash full, the kicks are undone and *homeless is the entry
+static int _cuckoo_place(cuckoo_t *ck, uint32_t idx, uint32_t tag, char *entry, char **homeless) {
+
+	if (_cuckoo_try_bucket(&ck->buckets[idx], tag, entry) == 0) return 0;
+
+	idx = _cuckoo_alt(ck, idx, tag);
+	if (_cuckoo_try_bucket(&ck->buckets[idx], tag, entry) == 0) return 0;
+
+	// bounded random walk: evict a victim, move it to its other bucket
+	uint32_t path[CUCKOO_MAX_KICKS];
+	int slots[CUCKOO_MAX_KICKS];
+	int kick = 0;
+	for (kick = 0;kick < CUCKOO_MAX_KICKS;kick ++) {
+
+		cuckoo_bucket_t *b = &ck->buckets[idx];
+		int victim = kvs_random() & (CUCKOO_SLOTS - 1);
+		path[kick] = idx;
+		slots[kick] = victim;
+
+		uint32_t vtag = b->tags[victim];
+		char *ventry = b->entries[victim];
+		b->tags[victim] = tag;
+		b->entries[victim] = entry;
+
+		tag = vtag;
+		entry = ventry;
+		idx = _cuckoo_alt(ck, idx, tag);
+
+		if (_cuckoo_try_bucket(&ck->buckets[idx], tag, entry) == 0) return 0;
+	}
+
+	if (ck->stash_count < CUCKOO_STASH_SIZE) {
+		ck->stash[ck->stash_count].tag = tag;
+		ck->stash[ck->stash_count].idx = idx;
+		ck->stash[ck->stash_count].entry = entry;
+		ck->stash_count ++;
+		return 0;
+	}
+
+	// walk back: every victim returns to its slot, the caller keeps its entry
+	while (kick -- > 0) {
+		cuckoo_bucket_t *b = &ck->buckets[path[kick]];
+
+		uint32_t vtag = b->tags[slots[kick]];
+		char *ventry = b->entries[slots[kick]];
+		b->tags[slots[kick]] = tag;
+		b->entries[slots[kick]] = entry;
+
+		tag = vtag;
+		entry = ventry;
+	}
+
+	*homeless = entry;
+
+	return -1;
+}
+
+
+static int _cuckoo_reinsert(cuckoo_t *ck, char *entry, char **homeless) {
+
+	uint64_t hash = _cuckoo_hash(_cuckoo_key(entry));
+	return _cuckoo_place(ck, (uint32_t)hash & ck->mask, _cuckoo_tag(hash), entry, homeless);
+}
+
+// double the table and rehash every entry, stash and the homeless one included
+static int _cuckoo_grow(cuckoo_t *ck, char *homeless) {
+
+	cuckoo_bucket_t *old = ck->buckets;
+	uint32_t old_buckets = ck->mask + 1;
+
+	cuckoo_stash_t stash[CUCKOO_STASH_SIZE];
+	int stash_count = ck->stash_count;
+	memcpy(stash, ck->stash, sizeof(stash));
+
+	uint32_t nbuckets = old_buckets << 1;
+	while (1) {
+
+		if (_cuckoo_alloc_buckets(ck, nbuckets) != 0) {
+			// a failed pass may have stashed in the new table
+			ck->buckets = old;
+			ck->mask = old_buckets - 1;
+			memcpy(ck->stash, stash, sizeof(stash));
+			ck->stash_count = stash_count;
+			return -1;
+		}
+		ck->stash_count = 0;
+
+		char *left = NULL;
+		int failed = 0;
+		uint32_t i = 0;
+		int j = 0;
+		for (i = 0;i < old_buckets && !failed;i ++) {
+			for (j = 0;j < CUCKOO_SLOTS;j ++) {
+				if (old[i].tags[j] == 0) continue;
+				if (_cuckoo_reinsert(ck, old[i].entries[j], &left) < 0) {
+					failed = 1;
+					break;
+				}
+			}
+		}
+		for (j = 0;j < stash_count && !failed;j ++) {
+			if (_cuckoo_reinsert(ck, stash[j].entry, &left) < 0) {
+				failed = 1;
+			}
+		}
+		if (!failed && _cuckoo_reinsert(ck, homeless, &left) < 0) {
+			failed = 1;
+		}
+
+		if (!failed) break;
+
+		// very unlikely, retry with a bigger table
+		kvstore_free(ck->buckets);
+		nbuckets <<= 1;
+	}
+
+	kvstore_free(old);
+
+	return 0;
+}
+
+// a freed bucket slot may give a stashed entry its home back
+static void _cuckoo_unstash(cuckoo_t *ck, uint32_t idx) {
+
+	int i = 0;
+	for (i = 0;i < ck->stash_count;i ++) {
+		cuckoo_stash_t *st = &ck->stash[i];
+		if (st->idx != idx && _cuckoo_alt(ck, st->idx, st->tag) != idx) continue;
+
+		if (_cuckoo_try_bucket(&ck->buckets[idx], st->tag, st->entry) == 0) {
+			ck->stash[i] = ck->stash[ck->stash_count - 1];
+			ck->stash_count --;
+		}
+		return ;
+	}
+}
+
+
+int init_cuckoo(cuckoo_t *ck) {
+
+	if (!ck) return -1;
+
+	memset(ck, 0, sizeof(cuckoo_t));
+
+	return _cuckoo_alloc_buckets(ck, CUCKOO_INIT_BUCKETS);
+}
+
+void dest_cuckoo(cuckoo_t *ck) {
+
+	if (!ck || !ck->buckets) return;
+
+	uint32_t i = 0;
+	int j = 0;
+	for (i = 0;i <= ck->mask;i ++) {
+		for (j = 0;j < CUCKOO_SLOTS;j ++) {
+			if (ck->buckets[i].tags[j]) {
+				_cuckoo_free_entry(ck->buckets[i].entries[j]);
+			}
+		}
+	}
+	for (j = 0;j < ck->stash_count;j ++) {
+		_cuckoo_free_entry(ck->stash[j].entry);
+	}
+
+	kvstore_free(ck->buckets);
+	ck->buckets = NULL;
+	ck->count = 0;
+}
+
+
+int put_kv_cuckoo(cuckoo_t *ck, char *key, char *value) {
+
+	if (!ck || !key || !value) return -1;
+
+	if (_cuckoo_find(ck, key)) return 1; // exist
+
+	char *entry = _cuckoo_create_entry(key, value);
+	if (!entry) return -1;
+
+	char *homeless = NULL;
+	if (_cuckoo_reinsert(ck, entry, &homeless) < 0) {
+		if (_cuckoo_grow(ck, homeless) != 0) {
+			// out of memory, the kicks were undone: the new entry is the homeless one
+			kvstore_free_tag(homeless, KVS_MEM_NODE);
+			return -1;
+		}
+	}
+
+	kvs_compress_hold(value);
+	ck->count ++;
+
+	return 0;
+}
+
+char *get_kv_cuckoo(cuckoo_t *ck, char *key) {
+
+	if (!ck || !key) return NULL;
+
+	char **slot = _cuckoo_find(ck, key);
+	if (!slot) return NULL;
+
+	*_cuckoo_lru(*slot) = kvs_lru_touch(*_cuckoo_lru(*slot));
+	return _cuckoo_value(*slot);
+}
+
+int delete_kv_cuckoo(cuckoo_t *ck, char *key) {
+
+	if (!ck || !key) return -1;
+
+	char **slot = _cuckoo_find(ck, key);
+	if (!slot) return 1; // no exist
+
+	_cuckoo_free_entry(*slot);
+
+	if (slot >= &ck->stash[0].entry && slot <= &ck->stash[CUCKOO_STASH_SIZE - 1].entry) {
+		int i = (int)(((char *)slot - (char *)&ck->stash[0].entry) / sizeof(cuckoo_stash_t));
+		ck->stash[i] = ck->stash[ck->stash_count - 1];
+		ck->stash_count --;
+	} else {
+		uint32_t idx = (uint32_t)(((char *)slot - (char *)ck->buckets) / sizeof(cuckoo_bucket_t));
+		cuckoo_bucket_t *b = &ck->buckets[idx];
+		int i = (int)(slot - b->entries);
+		b->tags[i] = 0;
+		b->entries[i] = NULL;
+
+		if (ck->stash_count) _cuckoo_unstash(ck, idx);
+	}
+
+	ck->count --;
+
+	return 0;
+}
+
+int modify_kv_cuckoo(cuckoo_t *ck, char *key, char *value) {
+
+	if (!ck || !key || !value) return -1;
+
+	char **slot = _cuckoo_find(ck, key);
+	if (!slot) return 1; // no exist
+
+	char *entry = _cuckoo_create_entry(key, value);
+	if (!entry) return -1;
+
+	*_cuckoo_lru(entry) = kvs_lru_touch(*_cuckoo_lru(*slot));
+	_cuckoo_free_entry(*slot);
+	*slot = entry;
+	kvs_compress_hold(value);
+
+	return 0;
+}
+
+
+
+// 5 + 2
+
+int kvstore_cuckoo_create(cuckoo_t *ck) {
+
+	return init_cuckoo(ck);
+
+}
+
+void kvstore_cuckoo_destory(cuckoo_t *ck) {
+
+	return dest_cuckoo(ck);
+
+}
+
+// heap allocated cuckoo table, one per shard
+cuckoo_t *kvstore_cuckoo_new(void) {
+
+	cuckoo_t *ck = (cuckoo_t *)kvstore_malloc(sizeof(cuckoo_t));
+	if (!ck) return NULL;
+
+	if (kvstore_cuckoo_create(ck) != 0) {
+		kvstore_free(ck);
+		return NULL;
+	}
+	return ck;
+}
+
+void kvstore_cuckoo_free(cuckoo_t *ck) {
+
+	if (!ck) return ;
+
+	kvstore_cuckoo_destory(ck);
+	kvstore_free(ck);
+}
+
+int kvs_cuckoo_set(cuckoo_t *ck, char *key, char *value) {
+
+	return put_kv_cuckoo(ck, key, value);
+
+}
+
+char *kvs_cuckoo_get(cuckoo_t *ck, char *key) {
+
+	return get_kv_cuckoo(ck, key);
+
+}
+
+int kvs_cuckoo_delete(cuckoo_t *ck, char *key) {
+
+	return delete_kv_cuckoo(ck, key);
+
+}
+
+int kvs_cuckoo_modify(cuckoo_t *ck, char *key, char *value) {
+
+	return modify_kv_cuckoo(ck, key, value);
+
+}
+
+int kvs_cuckoo_count(cuckoo_t *ck) {
+
+	return ck ? ck->count : -1;
+
+}
+
+// bytes the key costs: its entry, lru, key and value in one block.
+// -1: no such key
+long kvs_cuckoo_usage(cuckoo_t *ck, char *key) {
+
+	if (!ck || !key) return -1;
+
+	char **slot = _cuckoo_find(ck, key);
+	if (!slot) return -1;
+
+	return kvstore_usable_size(*slot);
+}
+
+// random key for eviction sampling: first occupied slot from a random bucket
+int kvs_cuckoo_sample(cuckoo_t *ck, char **key, unsigned int *lru) {
+
+	if (!ck || ck->count == 0) return -1;
+
+	uint32_t nbuckets = ck->mask + 1;
+	uint32_t idx = kvs_random() & ck->mask;
+	int start = kvs_random() % CUCKOO_SLOTS;
+
+	uint32_t i = 0;
+	for (i = 0;i < nbuckets;i ++) {
+		cuckoo_bucket_t *b = &ck->buckets[(idx + i) & ck->mask];
+		int j = 0;
+		for (j = 0;j < CUCKOO_SLOTS;j ++) {
+			char *entry = b->entries[(start + j) % CUCKOO_SLOTS];
+			if (b->tags[(start + j) % CUCKOO_SLOTS] == 0) continue;
+
+			*key = _cuckoo_key(entry);
+			*lru = *_cuckoo_lru(entry);
+			return 0;
+		}
+	}
+
+	if (ck->stash_count) {
+		char *entry = ck->stash[kvs_random() % ck->stash_count].entry;
+		*key = _cuckoo_key(entry);
+		*lru = *_cuckoo_lru(entry);
+		return 0;
+	}
+
+	return -1;
+}
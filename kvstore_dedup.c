@@ -0,0 +1,294 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "kvstore.h"
+
+
+// content addressed interning of values, CONFIG SET dedup yes. a heap value
+// (too long to be inline in the node) of at most dedup-max-size bytes is
+// looked up in a side table of value -> (refcount, bytes); an equal value
+// already stored by any key or engine is shared instead of copied. the node
+// tags the pointer KVS_STR_SHARED so kvs_str_free() drops a reference
+// instead of freeing.
+//
+// shared values are never written in place: MOD releases the old value and
+// interns the new one, which is the copy on write. they are charged to the
+// "other" engine, the last key to let go may live in a different engine than
+// the first. defrag leaves them alone, every node sharing one would need its
+// pointer swapped.
+//
+// the lsm worker releases flushed memtables on its own thread, so the table
+// takes a mutex. one lock per SET of a long value, next to a strlen and a
+// hash of the same bytes.
+
+#if ENABLE_VALUE_DEDUP
+
+#define DEDUP_MAX_SIZE			256		// default, CONFIG SET dedup-max-size
+#define DEDUP_MIN_BUCKETS		1024
+
+
+typedef struct dedup_entry_s {
+	struct dedup_entry_s *next;
+	uint64_t hash;
+	uint32_t refcount;
+	uint32_t len;
+	char data[];
+} dedup_entry_t;
+
+typedef struct kvs_dedup_s {
+
+	int enabled;
+	size_t max_size;
+
+	pthread_mutex_t lock;
+	dedup_entry_t **buckets;
+	size_t nbuckets;					// power of 2
+
+	uint64_t entries;					// distinct values
+	uint64_t refs;						// values stored, shared or not
+	uint64_t unique_bytes;				// one copy of each
+	uint64_t logical_bytes;				// what the keys would hold unshared
+	uint64_t interned;					// lookups that added a value
+	uint64_t shared;					// lookups that found one
+
+} kvs_dedup_t;
+
+static kvs_dedup_t Dedup = {
+	.max_size = DEDUP_MAX_SIZE,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static uint64_t _dedup_hash(const char *str, size_t len) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	size_t i = 0;
+	for (i = 0;i < len;i ++) {
+		hash ^= (uint8_t)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// table memory is shared like the values, charged to "other"
+static void *_dedup_malloc(size_t size, int tag) {
+
+	int engine = kvs_mem_engine;
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+	void *ptr = kvstore_malloc_tag(size, tag);
+	kvs_mem_engine = engine;
+
+	return ptr;
+}
+
+static void _dedup_free(void *ptr, int tag) {
+
+	int engine = kvs_mem_engine;
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+	kvstore_free_tag(ptr, tag);
+	kvs_mem_engine = engine;
+}
+
+// the last reference is gone, but a lockless reader may have picked the
+// value up from a key another thread dropped earlier: whoever releases last,
+// a worker or the lsm thread, the entry waits for the readers
+static void _dedup_retire(dedup_entry_t *e) {
+#if ENABLE_EBR
+	int engine = kvs_mem_engine;
+	kvs_mem_engine = KVS_ENGINE_OTHER;
+	kvs_ebr_retire(e, KVS_MEM_VALUE);
+	kvs_mem_engine = engine;
+#else
+	_dedup_free(e, KVS_MEM_VALUE);
+#endif
+}
+
+// double the table once there is an entry per bucket, with the lock held.
+// on failure the chains just grow longer
+static void _dedup_grow(void) {
+
+	size_t n = Dedup.nbuckets ? Dedup.nbuckets * 2 : DEDUP_MIN_BUCKETS;
+
+	dedup_entry_t **buckets = _dedup_malloc(sizeof(dedup_entry_t *) * n, KVS_MEM_INDEX);
+	if (!buckets) return ;
+	memset(buckets, 0, sizeof(dedup_entry_t *) * n);
+
+	size_t i = 0;
+	for (i = 0;i < Dedup.nbuckets;i ++) {
+		dedup_entry_t *e = Dedup.buckets[i];
+		while (e) {
+			dedup_entry_t *next = e->next;
+			e->next = buckets[e->hash & (n - 1)];
+			buckets[e->hash & (n - 1)] = e;
+			e = next;
+		}
+	}
+
+	_dedup_free(Dedup.buckets, KVS_MEM_INDEX);
+	Dedup.buckets = buckets;
+	Dedup.nbuckets = n;
+}
+
+
+// the shared copy of str with one more reference. NULL: dedup is off, str
+// is out of the size range or memory ran out, the caller copies it
+char *kvs_dedup_intern(const char *str) {
+
+	if (!__atomic_load_n(&Dedup.enabled, __ATOMIC_RELAXED)) return NULL;
+
+	size_t len = strlen(str);
+	if (len < KVS_VALUE_INLINE || len > Dedup.max_size) return NULL;
+
+	uint64_t hash = _dedup_hash(str, len);
+
+	pthread_mutex_lock(&Dedup.lock);
+
+	if (Dedup.entries >= Dedup.nbuckets) _dedup_grow();
+	if (!Dedup.buckets) {
+		pthread_mutex_unlock(&Dedup.lock);
+		return NULL;
+	}
+
+	dedup_entry_t **head = &Dedup.buckets[hash & (Dedup.nbuckets - 1)];
+	dedup_entry_t *e = *head;
+	while (e) {
+		if (e->hash == hash && e->len == len && memcmp(e->data, str, len) == 0) break;
+		e = e->next;
+	}
+
+	if (e) {
+		e->refcount ++;
+		Dedup.shared ++;
+	} else {
+		e = _dedup_malloc(sizeof(dedup_entry_t) + len + 1, KVS_MEM_VALUE);
+		if (!e) {
+			pthread_mutex_unlock(&Dedup.lock);
+			return NULL;
+		}
+		e->hash = hash;
+		e->refcount = 1;
+		e->len = len;
+		memcpy(e->data, str, len + 1);
+
+		e->next = *head;
+		*head = e;
+
+		Dedup.entries ++;
+		Dedup.unique_bytes += len + 1;
+		Dedup.interned ++;
+	}
+	Dedup.refs ++;
+	Dedup.logical_bytes += len + 1;
+
+	pthread_mutex_unlock(&Dedup.lock);
+
+	return e->data;
+}
+
+// drop one reference to a value kvs_dedup_intern() returned
+void kvs_dedup_release(char *value) {
+
+	dedup_entry_t *e = (dedup_entry_t *)(value - offsetof(dedup_entry_t, data));
+	int last = 0;
+
+	pthread_mutex_lock(&Dedup.lock);
+
+	Dedup.refs --;
+	Dedup.logical_bytes -= e->len + 1;
+
+	if (-- e->refcount == 0) {
+		dedup_entry_t **pp = &Dedup.buckets[e->hash & (Dedup.nbuckets - 1)];
+		while (*pp != e) pp = &(*pp)->next;
+		*pp = e->next;
+
+		Dedup.entries --;
+		Dedup.unique_bytes -= e->len + 1;
+		last = 1;
+	}
+
+	pthread_mutex_unlock(&Dedup.lock);
+
+	if (last) _dedup_retire(e);
+}
+
+// one reference's share of the entry, for MEMORY USAGE
+size_t kvs_dedup_usage(char *value) {
+
+	dedup_entry_t *e = (dedup_entry_t *)(value - offsetof(dedup_entry_t, data));
+
+	pthread_mutex_lock(&Dedup.lock);
+	size_t share = kvstore_usable_size(e) / e->refcount;
+	pthread_mutex_unlock(&Dedup.lock);
+
+	return share;
+}
+
+
+// CONFIG SET dedup yes|no, dedup-max-size <bytes>. turning it off only stops
+// new sharing, values already shared stay shared until released
+int kvs_dedup_config_set(char *name, char *value) {
+
+	if (strcmp(name, "dedup") == 0) {
+		if (strcmp(value, "yes") == 0) {
+			__atomic_store_n(&Dedup.enabled, 1, __ATOMIC_RELAXED);
+		} else if (strcmp(value, "no") == 0) {
+			__atomic_store_n(&Dedup.enabled, 0, __ATOMIC_RELAXED);
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(name, "dedup-max-size") == 0) {
+		char *end = NULL;
+		long size = strtol(value, &end, 10);
+		if (end == value || *end || size < KVS_VALUE_INLINE) return -1;
+
+		Dedup.max_size = size;
+		return 0;
+	}
+
+	return -1;
+}
+
+int kvs_dedup_config_get(char *name, char *buf, int len) {
+
+	if (strcmp(name, "dedup") == 0) {
+		return snprintf(buf, len, "%s", Dedup.enabled ? "yes" : "no");
+	}
+
+	if (strcmp(name, "dedup-max-size") == 0) {
+		return snprintf(buf, len, "%zu", Dedup.max_size);
+	}
+
+	return -1;
+}
+
+int kvs_dedup_stats(char *buf, int len) {
+
+	pthread_mutex_lock(&Dedup.lock);
+
+	double ratio = Dedup.unique_bytes ? (double)Dedup.logical_bytes / Dedup.unique_bytes : 1.0;
+
+	int n = snprintf(buf, len, "dedup:%s max_size:%zu values:%llu refs:%llu unique_bytes:%llu logical_bytes:%llu saved_bytes:%llu ratio:%.2f interned:%llu shared:%llu buckets:%zu\n",
+		Dedup.enabled ? "yes" : "no", Dedup.max_size,
+		(unsigned long long)Dedup.entries, (unsigned long long)Dedup.refs,
+		(unsigned long long)Dedup.unique_bytes, (unsigned long long)Dedup.logical_bytes,
+		(unsigned long long)(Dedup.logical_bytes - Dedup.unique_bytes), ratio,
+		(unsigned long long)Dedup.interned, (unsigned long long)Dedup.shared,
+		Dedup.nbuckets);
+
+	pthread_mutex_unlock(&Dedup.lock);
+
+	return n;
+}
+
+#endif
+
@@ -0,0 +1,238 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kvstore.h"
+
+
+// active defragmentation. after enough MOD/DEL churn the slab holds many
+// chunks a few objects keep alive; reserved memory is then a multiple of the
+// data. when the slab's reserved/used ratio crosses DEFRAG_THRESHOLD a cycle
+// starts: the allocator picks the sparse chunks (mp_defrag_begin), every
+// registered engine walks its keys and relocates its nodes, keys and values
+// out of them, and mp_defrag_end hands the emptied chunks back.
+//
+// the walk runs from kvstore_cron() on the event loop in steps of at most
+// DEFRAG_STEP_US, resuming from a key cursor, so requests keep flowing and
+// see a consistent engine between steps.
+//
+// with several workers every worker walks its own shard under the shard
+// lock, and the allocator only empties chunks of that worker's arena, where
+// its shard's objects come from. the trees are read lockless from other
+// workers meanwhile: an old copy is retired through ebr, not freed, and the
+// cycle waits for the readers before the chunks go back.
+//
+// the same walk cleans the value log (ENABLE_VALUE_LOG): a cycle also starts
+// when a log segment is sparse, and moves the live values out of it.
+
+#if ENABLE_MEM_DEFRAG
+
+#define DEFRAG_STEP_US			1000	// per cron call
+#define DEFRAG_KEYS_PER_CALL	64		// between clock checks
+#define DEFRAG_THRESHOLD		1.5		// reserved / used that starts a cycle
+#define DEFRAG_MIN_RESERVED		(4UL << 20)
+#define DEFRAG_RETRY_US			(5 * 1000000)	// after a cycle that could not release anything
+
+
+// one per shard, only the worker owning the shard touches it
+typedef struct kvs_defrag_walk_s {
+
+	int running;
+	int engine;					// being walked
+	char cursor[BUFFER_LENGTH];
+
+	// last finished cycle
+	double frag_before;
+	double frag_after;
+	size_t reserved_before;
+	size_t reserved_after;
+	uint64_t cycle_us;
+	uint64_t finished_us;
+
+	uint64_t started_us;
+	uint64_t retry_us;
+	uint64_t cycles;
+	uint64_t steps;
+	size_t released;
+
+} kvs_defrag_walk_t;
+
+typedef struct kvs_defrag_s {
+
+	KVS_ENGINE_DEFRAG engines[KVS_ENGINE_SIZE];
+
+	int enabled;				// CONFIG SET activedefrag yes|no
+
+	kvs_defrag_walk_t walks[KVS_MAX_SHARDS];
+
+} kvs_defrag_t;
+
+static kvs_defrag_t Defrag = {
+	.enabled = 1,
+};
+
+
+static uint64_t _now_us(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void kvs_defrag_register(int engine, KVS_ENGINE_DEFRAG defrag) {
+
+	if (engine < 0 || engine >= KVS_ENGINE_SIZE) return ;
+
+	Defrag.engines[engine] = defrag;
+}
+
+static int _defrag_start(kvs_defrag_walk_t *walk) {
+
+	size_t reserved = 0;
+	double frag = mp_fragmentation(&reserved, NULL);
+	int sparse = reserved >= DEFRAG_MIN_RESERVED && frag >= DEFRAG_THRESHOLD;
+#if ENABLE_VALUE_LOG
+	int dirty = kvs_vlog_dirty();
+#else
+	int dirty = 0;
+#endif
+	if (!sparse && !dirty) return 0;
+
+	// counting live objects walks the free lists, do not redo it every cron
+	uint64_t now = _now_us();
+	if (now < walk->retry_us) return 0;
+
+	int picked = sparse ? mp_defrag_begin() : 0;
+#if ENABLE_VALUE_LOG
+	if (dirty) picked += kvs_vlog_clean_begin();
+#endif
+
+	if (picked == 0) { // sparse, but nothing fits elsewhere
+		walk->retry_us = now + DEFRAG_RETRY_US;
+		return 0;
+	}
+
+	walk->running = 1;
+	walk->engine = 0;
+	walk->cursor[0] = '\0';
+	walk->frag_before = frag;
+	walk->reserved_before = reserved;
+	walk->started_us = now;
+
+	return 1;
+}
+
+static void _defrag_finish(kvs_defrag_walk_t *walk) {
+
+#if ENABLE_EBR
+	// the old copies must be back in their chunks before these are emptied
+	if (kvs_ebr_defer) kvs_ebr_synchronize();
+#endif
+
+	size_t released = mp_defrag_end();
+#if ENABLE_VALUE_LOG
+	released += kvs_vlog_clean_end();
+#endif
+	walk->released += released;
+
+	uint64_t now = _now_us();
+	walk->frag_after = mp_fragmentation(&walk->reserved_after, NULL);
+	walk->cycle_us = now - walk->started_us;
+	walk->finished_us = now;
+
+	// what is left is pinned by objects no engine walk reaches
+	if (released == 0) walk->retry_us = now + DEFRAG_RETRY_US;
+
+	walk->running = 0;
+	walk->cycles ++;
+}
+
+// one time-bounded step over the current shard, from the event loop of the
+// worker owning it, between requests
+void kvs_defrag_cron(void) {
+
+	kvs_defrag_walk_t *walk = &Defrag.walks[kvs_shard];
+
+	if (!walk->running) {
+		if (!Defrag.enabled || !_defrag_start(walk)) return ;
+	}
+
+	uint64_t begin = _now_us();
+
+	walk->steps ++;
+
+	while (walk->engine < KVS_ENGINE_SIZE) {
+		KVS_ENGINE_DEFRAG defrag = Defrag.engines[walk->engine];
+
+		// a move keeps the size class, engine accounting does not change
+		if (defrag) {
+			if (defrag(walk->cursor, DEFRAG_KEYS_PER_CALL) == 1) {
+				if (_now_us() - begin >= DEFRAG_STEP_US) break;
+				continue;
+			}
+		}
+
+		walk->engine ++;
+		walk->cursor[0] = '\0';
+	}
+
+	if (walk->engine == KVS_ENGINE_SIZE) {
+		_defrag_finish(walk);
+	}
+}
+
+int kvs_defrag_stats(char *buf, int len) {
+
+	size_t reserved = 0;
+	double frag = mp_fragmentation(&reserved, NULL);
+
+	// running: shards mid-cycle. the last cycle is the one that ended last
+	int running = 0;
+	uint64_t cycles = 0, steps = 0;
+	size_t released = 0;
+	kvs_defrag_walk_t last = { .frag_before = 1.0, .frag_after = 1.0 };
+
+	int i = 0;
+	for (i = 0;i < kvs_nshards;i ++) {
+		kvs_defrag_walk_t *walk = &Defrag.walks[i];
+
+		running += walk->running;
+		cycles += walk->cycles;
+		steps += walk->steps;
+		released += walk->released;
+		if (walk->cycles && walk->finished_us > last.finished_us) last = *walk;
+	}
+
+	return snprintf(buf, len, "activedefrag:%s running:%d fragmentation:%.2f reserved:%zu cycles:%llu steps:%llu moved:%zu released:%zu last_before:%.2f last_after:%.2f last_reserved_before:%zu last_reserved_after:%zu last_cycle_us:%llu\n",
+		Defrag.enabled ? "yes" : "no", running, frag, reserved,
+		(unsigned long long)cycles, (unsigned long long)steps,
+		mp_defrag_moves(), released,
+		last.frag_before, last.frag_after,
+		last.reserved_before, last.reserved_after,
+		(unsigned long long)last.cycle_us);
+}
+
+// CONFIG SET activedefrag yes|no, a running cycle finishes either way
+int kvs_defrag_config_set(char *value) {
+
+	if (strcmp(value, "yes") == 0) Defrag.enabled = 1;
+	else if (strcmp(value, "no") == 0) Defrag.enabled = 0;
+	else return -1;
+
+	return 0;
+}
+
+const char *kvs_defrag_config_get(void) {
+	return Defrag.enabled ? "yes" : "no";
+}
+
+#endif
+
@@ -0,0 +1,313 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+
+#include "kvstore.h"
+
+
+// epoch-based reclamation for whatever is read without its lock: the
+// lockless tree reads of kvstore_rcu.c today, any engine that wants the
+// same tomorrow.
+//
+//   - a global epoch, and a word per thread: the epoch it saw when it last
+//     entered a visit (kvs_ebr_enter()), low bit set while it is inside.
+//     visits never yield, a thread sits inside one for the length of a
+//     lookup.
+//   - kvs_ebr_retire() puts an unlinked block on the thread's open list, no
+//     fence, no shared write. at a quiescent point (kvs_ebr_quiescent(),
+//     from the event loop between two rounds) the open list is sealed with
+//     the epoch read after a full fence into the limbo list of that epoch,
+//     three of them, one per epoch mod 3.
+//   - the epoch moves from e to e+1 once every thread inside a visit has
+//     seen e. a reader can hold a block sealed in e only from a visit that
+//     began before the seal, in e or e-1, so the block is freed once the
+//     epoch reached e+2.
+//
+// everything happens on the retiring thread, the frees go where the
+// allocation accounting expects them. a thread with nothing in limbo does
+// not even look at the others at its quiescent points.
+
+#if ENABLE_EBR
+
+#define EBR_LIST_MIN			64
+#define EBR_BATCH				4096	// open blocks that seal without waiting for the loop
+
+
+typedef struct ebr_retired_s {
+	void *ptr;
+	KVS_EBR_FREE fn;		// NULL: kvstore_free_tag(ptr, tag)
+	int tag;
+	int engine;				// kvs_mem_engine at the retire, charged back to it
+	size_t bytes;
+} ebr_retired_t;
+
+typedef struct ebr_list_s {
+	ebr_retired_t *items;
+	int count;
+	int size;
+	unsigned long epoch;	// of the seal
+	size_t bytes;
+} ebr_list_t;
+
+// one per thread, on its own cache line, written by that thread
+typedef struct ebr_thread_s {
+	unsigned long state;	// epoch << 1, | 1 inside a visit
+	uint64_t visits;
+	uint64_t retired;
+	uint64_t freed;
+	size_t deferred_bytes;
+} __attribute__((aligned(64))) ebr_thread_t;
+
+static ebr_thread_t Threads[KVS_EBR_MAX_THREADS];
+static int Nthreads = 0;
+static unsigned long Epoch = 0;
+
+__thread int kvs_ebr_defer = 0;
+
+static __thread ebr_thread_t *Self = NULL;
+static __thread ebr_list_t Open;				// retired since the last seal
+static __thread ebr_list_t Limbo[3];			// sealed, by epoch mod 3
+static __thread int Deferred = 0;				// blocks on all of them
+
+
+// the first call of a thread takes its slot, threads do not go away
+static ebr_thread_t *_ebr_self(void) {
+
+	if (Self) return Self;
+
+	int id = __atomic_fetch_add(&Nthreads, 1, __ATOMIC_ACQ_REL);
+	if (id >= KVS_EBR_MAX_THREADS) {
+		fprintf(stderr, "ebr: more than %d threads\n", KVS_EBR_MAX_THREADS);
+		abort();
+	}
+
+	Self = &Threads[id];
+	return Self;
+}
+
+static int _ebr_nthreads(void) {
+	int n = __atomic_load_n(&Nthreads, __ATOMIC_ACQUIRE);
+	return n > KVS_EBR_MAX_THREADS ? KVS_EBR_MAX_THREADS : n;
+}
+
+
+void kvs_ebr_enter(void) {
+
+	ebr_thread_t *self = _ebr_self();
+	unsigned long epoch = __atomic_load_n(&Epoch, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&self->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+	// inside before the first pointer is read, pairs with _ebr_advance()
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	__atomic_store_n(&self->visits, self->visits + 1, __ATOMIC_RELAXED);
+}
+
+void kvs_ebr_exit(void) {
+	__atomic_store_n(&Self->state, Self->state & ~1UL, __ATOMIC_RELEASE);
+}
+
+
+// the epoch after trying to move it on
+static unsigned long _ebr_advance(void) {
+
+	unsigned long epoch = __atomic_load_n(&Epoch, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	int n = _ebr_nthreads();
+	int i = 0;
+	for (i = 0;i < n;i ++) {
+		unsigned long state = __atomic_load_n(&Threads[i].state, __ATOMIC_RELAXED);
+		if ((state & 1) && (state >> 1) != epoch) return epoch;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	// a loser finds the epoch moved on by someone else, as good
+	if (__atomic_compare_exchange_n(&Epoch, &epoch, epoch + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		return epoch + 1;
+	}
+	return epoch;
+}
+
+static void _ebr_free(ebr_list_t *list) {
+
+	int engine = kvs_mem_engine;
+	int defer = kvs_ebr_defer;
+	kvs_ebr_defer = 0;
+
+	int i = 0;
+	for (i = 0;i < list->count;i ++) {
+		ebr_retired_t *item = &list->items[i];
+		if (item->fn) {
+			item->fn(item->ptr);
+		} else {
+			kvs_mem_engine = item->engine;
+			kvstore_free_tag(item->ptr, item->tag);
+		}
+	}
+
+	kvs_mem_engine = engine;
+	kvs_ebr_defer = defer;
+
+	__atomic_store_n(&Self->freed, Self->freed + list->count, __ATOMIC_RELAXED);
+	__atomic_store_n(&Self->deferred_bytes, Self->deferred_bytes - list->bytes, __ATOMIC_RELAXED);
+
+	Deferred -= list->count;
+	list->count = 0;
+	list->bytes = 0;
+}
+
+static int _ebr_grow(ebr_list_t *list, int need) {
+
+	int size = list->size ? list->size : EBR_LIST_MIN;
+	while (size < need) size *= 2;
+	if (size == list->size) return 0;
+
+	ebr_retired_t *items = (ebr_retired_t *)realloc(list->items, sizeof(ebr_retired_t) * size);
+	if (!items) return -1;
+
+	list->items = items;
+	list->size = size;
+
+	return 0;
+}
+
+// until what was sealed in epoch can go, the readers never block
+static void _ebr_wait(unsigned long epoch) {
+	while (_ebr_advance() < epoch + 2) sched_yield();
+}
+
+// the open list into the limbo list of the current epoch
+static void _ebr_seal(void) {
+
+	if (Open.count == 0) return ;
+
+	// what was retired is unlinked before the epoch is read
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	unsigned long epoch = __atomic_load_n(&Epoch, __ATOMIC_RELAXED);
+
+	ebr_list_t *limbo = &Limbo[epoch % 3];
+	// sealed three epochs ago or more, free by now
+	if (limbo->count && limbo->epoch != epoch) _ebr_free(limbo);
+
+	if (limbo->count && _ebr_grow(limbo, limbo->count + Open.count) < 0) {
+		// no room to merge: the one sealed earlier goes first, whatever
+		// it costs to wait for it
+		_ebr_wait(epoch);
+		_ebr_free(limbo);
+	}
+
+	if (limbo->count == 0) {
+		ebr_list_t list = *limbo;
+		*limbo = Open;
+		Open = list;
+	} else {
+		memcpy(limbo->items + limbo->count, Open.items, sizeof(ebr_retired_t) * Open.count);
+		limbo->count += Open.count;
+		limbo->bytes += Open.bytes;
+		Open.count = 0;
+		Open.bytes = 0;
+	}
+	limbo->epoch = epoch;
+}
+
+static void _ebr_collect(void) {
+
+	// with no visit open anywhere the epoch takes both steps at once
+	_ebr_advance();
+	unsigned long epoch = _ebr_advance();
+
+	int i = 0;
+	for (i = 0;i < 3;i ++) {
+		if (Limbo[i].count && Limbo[i].epoch + 2 <= epoch) _ebr_free(&Limbo[i]);
+	}
+}
+
+static void _ebr_add(void *ptr, KVS_EBR_FREE fn, int tag, size_t bytes) {
+
+	ebr_thread_t *self = _ebr_self();
+
+	if (Open.count == Open.size && _ebr_grow(&Open, Open.count + 1) < 0) {
+		// no room to keep it: wait the readers out
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		_ebr_wait(__atomic_load_n(&Epoch, __ATOMIC_RELAXED));
+
+		int defer = kvs_ebr_defer;
+		kvs_ebr_defer = 0;
+		if (fn) fn(ptr);
+		else kvstore_free_tag(ptr, tag);
+		kvs_ebr_defer = defer;
+		return ;
+	}
+
+	ebr_retired_t *item = &Open.items[Open.count ++];
+	item->ptr = ptr;
+	item->fn = fn;
+	item->tag = tag;
+	item->engine = kvs_mem_engine;
+	item->bytes = bytes;
+	Open.bytes += bytes;
+	Deferred ++;
+
+	__atomic_store_n(&self->retired, self->retired + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&self->deferred_bytes, self->deferred_bytes + bytes, __ATOMIC_RELAXED);
+
+	// a thread without an event loop, or one long write
+	if (Open.count >= EBR_BATCH) kvs_ebr_quiescent();
+}
+
+void kvs_ebr_retire(void *ptr, int tag) {
+	if (ptr) _ebr_add(ptr, NULL, tag, kvstore_usable_size(ptr));
+}
+
+void kvs_ebr_retire_fn(void *ptr, KVS_EBR_FREE fn, size_t bytes) {
+	if (ptr && fn) _ebr_add(ptr, fn, 0, bytes);
+}
+
+void kvs_ebr_quiescent(void) {
+
+	if (Deferred == 0) return ;
+
+	_ebr_seal();
+	_ebr_collect();
+}
+
+void kvs_ebr_synchronize(void) {
+
+	_ebr_seal();
+	_ebr_collect();
+
+	while (Deferred) {
+		sched_yield();
+		_ebr_collect();
+	}
+}
+
+
+int kvs_ebr_stats(char *buf, int len) {
+
+	uint64_t visits = 0, retired = 0, freed = 0;
+	size_t bytes = 0;
+
+	int n = _ebr_nthreads();
+	int i = 0;
+	for (i = 0;i < n;i ++) {
+		visits += __atomic_load_n(&Threads[i].visits, __ATOMIC_RELAXED);
+		retired += __atomic_load_n(&Threads[i].retired, __ATOMIC_RELAXED);
+		freed += __atomic_load_n(&Threads[i].freed, __ATOMIC_RELAXED);
+		bytes += __atomic_load_n(&Threads[i].deferred_bytes, __ATOMIC_RELAXED);
+	}
+
+	return snprintf(buf, len, "ebr epoch:%lu threads:%d visits:%llu retired:%llu freed:%llu deferred:%llu deferred_bytes:%zu\n",
+		__atomic_load_n(&Epoch, __ATOMIC_RELAXED), n,
+		(unsigned long long)visits, (unsigned long long)retired, (unsigned long long)freed,
+		(unsigned long long)(retired - freed), bytes);
+}
+
+#endif
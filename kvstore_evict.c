@@ -0,0 +1,292 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kvstore.h"
+
+
+// memory ceiling with approximate eviction, the way redis does it: no global
+// lru list, every key carries a 24 bit clock and eviction compares a handful
+// of random samples. a write command that finds used memory above maxmemory
+// evicts at most EVICT_KEYS_PER_CALL keys before it runs; if that was not
+// enough the next write carries on, so the event loop never stalls on one
+// big eviction. writes fail with "ERROR OOM" only when nothing can be evicted
+// (noeviction, or every evictable engine is empty).
+//
+// array, lsm, blink and cow keys are not evicted: the array is capped at
+// KVS_ARRAY_SIZE, the lsm memtable flushes to disk and the two shared trees
+// have no access clock, their readers write nothing. their memory still
+// counts.
+
+#define EVICT_SAMPLES			5		// per engine per victim
+#define EVICT_KEYS_PER_CALL		32
+
+#define LFU_INIT_VAL			5
+#define LFU_LOG_FACTOR			10
+#define LFU_DECAY_TIME			1		// minutes per counter decrement
+
+
+enum {
+	KVS_POLICY_NOEVICTION = 0,
+	KVS_POLICY_ALLKEYS_LRU,
+	KVS_POLICY_ALLKEYS_LFU,
+
+	KVS_POLICY_SIZE,
+};
+
+static const char *policy_names[KVS_POLICY_SIZE] = {
+	"noeviction", "allkeys-lru", "allkeys-lfu",
+};
+
+static int policy = KVS_POLICY_ALLKEYS_LRU;	// atomic, CONFIG SET on one worker, read by all
+
+#if ENABLE_MAXMEMORY
+
+static size_t maxmemory = 0;		// atomic, 0: no limit
+static uint64_t evicted_keys = 0;	// atomic, every worker evicts
+static uint64_t oom_rejects = 0;
+
+typedef struct evict_engine_s {
+	KVS_ENGINE_SAMPLE sample;
+	KVS_ENGINE_DELETE del;
+} evict_engine_t;
+
+static evict_engine_t engines[KVS_ENGINE_SIZE];
+
+#endif
+
+
+static uint32_t _now_seconds(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	return (uint32_t)ts.tv_sec;
+}
+
+unsigned int kvs_random(void) {
+
+	static __thread uint64_t state = 0x9e3779b97f4a7c15ULL;	// per worker
+
+	state ^= state << 13;
+	state ^= state >> 7;
+	state ^= state << 17;
+
+	return (unsigned int)(state >> 32);
+}
+
+
+// lfu: counter decays by one every LFU_DECAY_TIME minutes without access
+static unsigned int _lfu_decayed(unsigned int lru) {
+
+	unsigned int now = (_now_seconds() / 60) & 0xFFFF;
+	unsigned int last = lru >> 8;
+	unsigned int counter = lru & 0xFF;
+
+	unsigned int elapsed = (now - last) & 0xFFFF;
+	unsigned int periods = elapsed / LFU_DECAY_TIME;
+
+	return periods > counter ? 0 : counter - periods;
+}
+
+// lfu: logarithmic increment, a counter of c needs ~c * LFU_LOG_FACTOR hits
+static unsigned int _lfu_log_incr(unsigned int counter) {
+
+	if (counter == 255) return 255;
+
+	double r = (double)kvs_random() / 4294967295.0;
+	double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+	double p = 1.0 / (base * LFU_LOG_FACTOR + 1);
+
+	return r < p ? counter + 1 : counter;
+}
+
+unsigned int kvs_lru_new(void) {
+
+	if (__atomic_load_n(&policy, __ATOMIC_RELAXED) == KVS_POLICY_ALLKEYS_LFU) {
+		return (((_now_seconds() / 60) & 0xFFFF) << 8) | LFU_INIT_VAL;
+	}
+	return _now_seconds() & KVS_LRU_MAX;
+}
+
+unsigned int kvs_lru_touch(unsigned int lru) {
+
+	if (__atomic_load_n(&policy, __ATOMIC_RELAXED) == KVS_POLICY_ALLKEYS_LFU) {
+		unsigned int counter = _lfu_log_incr(_lfu_decayed(lru));
+		return (((_now_seconds() / 60) & 0xFFFF) << 8) | counter;
+	}
+	return _now_seconds() & KVS_LRU_MAX;
+}
+
+// higher is a better victim
+static unsigned int _evict_score(unsigned int lru) {
+
+	if (__atomic_load_n(&policy, __ATOMIC_RELAXED) == KVS_POLICY_ALLKEYS_LFU) {
+		return 255 - _lfu_decayed(lru);
+	}
+	return ((_now_seconds() & KVS_LRU_MAX) - lru) & KVS_LRU_MAX; // idle seconds
+}
+
+
+#if ENABLE_MAXMEMORY
+
+void kvs_evict_register(int engine, KVS_ENGINE_SAMPLE sample, KVS_ENGINE_DELETE del) {
+
+	if (engine < 0 || engine >= KVS_ENGINE_SIZE) return ;
+
+	engines[engine].sample = sample;
+	engines[engine].del = del;
+}
+
+// 1: a ceiling is set, the access clocks of the keys decide what goes
+int kvs_evict_active(void) {
+	return __atomic_load_n(&maxmemory, __ATOMIC_RELAXED) != 0;
+}
+
+// before a write. 0: go ahead, -1: out of memory
+int kvs_evict_perform(void) {
+
+	size_t limit = __atomic_load_n(&maxmemory, __ATOMIC_RELAXED);
+	if (limit == 0 || kvs_mem_total() <= limit) return 0;
+
+	if (__atomic_load_n(&policy, __ATOMIC_RELAXED) == KVS_POLICY_NOEVICTION) {
+		__atomic_add_fetch(&oom_rejects, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	int saved = kvs_mem_engine;
+	int evicted = 0;
+	char victim[BUFFER_LENGTH];
+
+	while (evicted < EVICT_KEYS_PER_CALL && kvs_mem_total() > limit) {
+
+		int best = -1;
+		unsigned int best_score = 0;
+
+		int e = 0;
+		for (e = 0;e < KVS_ENGINE_SIZE;e ++) {
+			if (!engines[e].sample) continue;
+
+			int i = 0;
+			for (i = 0;i < EVICT_SAMPLES;i ++) {
+				char *key = NULL;
+				unsigned int lru = 0;
+
+				int res = engines[e].sample(&key, &lru);
+				if (res < 0) break; // empty
+				if (res > 0) continue; // hot
+
+				unsigned int score = _evict_score(lru);
+				if (best < 0 || score > best_score) {
+					size_t len = strlen(key);
+					if (len >= BUFFER_LENGTH) continue;
+					memcpy(victim, key, len + 1); // the engine frees key on delete
+
+					best = e;
+					best_score = score;
+				}
+			}
+		}
+
+		if (best < 0) break; // nothing left to evict
+
+		kvs_mem_engine = best;
+		engines[best].del(victim);
+
+		evicted ++;
+		__atomic_add_fetch(&evicted_keys, 1, __ATOMIC_RELAXED);
+	}
+
+	kvs_mem_engine = saved;
+
+	// partial progress lets the write through, the next one continues
+	if (evicted == 0 && kvs_mem_total() > limit) {
+		__atomic_add_fetch(&oom_rejects, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	return 0;
+}
+
+int kvs_evict_stats(char *buf, int len) {
+
+	int n = snprintf(buf, len, "used_memory:%zu maxmemory:%zu policy:%s evicted_keys:%llu oom_rejects:%llu\n",
+		kvs_mem_total(), __atomic_load_n(&maxmemory, __ATOMIC_RELAXED), policy_names[__atomic_load_n(&policy, __ATOMIC_RELAXED)],
+		(unsigned long long)__atomic_load_n(&evicted_keys, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&oom_rejects, __ATOMIC_RELAXED));
+
+	int e = 0;
+	for (e = 0;e < KVS_ENGINE_SIZE && n < len;e ++) {
+		n += snprintf(buf + n, len - n, "%s:%zu%s", kvs_engine_names[e],
+			kvs_mem_engine_used(e),
+			e == KVS_ENGINE_SIZE - 1 ? "\n" : " ");
+	}
+
+	return n;
+}
+
+
+// "64mb", "512kb", "1gb" or plain bytes
+static int _parse_memory(char *value, size_t *out) {
+
+	char *end = NULL;
+	unsigned long long n = strtoull(value, &end, 10);
+	if (end == value) return -1;
+
+	if (*end == '\0' || strcasecmp(end, "b") == 0) *out = n;
+	else if (strcasecmp(end, "kb") == 0 || strcasecmp(end, "k") == 0) *out = n << 10;
+	else if (strcasecmp(end, "mb") == 0 || strcasecmp(end, "m") == 0) *out = n << 20;
+	else if (strcasecmp(end, "gb") == 0 || strcasecmp(end, "g") == 0) *out = n << 30;
+	else return -1;
+
+	return 0;
+}
+
+// CONFIG SET maxmemory|maxmemory-policy <value>
+int kvs_evict_config_set(char *name, char *value) {
+
+	if (strcmp(name, "maxmemory") == 0) {
+		size_t limit = 0;
+		if (_parse_memory(value, &limit) != 0) return -1;
+
+		__atomic_store_n(&maxmemory, limit, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (strcmp(name, "maxmemory-policy") == 0) {
+		int i = 0;
+		for (i = 0;i < KVS_POLICY_SIZE;i ++) {
+			if (strcmp(value, policy_names[i]) == 0) {
+				__atomic_store_n(&policy, i, __ATOMIC_RELAXED);
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+	return -1;
+}
+
+// CONFIG GET maxmemory|maxmemory-policy
+int kvs_evict_config_get(char *name, char *buf, int len) {
+
+	if (strcmp(name, "maxmemory") == 0) {
+		return snprintf(buf, len, "%zu", __atomic_load_n(&maxmemory, __ATOMIC_RELAXED));
+	}
+
+	if (strcmp(name, "maxmemory-policy") == 0) {
+		return snprintf(buf, len, "%s", policy_names[__atomic_load_n(&policy, __ATOMIC_RELAXED)]);
+	}
+
+	return -1;
+}
+
+#endif
+
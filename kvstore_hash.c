@@ -20,18 +20,44 @@
 #define ENABLE_POINTER_KEY	1
 
 
+#if ENABLE_COMPACT_REFS
+typedef kvs_ref_t hashnode_link;		// 32 bit slab reference, kvstore.h
+#else
+typedef struct hashnode_s *hashnode_link;
+#endif
+
 typedef struct hashnode_s {
 #if ENABLE_POINTER_KEY
-	char *key;
-	char *value;
+	kvs_key_t key;			// short ones inline, kvstore.h
+	kvs_value_t value;
 #else
 	char key[MAX_KEY_LEN];
 	char value[MAX_VALUE_LEN];
 #endif	
-	struct hashnode_s *next;
+	unsigned int lru;
+	hashnode_link next;
 	
 } hashnode_t;
 
+#if ENABLE_POINTER_KEY
+#define HASH_KEY(node)		kvs_key_get(&(node)->key)
+#define HASH_VALUE(node)	kvs_value_get(&(node)->value)
+#else
+#define HASH_KEY(node)		((node)->key)
+#define HASH_VALUE(node)	((node)->value)
+#endif
+
+#if ENABLE_COMPACT_REFS
+#define HASH_NEXT(node)			((hashnode_t *)kvs_deref((node)->next))
+#define HASH_SET_NEXT(node, x)	((node)->next = kvs_ref(x))
+#define HASH_NODE_ALLOC()		((hashnode_t *)kvstore_malloc_ref(sizeof(hashnode_t), KVS_MEM_NODE))
+#else
+#define HASH_NEXT(node)			((node)->next)
+#define HASH_SET_NEXT(node, x)	((node)->next = (x))
+#define HASH_NODE_ALLOC()		((hashnode_t *)kvstore_malloc_tag(sizeof(hashnode_t), KVS_MEM_NODE))
+#endif
+#define HASH_NODE_FREE(node)	kvstore_free_tag((node), KVS_MEM_NODE)
+
 
 typedef struct hashtable_s {
 
@@ -43,8 +69,6 @@ typedef struct hashtable_s {
 } hashtable_t;
 
 
-hashtable_t Hash;
-
 
 // FNV-1a哈希算法
 // 更高效的哈希函数，减少冲突
@@ -68,25 +92,21 @@ static int _hash(char *key, int size) {
 
 hashnode_t *_create_node(char *key, char *value) {
 
-	hashnode_t *node = (hashnode_t*)kvstore_malloc(sizeof(hashnode_t));
+	hashnode_t *node = HASH_NODE_ALLOC();
 	if (!node) return NULL;
 
 #if ENABLE_POINTER_KEY
 
-	node->key = kvstore_malloc(strlen(key) + 1);
-	if (!node->key) {
-		kvstore_free(node);
+	if (kvs_key_set(&node->key, key) != 0) {
+		HASH_NODE_FREE(node);
 		return NULL;
 	}
-	strcpy(node->key, key);
 
-	node->value = kvstore_malloc(strlen(value) + 1);
-	if (!node->value) {
-		kvstore_free(node->key);
-		kvstore_free(node);
+	if (kvs_value_set(&node->value, value) != 0) {
+		kvs_key_free(&node->key);
+		HASH_NODE_FREE(node);
 		return NULL;
 	}
-	strcpy(node->value, value);
 
 #else
 
@@ -95,7 +115,8 @@ hashnode_t *_create_node(char *key, char *value) {
 	
 #endif
 
-	node->next = NULL;
+	HASH_SET_NEXT(node, NULL);
+	node->lru = kvs_lru_new();
 
 	return node;
 }
@@ -108,6 +129,7 @@ int init_hashtable(hashtable_t *hash) {
 
 	hash->nodes = (hashnode_t**)kvstore_malloc(sizeof(hashnode_t*) * MAX_TABLE_SIZE);
 	if (!hash->nodes) return -1;
+	memset(hash->nodes, 0, sizeof(hashnode_t*) * MAX_TABLE_SIZE);
 
 	hash->max_slots = MAX_TABLE_SIZE;
 	hash->count = 0; 
@@ -127,10 +149,10 @@ void dest_hashtable(hashtable_t *hash) {
 		while (node != NULL) { // error
 
 			hashnode_t *tmp = node;
-			node = node->next;
+			node = HASH_NEXT(node);
 			hash->nodes[i] = node;
 			
-			kvstore_free(tmp);
+			HASH_NODE_FREE(tmp);
 			
 		}
 	}
@@ -151,15 +173,16 @@ int put_kv_hashtable(hashtable_t *hash, char *key, char *value) {
 	hashnode_t *node = hash->nodes[idx];
 #if 1
 	while (node != NULL) {
-		if (strcmp(node->key, key) == 0) { // exist
+		if (strcmp(HASH_KEY(node), key) == 0) { // exist
 			return 1;
 		}
-		node = node->next;
+		node = HASH_NEXT(node);
 	}
 #endif
 
 	hashnode_t *new_node = _create_node(key, value);
-	new_node->next = hash->nodes[idx];
+	if (!new_node) return -1;
+	HASH_SET_NEXT(new_node, hash->nodes[idx]);
 	hash->nodes[idx] = new_node;
 	
 	hash->count ++;
@@ -178,11 +201,12 @@ char * get_kv_hashtable(hashtable_t *hash, char *key) {
 
 	while (node != NULL) {
 
-		if (strcmp(node->key, key) == 0) {
-			return node->value;
+		if (strcmp(HASH_KEY(node), key) == 0) {
+			node->lru = kvs_lru_touch(node->lru);
+			return HASH_VALUE(node);
 		}
 
-		node = node->next;
+		node = HASH_NEXT(node);
 	}
 
 
@@ -203,18 +227,14 @@ int delete_kv_hashtable(hashtable_t *hash, char *key) {
 	hashnode_t *head = hash->nodes[idx];
 	if (head == NULL) return -1; // noexist
 	// head node
-	if (strcmp(head->key, key) == 0) {
-		hashnode_t *tmp = head->next;
+	if (strcmp(HASH_KEY(head), key) == 0) {
+		hashnode_t *tmp = HASH_NEXT(head);
 		hash->nodes[idx] = tmp;
 
 #if ENABLE_POINTER_KEY
-		if (head->key) {
-			kvstore_free(head->key);
-		}
-		if (head->value) {
-			kvstore_free(head->value);
-		}
-		kvstore_free(head);
+		kvs_key_free(&head->key);
+		kvs_value_free(&head->value);
+		HASH_NODE_FREE(head);
 #else
 		free(head);
 #endif
@@ -224,27 +244,23 @@ int delete_kv_hashtable(hashtable_t *hash, char *key) {
 	}
 
 	hashnode_t *cur = head;
-	while (cur->next != NULL) {
-		if (strcmp(cur->next->key, key) == 0) break; // search node
+	while (HASH_NEXT(cur) != NULL) {
+		if (strcmp(HASH_KEY(HASH_NEXT(cur)), key) == 0) break; // search node
 		
-		cur = cur->next;
+		cur = HASH_NEXT(cur);
 	}
 
-	if (cur->next == NULL) {
+	if (HASH_NEXT(cur) == NULL) {
 		
 		return -1;
 	}
 
-	hashnode_t *tmp = cur->next;
+	hashnode_t *tmp = HASH_NEXT(cur);
 	cur->next = tmp->next;
 #if ENABLE_POINTER_KEY
-	if (tmp->key) {
-		kvstore_free(tmp->key);
-	}
-	if (tmp->value) {
-		kvstore_free(tmp->value);
-	}
-	kvstore_free(tmp);
+	kvs_key_free(&tmp->key);
+	kvs_value_free(&tmp->value);
+	HASH_NODE_FREE(tmp);
 #else
 	free(tmp);
 #endif
@@ -280,6 +296,27 @@ void kvstore_hash_destory(hashtable_t *hash) {
 
 }
 
+// heap allocated hash table, one per shard
+hashtable_t *kvstore_hash_new(void) {
+
+	hashtable_t *hash = (hashtable_t *)kvstore_malloc(sizeof(hashtable_t));
+	if (!hash) return NULL;
+
+	if (kvstore_hash_create(hash) != 0) {
+		kvstore_free(hash);
+		return NULL;
+	}
+	return hash;
+}
+
+void kvstore_hash_free(hashtable_t *hash) {
+
+	if (!hash) return ;
+
+	kvstore_hash_destory(hash);
+	kvstore_free(hash);
+}
+
 
 int kvs_hash_set(hashtable_t *hash, char *key, char *value) {
 
@@ -311,18 +348,17 @@ int kvs_hash_modify(hashtable_t *hash, char *key, char *value) {
 
 	while (node != NULL) {
 
-		if (strcmp(node->key, key) == 0) {
-			kvstore_free(node->value);
+		if (strcmp(HASH_KEY(node), key) == 0) {
+			kvs_value_free(&node->value);
+			node->lru = kvs_lru_touch(node->lru);
 
-			node->value = kvstore_malloc(strlen(value) + 1);
-			if (node->value) {
-				strcpy(node->value, value);
+			if (kvs_value_set(&node->value, value) == 0) {
 				return 0;
 			} else 
 				assert(0);
 		}
 
-		node = node->next;
+		node = HASH_NEXT(node);
 	}
 
 
@@ -334,6 +370,95 @@ int kvs_hash_count(hashtable_t *hash) {
 	return hash->count;
 }
 
+// bytes the key costs: its node, heap key and value, not its bucket slot.
+// -1: no such key
+long kvs_hash_usage(hashtable_t *hash, char *key) {
+
+	if (!hash || !key) return -1;
+
+	hashnode_t *node = hash->nodes[_hash(key, MAX_TABLE_SIZE)];
+	while (node != NULL) {
+		if (strcmp(HASH_KEY(node), key) == 0) {
+#if ENABLE_POINTER_KEY
+			return kvstore_usable_size(node) + kvs_key_usage(&node->key) + kvs_value_usage(&node->value);
+#else
+			return kvstore_usable_size(node);
+#endif
+		}
+		node = HASH_NEXT(node);
+	}
+
+	return -1;
+}
+
+
+#if ENABLE_MEM_DEFRAG
+
+// defrag walk over the buckets from the one in cursor, whole chains at a
+// time until budget nodes were visited
+int kvs_hash_defrag(hashtable_t *hash, char *cursor, int budget) {
+
+	if (!hash || !cursor) return -1;
+
+	int idx = cursor[0] ? atoi(cursor) : 0;
+
+	for (;idx < hash->max_slots;idx ++) {
+		if (budget <= 0) {
+			snprintf(cursor, BUFFER_LENGTH, "%d", idx);
+			return 1;
+		}
+
+		hashnode_t *prev = NULL; // NULL: the bucket head
+		hashnode_t *node = hash->nodes[idx];
+		while (node) {
+			hashnode_t *moved = kvstore_defrag_move(node);
+			if (moved) {
+				if (prev) HASH_SET_NEXT(prev, moved);
+				else hash->nodes[idx] = moved;
+				node = moved;
+			}
+
+#if ENABLE_POINTER_KEY
+			kvs_key_defrag(&node->key);
+			kvs_value_defrag(&node->value);
+#endif
+
+			budget --;
+			prev = node;
+			node = HASH_NEXT(node);
+		}
+	}
+
+	return 0;
+}
+
+#endif
 
+// random key for eviction sampling: first non-empty bucket from a random
+// slot, then a random node of its chain
+int kvs_hash_sample(hashtable_t *hash, char **key, unsigned int *lru) {
+
+	if (!hash || hash->count == 0) return -1;
+
+	int idx = kvs_random() % hash->max_slots;
+	int i = 0;
+	for (i = 0;i < hash->max_slots;i ++) {
+		hashnode_t *node = hash->nodes[(idx + i) % hash->max_slots];
+		if (!node) continue;
 
+		int len = 0;
+		hashnode_t *cur = node;
+		for (cur = node;cur != NULL;cur = HASH_NEXT(cur)) len ++;
+
+		int pick = kvs_random() % len;
+		while (pick --) node = HASH_NEXT(node);
+
+		*key = HASH_KEY(node);
+		*lru = node->lru;
+
+		return 0;
+	}
+
+	return -1;
+}
 
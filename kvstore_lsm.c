@@ -0,0 +1,1392 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "kvstore.h"
+
+
+// LSM tree: the skiplist engine is the mutable memtable. a full memtable is
+// frozen and flushed by the worker thread into a sorted, block indexed SSTable
+// with a bloom filter. the same thread runs leveled compaction.
+//
+// reads: memtable -> immutable memtables (newest first) -> L0 (newest first) -> L1..
+//
+// there is no write-ahead log, writes still in a memtable are lost on a crash.
+// kvstore_lsm_destory() flushes them.
+
+
+#define LSM_DATA_DIR			"./lsm_data"
+#define LSM_MANIFEST			"MANIFEST"
+
+#define LSM_MEMTABLE_SIZE		(1 * 1024 * 1024)
+#define LSM_MAX_IMMUTABLE		4		// writers stall beyond this
+#define LSM_BLOCK_SIZE			4096
+#define LSM_BLOOM_BITS_PER_KEY	10
+#define LSM_MAX_LEVELS			7
+#define LSM_L0_COMPACT_TRIGGER	4
+#define LSM_LEVEL_BASE			(8 * 1024 * 1024)	// L1, x10 per level
+#define LSM_SST_TARGET_SIZE		(2 * 1024 * 1024)
+
+#define LSM_SST_MAGIC			0x4c534d31	// "LSM1"
+#define LSM_FOOTER_SIZE			32
+
+// an empty value never comes from the protocol (strtok skips empty tokens)
+#define LSM_TOMBSTONE			""
+#define LSM_IS_TOMBSTONE(v)		((v)[0] == '\0')
+
+
+// sstable layout
+//
+//   data blocks:  { u32 klen, u32 vlen, key\0, value\0 } ...
+//   index:        u32 nblocks, { u32 offset, u32 size, u32 klen, last_key\0 } ...
+//   bloom:        u32 bits, u32 k, bits/8 bytes
+//   footer:       u64 index_off, u64 bloom_off, u64 entries, u32 magic, u32 pad
+
+typedef struct lsm_block_handle_s {
+	char *last_key;
+	uint32_t offset;
+	uint32_t size;
+} lsm_block_handle_t;
+
+typedef struct sstable_s {
+	uint64_t number;
+	int fd;
+	uint64_t size;
+	uint64_t entries;
+
+	char *smallest;
+	char *largest;
+
+	int nblocks;
+	lsm_block_handle_t *blocks;
+
+	uint8_t *bloom;
+	uint32_t bloom_bits;
+	uint32_t bloom_k;
+} sstable_t;
+
+typedef struct lsm_level_s {
+	sstable_t **files;	// L0: by file number, L1+: by key, no overlap
+	int nfiles;
+	int capacity;
+	uint64_t bytes;
+} lsm_level_t;
+
+typedef struct lsm_s {
+
+	skiplist *mem;
+	size_t mem_size;
+
+	skiplist *imm[LSM_MAX_IMMUTABLE];	// oldest first
+	int imm_keys[LSM_MAX_IMMUTABLE];	// key count once imm[i] is durable
+	int imm_count;
+
+	lsm_level_t levels[LSM_MAX_LEVELS];
+	int compact_ptr[LSM_MAX_LEVELS];
+
+	uint64_t next_file;
+	int count;
+	int durable_count;	// matches the flushed tables, goes to the manifest
+
+	char *value_buf;
+	size_t value_cap;
+
+	pthread_t worker;
+	pthread_mutex_t mutex;	// imm[] and levels[], the memtable is owned by the caller thread
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int closing;
+
+	uint64_t flushes;
+	uint64_t compactions;
+
+} lsm_t;
+
+
+lsm_t Lsm;
+
+
+static char *_lsm_strdup(const char *str) {
+
+	size_t len = strlen(str);
+	char *copy = kvstore_malloc(len + 1);
+	if (copy) memcpy(copy, str, len + 1);
+
+	return copy;
+}
+
+static void _lsm_sst_path(uint64_t number, char *path, size_t len) {
+	snprintf(path, len, "%s/%06llu.sst", LSM_DATA_DIR, (unsigned long long)number);
+}
+
+
+// ---------------- bloom filter ----------------
+
+static uint64_t _lsm_bloom_hash(const char *key) {
+
+	uint64_t hash = 14695981039346656037ULL;
+	while (*key) {
+		hash ^= (uint8_t)*key ++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int _lsm_bloom_may_contain(sstable_t *sst, const char *key) {
+
+	if (!sst->bloom || sst->bloom_bits == 0) return 1;
+
+	uint64_t hash = _lsm_bloom_hash(key);
+	uint64_t delta = (hash >> 33) | (hash << 31);
+
+	uint32_t i = 0;
+	for (i = 0;i < sst->bloom_k;i ++) {
+		uint64_t bit = hash % sst->bloom_bits;
+		if (!(sst->bloom[bit >> 3] & (1 << (bit & 7)))) return 0;
+		hash += delta;
+	}
+	return 1;
+}
+
+
+// ---------------- sstable reader ----------------
+
+static uint32_t _lsm_get_u32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t _lsm_get_u64(const char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static int _lsm_pread(int fd, void *buf, size_t len, off_t off) {
+
+	size_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, (char *)buf + done, len - done, off + done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static void _lsm_sst_close(sstable_t *sst) {
+
+	if (!sst) return ;
+
+	int i = 0;
+	for (i = 0;i < sst->nblocks;i ++) {
+		kvstore_free(sst->blocks[i].last_key);
+	}
+	if (sst->blocks) kvstore_free(sst->blocks);
+	if (sst->bloom) kvstore_free(sst->bloom);
+	if (sst->smallest) kvstore_free(sst->smallest);
+	if (sst->largest) kvstore_free(sst->largest);
+	if (sst->fd >= 0) close(sst->fd);
+
+	kvstore_free(sst);
+}
+
+static char *_lsm_read_block(sstable_t *sst, int idx) {
+
+	lsm_block_handle_t *h = &sst->blocks[idx];
+
+	char *buf = kvstore_malloc(h->size);
+	if (!buf) return NULL;
+
+	if (_lsm_pread(sst->fd, buf, h->size, h->offset) != 0) {
+		kvstore_free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static sstable_t *_lsm_sst_open(uint64_t number) {
+
+	char path[256] = {0};
+	_lsm_sst_path(number, path, sizeof(path));
+
+	sstable_t *sst = kvstore_malloc(sizeof(sstable_t));
+	if (!sst) return NULL;
+	memset(sst, 0, sizeof(sstable_t));
+	sst->number = number;
+
+	sst->fd = open(path, O_RDONLY);
+	if (sst->fd < 0) goto failed;
+
+	struct stat st;
+	if (fstat(sst->fd, &st) != 0 || st.st_size < LSM_FOOTER_SIZE) goto failed;
+	sst->size = st.st_size;
+
+	char footer[LSM_FOOTER_SIZE];
+	if (_lsm_pread(sst->fd, footer, LSM_FOOTER_SIZE, sst->size - LSM_FOOTER_SIZE) != 0) goto failed;
+	if (_lsm_get_u32(footer + 24) != LSM_SST_MAGIC) goto failed;
+
+	uint64_t index_off = _lsm_get_u64(footer);
+	uint64_t bloom_off = _lsm_get_u64(footer + 8);
+	sst->entries = _lsm_get_u64(footer + 16);
+
+	// index, then bloom, then the footer; a torn or foreign file fails here
+	uint64_t meta_end = sst->size - LSM_FOOTER_SIZE;
+	if (index_off > bloom_off || bloom_off > meta_end) goto failed;
+	if (bloom_off - index_off < 4 || meta_end - bloom_off < 8) goto failed;
+
+	// index and bloom are contiguous, load them in one read
+	size_t meta_len = meta_end - index_off;
+	size_t index_len = bloom_off - index_off;
+	char *meta = kvstore_malloc(meta_len);
+	if (!meta) goto failed;
+	if (_lsm_pread(sst->fd, meta, meta_len, index_off) != 0) {
+		kvstore_free(meta);
+		goto failed;
+	}
+
+	char *p = meta;
+	uint32_t nblocks = _lsm_get_u32(p);
+	p += 4;
+	// every handle takes at least 13 bytes of the index
+	if (nblocks > (index_len - 4) / 13) {
+		kvstore_free(meta);
+		goto failed;
+	}
+	sst->blocks = kvstore_malloc(sizeof(lsm_block_handle_t) * (nblocks ? nblocks : 1));
+	if (!sst->blocks) {
+		kvstore_free(meta);
+		goto failed;
+	}
+	memset(sst->blocks, 0, sizeof(lsm_block_handle_t) * (nblocks ? nblocks : 1));
+	sst->nblocks = nblocks;
+
+	int i = 0;
+	for (i = 0;i < sst->nblocks;i ++) {
+		size_t left = index_len - (size_t)(p - meta);
+		uint32_t klen = left >= 13 ? _lsm_get_u32(p + 8) : 0;
+		if (left < 13 || klen > left - 13 || p[12 + klen] != '\0') {
+			kvstore_free(meta);
+			goto failed;
+		}
+		sst->blocks[i].offset = _lsm_get_u32(p);
+		sst->blocks[i].size = _lsm_get_u32(p + 4);
+		sst->blocks[i].last_key = _lsm_strdup(p + 12);
+		p += 12 + klen + 1;
+	}
+
+	p = meta + (bloom_off - index_off);
+	sst->bloom_bits = _lsm_get_u32(p);
+	sst->bloom_k = _lsm_get_u32(p + 4);
+	if (sst->bloom_bits / 8 > meta_end - bloom_off - 8) {
+		kvstore_free(meta);
+		goto failed;
+	}
+	if (sst->bloom_bits) {
+		sst->bloom = kvstore_malloc(sst->bloom_bits / 8);
+		if (sst->bloom) memcpy(sst->bloom, p + 8, sst->bloom_bits / 8);
+	}
+
+	kvstore_free(meta);
+
+	// smallest key is the first record of the first block
+	if (sst->nblocks > 0) {
+		char *block = _lsm_read_block(sst, 0);
+		if (!block) goto failed;
+		sst->smallest = _lsm_strdup(block + 8);
+		kvstore_free(block);
+		sst->largest = _lsm_strdup(sst->blocks[sst->nblocks - 1].last_key);
+	} else {
+		sst->smallest = _lsm_strdup("");
+		sst->largest = _lsm_strdup("");
+	}
+
+	return sst;
+
+failed:
+	_lsm_sst_close(sst);
+	return NULL;
+}
+
+// 1: found (*value may be the tombstone), 0: not in this table, -1: io error
+static int _lsm_sst_get(lsm_t *lsm, sstable_t *sst, const char *key, char **value) {
+
+	if (strcmp(key, sst->smallest) < 0 || strcmp(key, sst->largest) > 0) return 0;
+	if (!_lsm_bloom_may_contain(sst, key)) return 0;
+
+	// first block whose last key >= key
+	int lo = 0, hi = sst->nblocks - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strcmp(sst->blocks[mid].last_key, key) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if (lo >= sst->nblocks) return 0;
+
+	char *block = _lsm_read_block(sst, lo);
+	if (!block) return -1;
+
+	int found = 0;
+	uint32_t pos = 0;
+	while (pos < sst->blocks[lo].size) {
+		uint32_t klen = _lsm_get_u32(block + pos);
+		uint32_t vlen = _lsm_get_u32(block + pos + 4);
+		char *k = block + pos + 8;
+		char *v = k + klen + 1;
+
+		int cmp = strcmp(k, key);
+		if (cmp == 0) {
+			if (lsm->value_cap < vlen + 1) {
+				char *buf = kvstore_malloc(vlen + 1);
+				if (!buf) break;
+				if (lsm->value_buf) kvstore_free(lsm->value_buf);
+				lsm->value_buf = buf;
+				lsm->value_cap = vlen + 1;
+			}
+			memcpy(lsm->value_buf, v, vlen + 1);
+			*value = lsm->value_buf;
+			found = 1;
+			break;
+		}
+		if (cmp > 0) break;
+
+		pos += 8 + klen + 1 + vlen + 1;
+	}
+
+	kvstore_free(block);
+
+	return found;
+}
+
+
+// ---------------- sstable iterator ----------------
+
+typedef struct lsm_iter_s {
+	sstable_t *sst;
+	int priority;		// bigger is newer
+
+	int block;
+	char *buf;
+	uint32_t pos;
+
+	char *key;
+	char *value;
+	int valid;
+} lsm_iter_t;
+
+static void _lsm_iter_next(lsm_iter_t *it) {
+
+	while (1) {
+		if (it->buf && it->pos < it->sst->blocks[it->block].size) {
+			uint32_t klen = _lsm_get_u32(it->buf + it->pos);
+			uint32_t vlen = _lsm_get_u32(it->buf + it->pos + 4);
+			it->key = it->buf + it->pos + 8;
+			it->value = it->key + klen + 1;
+			it->pos += 8 + klen + 1 + vlen + 1;
+			it->valid = 1;
+			return ;
+		}
+
+		if (it->buf) {
+			kvstore_free(it->buf);
+			it->buf = NULL;
+			it->block ++;
+		}
+		if (it->block >= it->sst->nblocks) {
+			it->valid = 0;
+			return ;
+		}
+
+		it->buf = _lsm_read_block(it->sst, it->block);
+		it->pos = 0;
+		if (!it->buf) {
+			it->valid = 0;
+			return ;
+		}
+	}
+}
+
+static void _lsm_iter_init(lsm_iter_t *it, sstable_t *sst, int priority) {
+
+	memset(it, 0, sizeof(lsm_iter_t));
+	it->sst = sst;
+	it->priority = priority;
+
+	_lsm_iter_next(it);
+}
+
+static void _lsm_iter_release(lsm_iter_t *it) {
+	if (it->buf) kvstore_free(it->buf);
+	it->buf = NULL;
+}
+
+
+// ---------------- sstable builder ----------------
+
+typedef struct lsm_builder_s {
+	FILE *fp;
+	uint64_t number;
+	uint64_t offset;
+
+	char *block;
+	uint32_t block_len;
+	uint32_t block_cap;
+	char *last_key;
+
+	lsm_block_handle_t *handles;
+	int nhandles;
+	int handles_cap;
+
+	uint64_t *hashes;
+	uint64_t entries;
+	uint64_t hashes_cap;
+
+	int failed;
+} lsm_builder_t;
+
+static int _lsm_builder_open(lsm_builder_t *b, uint64_t number) {
+
+	char path[256] = {0};
+	_lsm_sst_path(number, path, sizeof(path));
+
+	memset(b, 0, sizeof(lsm_builder_t));
+	b->number = number;
+
+	b->fp = fopen(path, "wb");
+	if (!b->fp) return -1;
+
+	b->block_cap = LSM_BLOCK_SIZE * 2;
+	b->block = kvstore_malloc(b->block_cap);
+	if (!b->block) {
+		fclose(b->fp);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void _lsm_builder_flush_block(lsm_builder_t *b) {
+
+	if (b->block_len == 0) return ;
+
+	if (b->nhandles == b->handles_cap) {
+		int cap = b->handles_cap ? b->handles_cap * 2 : 64;
+		lsm_block_handle_t *handles = kvstore_malloc(sizeof(lsm_block_handle_t) * cap);
+		if (!handles) {
+			b->failed = 1;
+			return ;
+		}
+		if (b->handles) {
+			memcpy(handles, b->handles, sizeof(lsm_block_handle_t) * b->nhandles);
+			kvstore_free(b->handles);
+		}
+		b->handles = handles;
+		b->handles_cap = cap;
+	}
+
+	if (fwrite(b->block, 1, b->block_len, b->fp) != b->block_len) b->failed = 1;
+
+	lsm_block_handle_t *h = &b->handles[b->nhandles ++];
+	h->offset = (uint32_t)b->offset;
+	h->size = b->block_len;
+	h->last_key = b->last_key;	// ownership moves to the handle
+	b->last_key = NULL;
+
+	b->offset += b->block_len;
+	b->block_len = 0;
+}
+
+static int _lsm_builder_add(lsm_builder_t *b, const char *key, const char *value) {
+
+	uint32_t klen = strlen(key);
+	uint32_t vlen = strlen(value);
+	uint32_t need = 8 + klen + 1 + vlen + 1;
+
+	if (b->block_len + need > b->block_cap) {
+		uint32_t cap = b->block_len + need;
+		char *block = kvstore_malloc(cap);
+		if (!block) return -1;
+		memcpy(block, b->block, b->block_len);
+		kvstore_free(b->block);
+		b->block = block;
+		b->block_cap = cap;
+	}
+
+	char *p = b->block + b->block_len;
+	memcpy(p, &klen, 4);
+	memcpy(p + 4, &vlen, 4);
+	memcpy(p + 8, key, klen + 1);
+	memcpy(p + 8 + klen + 1, value, vlen + 1);
+	b->block_len += need;
+
+	if (b->last_key) kvstore_free(b->last_key);
+	b->last_key = _lsm_strdup(key);
+
+	if (b->entries == b->hashes_cap) {
+		uint64_t cap = b->hashes_cap ? b->hashes_cap * 2 : 1024;
+		uint64_t *hashes = kvstore_malloc(sizeof(uint64_t) * cap);
+		if (!hashes) return -1;
+		if (b->hashes) {
+			memcpy(hashes, b->hashes, sizeof(uint64_t) * b->entries);
+			kvstore_free(b->hashes);
+		}
+		b->hashes = hashes;
+		b->hashes_cap = cap;
+	}
+	b->hashes[b->entries ++] = _lsm_bloom_hash(key);
+
+	if (b->block_len >= LSM_BLOCK_SIZE) {
+		_lsm_builder_flush_block(b);
+	}
+
+	return b->failed ? -1 : 0;
+}
+
+static uint64_t _lsm_builder_size(lsm_builder_t *b) {
+	return b->offset + b->block_len;
+}
+
+static void _lsm_builder_abandon(lsm_builder_t *b) {
+
+	char path[256] = {0};
+	int i = 0;
+
+	for (i = 0;i < b->nhandles;i ++) {
+		kvstore_free(b->handles[i].last_key);
+	}
+	if (b->handles) kvstore_free(b->handles);
+	if (b->hashes) kvstore_free(b->hashes);
+	if (b->block) kvstore_free(b->block);
+	if (b->last_key) kvstore_free(b->last_key);
+
+	if (b->fp) {
+		fclose(b->fp);
+		_lsm_sst_path(b->number, path, sizeof(path));
+		unlink(path);
+	}
+	b->fp = NULL;
+}
+
+// writes index, bloom and footer, then reopens the file as a table
+static sstable_t *_lsm_builder_finish(lsm_builder_t *b) {
+
+	_lsm_builder_flush_block(b);
+
+	uint64_t index_off = b->offset;
+	uint32_t n = b->nhandles;
+	fwrite(&n, 4, 1, b->fp);
+
+	int i = 0;
+	for (i = 0;i < b->nhandles;i ++) {
+		uint32_t klen = strlen(b->handles[i].last_key);
+		fwrite(&b->handles[i].offset, 4, 1, b->fp);
+		fwrite(&b->handles[i].size, 4, 1, b->fp);
+		fwrite(&klen, 4, 1, b->fp);
+		fwrite(b->handles[i].last_key, 1, klen + 1, b->fp);
+		b->offset += 12 + klen + 1;
+	}
+	b->offset += 4;
+
+	uint64_t bloom_off = b->offset;
+	uint32_t bits = (uint32_t)(b->entries * LSM_BLOOM_BITS_PER_KEY);
+	if (bits < 64) bits = 64;
+	bits = (bits + 7) & ~7U;
+	uint32_t k = 7;	// ~ln2 * bits per key
+
+	uint8_t *bloom = kvstore_malloc(bits / 8);
+	if (!bloom) {
+		_lsm_builder_abandon(b);
+		return NULL;
+	}
+	memset(bloom, 0, bits / 8);
+
+	uint64_t e = 0;
+	for (e = 0;e < b->entries;e ++) {
+		uint64_t hash = b->hashes[e];
+		uint64_t delta = (hash >> 33) | (hash << 31);
+		uint32_t j = 0;
+		for (j = 0;j < k;j ++) {
+			uint64_t bit = hash % bits;
+			bloom[bit >> 3] |= (1 << (bit & 7));
+			hash += delta;
+		}
+	}
+
+	fwrite(&bits, 4, 1, b->fp);
+	fwrite(&k, 4, 1, b->fp);
+	fwrite(bloom, 1, bits / 8, b->fp);
+	kvstore_free(bloom);
+
+	char footer[LSM_FOOTER_SIZE] = {0};
+	uint32_t magic = LSM_SST_MAGIC;
+	memcpy(footer, &index_off, 8);
+	memcpy(footer + 8, &bloom_off, 8);
+	memcpy(footer + 16, &b->entries, 8);
+	memcpy(footer + 24, &magic, 4);
+	fwrite(footer, 1, LSM_FOOTER_SIZE, b->fp);
+
+	int failed = b->failed || fflush(b->fp) != 0 || fsync(fileno(b->fp)) != 0;
+	if (failed) {
+		_lsm_builder_abandon(b);
+		return NULL;
+	}
+
+	fclose(b->fp);
+	b->fp = NULL;
+	_lsm_builder_abandon(b);	// releases the buffers, the file stays
+
+	return _lsm_sst_open(b->number);
+}
+
+
+// ---------------- version: levels and manifest ----------------
+
+static uint64_t _lsm_level_limit(int level) {
+
+	uint64_t limit = LSM_LEVEL_BASE;
+	while (-- level > 0) limit *= 10;
+
+	return limit;
+}
+
+static int _lsm_level_insert(lsm_level_t *lv, int level, sstable_t *sst) {
+
+	if (lv->nfiles == lv->capacity) {
+		int cap = lv->capacity ? lv->capacity * 2 : 16;
+		sstable_t **files = kvstore_malloc(sizeof(sstable_t *) * cap);
+		if (!files) return -1;
+		if (lv->files) {
+			memcpy(files, lv->files, sizeof(sstable_t *) * lv->nfiles);
+			kvstore_free(lv->files);
+		}
+		lv->files = files;
+		lv->capacity = cap;
+	}
+
+	int pos = lv->nfiles;
+	if (level > 0) {
+		while (pos > 0 && strcmp(lv->files[pos - 1]->smallest, sst->smallest) > 0) pos --;
+	} else {
+		while (pos > 0 && lv->files[pos - 1]->number > sst->number) pos --;
+	}
+
+	memmove(&lv->files[pos + 1], &lv->files[pos], sizeof(sstable_t *) * (lv->nfiles - pos));
+	lv->files[pos] = sst;
+	lv->nfiles ++;
+	lv->bytes += sst->size;
+
+	return 0;
+}
+
+static void _lsm_level_remove(lsm_level_t *lv, sstable_t *sst) {
+
+	int i = 0;
+	for (i = 0;i < lv->nfiles;i ++) {
+		if (lv->files[i] == sst) {
+			memmove(&lv->files[i], &lv->files[i + 1], sizeof(sstable_t *) * (lv->nfiles - i - 1));
+			lv->nfiles --;
+			lv->bytes -= sst->size;
+			return ;
+		}
+	}
+}
+
+// caller holds the mutex
+static int _lsm_write_manifest(lsm_t *lsm) {
+
+	char path[256] = {0}, tmp[256] = {0};
+	snprintf(path, sizeof(path), "%s/%s", LSM_DATA_DIR, LSM_MANIFEST);
+	snprintf(tmp, sizeof(tmp), "%s/%s.tmp", LSM_DATA_DIR, LSM_MANIFEST);
+
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) return -1;
+
+	fprintf(fp, "next_file %llu\n", (unsigned long long)lsm->next_file);
+	fprintf(fp, "count %d\n", lsm->durable_count);
+
+	int level = 0, i = 0;
+	for (level = 0;level < LSM_MAX_LEVELS;level ++) {
+		for (i = 0;i < lsm->levels[level].nfiles;i ++) {
+			fprintf(fp, "%d %llu\n", level, (unsigned long long)lsm->levels[level].files[i]->number);
+		}
+	}
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	return rename(tmp, path);
+}
+
+static int _lsm_load_manifest(lsm_t *lsm) {
+
+	char path[256] = {0};
+	snprintf(path, sizeof(path), "%s/%s", LSM_DATA_DIR, LSM_MANIFEST);
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) return 0; // fresh store
+
+	char line[128] = {0};
+	while (fgets(line, sizeof(line), fp)) {
+		unsigned long long number = 0;
+		int level = 0;
+
+		if (sscanf(line, "next_file %llu", &number) == 1) {
+			lsm->next_file = number;
+		} else if (sscanf(line, "count %d", &level) == 1) {
+			lsm->count = level;
+			lsm->durable_count = level;
+		} else if (sscanf(line, "%d %llu", &level, &number) == 2) {
+			if (level < 0 || level >= LSM_MAX_LEVELS) continue;
+
+			sstable_t *sst = _lsm_sst_open(number);
+			if (!sst) {
+				fprintf(stderr, "lsm: cannot open sstable %llu\n", number);
+				continue;
+			}
+			_lsm_level_insert(&lsm->levels[level], level, sst);
+		}
+	}
+
+	fclose(fp);
+
+	return 0;
+}
+
+static void _lsm_drop_sst(sstable_t *sst) {
+
+	char path[256] = {0};
+	_lsm_sst_path(sst->number, path, sizeof(path));
+
+	_lsm_sst_close(sst);
+	unlink(path);
+}
+
+
+// ---------------- flush and compaction, worker thread ----------------
+
+static int _lsm_flush_cb(char *key, char *value, void *arg) {
+
+	lsm_builder_t *b = (lsm_builder_t *)arg;
+	return _lsm_builder_add(b, key, value) != 0;
+}
+
+// mutex held on entry and exit, released while writing the table
+static void _lsm_flush_immutable(lsm_t *lsm) {
+
+	skiplist *imm = lsm->imm[0];
+	uint64_t number = lsm->next_file ++;
+
+	pthread_mutex_unlock(&lsm->mutex);
+
+	sstable_t *sst = NULL;
+	lsm_builder_t b;
+	if (_lsm_builder_open(&b, number) == 0) {
+		kvs_skiptable_scan(imm, NULL, _lsm_flush_cb, &b);
+		if (b.failed) {
+			_lsm_builder_abandon(&b);
+		} else {
+			sst = _lsm_builder_finish(&b);
+		}
+	}
+
+	pthread_mutex_lock(&lsm->mutex);
+
+	if (!sst) {
+		// keep the memtable readable and retry later
+		fprintf(stderr, "lsm: flush of memtable failed: %s\n", strerror(errno));
+		pthread_mutex_unlock(&lsm->mutex);
+		sleep(1);
+		pthread_mutex_lock(&lsm->mutex);
+		return ;
+	}
+
+	_lsm_level_insert(&lsm->levels[0], 0, sst);
+	lsm->durable_count = lsm->imm_keys[0];
+	memmove(&lsm->imm[0], &lsm->imm[1], sizeof(skiplist *) * (lsm->imm_count - 1));
+	memmove(&lsm->imm_keys[0], &lsm->imm_keys[1], sizeof(int) * (lsm->imm_count - 1));
+	lsm->imm_count --;
+	lsm->flushes ++;
+	_lsm_write_manifest(lsm);
+
+	pthread_cond_broadcast(&lsm->done_cond);
+
+	pthread_mutex_unlock(&lsm->mutex);
+	kvstore_skiptable_free(imm);
+	pthread_mutex_lock(&lsm->mutex);
+}
+
+
+typedef struct lsm_compaction_s {
+	int level;			// inputs come from level and level + 1
+	sstable_t **inputs;
+	int ninputs;
+	int nlower;			// inputs[0 .. nlower) are in level + 1
+	sstable_t **outputs;
+	int noutputs;
+	int outputs_cap;
+} lsm_compaction_t;
+
+static int _lsm_overlap(sstable_t *sst, const char *smallest, const char *largest) {
+	return !(strcmp(sst->largest, smallest) < 0 || strcmp(sst->smallest, largest) > 0);
+}
+
+// mutex held. picks L0 by file count, L1+ by level size
+static int _lsm_pick_compaction(lsm_t *lsm, lsm_compaction_t *c) {
+
+	memset(c, 0, sizeof(lsm_compaction_t));
+
+	int level = -1;
+	if (lsm->levels[0].nfiles >= LSM_L0_COMPACT_TRIGGER) {
+		level = 0;
+	} else {
+		int i = 0;
+		for (i = 1;i < LSM_MAX_LEVELS - 1;i ++) {
+			if (lsm->levels[i].bytes > _lsm_level_limit(i)) {
+				level = i;
+				break;
+			}
+		}
+	}
+	if (level < 0) return 0;
+
+	lsm_level_t *upper = &lsm->levels[level];
+	lsm_level_t *lower = &lsm->levels[level + 1];
+
+	c->level = level;
+	c->inputs = kvstore_malloc(sizeof(sstable_t *) * (upper->nfiles + lower->nfiles));
+	if (!c->inputs) return 0;
+
+	const char *smallest = NULL, *largest = NULL;
+	int i = 0;
+
+	if (level == 0) {
+		for (i = 0;i < upper->nfiles;i ++) {
+			sstable_t *sst = upper->files[i];
+			if (!smallest || strcmp(sst->smallest, smallest) < 0) smallest = sst->smallest;
+			if (!largest || strcmp(sst->largest, largest) > 0) largest = sst->largest;
+		}
+	} else {
+		// round robin over the key space of the level
+		sstable_t *sst = upper->files[lsm->compact_ptr[level] % upper->nfiles];
+		lsm->compact_ptr[level] ++;
+		smallest = sst->smallest;
+		largest = sst->largest;
+	}
+
+	for (i = 0;i < lower->nfiles;i ++) {
+		if (_lsm_overlap(lower->files[i], smallest, largest)) {
+			c->inputs[c->ninputs ++] = lower->files[i];
+		}
+	}
+	c->nlower = c->ninputs;
+
+	for (i = 0;i < upper->nfiles;i ++) {
+		if (_lsm_overlap(upper->files[i], smallest, largest)) {
+			c->inputs[c->ninputs ++] = upper->files[i];
+		}
+	}
+
+	return 1;
+}
+
+static int _lsm_compaction_output(lsm_compaction_t *c, sstable_t *sst) {
+
+	if (c->noutputs == c->outputs_cap) {
+		int cap = c->outputs_cap ? c->outputs_cap * 2 : 8;
+		sstable_t **outputs = kvstore_malloc(sizeof(sstable_t *) * cap);
+		if (!outputs) return -1;
+		if (c->outputs) {
+			memcpy(outputs, c->outputs, sizeof(sstable_t *) * c->noutputs);
+			kvstore_free(c->outputs);
+		}
+		c->outputs = outputs;
+		c->outputs_cap = cap;
+	}
+	c->outputs[c->noutputs ++] = sst;
+
+	return 0;
+}
+
+// k-way merge, runs without the mutex: only this thread changes levels[]
+static int _lsm_do_compaction(lsm_t *lsm, lsm_compaction_t *c, int drop_tombstones) {
+
+	lsm_iter_t *iters = kvstore_malloc(sizeof(lsm_iter_t) * c->ninputs);
+	if (!iters) return -1;
+
+	int i = 0;
+	for (i = 0;i < c->ninputs;i ++) {
+		// lower level is the oldest, L0 files are ordered by file number
+		int priority = 0;
+		if (i >= c->nlower) {
+			priority = (c->level == 0) ? (int)c->inputs[i]->number : 1;
+		}
+		_lsm_iter_init(&iters[i], c->inputs[i], priority);
+	}
+
+	int ret = 0;
+	int open = 0;
+	lsm_builder_t b;
+
+	while (1) {
+
+		int best = -1;
+		for (i = 0;i < c->ninputs;i ++) {
+			if (!iters[i].valid) continue;
+			if (best < 0) {
+				best = i;
+				continue;
+			}
+			int cmp = strcmp(iters[i].key, iters[best].key);
+			if (cmp < 0 || (cmp == 0 && iters[i].priority > iters[best].priority)) best = i;
+		}
+		if (best < 0) break;
+
+		if (!(drop_tombstones && LSM_IS_TOMBSTONE(iters[best].value))) {
+
+			if (!open) {
+				pthread_mutex_lock(&lsm->mutex);
+				uint64_t number = lsm->next_file ++;
+				pthread_mutex_unlock(&lsm->mutex);
+
+				if (_lsm_builder_open(&b, number) != 0) {
+					ret = -1;
+					break;
+				}
+				open = 1;
+			}
+
+			if (_lsm_builder_add(&b, iters[best].key, iters[best].value) != 0) {
+				ret = -1;
+				break;
+			}
+
+			if (_lsm_builder_size(&b) >= LSM_SST_TARGET_SIZE) {
+				sstable_t *sst = _lsm_builder_finish(&b);
+				open = 0;
+				if (!sst || _lsm_compaction_output(c, sst) != 0) {
+					ret = -1;
+					break;
+				}
+			}
+		}
+
+		// skip the shadowed versions of this key; the key lives in iters[best]'s
+		// block buffer, so advance the others first
+		for (i = 0;i < c->ninputs;i ++) {
+			if (i != best && iters[i].valid && strcmp(iters[i].key, iters[best].key) == 0) {
+				_lsm_iter_next(&iters[i]);
+			}
+		}
+		_lsm_iter_next(&iters[best]);
+	}
+
+	if (open) {
+		if (ret == 0) {
+			sstable_t *sst = _lsm_builder_finish(&b);
+			if (!sst || _lsm_compaction_output(c, sst) != 0) ret = -1;
+		} else {
+			_lsm_builder_abandon(&b);
+		}
+	}
+
+	for (i = 0;i < c->ninputs;i ++) {
+		_lsm_iter_release(&iters[i]);
+	}
+	kvstore_free(iters);
+
+	return ret;
+}
+
+static void _lsm_compaction_release(lsm_compaction_t *c) {
+	if (c->inputs) kvstore_free(c->inputs);
+	if (c->outputs) kvstore_free(c->outputs);
+}
+
+// mutex held on entry and exit
+static void _lsm_compact(lsm_t *lsm, lsm_compaction_t *c) {
+
+	int i = 0;
+	int target = c->level + 1;
+
+	// a single file without overlap just moves down a level
+	if (c->level > 0 && c->ninputs == 1 && c->nlower == 0) {
+		_lsm_level_remove(&lsm->levels[c->level], c->inputs[0]);
+		_lsm_level_insert(&lsm->levels[target], target, c->inputs[0]);
+		_lsm_write_manifest(lsm);
+		_lsm_compaction_release(c);
+		return ;
+	}
+
+	int bottom = 1;
+	for (i = target + 1;i < LSM_MAX_LEVELS;i ++) {
+		if (lsm->levels[i].nfiles) bottom = 0;
+	}
+
+	pthread_mutex_unlock(&lsm->mutex);
+	int ret = _lsm_do_compaction(lsm, c, bottom);
+	pthread_mutex_lock(&lsm->mutex);
+
+	if (ret != 0) {
+		fprintf(stderr, "lsm: compaction of level %d failed\n", c->level);
+		for (i = 0;i < c->noutputs;i ++) {
+			_lsm_drop_sst(c->outputs[i]);
+		}
+		_lsm_compaction_release(c);
+
+		pthread_mutex_unlock(&lsm->mutex);
+		sleep(1);
+		pthread_mutex_lock(&lsm->mutex);
+		return ;
+	}
+
+	for (i = 0;i < c->ninputs;i ++) {
+		_lsm_level_remove(&lsm->levels[i < c->nlower ? target : c->level], c->inputs[i]);
+	}
+	for (i = 0;i < c->noutputs;i ++) {
+		_lsm_level_insert(&lsm->levels[target], target, c->outputs[i]);
+	}
+	lsm->compactions ++;
+	_lsm_write_manifest(lsm);
+
+	// readers look files up under the mutex, none can hold the inputs now
+	for (i = 0;i < c->ninputs;i ++) {
+		_lsm_drop_sst(c->inputs[i]);
+	}
+
+	_lsm_compaction_release(c);
+}
+
+#if ENABLE_EBR
+// no event loop on this thread: what a flush retired, the shared values of
+// the memtable, is waited out here with the lock dropped
+static void _lsm_worker_quiescent(lsm_t *lsm) {
+
+	pthread_mutex_unlock(&lsm->mutex);
+	kvs_ebr_synchronize();
+	pthread_mutex_lock(&lsm->mutex);
+}
+#endif
+
+static void *_lsm_worker(void *arg) {
+
+	lsm_t *lsm = (lsm_t *)arg;
+
+	kvs_mem_engine = KVS_ENGINE_LSM; // frees what the memtable allocated
+
+	pthread_mutex_lock(&lsm->mutex);
+
+	while (1) {
+
+		if (lsm->imm_count > 0) {
+			_lsm_flush_immutable(lsm);
+#if ENABLE_EBR
+			_lsm_worker_quiescent(lsm);
+#endif
+			continue;
+		}
+
+		if (lsm->closing) break;
+
+		lsm_compaction_t c;
+		if (_lsm_pick_compaction(lsm, &c)) {
+			_lsm_compact(lsm, &c);
+			continue;
+		}
+
+		pthread_cond_wait(&lsm->work_cond, &lsm->mutex);
+	}
+
+	pthread_mutex_unlock(&lsm->mutex);
+
+	return NULL;
+}
+
+
+// ---------------- read/write path ----------------
+
+// freeze the memtable, stalls while the worker is behind
+static int _lsm_rotate_memtable(lsm_t *lsm) {
+
+	skiplist *mem = kvstore_skiptable_new();
+	if (!mem) return -1;
+
+	pthread_mutex_lock(&lsm->mutex);
+
+	while (lsm->imm_count == LSM_MAX_IMMUTABLE) {
+		pthread_cond_wait(&lsm->done_cond, &lsm->mutex);
+	}
+
+	lsm->imm_keys[lsm->imm_count] = lsm->count;
+	lsm->imm[lsm->imm_count ++] = lsm->mem;
+	lsm->mem = mem;
+	lsm->mem_size = 0;
+
+	pthread_cond_signal(&lsm->work_cond);
+	pthread_mutex_unlock(&lsm->mutex);
+
+	return 0;
+}
+
+static int _lsm_put(lsm_t *lsm, char *key, char *value) {
+
+	if (kvs_skiptable_set(lsm->mem, key, value) != 0) return -1;
+
+	// approximate node footprint: key, value and the node itself
+	lsm->mem_size += strlen(key) + strlen(value) + 64;
+
+	if (lsm->mem_size >= LSM_MEMTABLE_SIZE) {
+		return _lsm_rotate_memtable(lsm);
+	}
+
+	return 0;
+}
+
+// returns the live value, NULL if no exist or deleted
+static char *_lsm_lookup(lsm_t *lsm, char *key) {
+
+	// the memtable is only written by this thread, no lock needed
+	char *value = kvs_skiptable_get(lsm->mem, key);
+	if (value) {
+		return LSM_IS_TOMBSTONE(value) ? NULL : value;
+	}
+
+	char *result = NULL;
+	int found = 0;
+
+	pthread_mutex_lock(&lsm->mutex);
+
+	int i = 0;
+	for (i = lsm->imm_count - 1;i >= 0 && !found;i --) {
+		value = kvs_skiptable_get(lsm->imm[i], key);
+		if (value) {
+			found = 1;
+			if (!LSM_IS_TOMBSTONE(value)) {
+				// the worker frees the memtable after flushing, copy out
+				size_t vlen = strlen(value);
+				if (lsm->value_cap < vlen + 1) {
+					char *buf = kvstore_malloc(vlen + 1);
+					if (buf) {
+						if (lsm->value_buf) kvstore_free(lsm->value_buf);
+						lsm->value_buf = buf;
+						lsm->value_cap = vlen + 1;
+					}
+				}
+				if (lsm->value_cap >= vlen + 1) {
+					memcpy(lsm->value_buf, value, vlen + 1);
+					result = lsm->value_buf;
+				}
+			}
+		}
+	}
+
+	lsm_level_t *l0 = &lsm->levels[0];
+	for (i = l0->nfiles - 1;i >= 0 && !found;i --) {
+		if (_lsm_sst_get(lsm, l0->files[i], key, &value) > 0) {
+			found = 1;
+			if (!LSM_IS_TOMBSTONE(value)) result = value;
+		}
+	}
+
+	int level = 1;
+	for (level = 1;level < LSM_MAX_LEVELS && !found;level ++) {
+		lsm_level_t *lv = &lsm->levels[level];
+
+		// first file whose largest key >= key
+		int lo = 0, hi = lv->nfiles;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (strcmp(lv->files[mid]->largest, key) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo < lv->nfiles && _lsm_sst_get(lsm, lv->files[lo], key, &value) > 0) {
+			found = 1;
+			if (!LSM_IS_TOMBSTONE(value)) result = value;
+		}
+	}
+
+	pthread_mutex_unlock(&lsm->mutex);
+
+	return result;
+}
+
+
+int init_lsm(lsm_t *lsm) {
+
+	if (!lsm) return -1;
+
+	memset(lsm, 0, sizeof(lsm_t));
+	lsm->next_file = 1;
+
+	if (mkdir(LSM_DATA_DIR, 0755) != 0 && errno != EEXIST) {
+		perror("lsm mkdir");
+		return -1;
+	}
+
+	lsm->mem = kvstore_skiptable_new();
+	if (!lsm->mem) return -1;
+
+	pthread_mutex_init(&lsm->mutex, NULL);
+	pthread_cond_init(&lsm->work_cond, NULL);
+	pthread_cond_init(&lsm->done_cond, NULL);
+
+	_lsm_load_manifest(lsm);
+
+	if (pthread_create(&lsm->worker, NULL, _lsm_worker, lsm) != 0) {
+		kvstore_skiptable_free(lsm->mem);
+		lsm->mem = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void dest_lsm(lsm_t *lsm) {
+
+	if (!lsm || !lsm->mem) return ;
+
+	pthread_mutex_lock(&lsm->mutex);
+	if (kvs_skiptable_count(lsm->mem) > 0) {
+		while (lsm->imm_count == LSM_MAX_IMMUTABLE) {
+			pthread_cond_wait(&lsm->done_cond, &lsm->mutex);
+		}
+		lsm->imm_keys[lsm->imm_count] = lsm->count;
+		lsm->imm[lsm->imm_count ++] = lsm->mem;
+		lsm->mem = NULL;
+	}
+	lsm->closing = 1;
+	pthread_cond_signal(&lsm->work_cond);
+	pthread_mutex_unlock(&lsm->mutex);
+
+	pthread_join(lsm->worker, NULL);
+
+	_lsm_write_manifest(lsm);
+
+	if (lsm->mem) kvstore_skiptable_free(lsm->mem);
+	lsm->mem = NULL;
+
+	int level = 0, i = 0;
+	for (level = 0;level < LSM_MAX_LEVELS;level ++) {
+		for (i = 0;i < lsm->levels[level].nfiles;i ++) {
+			_lsm_sst_close(lsm->levels[level].files[i]);
+		}
+		if (lsm->levels[level].files) kvstore_free(lsm->levels[level].files);
+	}
+	if (lsm->value_buf) kvstore_free(lsm->value_buf);
+
+	pthread_mutex_destroy(&lsm->mutex);
+	pthread_cond_destroy(&lsm->work_cond);
+	pthread_cond_destroy(&lsm->done_cond);
+}
+
+
+
+// 5 + 2
+
+int kvstore_lsm_create(lsm_t *lsm) {
+
+	return init_lsm(lsm);
+
+}
+
+void kvstore_lsm_destory(lsm_t *lsm) {
+
+	return dest_lsm(lsm);
+
+}
+
+int kvs_lsm_set(lsm_t *lsm, char *key, char *value) {
+
+	if (!lsm || !key || !value || LSM_IS_TOMBSTONE(value)) return -1;
+
+	int exist = (_lsm_lookup(lsm, key) != NULL);
+
+	if (_lsm_put(lsm, key, value) != 0) return -1;
+	if (!exist) lsm->count ++;
+
+	return 0;
+}
+
+char *kvs_lsm_get(lsm_t *lsm, char *key) {
+
+	if (!lsm || !key) return NULL;
+
+	return _lsm_lookup(lsm, key);
+}
+
+int kvs_lsm_delete(lsm_t *lsm, char *key) {
+
+	if (!lsm || !key) return -1;
+
+	if (_lsm_lookup(lsm, key) == NULL) return 1; // no exist
+
+	if (_lsm_put(lsm, key, LSM_TOMBSTONE) != 0) return -1;
+	lsm->count --;
+
+	return 0;
+}
+
+int kvs_lsm_modify(lsm_t *lsm, char *key, char *value) {
+
+	if (!lsm || !key || !value || LSM_IS_TOMBSTONE(value)) return -1;
+
+	if (_lsm_lookup(lsm, key) == NULL) return 1; // no exist
+
+	return _lsm_put(lsm, key, value);
+}
+
+int kvs_lsm_count(lsm_t *lsm) {
+
+	return lsm ? lsm->count : -1;
+
+}
+
+// bytes the key costs in memory: its memtable node, 0 once flushed, the
+// sstable index is not per key. -1: no such key or deleted
+long kvs_lsm_usage(lsm_t *lsm, char *key) {
+
+	if (!lsm || !key) return -1;
+
+	char *value = kvs_skiptable_get(lsm->mem, key);
+	if (value) {
+		return LSM_IS_TOMBSTONE(value) ? -1 : kvs_skiptable_usage(lsm->mem, key);
+	}
+
+	long usage = -1;
+	int found = 0;
+
+	pthread_mutex_lock(&lsm->mutex);
+	int i = 0;
+	for (i = lsm->imm_count - 1;i >= 0 && !found;i --) {
+		value = kvs_skiptable_get(lsm->imm[i], key);
+		if (value) {
+			found = 1;
+			if (!LSM_IS_TOMBSTONE(value)) usage = kvs_skiptable_usage(lsm->imm[i], key);
+		}
+	}
+	pthread_mutex_unlock(&lsm->mutex);
+
+	if (found) return usage;
+
+	return _lsm_lookup(lsm, key) ? 0 : -1;
+}
@@ -1,103 +1,1067 @@
 
 
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+
+#include "kvstore.h"
+
+
+// size-class slab allocator behind kvstore_malloc/kvstore_free, one arena
+// per thread.
+//
+// 36 classes from 8 to 4096 bytes: 8 byte steps up to 128, then four
+// classes per power of two (160, 192, 224, 256, 320, ...). a class grows by
+// one 64KB chunk (16 pages) at a time, carving objects off a bump pointer;
+// freed objects go on the class free list, so alloc and free are O(1) with
+// no per-object header. larger requests fall back to malloc.
+//
+// every thread allocates from its own arena without locks. free() gets no
+// size, so a two-level page map indexed by chunk number (address >> 16)
+// records the owning arena and class of every chunk; a pointer whose chunk
+// is not in the map came from malloc. map leaves are never freed, readers
+// need no lock.
+//
+// a free from another thread (the lsm worker releasing a memtable the event
+// loop filled) is pushed onto the owner's lock-free return stack. the owner
+// takes the whole stack with one exchange when a class runs dry. an exited
+// thread's arena is left for the next new thread to adopt.
+//
+// with CONFIG SET hugepages thp|hugetlb an arena takes its chunks from 2MB
+// regions instead of one mmap each, so a tree descent over millions of small
+// nodes touches a few huge TLB entries. thp asks the kernel with
+// madvise(MADV_HUGEPAGE); hugetlb maps from the reserved pool
+// (vm.nr_hugepages) and falls back to thp when the pool is empty.
+//
+// defrag (ENABLE_MEM_DEFRAG): a cycle counts the live objects of every chunk
+// from the free lists, picks the sparse chunks of a class whose live objects
+// fit in the free slots of the others, and takes their free slots out of
+// circulation. the alloc and free fast paths only check the evac mark.
+// engines then walk their data and hand every pointer to mp_defrag_move(),
+// which copies objects out of those chunks. at the end a chunk that emptied
+// drops its pages (MADV_DONTNEED) and waits for reuse by any class; the
+// rest give their free slots back.
+//
+// compact references (ENABLE_COMPACT_REFS): mp_init reserves one 32GB range
+// of address space (PROT_NONE, no memory behind it) and every chunk and huge
+// region is carved from it in order. any slab object is then 8 byte aligned
+// at most 2^35 bytes past mp_ref_base, so kvs_ref() names it in 32 bits and
+// the rbtree, skiplist and hash links shrink to half. the range is the slab's
+// ceiling: when it is used up small allocations fail like an mmap would.
+
+#if ENABLE_MEM_POOL
+
+#define MP_CHUNK_SHIFT			16
+#define MP_CHUNK_SIZE			(1UL << MP_CHUNK_SHIFT)		// 64KB
+
+#define MP_MAX_SMALL			4096
+#define MP_CLASSES				36
+#define MP_MAX_ARENAS			255		// arena id fits the map entry
+
+#define MP_MAP_BITS				16		// 48 bit address space: 16 + 16 + 16
+#define MP_MAP_SIZE				(1UL << MP_MAP_BITS)
+
+#define MP_REGION_SIZE			(2UL << 20)		// one x86-64 huge page
+
+#define MP_DEFRAG_MAX_CHUNKS	256		// evacuated per cycle
+
+#define MP_REF_SHIFT			3		// slab objects are 8 byte aligned
+#define MP_REF_SPACE			(1UL << (32 + MP_REF_SHIFT))		// 32GB
 
-// 
-#define MEM_PAGE_SIZE		4096
+
+enum {
+	MP_HUGE_OFF = 0,
+	MP_HUGE_THP,
+	MP_HUGE_TLB,
+
+	MP_HUGE_SIZE,
+};
+
+#if ENABLE_HUGE_PAGES
+static const char *huge_names[MP_HUGE_SIZE] = {
+	"off", "thp", "hugetlb",
+};
+#endif
+
+
+typedef struct mp_class_s {
+	void *free_list;			// next pointer in the first 8 bytes
+	char *bump;
+	char *end;
+
+	size_t size;
+
+	// written by the owner only, read by stats
+	size_t chunks;
+	size_t allocs;
+	size_t frees;
+
+#if ENABLE_MEM_DEFRAG
+	char **chunk_list;			// libc memory, the pool cannot hold its own index
+	size_t chunk_cap;
+#endif
+} mp_class_t;
+
+#if ENABLE_MEM_DEFRAG
+typedef struct mp_evac_s {
+	char *chunk;
+	void *free_list;			// its free slots, kept out of circulation
+} mp_evac_t;
+#endif
+
+// one per chunk in the page map
+typedef struct mp_meta_s {
+	uint16_t tag;				// (arena << 8 | class) + 1, 0: not a slab chunk
+	uint16_t live;				// counted when a defrag cycle starts
+	uint16_t evac;				// slot in the owner's evacuation table + 1
+	uint16_t unused;
+} mp_meta_t;
+
+typedef struct mp_arena_s {
+	mp_class_t classes[MP_CLASSES];
+
+	void *remote;				// return stack, pushed by other threads
+	size_t remote_frees;
+
+	char *region;				// next free chunk of the current 2MB region
+	char *region_end;
+
+#if ENABLE_MEM_DEFRAG
+	mp_evac_t evac[MP_DEFRAG_MAX_CHUNKS];
+	int nevac;
+
+	char **empty;				// released chunks, mapped but without pages
+	size_t nempty;
+	size_t empty_cap;
+
+	size_t defrag_moves;
+#endif
+
+	int id;
+	int owned;					// a live thread is using it
+} __attribute__((aligned(64))) mp_arena_t;
 
 typedef struct mempool_s {
-    int block_size;
-    int free_count;
+	mp_arena_t arenas[MP_MAX_ARENAS];
+	int narenas;
+	pthread_key_t key;
+
+	pthread_mutex_t map_lock;
+	mp_meta_t *map[MP_MAP_SIZE];
+
+	size_t large_bytes;
+	size_t large_count;
+
+	int hugepages;
+	size_t thp_regions;
+	size_t hugetlb_regions;
+	size_t hugetlb_fallbacks;
+
+#if ENABLE_COMPACT_REFS
+	char *ref_next;				// next unused byte of the reserved range
+	char *ref_end;
+#endif
 
-    char *free_ptr;
-    char *mem;
+	int inited;
 } mempool_t;
 
 
-int mp_init(mempool_t *m, int size) {
+mempool_t m;
+
+#if ENABLE_COMPACT_REFS
+char *mp_ref_base = NULL;		// 8 bytes before the range, ref 0 stays NULL
+#endif
+
+static __thread mp_arena_t *local_arena = NULL;
 
-	if (!m) return -1;
-	if (size < 16) size = 16;
 
-	m->block_size = size;
+// 8..128 in 8 byte steps, then 4 classes per doubling up to 4096
+static inline int _mp_class_index(size_t size) {
 
-	m->mem = (char *)malloc(MEM_PAGE_SIZE);
-	if (!m->mem) return -1;
-	m->free_ptr = m->mem;
-	m->free_count = MEM_PAGE_SIZE / size;
+	if (size <= 8) return 0;
+	if (size <= 128) return (int)((size + 7) >> 3) - 1;
+
+	int p = 63 - __builtin_clzl(size - 1);		// 2^p < size <= 2^(p+1)
+	return 16 + (p - 7) * 4 + (int)((size - 1 - (1UL << p)) >> (p - 2));
+}
+
+static inline size_t _mp_class_size(int idx) {
+
+	if (idx < 16) return (size_t)(idx + 1) << 3;
+
+	int p = 7 + (idx - 16) / 4;
+	int k = (idx - 16) % 4 + 1;
+	return (1UL << p) + ((size_t)k << (p - 2));
+}
+
+// owner-only counters, relaxed stores so stats can read them from any thread
+#define MP_COUNT(field)		__atomic_store_n(&(field), (field) + 1, __ATOMIC_RELAXED)
+
+
+// NULL: not a slab chunk
+static inline mp_meta_t *_mp_lookup(void *ptr) {
+
+	uintptr_t chunk = (uintptr_t)ptr >> MP_CHUNK_SHIFT;
+	mp_meta_t *leaf = __atomic_load_n(&m.map[(chunk >> MP_MAP_BITS) & (MP_MAP_SIZE - 1)], __ATOMIC_ACQUIRE);
+	if (!leaf) return NULL;
+
+	mp_meta_t *meta = &leaf[chunk & (MP_MAP_SIZE - 1)];
+	return meta->tag ? meta : NULL;
+}
+
+#define MP_META_ARENA(meta)		(((meta)->tag - 1) >> 8)
+#define MP_META_CLASS(meta)		(((meta)->tag - 1) & 0xFF)
+
+static int _mp_map_set(void *chunk_base, int arena, int idx) {
+
+	uintptr_t chunk = (uintptr_t)chunk_base >> MP_CHUNK_SHIFT;
+	mp_meta_t **slot = &m.map[(chunk >> MP_MAP_BITS) & (MP_MAP_SIZE - 1)];
+
+	mp_meta_t *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!leaf) {
+		pthread_mutex_lock(&m.map_lock);
+		leaf = *slot;
+		if (!leaf) {
+			leaf = mmap(NULL, MP_MAP_SIZE * sizeof(mp_meta_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (leaf == MAP_FAILED) {
+				pthread_mutex_unlock(&m.map_lock);
+				return -1;
+			}
+			__atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&m.map_lock);
+	}
+
+	mp_meta_t *meta = &leaf[chunk & (MP_MAP_SIZE - 1)];
+	meta->live = 0;
+	meta->evac = 0;
+	meta->tag = (uint16_t)(((arena << 8) | idx) + 1);
+
+	return 0;
+}
+
+#if !ENABLE_COMPACT_REFS
+
+// size aligned anonymous mapping, size is a power of 2
+static void *_mp_map_aligned(size_t size) {
+
+	char *raw = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) return NULL;
+
+	char *base = (char *)(((uintptr_t)raw + size - 1) & ~(size - 1));
+	if (base > raw) munmap(raw, base - raw);
+	if (base + size < raw + size * 2) {
+		munmap(base + size, raw + size * 2 - (base + size));
+	}
+
+	return base;
+}
+
+#endif
+
+#if ENABLE_COMPACT_REFS
+
+// a size aligned piece of the reserved range, readable and writable.
+// NULL once the range is used up
+static char *_mp_ref_take(size_t size) {
+
+	pthread_mutex_lock(&m.map_lock); // once per chunk, not per object
+	char *p = (char *)(((uintptr_t)m.ref_next + size - 1) & ~(size - 1));
+	if (!m.ref_next || p + size > m.ref_end) {
+		pthread_mutex_unlock(&m.map_lock);
+		return NULL;
+	}
+	m.ref_next = p + size;
+	pthread_mutex_unlock(&m.map_lock);
+
+	if (mprotect(p, size, PROT_READ | PROT_WRITE) != 0) return NULL;
+
+	return p;
+}
+
+// ptr came from the reserved range, kvs_ref() can name it
+int mp_ref_ok(void *ptr) {
+
+	char *p = (char *)ptr;
+	return p > mp_ref_base && p < m.ref_end;
+}
+
+#endif
+
+#if ENABLE_HUGE_PAGES
+
+static char *_mp_region_alloc(int mode) {
+
+#if ENABLE_COMPACT_REFS
+	char *region = _mp_ref_take(MP_REGION_SIZE);
+	if (!region) return NULL;
+
+#ifdef MAP_HUGETLB
+	if (mode == MP_HUGE_TLB) { // replaces that piece of the range in place
+		if (mmap(region, MP_REGION_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED, -1, 0) != MAP_FAILED) {
+			__atomic_add_fetch(&m.hugetlb_regions, 1, __ATOMIC_RELAXED);
+			return region;
+		}
+		__atomic_add_fetch(&m.hugetlb_fallbacks, 1, __ATOMIC_RELAXED);
+	}
+#endif
+#else
+#ifdef MAP_HUGETLB
+	if (mode == MP_HUGE_TLB) { // huge page mappings are huge page aligned
+		char *region = mmap(NULL, MP_REGION_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (region != MAP_FAILED) {
+			__atomic_add_fetch(&m.hugetlb_regions, 1, __ATOMIC_RELAXED);
+			return region;
+		}
+		__atomic_add_fetch(&m.hugetlb_fallbacks, 1, __ATOMIC_RELAXED);
+	}
+#endif
+
+	char *region = _mp_map_aligned(MP_REGION_SIZE);
+	if (!region) return NULL;
+#endif
+
+#ifdef MADV_HUGEPAGE
+	madvise(region, MP_REGION_SIZE, MADV_HUGEPAGE); // a hint, THP may be off
+#endif
+	__atomic_add_fetch(&m.thp_regions, 1, __ATOMIC_RELAXED);
+
+	return region;
+}
+
+// AnonHugePages of the whole process, what the kernel actually backed
+static size_t _mp_anon_huge_bytes(void) {
+
+	FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+	if (!fp) return 0;
+
+	char line[256];
+	size_t kb = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) break;
+	}
+	fclose(fp);
+
+	return kb << 10;
+}
+
+// CONFIG SET hugepages off|thp|hugetlb, applies to chunks mapped from now on
+int mp_set_hugepages(const char *mode) {
 
 	int i = 0;
-	char *ptr = m->free_ptr;
-	for (i = 0;i < m->free_count;i ++) {
-		*(char **)ptr = ptr + size;
-		ptr += size;
+	for (i = 0;i < MP_HUGE_SIZE;i ++) {
+		if (strcmp(mode, huge_names[i]) == 0) {
+			__atomic_store_n(&m.hugepages, i, __ATOMIC_RELAXED);
+			return 0;
+		}
 	}
-	*(char **)ptr = NULL;
+	return -1;
+}
+
+const char *mp_get_hugepages(void) {
+	return huge_names[__atomic_load_n(&m.hugepages, __ATOMIC_RELAXED)];
+}
+
+#endif
+
+// a fresh MP_CHUNK_SIZE aligned chunk, so one map entry covers it
+#if ENABLE_MEM_DEFRAG
+// room to park one more released chunk
+static int _mp_empty_reserve(mp_arena_t *arena) {
+
+	if (arena->nempty < arena->empty_cap) return 0;
+
+	size_t cap = arena->empty_cap ? arena->empty_cap * 2 : 16;
+	char **list = realloc(arena->empty, sizeof(char *) * cap);
+	if (!list) return -1;
+
+	arena->empty = list;
+	arena->empty_cap = cap;
 
 	return 0;
 }
 
-void mp_dest(mempool_t *m) {
-	if (!m || !m->mem) return ;
-	
-	free(m->mem);
+#endif
+
+static void *_mp_chunk_alloc(mp_arena_t *arena) {
+
+#if ENABLE_MEM_DEFRAG
+	if (arena->nempty > 0) { // pages come back on first touch
+		return arena->empty[-- arena->nempty];
+	}
+#endif
+
+#if ENABLE_HUGE_PAGES
+	int mode = __atomic_load_n(&m.hugepages, __ATOMIC_RELAXED);
+	if (mode != MP_HUGE_OFF) {
+		if (arena->region == arena->region_end) {
+			char *region = _mp_region_alloc(mode);
+			if (region) {
+				arena->region = region;
+				arena->region_end = region + MP_REGION_SIZE;
+			}
+		}
+		if (arena->region < arena->region_end) {
+			char *chunk = arena->region;
+			arena->region += MP_CHUNK_SIZE;
+			return chunk;
+		}
+	}
+#endif
+
+#if ENABLE_COMPACT_REFS
+	return _mp_ref_take(MP_CHUNK_SIZE);
+#else
+	return _mp_map_aligned(MP_CHUNK_SIZE);
+#endif
+}
+
+// a chunk from _mp_chunk_alloc() that never got a class, back where it
+// came from
+static void _mp_chunk_return(mp_arena_t *arena, char *chunk) {
+
+#if ENABLE_MEM_DEFRAG
+	if (_mp_empty_reserve(arena) == 0) {
+		arena->empty[arena->nempty ++] = chunk;
+		return ;
+	}
+#endif
+
+#if ENABLE_HUGE_PAGES
+	if (chunk + MP_CHUNK_SIZE == arena->region) {
+		arena->region = chunk;
+		return ;
+	}
+#endif
+
+#if ENABLE_COMPACT_REFS
+	// the reserved range is not handed out twice, its pages go back
+	madvise(chunk, MP_CHUNK_SIZE, MADV_DONTNEED);
+#else
+	munmap(chunk, MP_CHUNK_SIZE);
+#endif
+}
+
+
+// thread exit: leave the arena, its memory and pending returns, for adoption
+static void _mp_arena_release(void *arg) {
 
+	mp_arena_t *arena = (mp_arena_t *)arg;
+	__atomic_store_n(&arena->owned, 0, __ATOMIC_RELEASE);
 }
 
+static mp_arena_t *_mp_arena_acquire(void) {
 
-void *mp_alloc(mempool_t *m) {
+	int n = __atomic_load_n(&m.narenas, __ATOMIC_ACQUIRE);
 
-	if (!m || m->free_count == 0) return NULL;
+	int i = 0;
+	for (i = 0;i < n;i ++) {
+		int expected = 0;
+		if (__atomic_compare_exchange_n(&m.arenas[i].owned, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return &m.arenas[i];
+		}
+	}
 
-	void *ptr = m->free_ptr;
+	pthread_mutex_lock(&m.map_lock);
+	mp_arena_t *arena = NULL;
+	if (m.narenas < MP_MAX_ARENAS) {
+		arena = &m.arenas[m.narenas];
+		arena->owned = 1;
+		__atomic_store_n(&m.narenas, m.narenas + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&m.map_lock);
 
-	m->free_ptr = *(char **)ptr;
-	m->free_count --;
-	
-	return ptr;
+	return arena;
 }
 
+static inline mp_arena_t *_mp_local(void) {
+
+	if (local_arena) return local_arena;
 
-void mp_free(mempool_t *m, void *ptr) {
+	if (!m.inited) mp_init();
 
-	*(char **)ptr = m->free_ptr;
-	m->free_ptr = (char *)ptr;
-	m->free_count ++;
+	local_arena = _mp_arena_acquire();
+	if (local_arena) pthread_setspecific(m.key, local_arena);
+
+	return local_arena;
 }
 
-mempool_t m;
+// ptr belongs to arena, the calling thread owns it
+static inline void _mp_free_local(mp_arena_t *arena, mp_meta_t *meta, void *ptr) {
+
+	mp_class_t *c = &arena->classes[MP_META_CLASS(meta)];
+
+#if ENABLE_MEM_DEFRAG
+	if (meta->evac) { // being emptied, keep the slot out of circulation
+		mp_evac_t *e = &arena->evac[meta->evac - 1];
+		*(void **)ptr = e->free_list;
+		e->free_list = ptr;
+		MP_COUNT(c->frees);
+		return ;
+	}
+#endif
+
+	*(void **)ptr = c->free_list;
+	c->free_list = ptr;
+	MP_COUNT(c->frees);
+}
 
+// take back everything other threads freed into this arena
+static void _mp_drain_remote(mp_arena_t *arena) {
 
-#if 0
+	void *list = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
 
-int main() {
+	while (list) {
+		void *next = *(void **)list;
 
-	mempool_t m;
+		_mp_free_local(arena, _mp_lookup(list), list);
 
-	mp_init(&m, 32);
+		list = next;
+	}
+}
 
-	void *p1 = mp_alloc(&m);
-	printf("1: mp_alloc: %p\n", p1);
 
-	void *p2 = mp_alloc(&m);
-	printf("2: mp_alloc: %p\n", p2);
+int mp_init(void) {
 
-	void *p3 = mp_alloc(&m);
-	printf("3: mp_alloc: %p\n", p3);
+	if (m.inited) return 0;
 
-	void *p4 = mp_alloc(&m);
-	printf("4: mp_alloc: %p\n", p4);
+	int i = 0, j = 0;
+	for (i = 0;i < MP_MAX_ARENAS;i ++) {
+		m.arenas[i].id = i;
+		for (j = 0;j < MP_CLASSES;j ++) {
+			m.arenas[i].classes[j].size = _mp_class_size(j);
+		}
+	}
+	pthread_mutex_init(&m.map_lock, NULL);
+	pthread_key_create(&m.key, _mp_arena_release);
 
-	mp_free(&m, p2);
+#if ENABLE_COMPACT_REFS
+	// address space only, pages are committed chunk by chunk
+	char *range = mmap(NULL, MP_REF_SPACE + MP_REGION_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (range == MAP_FAILED) {
+		fprintf(stderr, "mp_init: cannot reserve %lu bytes for compact references\n", MP_REF_SPACE);
+	} else {
+		m.ref_next = (char *)(((uintptr_t)range + MP_REGION_SIZE - 1) & ~(MP_REGION_SIZE - 1));
+		m.ref_end = m.ref_next + MP_REF_SPACE - MP_REGION_SIZE;
+		mp_ref_base = m.ref_next - (1 << MP_REF_SHIFT);
+	}
+#endif
 
-	void *p5 = mp_alloc(&m);
-	printf("5: mp_alloc: %p\n", p5);
-	
+	m.inited = 1;
 
 	return 0;
 }
 
+// chunks stay mapped until exit, like every slab allocator here
+void mp_dest(void) {
+
+	if (!m.inited) return ;
+
+	pthread_key_delete(m.key);
+	pthread_mutex_destroy(&m.map_lock);
+
+	m.inited = 0;
+}
+
+
+void *mp_alloc(size_t size) {
+
+	mp_arena_t *arena = size <= MP_MAX_SMALL ? _mp_local() : NULL;
+
+	if (!arena) { // large, or every arena taken
+		void *ptr = malloc(size);
+		if (ptr) {
+			__atomic_add_fetch(&m.large_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+			__atomic_add_fetch(&m.large_count, 1, __ATOMIC_RELAXED);
+		}
+		return ptr;
+	}
+
+	int idx = _mp_class_index(size);
+	mp_class_t *c = &arena->classes[idx];
+
+	if (!c->free_list && __atomic_load_n(&arena->remote, __ATOMIC_RELAXED)) {
+		_mp_drain_remote(arena);
+	}
+
+	void *ptr = NULL;
+	if (c->free_list) {
+		ptr = c->free_list;
+		c->free_list = *(void **)ptr;
+	} else {
+		if (c->bump + c->size > c->end) {
+#if ENABLE_MEM_DEFRAG
+			// room in the list before the chunk is taken and mapped
+			if (c->chunks == c->chunk_cap) {
+				size_t cap = c->chunk_cap ? c->chunk_cap * 2 : 16;
+				char **list = realloc(c->chunk_list, sizeof(char *) * cap);
+				if (!list) return NULL;
+				c->chunk_list = list;
+				c->chunk_cap = cap;
+			}
+#endif
+			char *chunk = _mp_chunk_alloc(arena);
+			if (!chunk) return NULL;
+			if (_mp_map_set(chunk, arena->id, idx) != 0) { // no map leaf
+				_mp_chunk_return(arena, chunk);
+				return NULL;
+			}
+#if ENABLE_MEM_DEFRAG
+			c->chunk_list[c->chunks] = chunk;
+#endif
+			c->bump = chunk;
+			c->end = chunk + MP_CHUNK_SIZE;
+			MP_COUNT(c->chunks);
+		}
+		ptr = c->bump;
+		c->bump += c->size;
+	}
+	MP_COUNT(c->allocs);
+
+	return ptr;
+}
+
+void mp_free(void *ptr) {
+
+	if (!ptr) return ;
+
+	mp_meta_t *meta = _mp_lookup(ptr);
+	if (!meta) {
+		__atomic_sub_fetch(&m.large_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&m.large_count, 1, __ATOMIC_RELAXED);
+		free(ptr);
+		return ;
+	}
+
+	mp_arena_t *owner = &m.arenas[MP_META_ARENA(meta)];
+
+	if (owner == local_arena) {
+		_mp_free_local(owner, meta, ptr);
+		return ;
+	}
+
+	// another thread's object: push onto its return stack
+	void *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+	do {
+		*(void **)ptr = head;
+	} while (!__atomic_compare_exchange_n(&owner->remote, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_add_fetch(&owner->remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+// bytes actually reserved for ptr, what memory accounting charges
+size_t mp_usable_size(void *ptr) {
+
+	if (!ptr) return 0;
+
+	mp_meta_t *meta = _mp_lookup(ptr);
+	if (!meta) return malloc_usable_size(ptr);
+
+	return _mp_class_size(MP_META_CLASS(meta));
+}
+
+// reserved slab bytes over the bytes handed out, 1.0 is perfectly dense
+double mp_fragmentation(size_t *reserved, size_t *used) {
+
+	int narenas = __atomic_load_n(&m.narenas, __ATOMIC_ACQUIRE);
+	size_t r = 0, u = 0;
+
+	int i = 0, j = 0;
+	for (i = 0;i < narenas;i ++) {
+		for (j = 0;j < MP_CLASSES;j ++) {
+			mp_class_t *c = &m.arenas[i].classes[j];
+			size_t a = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+			size_t f = __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+
+			r += __atomic_load_n(&c->chunks, __ATOMIC_RELAXED) * MP_CHUNK_SIZE;
+			u += a > f ? (a - f) * c->size : 0;
+		}
+	}
+
+	if (reserved) *reserved = r;
+	if (used) *used = u;
+
+	return u ? (double)r / u : 1.0;
+}
+
+
+#if ENABLE_MEM_DEFRAG
+
+typedef struct mp_candidate_s {
+	char *chunk;
+	mp_meta_t *meta;
+} mp_candidate_t;
+
+static int _mp_candidate_cmp(const void *a, const void *b) {
+	return (int)((const mp_candidate_t *)a)->meta->live - (int)((const mp_candidate_t *)b)->meta->live;
+}
+
+// pick the chunks of one class to empty: the sparsest first, as long as
+// their live objects fit in the free slots of the chunks that stay
+static int _mp_defrag_class(mp_arena_t *arena, int idx) {
+
+	mp_class_t *c = &arena->classes[idx];
+	if (c->chunks < 2 || arena->nevac == MP_DEFRAG_MAX_CHUNKS) return 0;
+
+	size_t cap = MP_CHUNK_SIZE / c->size;
+	size_t room = (c->end - c->bump) / c->size;	// the bump chunk always stays
+
+	mp_candidate_t cand[MP_DEFRAG_MAX_CHUNKS];
+	int ncand = 0;
+
+	// live = carved - free
+	size_t i = 0;
+	for (i = 0;i < c->chunks;i ++) {
+		char *chunk = c->chunk_list[i];
+		_mp_lookup(chunk)->live = chunk == c->end - MP_CHUNK_SIZE ? (c->bump - chunk) / c->size : cap;
+	}
+	void *obj = NULL;
+	for (obj = c->free_list;obj != NULL;obj = *(void **)obj) {
+		_mp_lookup(obj)->live --;
+	}
+
+	for (i = 0;i < c->chunks;i ++) {
+		char *chunk = c->chunk_list[i];
+		mp_meta_t *meta = _mp_lookup(chunk);
+		if (chunk == c->end - MP_CHUNK_SIZE) continue;
+
+		room += cap - meta->live;
+		if (meta->live * 2 < cap && ncand < MP_DEFRAG_MAX_CHUNKS - arena->nevac) {
+			cand[ncand].chunk = chunk;
+			cand[ncand].meta = meta;
+			ncand ++;
+		}
+	}
+	if (ncand == 0) return 0;
+
+	qsort(cand, ncand, sizeof(mp_candidate_t), _mp_candidate_cmp);
+
+	size_t need = 0;
+	int picked = 0;
+	for (i = 0;i < (size_t)ncand;i ++) {
+		size_t live = cand[i].meta->live;
+		if (need + live > room - (cap - live)) break;
+
+		room -= cap - live;
+		need += live;
+
+		arena->evac[arena->nevac].chunk = cand[i].chunk;
+		arena->evac[arena->nevac].free_list = NULL;
+		cand[i].meta->evac = ++ arena->nevac;
+		picked ++;
+	}
+	if (picked == 0) return 0;
+
+	// move the free slots of the picked chunks off the class free list
+	void **pp = &c->free_list;
+	while (*pp) {
+		obj = *pp;
+		mp_meta_t *meta = _mp_lookup(obj);
+		if (meta->evac) {
+			*pp = *(void **)obj;
+			mp_evac_t *e = &arena->evac[meta->evac - 1];
+			*(void **)obj = e->free_list;
+			e->free_list = obj;
+		} else {
+			pp = (void **)obj;
+		}
+	}
+
+	return picked;
+}
+
+// start a cycle in the calling thread's arena. returns the chunks picked,
+// 0: nothing worth moving
+int mp_defrag_begin(void) {
+
+	mp_arena_t *arena = _mp_local();
+	if (!arena || arena->nevac) return 0;
+
+	_mp_drain_remote(arena);
+
+	int picked = 0, i = 0;
+	for (i = 0;i < MP_CLASSES;i ++) {
+		picked += _mp_defrag_class(arena, i);
+	}
+
+	return picked;
+}
+
+// ptr sits in a chunk being emptied: copy it out and return the copy, ptr
+// stays allocated until the caller frees it, before mp_defrag_end() or its
+// chunk is not released. NULL: leave it where it is
+void *mp_defrag_copy(void *ptr) {
+
+	mp_arena_t *arena = local_arena;
+	if (!ptr || !arena || !arena->nevac) return NULL;
+
+	mp_meta_t *meta = _mp_lookup(ptr);
+	if (!meta || !meta->evac || MP_META_ARENA(meta) != arena->id) return NULL;
+
+	size_t size = _mp_class_size(MP_META_CLASS(meta));
+	void *moved = mp_alloc(size);
+	if (!moved) return NULL;
+
+	memcpy(moved, ptr, size);
+
+	MP_COUNT(arena->defrag_moves);
+
+	return moved;
+}
+
+// mp_defrag_copy() and free ptr at once
+void *mp_defrag_move(void *ptr) {
+
+	void *moved = mp_defrag_copy(ptr);
+	if (moved) _mp_free_local(local_arena, _mp_lookup(ptr), ptr);
+
+	return moved;
+}
+
+// objects relocated so far, all arenas
+size_t mp_defrag_moves(void) {
+
+	int narenas = __atomic_load_n(&m.narenas, __ATOMIC_ACQUIRE);
+	size_t moves = 0;
+
+	int i = 0;
+	for (i = 0;i < narenas;i ++) {
+		moves += __atomic_load_n(&m.arenas[i].defrag_moves, __ATOMIC_RELAXED);
+	}
+
+	return moves;
+}
+
+// end the cycle: emptied chunks give their pages back, the others return
+// their free slots. returns the bytes released
+size_t mp_defrag_end(void) {
+
+	mp_arena_t *arena = local_arena;
+	if (!arena || !arena->nevac) return 0;
+
+	_mp_drain_remote(arena);
+
+	size_t released = 0;
+	int i = 0;
+	for (i = 0;i < arena->nevac;i ++) {
+		mp_evac_t *e = &arena->evac[i];
+		mp_meta_t *meta = _mp_lookup(e->chunk);
+		mp_class_t *c = &arena->classes[MP_META_CLASS(meta)];
+
+		meta->evac = 0;
+
+		size_t free = 0;
+		void *obj = NULL;
+		for (obj = e->free_list;obj != NULL;obj = *(void **)obj) free ++;
+
+		if (free < MP_CHUNK_SIZE / c->size || _mp_empty_reserve(arena) != 0) {
+			while (e->free_list) {
+				obj = e->free_list;
+				e->free_list = *(void **)obj;
+				*(void **)obj = c->free_list;
+				c->free_list = obj;
+			}
+			continue;
+		}
+
+		size_t j = 0;
+		for (j = 0;j < c->chunks;j ++) {
+			if (c->chunk_list[j] == e->chunk) {
+				c->chunk_list[j] = c->chunk_list[c->chunks - 1];
+				break;
+			}
+		}
+		__atomic_store_n(&c->chunks, c->chunks - 1, __ATOMIC_RELAXED);
+
+		meta->tag = 0;
+		madvise(e->chunk, MP_CHUNK_SIZE, MADV_DONTNEED);
+		arena->empty[arena->nempty ++] = e->chunk;
+
+		released += MP_CHUNK_SIZE;
+	}
+
+	arena->nevac = 0;
+
+	return released;
+}
+
+#endif
+
+// one summary line, then one line per arena
+int mp_stats(char *buf, int len) {
+
+	int narenas = __atomic_load_n(&m.narenas, __ATOMIC_ACQUIRE);
+	size_t total_chunks = 0;
+
+	int i = 0, j = 0;
+	for (i = 0;i < narenas;i ++) {
+		for (j = 0;j < MP_CLASSES;j ++) {
+			total_chunks += __atomic_load_n(&m.arenas[i].classes[j].chunks, __ATOMIC_RELAXED);
+		}
+	}
+
+	size_t small_used = 0;
+	double frag = mp_fragmentation(NULL, &small_used);
+
+	int n = snprintf(buf, len, "slab classes:%d chunk_size:%lu arenas:%d reserved:%zu small_used:%zu fragmentation:%.2f large_count:%zu large_used:%zu\n",
+		MP_CLASSES, MP_CHUNK_SIZE, narenas, total_chunks * MP_CHUNK_SIZE, small_used, frag,
+		__atomic_load_n(&m.large_count, __ATOMIC_RELAXED),
+		__atomic_load_n(&m.large_bytes, __ATOMIC_RELAXED));
+
+#if ENABLE_HUGE_PAGES
+	if (n < len) {
+		size_t thp = __atomic_load_n(&m.thp_regions, __ATOMIC_RELAXED);
+		size_t tlb = __atomic_load_n(&m.hugetlb_regions, __ATOMIC_RELAXED);
+
+		n += snprintf(buf + n, len - n, "hugepages:%s huge_regions:%zu huge_reserved:%zu hugetlb_reserved:%zu hugetlb_fallbacks:%zu anon_huge_pages:%zu\n",
+			mp_get_hugepages(), thp + tlb, (thp + tlb) * MP_REGION_SIZE, tlb * MP_REGION_SIZE,
+			__atomic_load_n(&m.hugetlb_fallbacks, __ATOMIC_RELAXED), _mp_anon_huge_bytes());
+	}
+#endif
+
+#if ENABLE_COMPACT_REFS
+	if (n < len) {
+		char *start = mp_ref_base ? mp_ref_base + (1 << MP_REF_SHIFT) : NULL;
+
+		pthread_mutex_lock(&m.map_lock);
+		size_t used = m.ref_next - start;
+		pthread_mutex_unlock(&m.map_lock);
+
+		n += snprintf(buf + n, len - n, "compact_refs:yes ref_space:%zu ref_space_used:%zu\n",
+			(size_t)(m.ref_end - start), used);
+	}
+#endif
+
+	for (i = 0;i < narenas && n < len;i ++) {
+		mp_arena_t *arena = &m.arenas[i];
+		size_t chunks = 0, allocs = 0, frees = 0, used = 0;
+
+		for (j = 0;j < MP_CLASSES;j ++) {
+			mp_class_t *c = &arena->classes[j];
+			size_t a = __atomic_load_n(&c->allocs, __ATOMIC_RELAXED);
+			size_t f = __atomic_load_n(&c->frees, __ATOMIC_RELAXED);
+
+			chunks += __atomic_load_n(&c->chunks, __ATOMIC_RELAXED);
+			allocs += a;
+			frees += f;
+			used += a > f ? (a - f) * c->size : 0;
+		}
+
+		n += snprintf(buf + n, len - n, "arena%d%s chunks:%zu used:%zu allocs:%zu frees:%zu remote_frees:%zu\n",
+			i, __atomic_load_n(&arena->owned, __ATOMIC_RELAXED) ? "" : "(idle)",
+			chunks, used, allocs, frees,
+			__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED));
+	}
+
+	return n;
+}
+
 #endif
 
 
+
+// make mp_bench: alloc/free throughput per thread count against glibc.
+// every round each thread also frees a batch its neighbour allocated, so the
+// return stacks are exercised.
+#ifdef MP_BENCH
+
+#include <sys/time.h>
+
+#define BENCH_OPS			2000000
+#define BENCH_LIVE			1024
+#define BENCH_REMOTE		256
+
+static int use_glibc = 0;
+static int bench_threads = 1;
+static void **handoff[64];
+static pthread_barrier_t barrier;
+
+static void *_bench_alloc(size_t size) { return use_glibc ? malloc(size) : mp_alloc(size); }
+static void _bench_free(void *ptr) { if (use_glibc) free(ptr); else mp_free(ptr); }
+
+static void *_bench_worker(void *arg) {
+
+	int id = (int)(intptr_t)arg;
+	void *live[BENCH_LIVE] = {0};
+	unsigned int seed = id * 7919 + 1;
+
+	int i = 0, r = 0;
+	for (i = 0;i < BENCH_OPS;i ++) {
+		seed = seed * 1103515245 + 12345;
+		int slot = (seed >> 8) % BENCH_LIVE;
+		size_t size = 8 + ((seed >> 16) % 120);	// small keys and values
+
+		if (live[slot]) _bench_free(live[slot]);
+		live[slot] = _bench_alloc(size);
+
+		if ((i % (BENCH_OPS / 16)) == 0 && bench_threads > 1) {
+			for (r = 0;r < BENCH_REMOTE;r ++) handoff[id][r] = _bench_alloc(32);
+			pthread_barrier_wait(&barrier);
+			void **theirs = handoff[(id + 1) % bench_threads];
+			for (r = 0;r < BENCH_REMOTE;r ++) _bench_free(theirs[r]);
+			pthread_barrier_wait(&barrier);
+		}
+	}
+
+	for (i = 0;i < BENCH_LIVE;i ++) if (live[i]) _bench_free(live[i]);
+
+	return NULL;
+}
+
+static double _bench_run(int threads) {
+
+	pthread_t tid[64];
+	struct timeval begin, end;
+
+	bench_threads = threads;
+	pthread_barrier_init(&barrier, NULL, threads);
+
+	gettimeofday(&begin, NULL);
+	int i = 0;
+	for (i = 0;i < threads;i ++) pthread_create(&tid[i], NULL, _bench_worker, (void *)(intptr_t)i);
+	for (i = 0;i < threads;i ++) pthread_join(tid[i], NULL);
+	gettimeofday(&end, NULL);
+
+	pthread_barrier_destroy(&barrier);
+
+	double sec = (end.tv_sec - begin.tv_sec) + (end.tv_usec - begin.tv_usec) / 1e6;
+	return (double)BENCH_OPS * threads / sec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	if (max_threads > 64) max_threads = 64;
+
+	int i = 0;
+	for (i = 0;i < 64;i ++) handoff[i] = malloc(sizeof(void *) * BENCH_REMOTE);
+
+	mp_init();
+
+	int t = 1;
+	for (t = 1;t <= max_threads;t *= 2) {
+		use_glibc = 0;
+		double mp = _bench_run(t);
+		use_glibc = 1;
+		double glibc = _bench_run(t);
+		printf("threads: %2d  slab: %7.2f Mops/s (%6.2f per thread)  glibc: %7.2f Mops/s (%6.2f per thread)\n",
+			t, mp, mp / t, glibc, glibc / t);
+	}
+
+	char stats[4096];
+	mp_stats(stats, sizeof(stats));
+	printf("%s", stats);
+
+	return 0;
+}
+
+#endif
+
@@ -0,0 +1,268 @@
+
+
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include "kvstore.h"
+
+
+// where the workers run. kvstore -a spread|compact|off:
+//
+//   - the topology comes from /sys/devices/system/node/node<n>/cpulist,
+//     cut down to the cpus this process may run on (taskset, cgroups).
+//     nodes with no such cpu are left out. no sysfs, or one node left: a
+//     single node with every allowed cpu, pinning still applies.
+//   - spread gives worker w node w % nodes and the next free cpu there, so
+//     the workers share the sockets evenly. compact fills the cpus of the
+//     first node before the next. more workers than cpus wrap around.
+//   - each worker pins itself with sched_setaffinity() when it starts,
+//     before it makes its scheduler, its shard or any connection. memory
+//     comes from the local node by first touch from then on: the slab gives
+//     every thread an arena of its own and only the owner carves it, glibc
+//     malloc does the same per thread. a connection a peer steals keeps its
+//     buffers where they were.
+//
+// no mbind(): the slab maps 64KB chunks, one policy per chunk would cut the
+// mapping into as many vmas.
+
+#if ENABLE_NUMA
+
+#define NUMA_MAX_NODES			64
+#define NUMA_SYS_NODES			"/sys/devices/system/node"
+
+
+enum {
+	NUMA_SPREAD = 0,
+	NUMA_COMPACT,
+	NUMA_OFF,
+	NUMA_POLICY_SIZE
+};
+
+static const char *policy_names[NUMA_POLICY_SIZE] = { "spread", "compact", "off" };
+
+typedef struct numa_node_s {
+	int id;					// as the kernel numbers it
+	int ncpus;
+	int cpus[CPU_SETSIZE];	// allowed ones, ascending
+} numa_node_t;
+
+static int policy = NUMA_SPREAD;
+static int nnodes = 0;
+static int ncpus = 0;
+static numa_node_t Nodes[NUMA_MAX_NODES];
+
+static int worker_cpu[KVS_MAX_SHARDS];		// -1: not pinned
+static int worker_node[KVS_MAX_SHARDS];		// index into Nodes
+static int worker_pinned[KVS_MAX_SHARDS];
+static cpu_set_t allowed;					// what the process started with
+
+
+// "0-3,8,10-11"
+static void _numa_parse_cpulist(const char *list, cpu_set_t *set) {
+
+	CPU_ZERO(set);
+
+	const char *p = list;
+	while (*p && *p != '\n') {
+		char *end = NULL;
+		long first = strtol(p, &end, 10);
+		if (end == p) break;
+
+		long last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) break;
+		}
+
+		long cpu = 0;
+		for (cpu = first;cpu <= last && cpu < CPU_SETSIZE;cpu ++) {
+			CPU_SET(cpu, set);
+		}
+
+		p = (*end == ',') ? end + 1 : end;
+	}
+}
+
+static void _numa_add_node(int id, cpu_set_t *cpus, cpu_set_t *allowed) {
+
+	if (nnodes == NUMA_MAX_NODES) return ;
+
+	numa_node_t *node = &Nodes[nnodes];
+	node->id = id;
+	node->ncpus = 0;
+
+	int cpu = 0;
+	for (cpu = 0;cpu < CPU_SETSIZE;cpu ++) {
+		if (CPU_ISSET(cpu, cpus) && CPU_ISSET(cpu, allowed)) {
+			node->cpus[node->ncpus ++] = cpu;
+		}
+	}
+
+	if (node->ncpus == 0) return ; // memory only, or none of ours
+	ncpus += node->ncpus;
+	nnodes ++;
+}
+
+static void _numa_discover(cpu_set_t *allowed) {
+
+	nnodes = 0;
+	ncpus = 0;
+
+	DIR *dir = opendir(NUMA_SYS_NODES);
+	if (dir) {
+		struct dirent *entry = NULL;
+		while ((entry = readdir(dir)) != NULL) {
+			int id = -1;
+			if (sscanf(entry->d_name, "node%d", &id) != 1) continue;
+
+			char path[256];
+			snprintf(path, sizeof(path), NUMA_SYS_NODES "/node%d/cpulist", id);
+			FILE *fp = fopen(path, "r");
+			if (!fp) continue;
+
+			char list[4096] = {0};
+			if (fgets(list, sizeof(list), fp)) {
+				cpu_set_t cpus;
+				_numa_parse_cpulist(list, &cpus);
+				_numa_add_node(id, &cpus, allowed);
+			}
+			fclose(fp);
+		}
+		closedir(dir);
+	}
+
+	// readdir() order is no order
+	int i = 0, j = 0;
+	for (i = 1;i < nnodes;i ++) {
+		for (j = i;j > 0 && Nodes[j - 1].id > Nodes[j].id;j --) {
+			numa_node_t tmp = Nodes[j];
+			Nodes[j] = Nodes[j - 1];
+			Nodes[j - 1] = tmp;
+		}
+	}
+
+	if (nnodes == 0) { // no sysfs: one node, whatever we may run on
+		_numa_add_node(0, allowed, allowed);
+	}
+}
+
+static void _numa_place(int workers) {
+
+	int used[NUMA_MAX_NODES] = {0};
+
+	int w = 0;
+	for (w = 0;w < workers;w ++) {
+		worker_cpu[w] = -1;
+		worker_node[w] = -1;
+		if (policy == NUMA_OFF || nnodes == 0) continue;
+
+		int n = 0, k = 0;
+		if (policy == NUMA_SPREAD) {
+			n = w % nnodes;
+			k = used[n] ++ % Nodes[n].ncpus;
+		} else {
+			k = w % ncpus;
+			while (k >= Nodes[n].ncpus) k -= Nodes[n ++].ncpus;
+		}
+
+		worker_node[w] = n;
+		worker_cpu[w] = Nodes[n].cpus[k];
+	}
+}
+
+void kvs_numa_init(int workers) {
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		CPU_SET(0, &allowed);
+	}
+
+	_numa_discover(&allowed);
+	_numa_place(workers);
+}
+
+int kvs_numa_pin(int worker) {
+
+	if (worker < 0 || worker >= KVS_MAX_SHARDS || worker_cpu[worker] < 0) return 0;
+
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(worker_cpu[worker], &mask);
+
+	if (sched_setaffinity(0, sizeof(mask), &mask) != 0) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+
+	__atomic_store_n(&worker_pinned[worker], 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// back to every allowed cpu, for the threads the caller starts next
+void kvs_numa_unpin(void) {
+	if (CPU_COUNT(&allowed) > 0) sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+void kvs_numa_report(int workers) {
+
+	printf("numa : %d node%s, %d cpu%s, placement %s\n", nnodes, nnodes == 1 ? "" : "s",
+		ncpus, ncpus == 1 ? "" : "s", policy_names[policy]);
+
+	int i = 0, w = 0;
+	for (i = 0;i < nnodes;i ++) {
+		char line[1024];
+		int n = snprintf(line, sizeof(line), "numa : node %d cpus", Nodes[i].id);
+
+		int j = 0;
+		for (j = 0;j < Nodes[i].ncpus && n < (int)sizeof(line);j ++) {
+			n += snprintf(line + n, sizeof(line) - n, "%s%d", j ? "," : " ", Nodes[i].cpus[j]);
+		}
+		if (n < (int)sizeof(line)) n += snprintf(line + n, sizeof(line) - n, ", workers");
+
+		int none = 1;
+		for (w = 0;w < workers && n < (int)sizeof(line);w ++) {
+			if (worker_node[w] != i) continue;
+			n += snprintf(line + n, sizeof(line) - n, "%s%d@%d", none ? " " : ",", w, worker_cpu[w]);
+			none = 0;
+		}
+		if (none && n < (int)sizeof(line)) snprintf(line + n, sizeof(line) - n, " none");
+
+		printf("%s\n", line);
+	}
+}
+
+int kvs_numa_policy_set(const char *name) {
+
+	int i = 0;
+	for (i = 0;i < NUMA_POLICY_SIZE;i ++) {
+		if (strcmp(name, policy_names[i]) == 0) {
+			policy = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int kvs_numa_stats(char *buf, int len) {
+
+	int n = snprintf(buf, len, "numa:%s nodes:%d cpus:%d workers:%d\n",
+		policy_names[policy], nnodes, ncpus, kvs_nshards);
+
+	int w = 0;
+	for (w = 0;w < kvs_nshards && n < len;w ++) {
+		int node = worker_node[w];
+		n += snprintf(buf + n, len - n, "worker:%d cpu:%d node:%d pinned:%d\n", w, worker_cpu[w],
+			node < 0 ? -1 : Nodes[node].id, __atomic_load_n(&worker_pinned[w], __ATOMIC_ACQUIRE));
+	}
+
+	return n;
+}
+
+#endif
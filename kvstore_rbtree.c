@@ -23,49 +23,99 @@ typedef int KEY_TYPE;
 #endif
 
 
+#if ENABLE_COMPACT_REFS
+typedef kvs_ref_t rbtree_link;		// 32 bit slab reference, kvstore.h
+#else
+typedef struct _rbtree_node *rbtree_link;
+#endif
+
 typedef struct _rbtree_node {
 	unsigned char color;
-	struct _rbtree_node *right;
-	struct _rbtree_node *left;
-	struct _rbtree_node *parent;
+	unsigned int lru:KVS_LRU_BITS;
+	rbtree_link right;
+	rbtree_link left;
+	rbtree_link parent;
 
+#if ENABLE_KEY_CHAR
+	kvs_key_t key;			// short ones inline, kvstore.h
+	kvs_value_t value;
+#else
 	KEY_TYPE key;
 	void *value;
+#endif
 } rbtree_node;
 
+#define RB_KEY(node)		kvs_key_get(&(node)->key)
+#define RB_VALUE(node)		kvs_value_get(&(node)->value)
+
+#if ENABLE_COMPACT_REFS
+#define RB_LEFT(node)				((rbtree_node *)kvs_deref((node)->left))
+#define RB_RIGHT(node)				((rbtree_node *)kvs_deref((node)->right))
+#define RB_PARENT(node)				((rbtree_node *)kvs_deref((node)->parent))
+#define RB_SET_LEFT(node, x)		((node)->left = kvs_ref(x))
+#define RB_SET_RIGHT(node, x)		((node)->right = kvs_ref(x))
+#define RB_SET_PARENT(node, x)		((node)->parent = kvs_ref(x))
+#define RB_NODE_ALLOC()				((rbtree_node *)kvstore_malloc_ref(sizeof(rbtree_node), KVS_MEM_NODE))
+#else
+#define RB_LEFT(node)				((node)->left)
+#define RB_RIGHT(node)				((node)->right)
+#define RB_PARENT(node)				((node)->parent)
+#define RB_SET_LEFT(node, x)		((node)->left = (x))
+#define RB_SET_RIGHT(node, x)		((node)->right = (x))
+#define RB_SET_PARENT(node, x)		((node)->parent = (x))
+#define RB_NODE_ALLOC()				((rbtree_node *)kvstore_malloc_tag(sizeof(rbtree_node), KVS_MEM_NODE))
+#endif
+#define RB_NODE_FREE(node)			kvstore_free_tag((node), KVS_MEM_NODE)
+
+#if ENABLE_COMPACT_REFS
+#define RB_LINK(link)				((rbtree_node *)kvs_deref(link))
+#else
+#define RB_LINK(link)				(link)
+#endif
+
+// every change to the tree, kvs_rbtree_read() runs beside them
+#if ENABLE_RCU_READS
+#define RB_WRITE_BEGIN(T)			kvs_seq_write_begin(&(T)->seq)
+#define RB_WRITE_END(T)				kvs_seq_write_end(&(T)->seq)
+#else
+#define RB_WRITE_BEGIN(T)
+#define RB_WRITE_END(T)
+#endif
+
 typedef struct _rbtree {
 	rbtree_node *root;
 	rbtree_node *nil;
 	
 	int count;
+	unsigned int seq;		// odd while a writer is inside
 } rbtree;
 
 
 
 rbtree_node *rbtree_mini(rbtree *T, rbtree_node *x) {
-	while (x->left != T->nil) {
-		x = x->left;
+	while (RB_LEFT(x) != T->nil) {
+		x = RB_LEFT(x);
 	}
 	return x;
 }
 
 rbtree_node *rbtree_maxi(rbtree *T, rbtree_node *x) {
-	while (x->right != T->nil) {
-		x = x->right;
+	while (RB_RIGHT(x) != T->nil) {
+		x = RB_RIGHT(x);
 	}
 	return x;
 }
 
 rbtree_node *rbtree_successor(rbtree *T, rbtree_node *x) {
-	rbtree_node *y = x->parent;
+	rbtree_node *y = RB_PARENT(x);
 
-	if (x->right != T->nil) {
-		return rbtree_mini(T, x->right);
+	if (RB_RIGHT(x) != T->nil) {
+		return rbtree_mini(T, RB_RIGHT(x));
 	}
 
-	while ((y != T->nil) && (x == y->right)) {
+	while ((y != T->nil) && (x == RB_RIGHT(y))) {
 		x = y;
-		y = y->parent;
+		y = RB_PARENT(y);
 	}
 	return y;
 }
@@ -73,88 +123,93 @@ rbtree_node *rbtree_successor(rbtree *T, rbtree_node *x) {
 
 void rbtree_left_rotate(rbtree *T, rbtree_node *x) {
 
-	rbtree_node *y = x->right;  // x  --> y  ,  y --> x,   right --> left,  left --> right
+	rbtree_node *y = RB_RIGHT(x);  // x  --> y  ,  y --> x,   right --> left,  left --> right
 
-	x->right = y->left; //1 1
-	if (y->left != T->nil) { //1 2
-		y->left->parent = x;
+	RB_SET_RIGHT(x, RB_LEFT(y)); //1 1
+	if (RB_LEFT(y) != T->nil) { //1 2
+		RB_SET_PARENT(RB_LEFT(y), x);
 	}
 
-	y->parent = x->parent; //1 3
-	if (x->parent == T->nil) { //1 4
+	rbtree_node *p = RB_PARENT(x);
+	RB_SET_PARENT(y, p); //1 3
+	if (p == T->nil) { //1 4
 		T->root = y;
-	} else if (x == x->parent->left) {
-		x->parent->left = y;
+	} else if (x == RB_LEFT(p)) {
+		RB_SET_LEFT(p, y);
 	} else {
-		x->parent->right = y;
+		RB_SET_RIGHT(p, y);
 	}
 
-	y->left = x; //1 5
-	x->parent = y; //1 6
+	RB_SET_LEFT(y, x); //1 5
+	RB_SET_PARENT(x, y); //1 6
 }
 
 
 void rbtree_right_rotate(rbtree *T, rbtree_node *y) {
 
-	rbtree_node *x = y->left;
+	rbtree_node *x = RB_LEFT(y);
 
-	y->left = x->right;
-	if (x->right != T->nil) {
-		x->right->parent = y;
+	RB_SET_LEFT(y, RB_RIGHT(x));
+	if (RB_RIGHT(x) != T->nil) {
+		RB_SET_PARENT(RB_RIGHT(x), y);
 	}
 
-	x->parent = y->parent;
-	if (y->parent == T->nil) {
+	rbtree_node *p = RB_PARENT(y);
+	RB_SET_PARENT(x, p);
+	if (p == T->nil) {
 		T->root = x;
-	} else if (y == y->parent->right) {
-		y->parent->right = x;
+	} else if (y == RB_RIGHT(p)) {
+		RB_SET_RIGHT(p, x);
 	} else {
-		y->parent->left = x;
+		RB_SET_LEFT(p, x);
 	}
 
-	x->right = y;
-	y->parent = x;
+	RB_SET_RIGHT(x, y);
+	RB_SET_PARENT(y, x);
 }
 
 void rbtree_insert_fixup(rbtree *T, rbtree_node *z) {
 
-	while (z->parent->color == RED) { //z ---> RED
-		if (z->parent == z->parent->parent->left) {
-			rbtree_node *y = z->parent->parent->right;
+	while (RB_PARENT(z)->color == RED) { //z ---> RED
+		rbtree_node *p = RB_PARENT(z);
+		rbtree_node *g = RB_PARENT(p);
+
+		if (p == RB_LEFT(g)) {
+			rbtree_node *y = RB_RIGHT(g);
 			if (y->color == RED) {
-				z->parent->color = BLACK;
+				p->color = BLACK;
 				y->color = BLACK;
-				z->parent->parent->color = RED;
+				g->color = RED;
 
-				z = z->parent->parent; //z --> RED
+				z = g; //z --> RED
 			} else {
 
-				if (z == z->parent->right) {
-					z = z->parent;
+				if (z == RB_RIGHT(p)) {
+					z = p;
 					rbtree_left_rotate(T, z);
 				}
 
-				z->parent->color = BLACK;
-				z->parent->parent->color = RED;
-				rbtree_right_rotate(T, z->parent->parent);
+				RB_PARENT(z)->color = BLACK;
+				RB_PARENT(RB_PARENT(z))->color = RED;
+				rbtree_right_rotate(T, RB_PARENT(RB_PARENT(z)));
 			}
 		}else {
-			rbtree_node *y = z->parent->parent->left;
+			rbtree_node *y = RB_LEFT(g);
 			if (y->color == RED) {
-				z->parent->color = BLACK;
+				p->color = BLACK;
 				y->color = BLACK;
-				z->parent->parent->color = RED;
+				g->color = RED;
 
-				z = z->parent->parent; //z --> RED
+				z = g; //z --> RED
 			} else {
-				if (z == z->parent->left) {
-					z = z->parent;
+				if (z == RB_LEFT(p)) {
+					z = p;
 					rbtree_right_rotate(T, z);
 				}
 
-				z->parent->color = BLACK;
-				z->parent->parent->color = RED;
-				rbtree_left_rotate(T, z->parent->parent);
+				RB_PARENT(z)->color = BLACK;
+				RB_PARENT(RB_PARENT(z))->color = RED;
+				rbtree_left_rotate(T, RB_PARENT(RB_PARENT(z)));
 			}
 		}
 		
@@ -174,40 +229,40 @@ void rbtree_insert(rbtree *T, rbtree_node *z) {
 	while (x != T->nil) {
 		y = x;
 #if ENABLE_KEY_CHAR
-		if (strcmp(z->key, x->key) < 0) {
-			x = x->left;
-		} else if (strcmp(z->key, x->key) > 0) {
-			x = x->right;
+		if (strcmp(RB_KEY(z), RB_KEY(x)) < 0) {
+			x = RB_LEFT(x);
+		} else if (strcmp(RB_KEY(z), RB_KEY(x)) > 0) {
+			x = RB_RIGHT(x);
 		} else {
 			return ;
 		}
 
 #else
 		if (z->key < x->key) { //strcmp
-			x = x->left;
+			x = RB_LEFT(x);
 		} else if (z->key > x->key) {
-			x = x->right;
+			x = RB_RIGHT(x);
 		} else { //Exist
 			return ;
 		}
 #endif
 	}
 
-	z->parent = y;
+	RB_SET_PARENT(z, y);
 	if (y == T->nil) {
 		T->root = z;
 #if ENABLE_KEY_CHAR
-	} else if (strcmp(z->key, y->key) < 0) {
+	} else if (strcmp(RB_KEY(z), RB_KEY(y)) < 0) {
 #else
 	} else if (z->key < y->key) {
 #endif
-		y->left = z;
+		RB_SET_LEFT(y, z);
 	} else {
-		y->right = z;
+		RB_SET_RIGHT(y, z);
 	}
 
-	z->left = T->nil;
-	z->right = T->nil;
+	RB_SET_LEFT(z, T->nil);
+	RB_SET_RIGHT(z, T->nil);
 	z->color = RED;
 
 	rbtree_insert_fixup(T, z);
@@ -216,63 +271,63 @@ void rbtree_insert(rbtree *T, rbtree_node *z) {
 void rbtree_delete_fixup(rbtree *T, rbtree_node *x) {
 
 	while ((x != T->root) && (x->color == BLACK)) {
-		if (x == x->parent->left) {
+		if (x == RB_LEFT(RB_PARENT(x))) {
 
-			rbtree_node *w= x->parent->right;
+			rbtree_node *w= RB_RIGHT(RB_PARENT(x));
 			if (w->color == RED) {
 				w->color = BLACK;
-				x->parent->color = RED;
+				RB_PARENT(x)->color = RED;
 
-				rbtree_left_rotate(T, x->parent);
-				w = x->parent->right;
+				rbtree_left_rotate(T, RB_PARENT(x));
+				w = RB_RIGHT(RB_PARENT(x));
 			}
 
-			if ((w->left->color == BLACK) && (w->right->color == BLACK)) {
+			if ((RB_LEFT(w)->color == BLACK) && (RB_RIGHT(w)->color == BLACK)) {
 				w->color = RED;
-				x = x->parent;
+				x = RB_PARENT(x);
 			} else {
 
-				if (w->right->color == BLACK) {
-					w->left->color = BLACK;
+				if (RB_RIGHT(w)->color == BLACK) {
+					RB_LEFT(w)->color = BLACK;
 					w->color = RED;
 					rbtree_right_rotate(T, w);
-					w = x->parent->right;
+					w = RB_RIGHT(RB_PARENT(x));
 				}
 
-				w->color = x->parent->color;
-				x->parent->color = BLACK;
-				w->right->color = BLACK;
-				rbtree_left_rotate(T, x->parent);
+				w->color = RB_PARENT(x)->color;
+				RB_PARENT(x)->color = BLACK;
+				RB_RIGHT(w)->color = BLACK;
+				rbtree_left_rotate(T, RB_PARENT(x));
 
 				x = T->root;
 			}
 
 		} else {
 
-			rbtree_node *w = x->parent->left;
+			rbtree_node *w = RB_LEFT(RB_PARENT(x));
 			if (w->color == RED) {
 				w->color = BLACK;
-				x->parent->color = RED;
-				rbtree_right_rotate(T, x->parent);
-				w = x->parent->left;
+				RB_PARENT(x)->color = RED;
+				rbtree_right_rotate(T, RB_PARENT(x));
+				w = RB_LEFT(RB_PARENT(x));
 			}
 
-			if ((w->left->color == BLACK) && (w->right->color == BLACK)) {
+			if ((RB_LEFT(w)->color == BLACK) && (RB_RIGHT(w)->color == BLACK)) {
 				w->color = RED;
-				x = x->parent;
+				x = RB_PARENT(x);
 			} else {
 
-				if (w->left->color == BLACK) {
-					w->right->color = BLACK;
+				if (RB_LEFT(w)->color == BLACK) {
+					RB_RIGHT(w)->color = BLACK;
 					w->color = RED;
 					rbtree_left_rotate(T, w);
-					w = x->parent->left;
+					w = RB_LEFT(RB_PARENT(x));
 				}
 
-				w->color = x->parent->color;
-				x->parent->color = BLACK;
-				w->left->color = BLACK;
-				rbtree_right_rotate(T, x->parent);
+				w->color = RB_PARENT(x)->color;
+				RB_PARENT(x)->color = BLACK;
+				RB_LEFT(w)->color = BLACK;
+				rbtree_right_rotate(T, RB_PARENT(x));
 
 				x = T->root;
 			}
@@ -290,41 +345,43 @@ rbtree_node *rbtree_delete(rbtree *T, rbtree_node *z) {
 	rbtree_node *y = T->nil;
 	rbtree_node *x = T->nil;
 
-	if ((z->left == T->nil) || (z->right == T->nil)) {
+	if ((RB_LEFT(z) == T->nil) || (RB_RIGHT(z) == T->nil)) {
 		y = z;
 	} else {
 		y = rbtree_successor(T, z);
 	}
 
-	if (y->left != T->nil) {
-		x = y->left;
-	} else if (y->right != T->nil) {
-		x = y->right;
+	if (RB_LEFT(y) != T->nil) {
+		x = RB_LEFT(y);
+	} else if (RB_RIGHT(y) != T->nil) {
+		x = RB_RIGHT(y);
 	}
 
-	x->parent = y->parent;
-	if (y->parent == T->nil) {
+	rbtree_node *p = RB_PARENT(y);
+	RB_SET_PARENT(x, p);
+	if (p == T->nil) {
 		T->root = x;
-	} else if (y == y->parent->left) {
-		y->parent->left = x;
+	} else if (y == RB_LEFT(p)) {
+		RB_SET_LEFT(p, x);
 	} else {
-		y->parent->right = x;
+		RB_SET_RIGHT(p, x);
 	}
 
 	if (y != z) {
 		
 #if ENABLE_KEY_CHAR
-		void *tmp = z->key;
+		kvs_key_t key = z->key;
 		z->key = y->key;
-		y->key = tmp;
+		y->key = key;
 
-		tmp = z->value;
+		kvs_value_t value = z->value;
 		z->value = y->value;
-		y->value = tmp;
+		y->value = value;
 #else
 		z->key = y->key;
 		z->value = y->value;
 #endif
+		z->lru = y->lru;
 	}
 
 	if (y->color == BLACK) {
@@ -342,18 +399,18 @@ rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
 	while (node != T->nil) {
 		
 #if ENABLE_KEY_CHAR
-		if (strcmp(key, node->key) < 0) {
-			node = node->left;
-		} else if (strcmp(key, node->key) > 0) {
-			node = node->right;
+		if (strcmp(key, RB_KEY(node)) < 0) {
+			node = RB_LEFT(node);
+		} else if (strcmp(key, RB_KEY(node)) > 0) {
+			node = RB_RIGHT(node);
 		} else {
 			return node;
 		}
 #else
 		if (key < node->key) {
-			node = node->left;
+			node = RB_LEFT(node);
 		} else if (key > node->key) {
-			node = node->right;
+			node = RB_RIGHT(node);
 		} else {
 			return node;
 		}	
@@ -365,9 +422,9 @@ rbtree_node *rbtree_search(rbtree *T, KEY_TYPE key) {
 
 void rbtree_traversal(rbtree *T, rbtree_node *node) {
 	if (node != T->nil) {
-		rbtree_traversal(T, node->left);
-		printf("key:%s, color:%d\n", node->key, node->color);
-		rbtree_traversal(T, node->right);
+		rbtree_traversal(T, RB_LEFT(node));
+		printf("key:%s, color:%d\n", RB_KEY(node), node->color);
+		rbtree_traversal(T, RB_RIGHT(node));
 	}
 }
 
@@ -381,9 +438,10 @@ int kvstore_rbtree_create(rbtree *tree) {
 	if (!tree) return -1;
 	memset(tree, 0, sizeof(rbtree));
 	
-	tree->nil = (rbtree_node*)malloc(sizeof(rbtree_node));
-	tree->nil->key = malloc(1);
-	*(tree->nil->key) = '\0';
+	tree->nil = RB_NODE_ALLOC();
+	if (!tree->nil) return -1;
+	kvs_key_set(&tree->nil->key, "");
+	kvs_value_set(&tree->nil->value, "");
 	
 	
 	tree->nil->color = BLACK;
@@ -396,7 +454,6 @@ void kvstore_rbtree_destory(rbtree *tree) {
 
 	if (!tree) return ;
 
-	if (tree->nil->key) kvstore_free(tree->nil->key);
 
 	rbtree_node *node = tree->root;
 	while (node != tree->nil) {
@@ -408,43 +465,63 @@ void kvstore_rbtree_destory(rbtree *tree) {
 
 		node = rbtree_delete(tree, node);
 
-		if (!node) {
-			kvstore_free(node->key);
-			kvstore_free(node->value);
-			kvstore_free(node);
+		if (node) {
+			kvs_key_free(&node->key);
+			kvs_value_free(&node->value);
+			RB_NODE_FREE(node);
 		}
 		
 
 	}
 
+	RB_NODE_FREE(tree->nil);
+	tree->nil = NULL;
+
+}
+
+// heap allocated rbtree, one per shard
+rbtree *kvstore_rbtree_new(void) {
+
+	rbtree *tree = (rbtree *)kvstore_malloc(sizeof(rbtree));
+	if (!tree) return NULL;
+
+	if (kvstore_rbtree_create(tree) != 0) {
+		kvstore_free(tree);
+		return NULL;
+	}
+	return tree;
+}
+
+void kvstore_rbtree_free(rbtree *tree) {
+
+	if (!tree) return ;
+
+	kvstore_rbtree_destory(tree);
+	kvstore_free(tree);
 }
 
 
 int kvs_rbtree_set(rbtree *tree, char *key, char *value) {
 
-	rbtree_node *node  = (rbtree_node*)malloc(sizeof(rbtree_node));
+	rbtree_node *node  = RB_NODE_ALLOC();
 	if (!node) return -1;
+	node->lru = kvs_lru_new();
 
-	node->key = kvstore_malloc(strlen(key) + 1);
-	if (node->key == NULL) {
-		kvstore_free(node);
+	if (kvs_key_set(&node->key, key) != 0) {
+		RB_NODE_FREE(node);
 		return -1;
 	}
-	
-	memset(node->key, 0, strlen(key) + 1);
-	strcpy(node->key, key);
-	
-	node->value = kvstore_malloc(strlen(value) + 1);
-	if (node->value == NULL) {
-		kvstore_free(node->key);
-		kvstore_free(node);
+
+	if (kvs_value_set(&node->value, value) != 0) {
+		kvs_key_free(&node->key);
+		RB_NODE_FREE(node);
 		return -1;
 	}
-	memset(node->value, 0, strlen(value) + 1);
-	strcpy((char *)node->value, value);
 
+	RB_WRITE_BEGIN(tree);
 	rbtree_insert(tree, node);
 	tree->count ++;
+	RB_WRITE_END(tree);
 
 	return 0;
 }
@@ -456,7 +533,8 @@ char* kvs_rbtree_get(rbtree *tree, char *key) {
 		return NULL;
 	}
 
-	return node->value;
+	node->lru = kvs_lru_touch(node->lru);
+	return RB_VALUE(node);
 	
 }
 
@@ -468,14 +546,16 @@ int kvs_rbtree_delete(rbtree *tree, char *key) {
 		return -1;
 	}
 	
+	RB_WRITE_BEGIN(tree);
 	rbtree_node *cur = rbtree_delete(tree, node);
 
-	if (!cur) {
-		kvstore_free(cur->key);
-		kvstore_free(cur->value);
-		kvstore_free(cur);
+	if (cur) {
+		kvs_key_free(&cur->key);
+		kvs_value_free(&cur->value);
+		RB_NODE_FREE(cur);
 	}
 	tree->count --;
+	RB_WRITE_END(tree);
 	
 	return 0;
 }
@@ -488,26 +568,197 @@ int kvs_rbtree_modify(rbtree *tree, char *key, char *value) {
 		return -1;
 	}
 
-	char *tmp = node->value;
-	kvstore_free(tmp);
-	
-	node->value = kvstore_malloc(strlen(value) + 1);
-	if (node->value == NULL) {
+	RB_WRITE_BEGIN(tree);
+	kvs_value_free(&node->value);
+	node->lru = kvs_lru_touch(node->lru);
+
+	int res = kvs_value_set(&node->value, value);
+	RB_WRITE_END(tree);
+
+	return res != 0 ? -1 : 0;
+}
+
+int kvs_rbtree_count(rbtree *tree) {
+
+	return tree->count;
+
+}
+
+// bytes the key costs: its node and what its key and value hold on the heap.
+// -1: no such key
+long kvs_rbtree_usage(rbtree *tree, char *key) {
+
+	rbtree_node *node = rbtree_search(tree, key);
+	if (node == tree->nil) {
 		return -1;
 	}
-	strcpy(node->value, value);
+
+	return kvstore_usable_size(node) + kvs_key_usage(&node->key) + kvs_value_usage(&node->value);
+}
+
+#if ENABLE_RCU_READS
+
+// every node is copied out and checked against the sequence count before
+// anything it points to is touched: a rotation half done costs a retry, not
+// a wild pointer or a loop. a check that passes means no writer started
+// since the read began, so the path walked is one the tree really had.
+// the access clock is left alone, it shares a word with the color
+int kvs_rbtree_read(rbtree *tree, char *key, char *buf, int len) {
+
+	kvs_seq_read_t rd;
+	if (!kvs_seq_read_begin(&rd, &tree->seq)) return -1;
+
+	rbtree_node *nil = tree->nil;
+	rbtree_node *node = tree->root;
+
+	while (1) {
+		if (!kvs_seq_read_valid(&rd)) return -1;
+		if (node == nil) return 1;
+
+		kvs_key_t k = node->key;
+		rbtree_link left = node->left;
+		rbtree_link right = node->right;
+		if (!kvs_seq_read_valid(&rd)) return -1;
+
+		int cmp = strcmp(key, kvs_key_get(&k));
+		if (cmp == 0) break;
+
+		node = cmp < 0 ? RB_LINK(left) : RB_LINK(right);
+	}
+
+	kvs_value_t v = node->value;
+	if (!kvs_seq_read_valid(&rd)) return -1;
+
+	// the string behind v is not written in place, only freed, and that waits
+	snprintf(buf, len, "%s", kvs_value_get(&v));
+
+	return kvs_seq_read_valid(&rd) ? 0 : -1;
+}
+
+#endif
+
+// in-order walk from the first key >= start (NULL: from the smallest key)
+int kvs_rbtree_scan(rbtree *tree, char *start, SCAN_CALLBACK cb, void *arg) {
+
+	if (!tree || !cb) return -1;
+
+	rbtree_node *node = tree->root;
+	rbtree_node *lower = tree->nil;
+
+	if (start) {
+		while (node != tree->nil) {
+			if (strcmp(RB_KEY(node), start) >= 0) {
+				lower = node;
+				node = RB_LEFT(node);
+			} else {
+				node = RB_RIGHT(node);
+			}
+		}
+	} else if (node != tree->nil) {
+		lower = rbtree_mini(tree, node);
+	}
+
+	for (node = lower;node != tree->nil;node = rbtree_successor(tree, node)) {
+		if (cb(RB_KEY(node), RB_VALUE(node), arg)) return 1;
+	}
 
 	return 0;
 }
 
-int kvs_rbtree_count(rbtree *tree) {
+#if ENABLE_MEM_DEFRAG
 
-	return tree->count;
+// every pointer to a node is known: the parent's child (or the root) and
+// the children's parent
+static rbtree_node *_rbtree_defrag_node(rbtree *tree, rbtree_node *node) {
+
+	rbtree_node *moved = kvstore_defrag_move(node);
+	if (!moved) return node;
+
+	rbtree_node *parent = RB_PARENT(moved);
+	if (parent == tree->nil) {
+		tree->root = moved;
+	} else if (RB_LEFT(parent) == node) {
+		RB_SET_LEFT(parent, moved);
+	} else {
+		RB_SET_RIGHT(parent, moved);
+	}
+
+	if (RB_LEFT(moved) != tree->nil) RB_SET_PARENT(RB_LEFT(moved), moved);
+	if (RB_RIGHT(moved) != tree->nil) RB_SET_PARENT(RB_RIGHT(moved), moved);
+
+	return moved;
+}
+
+// in-order defrag walk of budget keys from the first key >= cursor
+int kvs_rbtree_defrag(rbtree *tree, char *cursor, int budget, KVS_DEFRAG_MOVED moved) {
 
+	if (!tree || !cursor) return -1;
+
+	rbtree_node *node = tree->root;
+	rbtree_node *lower = tree->nil;
+
+	if (cursor[0]) {
+		while (node != tree->nil) {
+			if (strcmp(RB_KEY(node), cursor) >= 0) {
+				lower = node;
+				node = RB_LEFT(node);
+			} else {
+				node = RB_RIGHT(node);
+			}
+		}
+	} else if (node != tree->nil) {
+		lower = rbtree_mini(tree, node);
+	}
+
+	RB_WRITE_BEGIN(tree);
+	for (node = lower;node != tree->nil;node = rbtree_successor(tree, node)) {
+		if (budget -- == 0) {
+			snprintf(cursor, BUFFER_LENGTH, "%s", RB_KEY(node));
+			RB_WRITE_END(tree);
+			return 1;
+		}
+
+		node = _rbtree_defrag_node(tree, node);
+
+		// inline strings moved with the node, only heap ones are left
+		kvs_key_defrag(&node->key);
+
+		if (kvs_value_defrag(&node->value)) {
+			if (moved) moved(RB_KEY(node));
+		}
+	}
+	RB_WRITE_END(tree);
+
+	return 0;
 }
 
+#endif
+
+// random node for eviction sampling: a random-length walk down random
+// branches. not uniform, deep nodes are picked less often, good enough to
+// compare a handful of access clocks.
+int kvs_rbtree_sample(rbtree *tree, char **key, unsigned int *lru) {
+
+	if (!tree || tree->root == tree->nil) return -1;
+
+	rbtree_node *node = tree->root;
+	while (1) {
+		unsigned int r = kvs_random();
+		if ((r & 3) == 0) break; // stop here one time in four
+
+		rbtree_node *next = (r & 4) ? RB_LEFT(node) : RB_RIGHT(node);
+		if (next == tree->nil) next = (r & 4) ? RB_RIGHT(node) : RB_LEFT(node);
+		if (next == tree->nil) break;
+
+		node = next;
+	}
+
+	*key = RB_KEY(node);
+	*lru = node->lru;
+
+	return 0;
+}
 
-rbtree Tree;
 
 
 
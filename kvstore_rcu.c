@@ -0,0 +1,88 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "kvstore.h"
+
+
+// the lockless tree reads, CONFIG SET rcu-reads yes. a worker answering
+// RGET, SGET or BGET of another worker's shard walks the tree with no lock
+// (kvs_rbtree_read() and the like), the sequence count tells it when a
+// writer got in the way. what keeps it from walking into freed memory is an
+// ebr visit around the lookups of the key: inside kvstore_shard_enter() of
+// a multi-worker server kvs_ebr_defer is set, and kvstore_free_tag() retires
+// nodes, keys, values and interned values whose last reference went
+// instead of freeing them (kvstore_ebr.c).
+
+#if ENABLE_RCU_READS
+
+
+// one per worker, on its own cache line, written by that worker
+typedef struct rcu_slot_s {
+	uint64_t reads;			// lookups answered without the lock
+	uint64_t retries;		// lookups thrown away, the tree changed
+	uint64_t fallbacks;		// keys that went to the locked path after all
+} __attribute__((aligned(64))) rcu_slot_t;
+
+static rcu_slot_t Slots[KVS_MAX_SHARDS];
+
+int kvs_rcu_reads = 1;
+
+
+void kvs_rcu_read_lock(void) {
+	kvs_ebr_enter();
+}
+
+void kvs_rcu_read_unlock(int retries, int served) {
+
+	kvs_ebr_exit();
+
+	rcu_slot_t *slot = &Slots[kvs_worker];
+
+	__atomic_store_n(&slot->retries, slot->retries + retries, __ATOMIC_RELAXED);
+	if (served) {
+		__atomic_store_n(&slot->reads, slot->reads + 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_store_n(&slot->fallbacks, slot->fallbacks + 1, __ATOMIC_RELAXED);
+	}
+}
+
+
+int kvs_rcu_config_set(char *value) {
+
+	if (strcmp(value, "yes") == 0) {
+		__atomic_store_n(&kvs_rcu_reads, 1, __ATOMIC_RELAXED);
+	} else if (strcmp(value, "no") == 0) {
+		__atomic_store_n(&kvs_rcu_reads, 0, __ATOMIC_RELAXED);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+const char *kvs_rcu_config_get(void) {
+	return kvs_rcu_reads ? "yes" : "no";
+}
+
+int kvs_rcu_stats(char *buf, int len) {
+
+	uint64_t reads = 0, retries = 0, fallbacks = 0;
+
+	int i = 0;
+	for (i = 0;i < kvs_nshards;i ++) {
+		reads += __atomic_load_n(&Slots[i].reads, __ATOMIC_RELAXED);
+		retries += __atomic_load_n(&Slots[i].retries, __ATOMIC_RELAXED);
+		fallbacks += __atomic_load_n(&Slots[i].fallbacks, __ATOMIC_RELAXED);
+	}
+
+	return snprintf(buf, len, "rcu:%s reads:%llu retries:%llu fallbacks:%llu\n",
+		kvs_nshards == 1 ? "single" : kvs_rcu_config_get(),
+		(unsigned long long)reads, (unsigned long long)retries, (unsigned long long)fallbacks);
+}
+
+#endif
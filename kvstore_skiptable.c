@@ -17,19 +17,60 @@ typedef char* KEY_TYPE;
 typedef int KEY_TYPE;
 #endif
 
+#if ENABLE_COMPACT_REFS
+typedef kvs_ref_t skiplist_link;        // 32 bit slab reference, kvstore.h
+#else
+typedef struct _skiplist_node *skiplist_link;
+#endif
+
 typedef struct _skiplist_node {
+#if ENABLE_KEY_CHAR
+    kvs_key_t key;          // short ones inline, kvstore.h
+    kvs_value_t value;
+#else
     KEY_TYPE key;
     void *value;
-    struct _skiplist_node **forward;
+#endif
+    unsigned int lru;
+    skiplist_link *forward;
 } skiplist_node;
 
+#define SL_KEY(node)        kvs_key_get(&(node)->key)
+#define SL_VALUE(node)      kvs_value_get(&(node)->value)
+
+#if ENABLE_COMPACT_REFS
+#define SL_NEXT(node, i)            ((skiplist_node *)kvs_deref((node)->forward[i]))
+#define SL_SET_NEXT(node, i, x)     ((node)->forward[i] = kvs_ref(x))
+#define SL_NODE_ALLOC()             ((skiplist_node *)kvstore_malloc_ref(sizeof(skiplist_node), KVS_MEM_NODE))
+#else
+#define SL_NEXT(node, i)            ((node)->forward[i])
+#define SL_SET_NEXT(node, i, x)     ((node)->forward[i] = (x))
+#define SL_NODE_ALLOC()             ((skiplist_node *)kvstore_malloc_tag(sizeof(skiplist_node), KVS_MEM_NODE))
+#endif
+#define SL_NODE_FREE(node)          kvstore_free_tag((node), KVS_MEM_NODE)
+
+#if ENABLE_COMPACT_REFS
+#define SL_LINK(link)               ((skiplist_node *)kvs_deref(link))
+#else
+#define SL_LINK(link)               (link)
+#endif
+
+// every change to the list, kvs_skiptable_read() runs beside them
+#if ENABLE_RCU_READS
+#define SL_WRITE_BEGIN(sl)          kvs_seq_write_begin(&(sl)->seq)
+#define SL_WRITE_END(sl)            kvs_seq_write_end(&(sl)->seq)
+#else
+#define SL_WRITE_BEGIN(sl)
+#define SL_WRITE_END(sl)
+#endif
+
 typedef struct _skiplist {
     int level;
     struct _skiplist_node *header;
     int count;
+    unsigned int seq;       // odd while a writer is inside
 } skiplist;
 
-skiplist Skiplist;
 
 static int random_level() {
     int level = 1;
@@ -40,41 +81,35 @@ static int random_level() {
 }
 
 static skiplist_node *create_node(int level, KEY_TYPE key, void *value) {
-    skiplist_node *node = (skiplist_node *)kvstore_malloc(sizeof(skiplist_node));
+    skiplist_node *node = SL_NODE_ALLOC();
     if (!node) return NULL;
 
-    node->forward = (skiplist_node **)kvstore_malloc(sizeof(skiplist_node *) * level);
+    node->forward = (skiplist_link *)kvstore_malloc_tag(sizeof(skiplist_link) * level, KVS_MEM_NODE);
     if (!node->forward) {
-        kvstore_free(node);
+        SL_NODE_FREE(node);
         return NULL;
     }
 
 #if ENABLE_KEY_CHAR
-    node->key = kvstore_malloc(strlen(key) + 1);
-    if (!node->key) {
-        kvstore_free(node->forward);
-        kvstore_free(node);
+    if (kvs_key_set(&node->key, key) != 0) {
+        SL_NODE_FREE(node->forward);
+        SL_NODE_FREE(node);
         return NULL;
     }
-    strcpy(node->key, key);
-
-    if (value) {
-        node->value = kvstore_malloc(strlen((char *)value) + 1);
-        if (!node->value) {
-            kvstore_free(node->key);
-            kvstore_free(node->forward);
-            kvstore_free(node);
-            return NULL;
-        }
-        strcpy((char *)node->value, (char *)value);
-    } else {
-        node->value = NULL;
+
+    if (kvs_value_set(&node->value, value ? (char *)value : "") != 0) {
+        kvs_key_free(&node->key);
+        SL_NODE_FREE(node->forward);
+        SL_NODE_FREE(node);
+        return NULL;
     }
 #else
     node->key = key;
     node->value = value;
 #endif
 
+    node->lru = kvs_lru_new();
+
     return node;
 }
 
@@ -88,7 +123,7 @@ int skiplist_init(skiplist *sl) {
     if (!sl->header) return -1;
 
     for (int i = 0; i < MAX_LEVEL; i++) {
-        sl->header->forward[i] = NULL;
+        SL_SET_NEXT(sl->header, i, NULL);
     }
 
     srand(time(NULL));
@@ -98,25 +133,21 @@ int skiplist_init(skiplist *sl) {
 void skiplist_destory(skiplist *sl) {
     if (!sl) return;
 
-    skiplist_node *node = sl->header->forward[0];
+    skiplist_node *node = SL_NEXT(sl->header, 0);
     while (node != NULL) {
         skiplist_node *tmp = node;
-        node = node->forward[0];
+        node = SL_NEXT(node, 0);
 
-        kvstore_free(tmp->key);
-        if (tmp->value) {
-            kvstore_free(tmp->value);
-        }
-        kvstore_free(tmp->forward);
-        kvstore_free(tmp);
+        kvs_key_free(&tmp->key);
+        kvs_value_free(&tmp->value);
+        SL_NODE_FREE(tmp->forward);
+        SL_NODE_FREE(tmp);
     }
 
-    kvstore_free(sl->header->key);
-    if (sl->header->value) {
-        kvstore_free(sl->header->value);
-    }
-    kvstore_free(sl->header->forward);
-    kvstore_free(sl->header);
+    kvs_key_free(&sl->header->key);
+    kvs_value_free(&sl->header->value);
+    SL_NODE_FREE(sl->header->forward);
+    SL_NODE_FREE(sl->header);
 }
 
 skiplist_node *skiplist_search(skiplist *sl, KEY_TYPE key) {
@@ -125,18 +156,18 @@ skiplist_node *skiplist_search(skiplist *sl, KEY_TYPE key) {
     skiplist_node *x = sl->header;
     for (int i = sl->level - 1; i >= 0; i--) {
 #if ENABLE_KEY_CHAR
-        while (x->forward[i] != NULL && strcmp(x->forward[i]->key, key) < 0) {
+        while (SL_NEXT(x, i) != NULL && strcmp(SL_KEY(SL_NEXT(x, i)), key) < 0) {
 #else
-        while (x->forward[i] != NULL && x->forward[i]->key < key) {
+        while (SL_NEXT(x, i) != NULL && SL_NEXT(x, i)->key < key) {
 #endif
-            x = x->forward[i];
+            x = SL_NEXT(x, i);
         }
     }
 
-    x = x->forward[0];
+    x = SL_NEXT(x, 0);
 
 #if ENABLE_KEY_CHAR
-    if (x != NULL && strcmp(x->key, key) == 0) {
+    if (x != NULL && strcmp(SL_KEY(x), key) == 0) {
 #else
     if (x != NULL && x->key == key) {
 #endif
@@ -154,19 +185,19 @@ int skiplist_insert(skiplist *sl, KEY_TYPE key, void *value) {
 
 	for (int i = sl->level - 1; i >= 0; i--) {
 #if ENABLE_KEY_CHAR
-		while (x->forward[i] != NULL && strcmp(x->forward[i]->key, key) < 0) {
+		while (SL_NEXT(x, i) != NULL && strcmp(SL_KEY(SL_NEXT(x, i)), key) < 0) {
 #else
-		while (x->forward[i] != NULL && x->forward[i]->key < key) {
+		while (SL_NEXT(x, i) != NULL && SL_NEXT(x, i)->key < key) {
 #endif
-			x = x->forward[i];
+			x = SL_NEXT(x, i);
 		}
 		update[i] = x;
 	}
 
-	x = x->forward[0];
+	x = SL_NEXT(x, 0);
 
 #if ENABLE_KEY_CHAR
-	if (x != NULL && strcmp(x->key, key) == 0) {
+	if (x != NULL && strcmp(SL_KEY(x), key) == 0) {
 #else
 	if (x != NULL && x->key == key) {
 #endif
@@ -187,7 +218,7 @@ int skiplist_insert(skiplist *sl, KEY_TYPE key, void *value) {
 
 	for (int i = 0; i < level; i++) {
 		x->forward[i] = update[i]->forward[i];
-		update[i]->forward[i] = x;
+		SL_SET_NEXT(update[i], i, x);
 	}
 
 	// sl->count++ is now handled in kvs_skiptable_set
@@ -202,19 +233,19 @@ int skiplist_delete(skiplist *sl, KEY_TYPE key) {
 
     for (int i = sl->level - 1; i >= 0; i--) {
 #if ENABLE_KEY_CHAR
-        while (x->forward[i] != NULL && strcmp(x->forward[i]->key, key) < 0) {
+        while (SL_NEXT(x, i) != NULL && strcmp(SL_KEY(SL_NEXT(x, i)), key) < 0) {
 #else
-        while (x->forward[i] != NULL && x->forward[i]->key < key) {
+        while (SL_NEXT(x, i) != NULL && SL_NEXT(x, i)->key < key) {
 #endif
-            x = x->forward[i];
+            x = SL_NEXT(x, i);
         }
         update[i] = x;
     }
 
-    x = x->forward[0];
+    x = SL_NEXT(x, 0);
 
 #if ENABLE_KEY_CHAR
-    if (x == NULL || strcmp(x->key, key) != 0) {
+    if (x == NULL || strcmp(SL_KEY(x), key) != 0) {
 #else
     if (x == NULL || x->key != key) {
 #endif
@@ -222,21 +253,21 @@ int skiplist_delete(skiplist *sl, KEY_TYPE key) {
     }
 
     for (int i = 0; i < sl->level; i++) {
-        if (update[i]->forward[i] != x) {
+        if (SL_NEXT(update[i], i) != x) {
             break;
         }
         update[i]->forward[i] = x->forward[i];
     }
 
     // Update the level of the skip list
-    while (sl->level > 1 && sl->header->forward[sl->level - 1] == NULL) {
+    while (sl->level > 1 && SL_NEXT(sl->header, sl->level - 1) == NULL) {
         sl->level--;
     }
 
-    kvstore_free(x->key);
-    kvstore_free(x->value);
-    kvstore_free(x->forward);
-    kvstore_free(x);
+    kvs_key_free(&x->key);
+    kvs_value_free(&x->value);
+    SL_NODE_FREE(x->forward);
+    SL_NODE_FREE(x);
 
     sl->count--;
     return 0;
@@ -250,14 +281,13 @@ int skiplist_modify(skiplist *sl, KEY_TYPE key, void *value) {
         return -1; // key not found
     }
 
-    kvstore_free(node->value);
+    kvs_value_free(&node->value);
+    node->lru = kvs_lru_touch(node->lru);
 
-    node->value = kvstore_malloc(strlen((char *)value) + 1);
-    if (!node->value) {
+    if (kvs_value_set(&node->value, (char *)value) != 0) {
         return -1;
     }
 
-    strcpy((char *)node->value, (char *)value);
     return 0;
 }
 
@@ -279,14 +309,19 @@ void kvstore_skiptable_destory(skiplist *sl) {
 int kvs_skiptable_set(skiplist *sl, char *key, char *value) {
 	if (!sl || !key || !value) return -1;
 	
+	SL_WRITE_BEGIN(sl);
 	int res = skiplist_insert(sl, key, value);
 	if (res == 0) {
 		// New key inserted, increment count
 		sl->count++;
 	} else if (res == 1) {
 		// Key already exists, update it
-		return skiplist_modify(sl, key, value);
+		res = skiplist_modify(sl, key, value);
+		SL_WRITE_END(sl);
+		return res;
 	}
+	SL_WRITE_END(sl);
+
 	return 0;
 }
 
@@ -298,23 +333,206 @@ char *kvs_skiptable_get(skiplist *sl, char *key) {
         return NULL;
     }
     
-    return node->value;
+    node->lru = kvs_lru_touch(node->lru);
+    return SL_VALUE(node);
 }
 
 int kvs_skiptable_delete(skiplist *sl, char *key) {
     if (!sl || !key) return -1;
     
-    return skiplist_delete(sl, key);
+    SL_WRITE_BEGIN(sl);
+    int res = skiplist_delete(sl, key);
+    SL_WRITE_END(sl);
+
+    return res;
 }
 
 int kvs_skiptable_modify(skiplist *sl, char *key, char *value) {
     if (!sl || !key || !value) return -1;
     
-    return skiplist_modify(sl, key, value);
+    SL_WRITE_BEGIN(sl);
+    int res = skiplist_modify(sl, key, value);
+    SL_WRITE_END(sl);
+
+    return res;
 }
 
 int kvs_skiptable_count(skiplist *sl) {
     if (!sl) return 0;
     
     return sl->count;
+}
+
+// bytes the key costs: its node, forward array, heap key and value.
+// -1: no such key
+long kvs_skiptable_usage(skiplist *sl, char *key) {
+    skiplist_node *node = skiplist_search(sl, key);
+    if (!node) return -1;
+
+    return kvstore_usable_size(node) + kvstore_usable_size(node->forward)
+        + kvs_key_usage(&node->key) + kvs_value_usage(&node->value);
+}
+
+#if ENABLE_RCU_READS
+// the search of skiplist_search(), with every node copied out and checked
+// against the sequence count before its key or links are followed, see
+// kvs_rbtree_read(). the access clock is left alone
+int kvs_skiptable_read(skiplist *sl, char *key, char *buf, int len) {
+    kvs_seq_read_t rd;
+    if (!kvs_seq_read_begin(&rd, &sl->seq)) return -1;
+
+    skiplist_node *x = sl->header;
+    int level = sl->level;
+    if (!kvs_seq_read_valid(&rd)) return -1;
+
+    skiplist_node *next = NULL;
+    kvs_key_t k;
+    int cmp = 1;
+
+    for (int i = level - 1; i >= 0; i--) {
+        while (1) {
+            skiplist_link link = x->forward[i];
+            if (!kvs_seq_read_valid(&rd)) return -1;
+
+            next = SL_LINK(link);
+            if (next == NULL) {
+                cmp = 1;
+                break;
+            }
+
+            k = next->key;
+            if (!kvs_seq_read_valid(&rd)) return -1;
+
+            cmp = strcmp(kvs_key_get(&k), key);
+            if (cmp >= 0) break;
+            x = next;
+        }
+    }
+
+    // the loop ended on level 0 with next the first node >= key
+    if (cmp != 0) return kvs_seq_read_valid(&rd) ? 1 : -1;
+
+    kvs_value_t v = next->value;
+    if (!kvs_seq_read_valid(&rd)) return -1;
+
+    snprintf(buf, len, "%s", kvs_value_get(&v));
+
+    return kvs_seq_read_valid(&rd) ? 0 : -1;
+}
+#endif
+
+// in-order walk from the first key >= start (NULL: from the smallest key).
+// returns 1 when cb stopped the walk by returning non-zero, 0 at the end
+int kvs_skiptable_scan(skiplist *sl, char *start, SCAN_CALLBACK cb, void *arg) {
+    if (!sl || !cb) return -1;
+
+    skiplist_node *x = sl->header;
+    if (start) {
+        for (int i = sl->level - 1; i >= 0; i--) {
+            while (SL_NEXT(x, i) != NULL && strcmp(SL_KEY(SL_NEXT(x, i)), start) < 0) {
+                x = SL_NEXT(x, i);
+            }
+        }
+    }
+
+    skiplist_node *node = SL_NEXT(x, 0);
+    while (node != NULL) {
+        if (cb(SL_KEY(node), SL_VALUE(node), arg)) return 1;
+        node = SL_NEXT(node, 0);
+    }
+
+    return 0;
+}
+
+#if ENABLE_MEM_DEFRAG
+// in-order defrag walk of budget keys from the first key >= cursor.
+// update[i] is the last node before the current one on level i, so a moved
+// node is relinked on exactly the levels it is on.
+int kvs_skiptable_defrag(skiplist *sl, char *cursor, int budget, KVS_DEFRAG_MOVED moved) {
+    if (!sl || !cursor) return -1;
+
+    skiplist_node *update[MAX_LEVEL];
+    skiplist_node *x = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (SL_NEXT(x, i) != NULL && cursor[0] && strcmp(SL_KEY(SL_NEXT(x, i)), cursor) < 0) {
+            x = SL_NEXT(x, i);
+        }
+        update[i] = x;
+    }
+
+    SL_WRITE_BEGIN(sl);
+    skiplist_node *node = SL_NEXT(x, 0);
+    while (node != NULL) {
+        if (budget-- == 0) {
+            snprintf(cursor, BUFFER_LENGTH, "%s", SL_KEY(node));
+            SL_WRITE_END(sl);
+            return 1;
+        }
+
+        skiplist_node *n = kvstore_defrag_move(node);
+        if (n) {
+            for (int i = 0; i < sl->level; i++) {
+                if (SL_NEXT(update[i], i) == node) SL_SET_NEXT(update[i], i, n);
+            }
+            node = n;
+        }
+
+        skiplist_link *forward = kvstore_defrag_move(node->forward);
+        if (forward) node->forward = forward;
+
+        // inline strings moved with the node, only heap ones are left
+        kvs_key_defrag(&node->key);
+
+        if (kvs_value_defrag(&node->value)) {
+            if (moved) moved(SL_KEY(node));
+        }
+
+        for (int i = 0; i < sl->level; i++) {
+            if (SL_NEXT(update[i], i) == node) update[i] = node;
+        }
+        node = SL_NEXT(node, 0);
+    }
+    SL_WRITE_END(sl);
+
+    return 0;
+}
+#endif
+
+// random node for eviction sampling: walk 0-3 steps on every level on the
+// way down, roughly a random position in the list
+int kvs_skiptable_sample(skiplist *sl, char **key, unsigned int *lru) {
+    if (!sl || !sl->header || SL_NEXT(sl->header, 0) == NULL) return -1;
+
+    skiplist_node *x = sl->header;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        unsigned int steps = kvs_random() & 3;
+        while (steps-- > 0 && SL_NEXT(x, i) != NULL) {
+            x = SL_NEXT(x, i);
+        }
+    }
+    if (x == sl->header) x = SL_NEXT(x, 0);
+
+    *key = SL_KEY(x);
+    *lru = x->lru;
+
+    return 0;
+}
+
+// heap allocated skiplist, for callers that need more than one instance
+skiplist *kvstore_skiptable_new(void) {
+    skiplist *sl = (skiplist *)kvstore_malloc(sizeof(skiplist));
+    if (!sl) return NULL;
+
+    if (kvstore_skiptable_create(sl) != 0) {
+        kvstore_free(sl);
+        return NULL;
+    }
+    return sl;
+}
+
+void kvstore_skiptable_free(skiplist *sl) {
+    if (!sl) return;
+
+    kvstore_skiptable_destory(sl);
+    kvstore_free(sl);
 }
\ No newline at end of file
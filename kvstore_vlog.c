@@ -0,0 +1,367 @@
+
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "kvstore.h"
+
+
+// log structured value storage, CONFIG SET value-log yes. a value too long
+// to be inline in its node is appended to the head of a log of 1MB segments
+// instead of getting its own allocation, the node keeps a pointer into the
+// segment tagged KVS_STR_LOG. a free only subtracts the entry from its
+// segment's live bytes, so MOD and DEL churn leaves no holes behind in the
+// slab, only dead bytes in the log.
+//
+//   segment: vlog_segment_t, then entries of
+//            uint32_t size, the value and its terminator, padded to 4 bytes
+//
+// the cleaner rides the defrag walk (kvstore_defrag.c): when a sealed
+// segment drops below value-log-clean-below percent live, a cycle marks it
+// and the engine walks hand every value to kvs_str_defrag(), which copies
+// the live entries of marked segments to the head. a marked segment whose
+// live bytes reached 0 is released at the end of the cycle; one still
+// pinned, by an lsm memtable the walk does not reach, waits for the next.
+// the log is shared by the shards and each worker walks only its own: the
+// marks of a round stay until every shard ended a walk that began after
+// them, and a released segment goes through ebr, the old entries may still
+// be under a lockless reader.
+//
+// appends and the segment list take a mutex, frees are atomic: the lsm
+// worker releases flushed memtables on its own thread.
+
+#if ENABLE_VALUE_LOG
+
+#define VLOG_SEGMENT_SIZE		(1UL << 20)		// power of 2, segments are size aligned
+#define VLOG_HEADER				sizeof(uint32_t)
+#define VLOG_CLEAN_BELOW		75				// default, CONFIG SET value-log-clean-below
+#define VLOG_CLEAN_MAX			64				// segments marked per cycle
+
+#define VLOG_SEGMENT(value)		((vlog_segment_t *)((uintptr_t)(value) & ~(VLOG_SEGMENT_SIZE - 1)))
+#define VLOG_ENTRY_SIZE(len)	((uint32_t)((VLOG_HEADER + (len) + 1 + 3) & ~3UL))
+
+
+typedef struct vlog_segment_s {
+	struct vlog_segment_s *next;
+	size_t live;					// bytes of live entries, atomic
+	uint32_t used;					// append offset, header included
+	uint32_t cleaning;				// marked by the current cycle
+} vlog_segment_t;
+
+#define VLOG_CAPACITY			(VLOG_SEGMENT_SIZE - sizeof(vlog_segment_t))
+
+typedef struct kvs_vlog_s {
+
+	int enabled;
+	int clean_below;				// percent live
+
+	pthread_mutex_t lock;
+	vlog_segment_t *segments;		// newest first, the first one is the head
+	size_t nsegments;
+
+	uint64_t appended;
+	uint64_t appended_bytes;
+	uint64_t moved;
+	uint64_t moved_bytes;
+	uint64_t cleaned;				// segments released
+	uint64_t cycles;
+
+	// the cleaning round, lock held
+	int marked;						// segments of the round, 0: none open
+	int walked;						// shards done with it
+	char joined[KVS_MAX_SHARDS];	// 1: walking it, 2: done
+
+} kvs_vlog_t;
+
+static kvs_vlog_t VLog = {
+	.clean_below = VLOG_CLEAN_BELOW,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static vlog_segment_t *_vlog_segment_new(void) {
+
+	void *mem = NULL;
+	if (posix_memalign(&mem, VLOG_SEGMENT_SIZE, VLOG_SEGMENT_SIZE) != 0) return NULL;
+
+	vlog_segment_t *seg = (vlog_segment_t *)mem;
+	seg->live = 0;
+	seg->used = sizeof(vlog_segment_t);
+	seg->cleaning = 0;
+
+	seg->next = VLog.segments;
+	VLog.segments = seg;
+	VLog.nsegments ++;
+
+	return seg;
+}
+
+// append an entry to the head, a new head when it is full. lock held
+static char *_vlog_put(const char *str, size_t len, uint32_t size) {
+
+	vlog_segment_t *head = VLog.segments;
+	if (!head || head->used + size > VLOG_SEGMENT_SIZE) {
+		head = _vlog_segment_new();
+		if (!head) return NULL;
+	}
+
+	char *entry = (char *)head + head->used;
+	*(uint32_t *)entry = size;
+	memcpy(entry + VLOG_HEADER, str, len + 1);
+
+	head->used += size;
+	__atomic_add_fetch(&head->live, size, __ATOMIC_RELAXED);
+
+	return entry + VLOG_HEADER;
+}
+
+static int _vlog_sparse(vlog_segment_t *seg) {
+	return seg != VLog.segments && !seg->cleaning
+		&& __atomic_load_n(&seg->live, __ATOMIC_RELAXED) * 100 < VLOG_CAPACITY * VLog.clean_below;
+}
+
+
+// the log copy of str, charged to the calling engine. NULL: the log is off,
+// str is short enough to be inline or memory ran out, the caller copies it
+char *kvs_vlog_append(const char *str) {
+
+	if (!__atomic_load_n(&VLog.enabled, __ATOMIC_RELAXED)) return NULL;
+
+	size_t len = strlen(str);
+	if (len < KVS_VALUE_INLINE || VLOG_ENTRY_SIZE(len) > VLOG_CAPACITY) return NULL;
+
+	uint32_t size = VLOG_ENTRY_SIZE(len);
+
+	pthread_mutex_lock(&VLog.lock);
+	char *value = _vlog_put(str, len, size);
+	if (value) {
+		VLog.appended ++;
+		VLog.appended_bytes += size;
+	}
+	pthread_mutex_unlock(&VLog.lock);
+
+	if (value) {
+		__atomic_add_fetch(&kvs_mem_used[kvs_mem_engine][KVS_MEM_VALUE], size, __ATOMIC_RELAXED);
+	}
+
+	return value;
+}
+
+// the entry is dead, from any thread
+void kvs_vlog_free(char *value) {
+
+	uint32_t size = *(uint32_t *)(value - VLOG_HEADER);
+
+	__atomic_sub_fetch(&VLOG_SEGMENT(value)->live, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&kvs_mem_used[kvs_mem_engine][KVS_MEM_VALUE], size, __ATOMIC_RELAXED);
+}
+
+// the entry's bytes, header and padding included
+size_t kvs_vlog_usage(char *value) {
+	return *(uint32_t *)(value - VLOG_HEADER);
+}
+
+// NULL: value stays put. otherwise its segment is being cleaned, value was
+// copied to the head and the caller swaps its pointer
+char *kvs_vlog_move(char *value) {
+
+	vlog_segment_t *seg = VLOG_SEGMENT(value);
+	if (!seg->cleaning) return NULL;
+
+	uint32_t size = *(uint32_t *)(value - VLOG_HEADER);
+
+	pthread_mutex_lock(&VLog.lock);
+	char *moved = _vlog_put(value, strlen(value), size);
+	if (moved) {
+		VLog.moved ++;
+		VLog.moved_bytes += size;
+	}
+	pthread_mutex_unlock(&VLog.lock);
+
+	if (!moved) return NULL;
+
+	__atomic_sub_fetch(&seg->live, size, __ATOMIC_RELAXED);
+
+	return moved;
+}
+
+
+// the current shard has a walk to do: a sealed segment fell below the
+// cleaning threshold, or a round it did not join is open
+int kvs_vlog_dirty(void) {
+
+	int dirty = 0;
+
+	pthread_mutex_lock(&VLog.lock);
+	if (VLog.marked) {
+		dirty = !VLog.joined[kvs_shard];
+	} else {
+		vlog_segment_t *seg = NULL;
+		for (seg = VLog.segments;seg != NULL && !dirty;seg = seg->next) {
+			dirty = _vlog_sparse(seg);
+		}
+	}
+	pthread_mutex_unlock(&VLog.lock);
+
+	return dirty;
+}
+
+// the current shard joins the round, marking the sparse segments opens
+// one. how many segments its walk cleans
+int kvs_vlog_clean_begin(void) {
+
+	int picked = 0;
+
+	pthread_mutex_lock(&VLog.lock);
+	if (!VLog.marked) {
+		vlog_segment_t *seg = NULL;
+		for (seg = VLog.segments;seg != NULL && VLog.marked < VLOG_CLEAN_MAX;seg = seg->next) {
+			if (_vlog_sparse(seg)) {
+				seg->cleaning = 1;
+				VLog.marked ++;
+			}
+		}
+		if (VLog.marked) {
+			VLog.cycles ++;
+			VLog.walked = 0;
+			memset(VLog.joined, 0, sizeof(VLog.joined));
+		}
+	}
+	if (VLog.marked && !VLog.joined[kvs_shard]) {
+		VLog.joined[kvs_shard] = 1;
+		picked = VLog.marked;
+	}
+	pthread_mutex_unlock(&VLog.lock);
+
+	return picked;
+}
+
+// the current shard's walk is over. once every shard walked the round,
+// release the marked segments nothing points into any more. bytes released
+size_t kvs_vlog_clean_end(void) {
+
+	size_t released = 0;
+	vlog_segment_t *dead = NULL;
+
+	pthread_mutex_lock(&VLog.lock);
+	if (!VLog.marked || VLog.joined[kvs_shard] != 1) {
+		pthread_mutex_unlock(&VLog.lock);
+		return 0;
+	}
+	VLog.joined[kvs_shard] = 2;
+	if (++ VLog.walked < kvs_nshards) {
+		pthread_mutex_unlock(&VLog.lock);
+		return 0;
+	}
+
+	vlog_segment_t **pp = &VLog.segments;
+	while (*pp) {
+		vlog_segment_t *seg = *pp;
+		if (!seg->cleaning) {
+			pp = &seg->next;
+			continue;
+		}
+
+		seg->cleaning = 0;
+		if (__atomic_load_n(&seg->live, __ATOMIC_ACQUIRE) != 0) {
+			pp = &seg->next;
+			continue;
+		}
+
+		*pp = seg->next;
+		seg->next = dead;
+		dead = seg;
+		VLog.nsegments --;
+		VLog.cleaned ++;
+
+		released += VLOG_SEGMENT_SIZE;
+	}
+	VLog.marked = 0;
+	pthread_mutex_unlock(&VLog.lock);
+
+	while (dead) {
+		vlog_segment_t *seg = dead;
+		dead = seg->next;
+#if ENABLE_EBR
+		if (kvs_ebr_defer) {
+			kvs_ebr_retire_fn(seg, free, VLOG_SEGMENT_SIZE);
+			continue;
+		}
+#endif
+		free(seg);
+	}
+
+	return released;
+}
+
+
+// CONFIG SET value-log yes|no, value-log-clean-below <percent>. turning the
+// log off only stops appends, values already in it stay until freed
+int kvs_vlog_config_set(char *name, char *value) {
+
+	if (strcmp(name, "value-log") == 0) {
+		if (strcmp(value, "yes") == 0) {
+			__atomic_store_n(&VLog.enabled, 1, __ATOMIC_RELAXED);
+		} else if (strcmp(value, "no") == 0) {
+			__atomic_store_n(&VLog.enabled, 0, __ATOMIC_RELAXED);
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(name, "value-log-clean-below") == 0) {
+		char *end = NULL;
+		long percent = strtol(value, &end, 10);
+		if (end == value || *end || percent < 1 || percent > 99) return -1;
+
+		VLog.clean_below = percent;
+		return 0;
+	}
+
+	return -1;
+}
+
+int kvs_vlog_config_get(char *name, char *buf, int len) {
+
+	if (strcmp(name, "value-log") == 0) {
+		return snprintf(buf, len, "%s", VLog.enabled ? "yes" : "no");
+	}
+
+	if (strcmp(name, "value-log-clean-below") == 0) {
+		return snprintf(buf, len, "%d", VLog.clean_below);
+	}
+
+	return -1;
+}
+
+int kvs_vlog_stats(char *buf, int len) {
+
+	size_t live = 0;
+
+	pthread_mutex_lock(&VLog.lock);
+	vlog_segment_t *seg = NULL;
+	for (seg = VLog.segments;seg != NULL;seg = seg->next) {
+		live += __atomic_load_n(&seg->live, __ATOMIC_RELAXED);
+	}
+	size_t reserved = VLog.nsegments * VLOG_SEGMENT_SIZE;
+	double utilization = reserved ? (double)live / reserved : 1.0;
+
+	int n = snprintf(buf, len, "value_log:%s clean_below:%d segments:%zu segment_size:%lu reserved:%zu live:%zu utilization:%.2f appended:%llu appended_bytes:%llu moved:%llu moved_bytes:%llu cleaned:%llu cycles:%llu\n",
+		VLog.enabled ? "yes" : "no", VLog.clean_below,
+		VLog.nsegments, VLOG_SEGMENT_SIZE, reserved, live, utilization,
+		(unsigned long long)VLog.appended, (unsigned long long)VLog.appended_bytes,
+		(unsigned long long)VLog.moved, (unsigned long long)VLog.moved_bytes,
+		(unsigned long long)VLog.cleaned, (unsigned long long)VLog.cycles);
+	pthread_mutex_unlock(&VLog.lock);
+
+	return n;
+}
+
+#endif
+
@@ -46,13 +46,63 @@
 #include "nty_coroutine.h"
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #define MAX_CLIENT_NUM			1000000
 #define TIME_SUB_MS(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000 + (tv1.tv_usec - tv2.tv_usec) / 1000)
 
 
+static nty_schedule *workers[KVS_MAX_SHARDS];	// worker i owns shard i
+static pthread_barrier_t workers_ready;
+
+typedef struct shard_call_s {
+	void (*fn)(void *);
+	void *arg;
+	nty_coroutine *caller;
+} shard_call_t;
+
+// on the owning worker, from its inbox
+static void shard_call_run(void *arg) {
+	shard_call_t *call = (shard_call_t *)arg;
+
+	call->fn(call->arg);
+	nty_coroutine_wake(call->caller); // call belongs to the caller from here
+}
+
+int kvstore_shard_call(int shard, void (*fn)(void *), void *arg) {
+
+	if (shard == kvs_worker) {
+		fn(arg);
+		return 0;
+	}
+
+	nty_schedule *sched = nty_coroutine_get_sched();
+	if (!sched || !sched->curr_thread || !workers[shard]) return -1;
+
+	shard_call_t *call = (shard_call_t *)malloc(sizeof(shard_call_t));
+	if (!call) return -1;
+
+	call->fn = fn;
+	call->arg = arg;
+	call->caller = sched->curr_thread;
+
+	if (nty_schedule_post(workers[shard], shard_call_run, call) != 0) {
+		free(call);
+		return -1;
+	}
+	nty_coroutine_park();
+	free(call);
+
+	return 0;
+}
+
+
+// arg: the connection, from the accept loop or a reader handing it on. on
+// the heap, the buffers are reset per request: a request forwarded to
+// another worker runs there while this coroutine's stack is swapped out
 void server_reader(void *arg) {
-	int fd = *(int *)arg;
+	struct conn_item *conn = (struct conn_item *)arg;
+	int fd = conn->fd;
 	int ret = 0;
 
  
@@ -80,21 +130,31 @@ void server_reader(void *arg) {
 		}
 #else
 		
-		struct conn_item item = {0};
-		ret = recv(fd, item.rbuffer, BUFFER_LENGTH, 0);
+		memset(conn->rbuffer, 0, BUFFER_LENGTH);
+		ret = recv(fd, conn->rbuffer, BUFFER_LENGTH, 0);
 		if (ret > 0) {
 			if(fd > MAX_CLIENT_NUM) 
-			printf("read from server: %.*s\n", ret, item.rbuffer);
+			printf("read from server: %.*s\n", ret, conn->rbuffer);
 
-			kvstore_request(&item);
+			kvstore_request(conn);
 			
-			item.wlen = strlen(item.wbuffer);
-			ret = send(fd, item.wbuffer, item.wlen, 0);
+			conn->wlen = strlen(conn->wbuffer);
+			ret = send(fd, conn->wbuffer, conn->wlen, 0);
 			if (ret == -1) {
 				close(fd);
 				break;
 			}
 
+#if ENABLE_WORK_STEALING
+			// nothing of the connection is on this scheduler between two
+			// requests, not even the fd in its epoll: a new reader in the
+			// deque goes to the idle peer that steals it
+			if (kvs_nshards > 1 && nty_schedule_overloaded()) {
+				nty_coroutine *next = NULL;
+				if (nty_coroutine_create(&next, server_reader, conn) == 0) return ;
+			}
+#endif
+
 		} else if (ret == 0) {	
 			close(fd);
 			break;
@@ -103,6 +163,26 @@ void server_reader(void *arg) {
 #endif
 
 	}
+	free(conn);
+}
+
+
+// the scheduler between two rounds
+static void server_quiescent(void *arg) {
+	(void)arg;
+	kvstore_quiescent();
+}
+
+// background work between requests, same thread as the readers
+void server_cron(void *arg) {
+
+	(void)arg;
+
+	while (1) {
+		nty_coroutine_sleep(KVS_CRON_INTERVAL_MS); // only queues the wakeup
+		nty_coroutine_yield(nty_coroutine_get_sched()->curr_thread);
+		kvstore_cron();
+	}
 }
 
 
@@ -114,11 +194,21 @@ void server(void *arg) {
 	int fd = nty_socket(AF_INET, SOCK_STREAM, 0);
 	if (fd < 0) return ;
 
+	// every worker listens on the port, the kernel spreads the connections
+	if (kvs_nshards > 1) {
+		int reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&reuse, sizeof(reuse));
+	}
+
 	struct sockaddr_in local, remote;
 	local.sin_family = AF_INET;
 	local.sin_port = htons(port);
 	local.sin_addr.s_addr = INADDR_ANY;
-	bind(fd, (struct sockaddr*)&local, sizeof(struct sockaddr_in));
+	if (bind(fd, (struct sockaddr*)&local, sizeof(struct sockaddr_in)) < 0) {
+		perror("bind");
+		close(fd);
+		return ;
+	}
 
 	listen(fd, 20);
 	printf("listen port : %d\n", port);
@@ -140,8 +230,17 @@ void server(void *arg) {
 			
 		}
 
+		if (cli_fd < 0) continue;
+
+		struct conn_item *conn = (struct conn_item *)calloc(1, sizeof(struct conn_item));
+		if (!conn) {
+			close(cli_fd);
+			continue;
+		}
+		conn->fd = cli_fd;
+
 		nty_coroutine *read_co;
-		nty_coroutine_create(&read_co, server_reader, &cli_fd);
+		nty_coroutine_create(&read_co, server_reader, conn);
 
 	}
 	
@@ -167,9 +266,21 @@ int main(int argc, char *argv[]) {
 
 #else
 
-int ntyco_entry(void) {
+// one worker thread: a scheduler of its own (created by the first
+// coroutine), with a listener on the shared port and the cron. every worker
+// has registered its scheduler before any of them takes a request
+void *ntyco_worker(void *arg) {
 	nty_coroutine *co = NULL;
 
+	kvs_worker = (int)(intptr_t)arg;
+	kvs_shard = kvs_worker;
+
+#if ENABLE_NUMA
+	// on its cpu before the scheduler, the shard or a connection is made
+	kvs_numa_pin(kvs_worker);
+	if (kvs_worker > 0 && kvstore_shard_init(kvs_worker) != 0) exit(1);
+#endif
+
 	int i = 0;
 	unsigned short base_port = 9096;
 	for (i = 0;i < 1;i ++) {
@@ -177,9 +288,82 @@ int ntyco_entry(void) {
 		*port = base_port + i;
 		nty_coroutine_create(&co, server, port); ////////no run
 	}
+	nty_coroutine_create(&co, server_cron, NULL);
+
+	workers[kvs_worker] = nty_coroutine_get_sched();
+	nty_schedule_quiescent(server_quiescent, NULL);
+#if ENABLE_WORK_STEALING
+	// after the listener and the cron, those stay on this worker
+	if (kvs_nshards > 1) nty_schedule_steal_join();
+#endif
+	pthread_barrier_wait(&workers_ready);
 
 	nty_schedule_run(); //run
 
+	return NULL;
+}
+
+// a summary, imbalance is the most coroutines on one worker over the
+// mean, then a line per worker
+int kvstore_sched_stats(char *buf, int len) {
+
+	nty_steal_stats stats[KVS_MAX_SHARDS];
+	nty_steal_stats total = {0};
+	int most = 0;
+
+	int i = 0;
+	for (i = 0;i < kvs_nshards;i ++) {
+		memset(&stats[i], 0, sizeof(nty_steal_stats));
+		if (workers[i]) nty_schedule_steal_stats(workers[i], &stats[i]);
+
+		total.steals += stats[i].steals;
+		total.wakes += stats[i].wakes;
+		total.sheds += stats[i].sheds;
+		total.live += stats[i].live;
+		if (stats[i].live > most) most = stats[i].live;
+	}
+
+	double mean = (double)total.live / kvs_nshards;
+	int n = snprintf(buf, len, "sched:%s workers:%d coroutines:%d steals:%llu wakes:%llu sheds:%llu imbalance:%.2f\n",
+		ENABLE_WORK_STEALING && kvs_nshards > 1 ? "stealing" : "single", kvs_nshards, total.live,
+		(unsigned long long)total.steals, (unsigned long long)total.wakes,
+		(unsigned long long)total.sheds, mean > 0 ? most / mean : 1.0);
+
+	for (i = 0;i < kvs_nshards && n < len;i ++) {
+		n += snprintf(buf + n, len - n, "worker:%d coroutines:%d queued:%d steals:%llu stolen:%llu sheds:%llu\n",
+			i, stats[i].live, stats[i].queued, (unsigned long long)stats[i].steals,
+			(unsigned long long)stats[i].stolen, (unsigned long long)stats[i].sheds);
+	}
+
+	return n;
+}
+
+int kvstore_compute(void (*fn)(void *), void *arg) {
+
+	nty_coroutine_compute(fn, arg);
+	return 0;
+}
+
+// kvs_nshards workers, the calling thread is the first
+int ntyco_entry(void) {
+
+	init_hook(); // resolve the hooked calls once, not racing in every worker
+	pthread_barrier_init(&workers_ready, NULL, kvs_nshards);
+	kvs_ncompute = nty_coroutine_compute_create(kvs_ncompute);
+
+	int i = 0;
+	for (i = 1;i < kvs_nshards;i ++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, ntyco_worker, (void *)(intptr_t)i) != 0) {
+			perror("pthread_create");
+			return -1;
+		}
+		pthread_detach(tid);
+	}
+	printf("workers : %d, compute threads : %d\n", kvs_nshards, kvs_ncompute);
+
+	ntyco_worker((void *)(intptr_t)0);
+
 	return 0;
 }
 
@@ -3,16 +3,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include <getopt.h>
 
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <arpa/inet.h>
 
 #define MAX_MAS_LENGTH		512
 #define TIME_SUB_MS(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000 + (tv1.tv_usec - tv2.tv_usec) / 1000)
+#define TIME_SUB_US(tv1, tv2)  ((tv1.tv_sec - tv2.tv_sec) * 1000000 + (tv1.tv_usec - tv2.tv_usec))
 
 
 int send_msg(int connfd, char *msg, int length) {
@@ -294,146 +297,2366 @@ void btree_testcase_5w_node(int connfd) {
 }
 
 
+void cuckoo_testcase(int connfd) {
+
+	test_case(connfd, "CSET Name King", "SUCCESS", "CSETCase");
+	test_case(connfd, "CGET Name", "King", "CGETCase");
+	test_case(connfd, "CMOD Name Darren", "SUCCESS", "CMODCase");
+	test_case(connfd, "CGET Name", "Darren", "CGETCase");
+	test_case(connfd, "CDEL Name", "SUCCESS", "CDELCase");
+	test_case(connfd, "CGET Name", "NO EXIST", "CGETCase");
+
+}
+
+void cuckoo_testcase_5w_node(int connfd) {
+
+	int count = 50000;
+	int i = 0;
+
+	for (i = 0;i < count;i ++) {
+
+		char cmd[128] = {0};
+
+		snprintf(cmd, 128, "CSET Name%d King%d", i, i);
+		test_case(connfd, cmd, "SUCCESS", "CSETCase");
+
+		char result[128] = {0};
+		sprintf(result, "%d", i+1);
+		test_case(connfd, "CCOUNT", result, "CCOUNT");
+		
+		
+	}
+
+	for (i = 0;i < count;i ++) {
+		
+		char cmd[128] = {0};
+
+		snprintf(cmd, 128, "CDEL Name%d", i);
+		test_case(connfd, cmd, "SUCCESS", "CDELCase");
+
+		char result[128] = {0};
+		sprintf(result, "%d", count - (i+1));
+		test_case(connfd, "CCOUNT", result, "CCOUNT");
+
+	}
+	
+
+}
+
+void lsm_testcase(int connfd) {
+
+	test_case(connfd, "LSET Name King", "SUCCESS", "LSETCase");
+	test_case(connfd, "LGET Name", "King", "LGETCase");
+	test_case(connfd, "LMOD Name Darren", "SUCCESS", "LMODCase");
+	test_case(connfd, "LGET Name", "Darren", "LGETCase");
+	test_case(connfd, "LDEL Name", "SUCCESS", "LDELCase");
+	test_case(connfd, "LGET Name", "NO EXIST", "LGETCase");
+
+}
+
+// enough data to flush several memtables and run compactions
+void lsm_testcase_20w_node(int connfd) {
+
+	int count = 200000;
+	int i = 0;
+
+	// the store is persistent: count relative to what is already there,
+	// and use keys no earlier run can have left behind
+	int run = (int)time(NULL);
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "LCOUNT", strlen("LCOUNT"));
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+	int base = atoi(result);
+
+	for (i = 0;i < count;i ++) {
+		char cmd[256] = {0};
+		snprintf(cmd, 256, "LSET Lsm%d-%08d Value%08d-%0120d", run, i, i, i);
+		test_case(connfd, cmd, "SUCCESS", "LSETCase");
+	}
+
+	for (i = 0;i < count;i += 7) {
+		char cmd[128] = {0};
+		char value[256] = {0};
+		snprintf(cmd, 128, "LGET Lsm%d-%08d", run, i);
+		snprintf(value, 256, "Value%08d-%0120d", i, i);
+		test_case(connfd, cmd, value, "LGETCase");
+	}
+
+	for (i = 0;i < count;i += 2) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "LDEL Lsm%d-%08d", run, i);
+		test_case(connfd, cmd, "SUCCESS", "LDELCase");
+	}
+
+	for (i = 0;i < count;i += 5) {
+		char cmd[128] = {0};
+		char value[256] = {0};
+		snprintf(cmd, 128, "LGET Lsm%d-%08d", run, i);
+		if (i % 2 == 0) {
+			snprintf(value, 256, "NO EXIST");
+		} else {
+			snprintf(value, 256, "Value%08d-%0120d", i, i);
+		}
+		test_case(connfd, cmd, value, "LGETCase");
+	}
+
+	snprintf(result, MAX_MAS_LENGTH, "%d", base + count / 2);
+	test_case(connfd, "LCOUNT", result, "LCOUNT");
+
+	for (i = 1;i < count;i += 2) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "LDEL Lsm%d-%08d", run, i);
+		test_case(connfd, cmd, "SUCCESS", "LDELCase");
+	}
+
+	snprintf(result, MAX_MAS_LENGTH, "%d", base);
+	test_case(connfd, "LCOUNT", result, "LCOUNT");
+
+}
+
+
+static int cmp_latency(const void *a, const void *b) {
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+// GET latency percentiles of one engine, prefix: "H", "C", ...
+// negative lookups in front of the ordered engines. half the keys are
+// deleted so the filter goes stale and has to rebuild under traffic.
+void bloom_testcase(int connfd, char *prefix, int count) {
+
+	int i = 0;
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sSET Bloom%d King%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "BloomSETCase");
+	}
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sGET Absent%d", prefix, i);
+		test_case(connfd, cmd, "NO EXIST", "BloomMissCase");
+	}
+
+	for (i = 0;i < count;i += 2) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sDEL Bloom%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "BloomDELCase");
+	}
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		char result[128] = {0};
+		snprintf(cmd, 128, "%sGET Bloom%d", prefix, i);
+		if (i % 2) snprintf(result, 128, "King%d", i);
+		else snprintf(result, 128, "NO EXIST");
+		test_case(connfd, cmd, result, "BloomGETCase");
+	}
+
+	for (i = 1;i < count;i += 2) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sDEL Bloom%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "BloomDELCase");
+	}
+
+}
+
+// skewed reads against the hot-key cache. every write to a cached key must
+// be visible on the next read, including btree deletes that move values
+// between nodes.
+void cache_testcase(int connfd, char *prefix, int count) {
+
+	int i = 0, j = 0;
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sSET Hot%d King%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "CacheSETCase");
+	}
+
+	for (j = 0;j < 20;j ++) {
+		for (i = 0;i < count;i += (i < 16 ? 1 : 97)) { // 16 hot keys, a few cold
+			char cmd[128] = {0};
+			char result[128] = {0};
+			snprintf(cmd, 128, "%sGET Hot%d", prefix, i);
+			snprintf(result, 128, "King%d", i);
+			test_case(connfd, cmd, result, "CacheGETCase");
+		}
+	}
+
+	for (i = 0;i < 16;i ++) {
+		char cmd[128] = {0};
+		char result[128] = {0};
+		snprintf(cmd, 128, "%sMOD Hot%d Darren%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "CacheMODCase");
+		snprintf(cmd, 128, "%sGET Hot%d", prefix, i);
+		snprintf(result, 128, "Darren%d", i);
+		test_case(connfd, cmd, result, "CacheGETCase");
+	}
+
+	// delete the cold keys around the hot ones, then check the hot values
+	for (i = 16;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sDEL Hot%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "CacheDELCase");
+	}
+
+	for (i = 0;i < 16;i ++) {
+		char cmd[128] = {0};
+		char result[128] = {0};
+		snprintf(cmd, 128, "%sGET Hot%d", prefix, i);
+		snprintf(result, 128, "Darren%d", i);
+		test_case(connfd, cmd, result, "CacheGETCase");
+		snprintf(cmd, 128, "%sDEL Hot%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "CacheDELCase");
+		snprintf(cmd, 128, "%sGET Hot%d", prefix, i);
+		test_case(connfd, cmd, "NO EXIST", "CacheGETCase");
+	}
+}
+
+static long used_memory(int connfd) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS MEMORY", strlen("STATS MEMORY"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, "used_memory:");
+	return p ? atol(p + strlen("used_memory:")) : -1;
+}
+
+// run an engine as a cache under a 1mb ceiling. lfu keeps the keys that are
+// read over and over, the rest is evicted, every write still succeeds.
+void maxmemory_testcase(int connfd, char *prefix, int count) {
+
+	char cmd[128] = {0};
+	char result[128] = {0};
+	int i = 0, j = 0;
+
+	test_case(connfd, "CONFIG SET maxmemory-policy allkeys-lfu", "SUCCESS", "CONFIGCase");
+
+	for (i = 0;i < 10;i ++) {
+		snprintf(cmd, 128, "%sSET Hotkey%d Value%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "EvictSETCase");
+	}
+
+	long limit = used_memory(connfd) + (1 << 20);
+	snprintf(cmd, 128, "CONFIG SET maxmemory %ld", limit);
+	test_case(connfd, cmd, "SUCCESS", "CONFIGCase");
+	snprintf(result, 128, "%ld", limit);
+	test_case(connfd, "CONFIG GET maxmemory", result, "CONFIGCase");
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 128, "%sSET Evict%d King%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "EvictSETCase");
+
+		if (i % 50 == 0) {
+			for (j = 0;j < 10;j ++) {
+				snprintf(cmd, 128, "%sGET Hotkey%d", prefix, j);
+				snprintf(result, 128, "Value%d", j);
+				test_case(connfd, cmd, result, "EvictHotCase");
+			}
+		}
+	}
+
+	long used = used_memory(connfd);
+	if (used > limit + 4096) {
+		printf("==> FAILED --> EvictLimitCase, used %ld > maxmemory %ld\n", used, limit);
+	}
+
+	// noeviction refuses writes instead
+	test_case(connfd, "CONFIG SET maxmemory-policy noeviction", "SUCCESS", "CONFIGCase");
+	test_case(connfd, "CONFIG SET maxmemory 1", "SUCCESS", "CONFIGCase");
+	snprintf(cmd, 128, "%sSET Refused Value", prefix);
+	test_case(connfd, cmd, "ERROR OOM", "EvictOOMCase");
+
+	test_case(connfd, "CONFIG SET maxmemory 0", "SUCCESS", "CONFIGCase");
+	test_case(connfd, "CONFIG SET maxmemory-policy allkeys-lru", "SUCCESS", "CONFIGCase");
+
+	// clean up whatever survived
+	for (i = 0;i < count;i ++) {
+		char res[MAX_MAS_LENGTH] = {0};
+		snprintf(cmd, 128, "%sDEL Evict%d", prefix, i);
+		send_msg(connfd, cmd, strlen(cmd));
+		recv_msg(connfd, res, MAX_MAS_LENGTH);
+	}
+	for (i = 0;i < 10;i ++) {
+		snprintf(cmd, 128, "%sDEL Hotkey%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "EvictDELCase");
+	}
+
+	snprintf(cmd, 128, "%sCOUNT", prefix);
+	test_case(connfd, cmd, "0", "EvictCOUNTCase");
+}
+
+// switch the slab to huge page regions, fill an engine and check the
+// regions show up in STATS SLAB. 300 byte values land in a size class the
+// other cases leave empty, so the fill has to map new chunks.
+void hugepage_testcase(int connfd, char *prefix, int count) {
+
+	char cmd[512] = {0};
+	char result[512] = {0};
+	char value[301] = {0};
+	int i = 0;
+
+	memset(value, 'v', 300);
+
+	test_case(connfd, "CONFIG GET hugepages", "off", "CONFIGCase");
+	test_case(connfd, "CONFIG SET hugepages bogus", "FAILED", "CONFIGCase");
+	test_case(connfd, "CONFIG SET hugepages thp", "SUCCESS", "CONFIGCase");
+	test_case(connfd, "CONFIG GET hugepages", "thp", "CONFIGCase");
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 512, "%sSET Huge%d %s%d", prefix, i, value, i);
+		test_case(connfd, cmd, "SUCCESS", "HugeSETCase");
+	}
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS SLAB", strlen("STATS SLAB"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, "huge_regions:");
+	if (!p || atol(p + strlen("huge_regions:")) == 0) {
+		printf("==> FAILED --> HugeRegionCase, no huge page region in '%s'\n", stats);
+	}
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 512, "%sGET Huge%d", prefix, i);
+		snprintf(result, 512, "%s%d", value, i);
+		test_case(connfd, cmd, result, "HugeGETCase");
+		snprintf(cmd, 512, "%sDEL Huge%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "HugeDELCase");
+	}
+
+	test_case(connfd, "CONFIG SET hugepages off", "SUCCESS", "CONFIGCase");
+}
+
+static long defrag_stat(int connfd, const char *field) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS DEFRAG", strlen("STATS DEFRAG"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, field);
+	return p ? atol(p + strlen(field)) : -1;
+}
+
+// fill an engine with mixed value sizes, well over DEFRAG_MIN_RESERVED,
+// delete nine keys in ten and wait for the defragmenter to give the sparse
+// chunks back. the survivors must read back unchanged after their nodes,
+// keys and values moved.
+void defrag_testcase(int connfd, char *prefix, int count) {
+
+	char cmd[512] = {0};
+	char result[512] = {0};
+	char value[512] = {0};
+	int i = 0;
+
+	for (i = 0;i < count;i ++) {
+		memset(value, 'a' + i % 26, 16 + i % 400);
+		value[16 + i % 400] = '\0';
+		snprintf(cmd, 512, "%sSET Frag%d %s", prefix, i, value);
+		test_case(connfd, cmd, "SUCCESS", "DefragSETCase");
+	}
+	for (i = 0;i < count;i ++) {
+		if (i % 10 == 0) continue;
+		snprintf(cmd, 512, "%sDEL Frag%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "DefragDELCase");
+	}
+
+	long cycles = defrag_stat(connfd, "cycles:");
+	long reserved = defrag_stat(connfd, " reserved:");
+
+	int waited = 0;
+	while (waited < 10000 && (defrag_stat(connfd, "cycles:") <= cycles || defrag_stat(connfd, "running:") != 0)) {
+		usleep(100 * 1000);
+		waited += 100;
+	}
+
+	if (defrag_stat(connfd, " reserved:") >= reserved) {
+		printf("==> FAILED --> DefragReleaseCase, reserved %ld -> %ld\n", reserved, defrag_stat(connfd, " reserved:"));
+	}
+
+	for (i = 0;i < count;i += 10) {
+		memset(value, 'a' + i % 26, 16 + i % 400);
+		value[16 + i % 400] = '\0';
+		snprintf(cmd, 512, "%sGET Frag%d", prefix, i);
+		snprintf(result, 512, "%s", value);
+		test_case(connfd, cmd, result, "DefragGETCase");
+		snprintf(cmd, 512, "%sDEL Frag%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "DefragDELCase");
+	}
+
+	snprintf(cmd, 512, "%sCOUNT", prefix);
+	test_case(connfd, cmd, "0", "DefragCOUNTCase");
+}
+
+// key i and its value, lengths straddling the inline limits: keys 12-19
+// bytes (inline below 16), values 20-27 bytes (inline below 24)
+static void inline_kv(int i, int shift, char *key, char *value) {
+	snprintf(key, 64, "K%0*d", 11 + i % 8, i);
+	snprintf(value, 64, "V%0*d", 19 + (i + shift) % 8, i);
+}
+
+// every record flips between inline and heap strings with MOD, and deleting
+// every other key makes the trees rebalance with inline keys in the nodes
+void inline_testcase(int connfd, char *prefix, int count) {
+
+	char cmd[128] = {0};
+	char key[64] = {0};
+	char value[64] = {0};
+	int i = 0;
+
+	for (i = 0;i < count;i ++) {
+		inline_kv(i, 0, key, value);
+		snprintf(cmd, 128, "%sSET %s %s", prefix, key, value);
+		test_case(connfd, cmd, "SUCCESS", "InlineSETCase");
+	}
+
+	for (i = 0;i < count;i ++) {
+		inline_kv(i, 0, key, value);
+		snprintf(cmd, 128, "%sGET %s", prefix, key);
+		test_case(connfd, cmd, value, "InlineGETCase");
+		test_case(connfd, cmd, value, "InlineGETCase");
+	}
+
+	for (i = 1;i < count;i += 2) {
+		inline_kv(i, 0, key, value);
+		snprintf(cmd, 128, "%sDEL %s", prefix, key);
+		test_case(connfd, cmd, "SUCCESS", "InlineDELCase");
+	}
+
+	for (i = 0;i < count;i += 2) {
+		inline_kv(i, 0, key, value);
+		snprintf(cmd, 128, "%sGET %s", prefix, key);
+		test_case(connfd, cmd, value, "InlineGETCase");
+
+		inline_kv(i, 4, key, value);
+		snprintf(cmd, 128, "%sMOD %s %s", prefix, key, value);
+		test_case(connfd, cmd, "SUCCESS", "InlineMODCase");
+		snprintf(cmd, 128, "%sGET %s", prefix, key);
+		test_case(connfd, cmd, value, "InlineGETCase");
+	}
+
+	for (i = 0;i < count;i += 2) {
+		inline_kv(i, 4, key, value);
+		snprintf(cmd, 128, "%sDEL %s", prefix, key);
+		test_case(connfd, cmd, "SUCCESS", "InlineDELCase");
+		snprintf(cmd, 128, "%sGET %s", prefix, key);
+		test_case(connfd, cmd, "NO EXIST", "InlineGETCase");
+	}
+
+	snprintf(cmd, 128, "%sCOUNT", prefix);
+	test_case(connfd, cmd, "0", "InlineCOUNTCase");
+}
+
+// a json array of records like the ones worth compressing, about 320 bytes
+static void json_value(int i, int version, char *value, int len) {
+	snprintf(value, len,
+		"[{\"id\":%d,\"name\":\"user%d\",\"email\":\"user%d@example.com\",\"active\":true,\"roles\":[\"reader\",\"writer\"],\"version\":%d},"
+		"{\"id\":%d,\"name\":\"user%d\",\"email\":\"user%d@example.com\",\"active\":false,\"roles\":[\"reader\"],\"version\":%d},"
+		"{\"id\":%d,\"name\":\"user%d\",\"email\":\"user%d@example.com\",\"active\":true,\"roles\":[\"reader\",\"admin\"],\"version\":%d}]",
+		i, i, i, version, i + 1, i + 1, i + 1, version, i + 2, i + 2, i + 2, version);
+}
+
+static long compress_stat(int connfd, const char *field) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS COMPRESSION", strlen("STATS COMPRESSION"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, field);
+	return p ? atol(p + strlen(field)) : -1;
+}
+
+// large json values through an engine with compression on: they read back
+// unchanged, take less memory, and come back packed only on request. the
+// saving is of the values stored now, back where it was once they are
+// deleted. lsm values are not counted, only the total packed grows
+void compression_testcase(int connfd, char *prefix, char *engine, int count) {
+
+	char cmd[MAX_MAS_LENGTH] = {0};
+	char value[MAX_MAS_LENGTH] = {0};
+	int i = 0;
+
+	snprintf(cmd, MAX_MAS_LENGTH, "CONFIG SET compression %s", engine);
+	test_case(connfd, cmd, "SUCCESS", "CompressCONFIGCase");
+
+	char *field = strcmp(engine, "lsm") == 0 ? "raw_bytes_total:" : "saved_bytes:";
+	long saved = compress_stat(connfd, field);
+
+	for (i = 0;i < count;i ++) {
+		json_value(i, 0, value, MAX_MAS_LENGTH);
+		snprintf(cmd, MAX_MAS_LENGTH, "%sSET Json%d %s", prefix, i, value);
+		test_case(connfd, cmd, "SUCCESS", "CompressSETCase");
+	}
+
+	if (compress_stat(connfd, field) <= saved) {
+		printf("==> FAILED --> CompressSavedCase, %s did not grow\n", field);
+	}
+
+	for (i = 0;i < count;i ++) {
+		json_value(i, 0, value, MAX_MAS_LENGTH);
+		snprintf(cmd, MAX_MAS_LENGTH, "%sGET Json%d", prefix, i);
+		test_case(connfd, cmd, value, "CompressGETCase");
+
+		json_value(i, 1, value, MAX_MAS_LENGTH);
+		snprintf(cmd, MAX_MAS_LENGTH, "%sMOD Json%d %s", prefix, i, value);
+		test_case(connfd, cmd, "SUCCESS", "CompressMODCase");
+		snprintf(cmd, MAX_MAS_LENGTH, "%sGET Json%d", prefix, i);
+		test_case(connfd, cmd, value, "CompressGETCase");
+	}
+
+	// a raw value that looks packed is stored escaped and reads back as sent
+	snprintf(cmd, MAX_MAS_LENGTH, "%sSET Magic \x01" "12:notpacked", prefix);
+	test_case(connfd, cmd, "SUCCESS", "CompressSETCase");
+	snprintf(cmd, MAX_MAS_LENGTH, "%sGET Magic", prefix);
+	test_case(connfd, cmd, "\x01" "12:notpacked", "CompressGETCase");
+	snprintf(cmd, MAX_MAS_LENGTH, "%sDEL Magic", prefix);
+	test_case(connfd, cmd, "SUCCESS", "CompressDELCase");
+
+	// negotiated: the stored bytes, shorter than the json
+	test_case(connfd, "CLIENT COMPRESSED yes", "SUCCESS", "CompressCLIENTCase");
+	snprintf(cmd, MAX_MAS_LENGTH, "%sGET Json0", prefix);
+	send_msg(connfd, cmd, strlen(cmd));
+	memset(value, 0, MAX_MAS_LENGTH);
+	recv_msg(connfd, value, MAX_MAS_LENGTH);
+	char raw[MAX_MAS_LENGTH] = {0};
+	json_value(0, 1, raw, MAX_MAS_LENGTH);
+	if (value[0] != '\x01' || strlen(value) >= strlen(raw)) {
+		printf("==> FAILED --> CompressPackedGETCase, %zu bytes\n", strlen(value));
+	}
+	test_case(connfd, "CLIENT COMPRESSED no", "SUCCESS", "CompressCLIENTCase");
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, MAX_MAS_LENGTH, "%sDEL Json%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "CompressDELCase");
+	}
+
+	if (strcmp(engine, "lsm") != 0) {
+		long left = compress_stat(connfd, "saved_bytes:");
+		if (left != saved) {
+			printf("==> FAILED --> CompressLiveCase, saved_bytes %ld -> %ld after DEL\n", saved, left);
+		}
+	}
+
+	test_case(connfd, "CONFIG SET compression none", "SUCCESS", "CompressCONFIGCase");
+}
+
+static long dedup_stat(int connfd, const char *field) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS DEDUP", strlen("STATS DEDUP"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, field);
+	return p ? atol(p + strlen(field)) : -1;
+}
+
+// a few long values repeated over many keys of every node engine share one
+// copy each. a MOD gives one key its own copy and leaves the others alone,
+// deleting the keys gives the copies back.
+void dedup_testcase(int connfd, char *prefixes, int count) {
+
+	char cmd[512] = {0};
+	char value[4][128] = {{0}};
+	char result[512] = {0};
+	int i = 0, p = 0;
+
+	for (i = 0;i < 4;i ++) {
+		snprintf(value[i], 128, "{\"status\":\"state-%d\",\"retry\":%d,\"owner\":\"default-service-account\"}", i, i * 3);
+	}
+
+	test_case(connfd, "CONFIG SET dedup yes", "SUCCESS", "DedupCONFIGCase");
+	test_case(connfd, "CONFIG GET dedup", "yes", "DedupCONFIGCase");
+
+	long values = dedup_stat(connfd, "values:");
+	long refs = dedup_stat(connfd, "refs:");
+	int engines = strlen(prefixes);
+
+	for (p = 0;p < engines;p ++) {
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 512, "%cSET Dedup%d %s", prefixes[p], i, value[i % 4]);
+			test_case(connfd, cmd, "SUCCESS", "DedupSETCase");
+		}
+	}
+
+	if (dedup_stat(connfd, "values:") != values + 4 || dedup_stat(connfd, "refs:") != refs + (long)engines * count) {
+		printf("==> FAILED --> DedupShareCase, values %ld refs %ld\n", dedup_stat(connfd, "values:"), dedup_stat(connfd, "refs:"));
+	}
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS DEDUP", strlen("STATS DEDUP"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+	printf("%s", stats);
+
+	// copy on write: the modified key reads the new value, its neighbours the shared one
+	for (p = 0;p < engines;p ++) {
+		snprintf(cmd, 512, "%cMOD Dedup0 %s-own", prefixes[p], value[0]);
+		test_case(connfd, cmd, "SUCCESS", "DedupMODCase");
+		snprintf(cmd, 512, "%cGET Dedup0", prefixes[p]);
+		snprintf(result, 512, "%s-own", value[0]);
+		test_case(connfd, cmd, result, "DedupGETCase");
+		snprintf(cmd, 512, "%cGET Dedup4", prefixes[p]);
+		test_case(connfd, cmd, value[0], "DedupGETCase");
+	}
+
+	for (p = 0;p < engines;p ++) {
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 512, "%cGET Dedup%d", prefixes[p], i);
+			if (i == 0) snprintf(result, 512, "%s-own", value[0]);
+			else snprintf(result, 512, "%s", value[i % 4]);
+			test_case(connfd, cmd, result, "DedupGETCase");
+			snprintf(cmd, 512, "%cDEL Dedup%d", prefixes[p], i);
+			test_case(connfd, cmd, "SUCCESS", "DedupDELCase");
+		}
+	}
+
+	if (dedup_stat(connfd, "values:") != values || dedup_stat(connfd, "refs:") != refs) {
+		printf("==> FAILED --> DedupReleaseCase, values %ld refs %ld\n", dedup_stat(connfd, "values:"), dedup_stat(connfd, "refs:"));
+	}
+
+	test_case(connfd, "CONFIG SET dedup no", "SUCCESS", "DedupCONFIGCase");
+}
+
+static double vlog_stat(int connfd, const char *field) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS VLOG", strlen("STATS VLOG"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, field);
+	return p ? atof(p + strlen(field)) : -1;
+}
+
+static void vlog_value(int i, int version, char *value) {
+	snprintf(value, 128, "log-value-%08d-version-%d-padding-to-sixty-bytes-of-data", i, version);
+}
+
+// values in the log through MOD churn and deletes: the cleaner compacts the
+// sparse segments, every survivor reads back, and the log empties with the
+// keys
+void vlog_testcase(int connfd, char *prefixes, int count) {
+
+	char cmd[512] = {0};
+	char value[128] = {0};
+	int i = 0, p = 0, v = 0;
+	int engines = strlen(prefixes);
+
+	test_case(connfd, "CONFIG SET value-log yes", "SUCCESS", "VlogCONFIGCase");
+	test_case(connfd, "CONFIG GET value-log", "yes", "VlogCONFIGCase");
+
+	for (v = 0;v < 4;v ++) {
+		for (p = 0;p < engines;p ++) {
+			for (i = 0;i < count;i ++) {
+				vlog_value(i, v, value);
+				snprintf(cmd, 512, "%c%s Log%d %s", prefixes[p], v ? "MOD" : "SET", i, value);
+				test_case(connfd, cmd, "SUCCESS", "VlogSETCase");
+			}
+		}
+	}
+	for (p = 0;p < engines;p ++) {
+		for (i = 0;i < count;i ++) {
+			if (i % 4 == 0) continue;
+			snprintf(cmd, 512, "%cDEL Log%d", prefixes[p], i);
+			test_case(connfd, cmd, "SUCCESS", "VlogDELCase");
+		}
+	}
+
+	double segments = vlog_stat(connfd, "segments:");
+	double cleaned = vlog_stat(connfd, "cleaned:");
+
+	int waited = 0;
+	while (waited < 15000 && vlog_stat(connfd, "segments:") > segments / 4 + 1) {
+		usleep(100 * 1000);
+		waited += 100;
+	}
+
+	if (vlog_stat(connfd, "cleaned:") <= cleaned || vlog_stat(connfd, "utilization:") < 0.5) {
+		printf("==> FAILED --> VlogCleanCase, segments %.0f -> %.0f utilization %.2f\n",
+			segments, vlog_stat(connfd, "segments:"), vlog_stat(connfd, "utilization:"));
+	}
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS VLOG", strlen("STATS VLOG"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+	printf("%s", stats);
+
+	for (p = 0;p < engines;p ++) {
+		for (i = 0;i < count;i += 4) {
+			vlog_value(i, 3, value);
+			snprintf(cmd, 512, "%cGET Log%d", prefixes[p], i);
+			test_case(connfd, cmd, value, "VlogGETCase");
+			snprintf(cmd, 512, "%cDEL Log%d", prefixes[p], i);
+			test_case(connfd, cmd, "SUCCESS", "VlogDELCase");
+		}
+	}
+
+	if (vlog_stat(connfd, " live:") != 0) {
+		printf("==> FAILED --> VlogReleaseCase, live %.0f\n", vlog_stat(connfd, " live:"));
+	}
+
+	test_case(connfd, "CONFIG SET value-log no", "SUCCESS", "VlogCONFIGCase");
+}
+
+static long engine_memory(int connfd, const char *engine) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS MEMORY", strlen("STATS MEMORY"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char field[64] = {0};
+	snprintf(field, 64, " %s:", engine);
+	char *p = strstr(stats, field);
+	return p ? atol(p + strlen(field)) : -1;
+}
+
+// memory per key of an engine: count keys with inline key and value, so the
+// node and its links are all there is. with compact references (STATS SLAB
+// compact_refs:yes) the links are 32 bit and a key must fit in limit bytes.
+void refs_testcase(int connfd, char *prefix, char *engine, int count, long limit) {
+
+	char cmd[512] = {0};
+	char result[512] = {0};
+	int i = 0;
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS SLAB", strlen("STATS SLAB"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+	int compact = strstr(stats, "compact_refs:yes") != NULL;
+
+	long before = engine_memory(connfd, engine);
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 512, "%sSET Ref%07d v%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "RefsSETCase");
+	}
+
+	long after = engine_memory(connfd, engine);
+	double per_key = (double)(after - before) / count;
+
+	printf("%s: %d keys, %.1f bytes/key, compact_refs:%s\n", engine, count, per_key, compact ? "yes" : "no");
+	if (compact && per_key > limit) {
+		printf("==> FAILED --> RefsMemoryCase, %s %.1f bytes/key > %ld\n", engine, per_key, limit);
+	}
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 512, "%sGET Ref%07d", prefix, i);
+		snprintf(result, 512, "v%d", i);
+		test_case(connfd, cmd, result, "RefsGETCase");
+	}
+	for (i = 0;i < count;i += 2) {
+		snprintf(cmd, 512, "%sDEL Ref%07d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "RefsDELCase");
+	}
+	for (i = 1;i < count;i += 2) {
+		snprintf(cmd, 512, "%sGET Ref%07d", prefix, i);
+		snprintf(result, 512, "v%d", i);
+		test_case(connfd, cmd, result, "RefsGETCase");
+		snprintf(cmd, 512, "%sDEL Ref%07d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "RefsDELCase");
+	}
+
+	snprintf(cmd, 512, "%sCOUNT", prefix);
+	test_case(connfd, cmd, "0", "RefsCOUNTCase");
+}
+
+static int ebr_stats(int connfd, long *retired, long *freed, long *deferred_bytes) {
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS EBR", strlen("STATS EBR"));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *r = strstr(stats, "retired:");
+	char *f = strstr(stats, "freed:");
+	char *b = strstr(stats, "deferred_bytes:");
+	if (!r || !f || !b) return -1;
+
+	*retired = atol(r + strlen("retired:"));
+	*freed = atol(f + strlen("freed:"));
+	*deferred_bytes = atol(b + strlen("deferred_bytes:"));
+	return 0;
+}
+
+// what workers retired goes back at the next rounds of their event loops,
+// the cron wakes every loop at least every 100ms. 0: nothing deferred
+static int ebr_drain(int connfd, long *retired, long *freed, long *deferred_bytes) {
+
+	int i = 0;
+	for (i = 0;i < 30;i ++) {
+		if (ebr_stats(connfd, retired, freed, deferred_bytes) < 0) return -1;
+		if (*retired == *freed && *deferred_bytes == 0) return 0;
+		usleep(100 * 1000);
+	}
+	return -1;
+}
+
+static long memory_stat(int connfd, char engine, const char *field) {
+
+	const char *names = "RHSB";
+	const char *engines[] = {"rbtree", "hash", "skiptable", "btree"};
+
+	char cmd[64] = {0};
+	snprintf(cmd, 64, "MEMORY STATS %s", engines[strchr(names, engine) - names]);
+
+	char stats[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, cmd, strlen(cmd));
+	recv_msg(connfd, stats, MAX_MAS_LENGTH);
+
+	char *p = strstr(stats, field);
+	return p ? atol(p + strlen(field)) : -1;
+}
+
+// per tag accounting: keys with heap keys and values grow the node, key and
+// value counters, MEMORY USAGE of a key matches what it added, and deleting
+// the keys brings every counter back to where it was.
+void memory_testcase(int connfd, char *prefixes, int count) {
+
+	const char *kinds[] = {" node:", " key:", " value:", " index:"};
+
+	char cmd[512] = {0};
+	char result[512] = {0};
+	long before[4] = {0};
+	int i = 0, p = 0, k = 0;
+	int engines = strlen(prefixes);
+
+	test_case(connfd, "MEMORY USAGE NoSuchMemoryKey", "NO EXIST", "MemoryUSAGECase");
+	test_case(connfd, "MEMORY STATS nosuchengine", "NO EXIST", "MemorySTATSCase");
+
+	for (p = 0;p < engines;p ++) {
+		char e = prefixes[p];
+
+		long retired = 0, freed = 0, deferred = 0;
+		ebr_drain(connfd, &retired, &freed, &deferred);
+		for (k = 0;k < 4;k ++) before[k] = memory_stat(connfd, e, kinds[k]);
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 512, "%cSET MemoryKey-%08d memory-value-%08d-longer-than-inline", e, i, i);
+			test_case(connfd, cmd, "SUCCESS", "MemorySETCase");
+		}
+
+		long node = memory_stat(connfd, e, " node:") - before[0];
+		long key = memory_stat(connfd, e, " key:") - before[1];
+		long value = memory_stat(connfd, e, " value:") - before[2];
+		if (node <= 0 || key < (long)count * 22 || value < (long)count * 45) {
+			printf("==> FAILED --> MemoryTagCase, %c node %ld key %ld value %ld\n", e, node, key, value);
+		}
+
+		// rbtree and hash keys of one shape all cost the same
+		snprintf(cmd, 512, "MEMORY USAGE MemoryKey-%08d", count / 2);
+		send_msg(connfd, cmd, strlen(cmd));
+		memset(result, 0, 512);
+		recv_msg(connfd, result, 512);
+
+		char field[32] = {0};
+		snprintf(field, 32, "%s:", e == 'R' ? "rbtree" : e == 'H' ? "hash" : e == 'S' ? "skiptable" : "btree");
+		char *u = strstr(result, field);
+		long usage = u ? atol(u + strlen(field)) : -1;
+		if (usage <= 0 || ((e == 'R' || e == 'H') && usage * count != node + key + value)) {
+			printf("==> FAILED --> MemoryUSAGECase, %c usage %ld, %ld per key\n", e, usage, (node + key + value) / count);
+		}
+
+		printf("%c: %ld bytes/key node %ld key %ld value %ld, MEMORY USAGE %ld\n", e,
+			(node + key + value) / count, node / count, key / count, value / count, usage);
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 512, "%cDEL MemoryKey-%08d", e, i);
+			test_case(connfd, cmd, "SUCCESS", "MemoryDELCase");
+		}
+
+		// with several workers the frees wait for the lockless readers
+		ebr_drain(connfd, &retired, &freed, &deferred);
+		for (k = 0;k < 3;k ++) {
+			long after = memory_stat(connfd, e, kinds[k]);
+			if (after != before[k]) {
+				printf("==> FAILED --> MemoryReleaseCase, %c%s %ld != %ld\n", e, kinds[k], after, before[k]);
+			}
+		}
+	}
+}
+
+void latency_testcase(int connfd, char *prefix, int count) {
+
+	long *lat = malloc(sizeof(long) * count);
+	if (!lat) return ;
+
+	int i = 0;
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sSET Lat%d Value%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "LatSETCase");
+	}
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		char result[128] = {0};
+		snprintf(cmd, 128, "%sGET Lat%d", prefix, i);
+		snprintf(result, 128, "Value%d", i);
+
+		struct timeval tv_begin, tv_end;
+		gettimeofday(&tv_begin, NULL);
+		test_case(connfd, cmd, result, "LatGETCase");
+		gettimeofday(&tv_end, NULL);
+
+		lat[i] = TIME_SUB_US(tv_end, tv_begin);
+	}
+
+	for (i = 0;i < count;i ++) {
+		char cmd[128] = {0};
+		snprintf(cmd, 128, "%sDEL Lat%d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "LatDELCase");
+	}
+
+	qsort(lat, count, sizeof(long), cmp_latency);
+
+	printf("%sGET latency--> p50: %ldus, p99: %ldus, p99.9: %ldus, max: %ldus\n", prefix,
+		lat[count / 2], lat[count * 99 / 100], lat[count * 999 / 1000], lat[count - 1]);
+
+	free(lat);
+}
+
 
 int connect_tcpserver(const char *ip, unsigned short port) {
 
-	int connfd = socket(AF_INET, SOCK_STREAM, 0);
+	int connfd = socket(AF_INET, SOCK_STREAM, 0);
+
+	struct sockaddr_in tcpserver_addr;
+	memset(&tcpserver_addr, 0, sizeof(struct sockaddr_in));
+
+	tcpserver_addr.sin_family = AF_INET;
+	tcpserver_addr.sin_addr.s_addr = inet_addr(ip);
+	tcpserver_addr.sin_port = htons(port);
+
+	int ret = connect(connfd, (struct sockaddr*)&tcpserver_addr, sizeof(struct sockaddr_in));
+	if (ret) {
+		perror("connect");
+		return -1;
+	}
+
+	return connfd;
+}
+
+#define SHARD_CONNS		8
+
+static int shard_count(int connfd, char engine) {
+
+	char cmd[32] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+
+	snprintf(cmd, 32, "%cCOUNT", engine);
+	send_msg(connfd, cmd, strlen(cmd));
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+
+	return atoi(result);
+}
+
+// keys set on one connection are read, counted and deleted on the others.
+// against kvstore -w the connections land on different workers and the
+// keys on different shards, COUNT has to add them all up
+void shard_testcase(const char *ip, unsigned short port, char *prefixes, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	int i = 0, p = 0;
+
+	for (i = 0;i < SHARD_CONNS;i ++) {
+		conns[i] = connect_tcpserver(ip, port);
+		if (conns[i] < 0) {
+			printf("==> FAILED --> ShardConnectCase\n");
+			return ;
+		}
+	}
+
+	for (p = 0;p < (int)strlen(prefixes);p ++) {
+		char e = prefixes[p];
+		int base = shard_count(conns[0], e);
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cSET ShardKey-%d shard-value-%d", e, i, i);
+			test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "ShardSETCase");
+		}
+
+		for (i = 0;i < SHARD_CONNS;i ++) {
+			int n = shard_count(conns[i], e);
+			if (n != base + count) {
+				printf("==> FAILED --> ShardCOUNTCase, %c %d != %d\n", e, n, base + count);
+			}
+		}
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cGET ShardKey-%d", e, i);
+			snprintf(pattern, 128, "shard-value-%d", i);
+			test_case(conns[(i + 1) % SHARD_CONNS], cmd, pattern, "ShardGETCase");
+		}
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cDEL ShardKey-%d", e, i);
+			test_case(conns[(i + 2) % SHARD_CONNS], cmd, "SUCCESS", "ShardDELCase");
+		}
+
+		int n = shard_count(conns[SHARD_CONNS - 1], e);
+		if (n != base) {
+			printf("==> FAILED --> ShardCOUNTCase, %c %d != %d after DEL\n", e, n, base);
+		}
+	}
+
+	for (i = 0;i < SHARD_CONNS;i ++) {
+		close(conns[i]);
+	}
+}
+
+// RANGE counts of an ordered engine over more keys than one step of the
+// compute thread, with keys deleted between the calls, and a GET on another
+// connection while a RANGE is in flight
+void range_testcase(const char *ip, unsigned short port, char *prefix, char *engine, int count) {
+
+	int connfd = connect_tcpserver(ip, port);
+	int other = connect_tcpserver(ip, port);
+	if (connfd < 0 || other < 0) {
+		printf("==> FAILED --> RangeConnectCase\n");
+		return ;
+	}
+
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	int i = 0;
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 128, "%sSET Range%06d v%d", prefix, i, i);
+		test_case(connfd, cmd, "SUCCESS", "RangeSETCase");
+	}
+
+	snprintf(cmd, 128, "RANGE %s Range000000 Range999999", engine);
+	snprintf(pattern, 128, "%d", count);
+	test_case(connfd, cmd, pattern, "RangeAllCase");
+
+	snprintf(cmd, 128, "RANGE %s Range000100 Range000199", engine);
+	test_case(connfd, cmd, "100", "RangeSubCase");
+
+	snprintf(cmd, 128, "RANGE %s Range%06d Range~", engine, count - 10);
+	test_case(connfd, cmd, "10", "RangeTailCase");
+
+	snprintf(cmd, 128, "RANGE %s Range000200 Range000100", engine);
+	test_case(connfd, cmd, "0", "RangeEmptyCase");
+
+	test_case(connfd, "RANGE hash a b", "ERROR", "RangeEngineCase");
+	snprintf(cmd, 128, "RANGE %s Range000000", engine);
+	test_case(connfd, cmd, "ERROR", "RangeArgsCase");
+
+	// the reply to the GET does not depend on the RANGE before it
+	snprintf(cmd, 128, "RANGE %s Range000000 Range999999", engine);
+	send_msg(connfd, cmd, strlen(cmd));
+	snprintf(cmd, 128, "%sGET Range000007", prefix);
+	test_case(other, cmd, "v7", "RangeConcurrentGETCase");
+	char result[MAX_MAS_LENGTH] = {0};
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+	equals(pattern, result, "RangeConcurrentCase");
+
+	for (i = 1;i < count;i += 2) {
+		snprintf(cmd, 128, "%sDEL Range%06d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "RangeDELCase");
+	}
+
+	snprintf(cmd, 128, "RANGE %s Range000000 Range999999", engine);
+	snprintf(pattern, 128, "%d", (count + 1) / 2);
+	test_case(connfd, cmd, pattern, "RangeAfterDELCase");
+
+	for (i = 0;i < count;i += 2) {
+		snprintf(cmd, 128, "%sDEL Range%06d", prefix, i);
+		test_case(connfd, cmd, "SUCCESS", "RangeDELCase");
+	}
+
+	snprintf(cmd, 128, "RANGE %s Range000000 Range999999", engine);
+	test_case(connfd, cmd, "0", "RangeClearedCase");
+
+	close(connfd);
+	close(other);
+}
+
+// connections may move to another worker between requests: every one
+// keeps getting its own answers, and STATS SCHED adds up to the workers
+void sched_testcase(const char *ip, unsigned short port, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> SchedConnectCase\n");
+			return ;
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "HSET Sched-%d-%d v%d", c, i, i);
+			test_case(conns[c], cmd, "SUCCESS", "SchedSETCase");
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "HGET Sched-%d-%d", c, i);
+			snprintf(pattern, 128, "v%d", i);
+			test_case(conns[c], cmd, pattern, "SchedGETCase");
+			snprintf(cmd, 128, "HDEL Sched-%d-%d", c, i);
+			test_case(conns[c], cmd, "SUCCESS", "SchedDELCase");
+		}
+	}
+
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(conns[0], "STATS SCHED", strlen("STATS SCHED"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+
+	int workers = 0, lines = 0;
+	char *line = strstr(result, "workers:");
+	if (strncmp(result, "sched:", 6) != 0 || !line || sscanf(line, "workers:%d", &workers) != 1) {
+		printf("==> FAILED --> SchedStatsCase, '%s'\n", result);
+	} else {
+		for (line = result;(line = strstr(line, "worker:")) != NULL;line ++) lines ++;
+		// the reply is cut at the buffer with many workers
+		if (lines != workers && strlen(result) < MAX_MAS_LENGTH - 128) {
+			printf("==> FAILED --> SchedStatsCase, %d lines for %d workers\n", lines, workers);
+		}
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+// array: 0x01, rbtree: 0x02, hash: 0x04, skiptable: 0x08, btree: 0x10, cuckoo: 0x20, lsm: 0x40, bloom: 0x80, cache: 0x100, maxmemory: 0x200, hugepages: 0x400, defrag: 0x800, inline: 0x1000, compression: 0x2000, refs: 0x4000, dedup: 0x8000, vlog: 0x10000, memory: 0x20000, shards: 0x40000, range: 0x80000, sched: 0x100000, rcu: 0x200000, ebr: 0x400000, numa: 0x800000, blink: 0x1000000, cow: 0x2000000, epoll: 0x4000000
+
+// ./testcase -s 192.168.243.131 -p 9096 -m 1
+// RGET, SGET and BGET of keys that other workers own, answered without the
+// shard lock, while one connection keeps changing the same keys: a GET sent
+// between a MOD and its reply must see the old or the new value, nothing
+// else. with more than one worker STATS RCU must show lockless reads
+void rcu_testcase(const char *ip, unsigned short port, char *prefixes, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> RcuConnectCase\n");
+			return ;
+		}
+	}
+
+	char *p = NULL;
+	for (p = prefixes;*p;p ++) {
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cSET Rcu-%c-%d a%d", *p, *p, i, i);
+			test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "RcuSETCase");
+		}
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cMOD Rcu-%c-%d b%d", *p, *p, i, i);
+			send_msg(conns[0], cmd, strlen(cmd));
+
+			for (c = 1;c < SHARD_CONNS;c ++) {
+				snprintf(cmd, 128, "%cGET Rcu-%c-%d", *p, *p, i);
+				send_msg(conns[c], cmd, strlen(cmd));
+
+				memset(result, 0, MAX_MAS_LENGTH);
+				recv_msg(conns[c], result, MAX_MAS_LENGTH);
+				if (atoi(result + 1) != i || (result[0] != 'a' && result[0] != 'b')) {
+					printf("==> FAILED --> RcuGETCase, '%s' for key %d\n", result, i);
+				}
+			}
+
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[0], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "RcuMODCase");
+		}
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 128, "%cGET Rcu-%c-%d", *p, *p, i);
+			snprintf(pattern, 128, "b%d", i);
+			test_case(conns[i % SHARD_CONNS], cmd, pattern, "RcuGETCase");
+
+			snprintf(cmd, 128, "%cDEL Rcu-%c-%d", *p, *p, i);
+			test_case(conns[(i + 1) % SHARD_CONNS], cmd, "SUCCESS", "RcuDELCase");
+
+			snprintf(cmd, 128, "%cGET Rcu-%c-%d", *p, *p, i);
+			test_case(conns[(i + 2) % SHARD_CONNS], cmd, "NO EXIST", "RcuGETCase");
+		}
+	}
+
+	memset(result, 0, MAX_MAS_LENGTH);
+	send_msg(conns[0], "STATS RCU", strlen("STATS RCU"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+
+	char state[16] = {0};
+	long reads = -1;
+	if (sscanf(result, "rcu:%15s reads:%ld", state, &reads) != 2) {
+		printf("==> FAILED --> RcuStatsCase, '%s'\n", result);
+	} else if (strcmp(state, "yes") == 0 && reads <= 0) {
+		printf("==> FAILED --> RcuStatsCase, no lockless reads: '%s'\n", result);
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+// long values written, read from every connection and deleted, so that
+// workers free what others may be reading. whatever went to the limbo
+// lists must come back at the quiescent points of the event loops: shortly
+// after the last write STATS EBR shows nothing deferred. with more than one
+// worker the frees must have gone through it at all
+void ebr_testcase(const char *ip, unsigned short port, char *prefixes, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[256] = {0};
+	char pattern[128] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> EbrConnectCase\n");
+			return ;
+		}
+	}
+
+	long retired = 0, freed = 0, bytes = 0;
+	if (ebr_stats(conns[0], &retired, &freed, &bytes) < 0) {
+		printf("==> FAILED --> EbrStatsCase\n");
+	}
+	long before = retired;
+
+	char *p = NULL;
+	for (p = prefixes;*p;p ++) {
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 256, "%cSET Ebr-%c-%d %0100d", *p, *p, i, i);
+			test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "EbrSETCase");
+		}
+
+		for (i = 0;i < count;i ++) {
+			snprintf(cmd, 256, "%cGET Ebr-%c-%d", *p, *p, i);
+			snprintf(pattern, 128, "%0100d", i);
+			test_case(conns[(i + 3) % SHARD_CONNS], cmd, pattern, "EbrGETCase");
+
+			snprintf(cmd, 256, "%cDEL Ebr-%c-%d", *p, *p, i);
+			test_case(conns[(i + 5) % SHARD_CONNS], cmd, "SUCCESS", "EbrDELCase");
+		}
+	}
+
+	if (ebr_drain(conns[0], &retired, &freed, &bytes) < 0) {
+		printf("==> FAILED --> EbrDrainCase, retired:%ld freed:%ld deferred_bytes:%ld\n", retired, freed, bytes);
+	}
+
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(conns[0], "STATS RCU", strlen("STATS RCU"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+	if (strncmp(result, "rcu:single", strlen("rcu:single")) != 0 && retired - before < count) {
+		printf("==> FAILED --> EbrRetireCase, %ld retired with more than one worker\n", retired - before);
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+// a value shared by an rbtree key and the lsm memtable: the rbtree keys are
+// deleted while the other connections read them, lockless across workers,
+// and the memtable fills up and flushes meanwhile. whichever lets go of a
+// value last, a worker or the lsm thread, the readers see it whole, and
+// nothing stays deferred
+void dedup_flush_testcase(const char *ip, unsigned short port, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[512] = {0};
+	char value[128] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> DedupFlushConnectCase\n");
+			return ;
+		}
+	}
+
+	test_case(conns[0], "CONFIG SET dedup yes", "SUCCESS", "DedupCONFIGCase");
+
+	for (i = 0;i < count;i ++) {
+		snprintf(value, 128, "flush-shared-%06d-%064d", i, i);
+		snprintf(cmd, 512, "LSET DFlush%d %s", i, value);
+		test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "DedupFlushSETCase");
+		snprintf(cmd, 512, "RSET DFlush%d %s", i, value);
+		test_case(conns[(i + 1) % SHARD_CONNS], cmd, "SUCCESS", "DedupFlushSETCase");
+	}
+
+	for (i = 0;i < count;i ++) {
+		snprintf(value, 128, "flush-shared-%06d-%064d", i, i);
+		snprintf(cmd, 512, "RDEL DFlush%d", i);
+		send_msg(conns[0], cmd, strlen(cmd));
+
+		for (c = 1;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 512, "RGET DFlush%d", i);
+			send_msg(conns[c], cmd, strlen(cmd));
+
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			if (strcmp(result, value) != 0 && strcmp(result, "NO EXIST") != 0) {
+				printf("==> FAILED --> DedupFlushGETCase, '%s' for key %d\n", result, i);
+			}
+		}
+
+		memset(result, 0, MAX_MAS_LENGTH);
+		recv_msg(conns[0], result, MAX_MAS_LENGTH);
+		equals("SUCCESS", result, "DedupFlushDELCase");
+
+		// over dedup-max-size, the memtable fills without sharing more
+		snprintf(cmd, 512, "LSET DFill%d %0300d", i, i);
+		test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "DedupFlushFillCase");
+	}
+
+	long retired = 0, freed = 0, bytes = 0;
+	if (ebr_drain(conns[0], &retired, &freed, &bytes) < 0) {
+		printf("==> FAILED --> DedupFlushDrainCase, retired:%ld freed:%ld deferred_bytes:%ld\n", retired, freed, bytes);
+	}
+
+	for (i = 0;i < count;i ++) {
+		snprintf(cmd, 512, "LDEL DFlush%d", i);
+		test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "DedupFlushDELCase");
+		snprintf(cmd, 512, "LDEL DFill%d", i);
+		test_case(conns[i % SHARD_CONNS], cmd, "SUCCESS", "DedupFlushDELCase");
+	}
+
+	test_case(conns[0], "CONFIG SET dedup no", "SUCCESS", "DedupCONFIGCase");
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+// STATS NUMA: a line per worker, as many as STATS SCHED counts, every one
+// pinned to a cpu the summary knows of unless placement is off
+void numa_testcase(int connfd) {
+
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS NUMA", strlen("STATS NUMA"));
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+
+	char policy[16] = {0};
+	int nodes = 0, cpus = 0, workers = 0;
+	if (sscanf(result, "numa:%15s nodes:%d cpus:%d workers:%d", policy, &nodes, &cpus, &workers) != 4 ||
+		nodes < 1 || cpus < 1 || workers < 1) {
+		printf("==> FAILED --> NumaStatsCase, '%s'\n", result);
+		return ;
+	}
+
+	int lines = 0;
+	char *line = strchr(result, '\n');
+	while (line && line[1]) {
+		int worker = -1, cpu = -1, node = -1, pinned = -1;
+		if (sscanf(line + 1, "worker:%d cpu:%d node:%d pinned:%d", &worker, &cpu, &node, &pinned) != 4 || worker != lines) {
+			printf("==> FAILED --> NumaWorkerCase, '%s'\n", line + 1);
+			return ;
+		}
+		if (strcmp(policy, "off") != 0 && (cpu < 0 || node < 0 || pinned != 1)) {
+			printf("==> FAILED --> NumaPinCase, worker %d cpu %d node %d pinned %d\n", worker, cpu, node, pinned);
+		}
+		lines ++;
+		line = strchr(line + 1, '\n');
+	}
+
+	char sched[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "STATS SCHED", strlen("STATS SCHED"));
+	recv_msg(connfd, sched, MAX_MAS_LENGTH);
+	char *w = strstr(sched, "workers:");
+	if (lines != workers || !w || atoi(w + strlen("workers:")) != workers) {
+		printf("==> FAILED --> NumaWorkersCase, %d lines, '%s'\n", lines, result);
+	}
+}
+
+static int blink_count(int connfd) {
+
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "BLCOUNT", strlen("BLCOUNT"));
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+
+	return atoi(result);
+}
+
+// the b-link tree is one for every worker: the connections write their own
+// keys at the same time, each sends before any reads its reply, and then
+// read, change and delete the keys of the others. the B* replies, misses
+// included, and BLCOUNT, RANGE and STATS BLINK must agree all along
+void blink_testcase(const char *ip, unsigned short port, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> BlinkConnectCase\n");
+			return ;
+		}
+	}
+
+	test_case(conns[0], "BLSET Name King", "SUCCESS", "BlinkSETCase");
+	test_case(conns[1], "BLGET Name", "King", "BlinkGETCase");
+	test_case(conns[2], "BLMOD Name Darren", "SUCCESS", "BlinkMODCase");
+	test_case(conns[3], "BLGET Name", "Darren", "BlinkGETCase");
+	test_case(conns[4], "BLSET Name King", "SUCCESS", "BlinkSETCase");
+	test_case(conns[5], "BLGET Name", "King", "BlinkGETCase");
+	test_case(conns[6], "BLDEL Name", "SUCCESS", "BlinkDELCase");
+	test_case(conns[7], "BLGET Name", "NO EXIST", "BlinkGETCase");
+	test_case(conns[0], "BLDEL Name", "ERROR", "BlinkDELCase");
+	test_case(conns[1], "BLMOD Name Darren", "ERROR", "BlinkMODCase");
+
+	int base = blink_count(conns[0]);
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "BLSET Blink-%d-%06d v%d-%d", c, i, c, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "BlinkConcurrentSETCase");
+		}
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		int n = blink_count(conns[c]);
+		if (n != base + count * SHARD_CONNS) {
+			printf("==> FAILED --> BlinkCOUNTCase, %d != %d\n", n, base + count * SHARD_CONNS);
+		}
+	}
+
+	snprintf(pattern, 128, "%d", count * SHARD_CONNS);
+	test_case(conns[0], "RANGE blink Blink-0-000000 Blink-9", pattern, "BlinkRangeCase");
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "BLGET Blink-%d-%06d", (c + 1) % SHARD_CONNS, i);
+			snprintf(pattern, 128, "v%d-%d", (c + 1) % SHARD_CONNS, i);
+			test_case(conns[c], cmd, pattern, "BlinkGETCase");
+		}
+	}
+
+	// every other key changed by one connection and read by the next
+	for (i = 0;i < count;i += 2) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "BLMOD Blink-%d-%06d w%d-%d", (c + 2) % SHARD_CONNS, i, c, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "BlinkConcurrentMODCase");
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "BLGET Blink-%d-%06d", (c + 2) % SHARD_CONNS, i);
+			snprintf(pattern, 128, "w%d-%d", c, i);
+			test_case(conns[(c + 1) % SHARD_CONNS], cmd, pattern, "BlinkMODGETCase");
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, 128, "BLDEL Blink-%d-%06d", (c + 3) % SHARD_CONNS, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "BlinkConcurrentDELCase");
+		}
+	}
+
+	test_case(conns[4], "BLGET Blink-0-000000", "NO EXIST", "BlinkGETCase");
+	int n = blink_count(conns[SHARD_CONNS - 1]);
+	if (n != base) {
+		printf("==> FAILED --> BlinkCOUNTCase, %d != %d after DEL\n", n, base);
+	}
+
+	memset(result, 0, MAX_MAS_LENGTH);
+	send_msg(conns[0], "STATS BLINK", strlen("STATS BLINK"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+
+	int keys = -1, height = 0;
+	if (sscanf(result, "blink keys:%d height:%d", &keys, &height) != 2 || keys != base || height < 2) {
+		printf("==> FAILED --> BlinkStatsCase, '%s'\n", result);
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+static int cow_count(int connfd) {
+
+	char result[MAX_MAS_LENGTH] = {0};
+	send_msg(connfd, "PCOUNT", strlen("PCOUNT"));
+	recv_msg(connfd, result, MAX_MAS_LENGTH);
+
+	return atoi(result);
+}
+
+#define COW_BACKUP_NAME		"kvstore_cow.backup"
+
+// the copy-on-write tree: the connections write at the same time as in the
+// b-link case. a RANGE and a BACKUP run while the others change every
+// value, each sees one version: all the keys, in order, old or new values.
+// the backup replayed after the keys are gone brings them back
+void cow_testcase(const char *ip, unsigned short port, int count) {
+
+	int conns[SHARD_CONNS];
+	char cmd[MAX_MAS_LENGTH] = {0};
+	char pattern[128] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+	char path[MAX_MAS_LENGTH] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> CowConnectCase\n");
+			return ;
+		}
+	}
+
+	// the server writes into its backup directory, kvstore -b
+	send_msg(conns[0], "CONFIG GET backup-dir", strlen("CONFIG GET backup-dir"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+	snprintf(path, MAX_MAS_LENGTH, "%s/%s", result, COW_BACKUP_NAME);
+
+	test_case(conns[0], "PSET Name King", "SUCCESS", "CowSETCase");
+	test_case(conns[1], "PGET Name", "King", "CowGETCase");
+	test_case(conns[2], "PMOD Name Darren", "SUCCESS", "CowMODCase");
+	test_case(conns[3], "PGET Name", "Darren", "CowGETCase");
+	test_case(conns[4], "PSET Name King", "SUCCESS", "CowSETCase");
+	test_case(conns[5], "PGET Name", "King", "CowGETCase");
+	test_case(conns[6], "PDEL Name", "SUCCESS", "CowDELCase");
+	test_case(conns[7], "PGET Name", "NO EXIST", "CowGETCase");
+	test_case(conns[0], "PDEL Name", "NO EXIST", "CowDELCase");
+	test_case(conns[1], "PMOD Name Darren", "NO EXIST", "CowMODCase");
+	test_case(conns[2], "BACKUP /tmp/kvstore_cow.backup", "ERROR", "CowBackupPathCase");
+	test_case(conns[2], "BACKUP ../kvstore_cow.backup", "ERROR", "CowBackupPathCase");
+	test_case(conns[2], "BACKUP ..", "ERROR", "CowBackupPathCase");
+	test_case(conns[2], "BACKUP .", "ERROR", "CowBackupPathCase");
+
+	int base = cow_count(conns[0]);
+	int total = base + count * SHARD_CONNS;
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, MAX_MAS_LENGTH, "PSET Cow-%d-%06d v%d-%d", c, i, c, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "CowConcurrentSETCase");
+		}
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		int n = cow_count(conns[c]);
+		if (n != total) {
+			printf("==> FAILED --> CowCOUNTCase, %d != %d\n", n, total);
+		}
+	}
+
+	for (i = 0;i < count;i += 7) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, MAX_MAS_LENGTH, "PGET Cow-%d-%06d", (c + 1) % SHARD_CONNS, i);
+			snprintf(pattern, 128, "v%d-%d", (c + 1) % SHARD_CONNS, i);
+			test_case(conns[c], cmd, pattern, "CowGETCase");
+		}
+	}
+
+	send_msg(conns[0], "RANGE cow Cow-0-000000 Cow-9", strlen("RANGE cow Cow-0-000000 Cow-9"));
+	snprintf(cmd, MAX_MAS_LENGTH, "BACKUP %s", COW_BACKUP_NAME);
+	send_msg(conns[1], cmd, strlen(cmd));
+
+	for (i = 0;i < count;i ++) {
+		for (c = 2;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, MAX_MAS_LENGTH, "PMOD Cow-%d-%06d w%d-%d", (c + i) % SHARD_CONNS, i, c, i);
+			test_case(conns[c], cmd, "SUCCESS", "CowConcurrentMODCase");
+		}
+	}
+
+	snprintf(pattern, 128, "%d", count * SHARD_CONNS);
+	memset(result, 0, MAX_MAS_LENGTH);
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+	equals(pattern, result, "CowRangeCase");
+
+	snprintf(pattern, 128, "%d", total);
+	memset(result, 0, MAX_MAS_LENGTH);
+	recv_msg(conns[1], result, MAX_MAS_LENGTH);
+	equals(pattern, result, "CowBackupCase");
+
+	memset(result, 0, MAX_MAS_LENGTH);
+	send_msg(conns[0], "STATS COW", strlen("STATS COW"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+
+	unsigned long txn = 0;
+	int keys = -1, height = 0, snapshots = -1;
+	if (sscanf(result, "cow txn:%lu keys:%d height:%d snapshots:%d", &txn, &keys, &height, &snapshots) != 4
+		|| keys != total || height < 2 || snapshots != 0) {
+		printf("==> FAILED --> CowStatsCase, '%s'\n", result);
+	}
+
+	// one line per key, in key order, none lost to the writes around it
+	char lines[MAX_MAS_LENGTH] = {0};
+	char last[MAX_MAS_LENGTH] = {0};
+	int nlines = 0, disorder = 0;
+
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		printf("==> FAILED --> CowBackupFileCase\n");
+	} else {
+		while (fgets(lines, MAX_MAS_LENGTH, fp)) {
+			char key[MAX_MAS_LENGTH] = {0};
+			if (sscanf(lines, "PSET %s", key) != 1 || (nlines && strcmp(last, key) >= 0)) disorder ++;
+			snprintf(last, MAX_MAS_LENGTH, "%s", key);
+			nlines ++;
+		}
+		if (nlines != total || disorder) {
+			printf("==> FAILED --> CowBackupFileCase, %d lines, %d out of order\n", nlines, disorder);
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			snprintf(cmd, MAX_MAS_LENGTH, "PDEL Cow-%d-%06d", (c + 3) % SHARD_CONNS, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < SHARD_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "CowConcurrentDELCase");
+		}
+	}
+
+	test_case(conns[4], "PGET Cow-0-000000", "NO EXIST", "CowGETCase");
+	int n = cow_count(conns[SHARD_CONNS - 1]);
+	if (n != base) {
+		printf("==> FAILED --> CowCOUNTCase, %d != %d after DEL\n", n, base);
+	}
+
+	// the restore: the backup replayed line by line
+	if (fp) {
+		rewind(fp);
+		while (fgets(lines, MAX_MAS_LENGTH, fp)) {
+			lines[strcspn(lines, "\n")] = '\0';
+			if (strncmp(lines, "PSET Cow-", strlen("PSET Cow-")) != 0) continue;
+			test_case(conns[5], lines, "SUCCESS", "CowRestoreCase");
+		}
+		fclose(fp);
+
+		n = cow_count(conns[6]);
+		if (n != total) {
+			printf("==> FAILED --> CowRestoreCOUNTCase, %d != %d\n", n, total);
+		}
+
+		memset(result, 0, MAX_MAS_LENGTH);
+		send_msg(conns[7], "PGET Cow-3-000001", strlen("PGET Cow-3-000001"));
+		recv_msg(conns[7], result, MAX_MAS_LENGTH);
+		if (strcmp(result, "v3-1") != 0 && strcmp(result, "w2-1") != 0) {
+			printf("==> FAILED --> CowRestoreGETCase, '%s'\n", result);
+		}
+
+		for (i = 0;i < count;i ++) {
+			for (c = 0;c < SHARD_CONNS;c ++) {
+				snprintf(cmd, MAX_MAS_LENGTH, "PDEL Cow-%d-%06d", c, i);
+				send_msg(conns[c], cmd, strlen(cmd));
+			}
+			for (c = 0;c < SHARD_CONNS;c ++) {
+				memset(result, 0, MAX_MAS_LENGTH);
+				recv_msg(conns[c], result, MAX_MAS_LENGTH);
+				equals("SUCCESS", result, "CowConcurrentDELCase");
+			}
+		}
+	}
+	unlink(path);
+
+	memset(result, 0, MAX_MAS_LENGTH);
+	send_msg(conns[0], "STATS COW", strlen("STATS COW"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+	if (sscanf(result, "cow txn:%lu keys:%d height:%d snapshots:%d", &txn, &keys, &height, &snapshots) != 4
+		|| keys != base || snapshots != 0) {
+		printf("==> FAILED --> CowStatsCase, '%s'\n", result);
+	}
+
+	for (c = 0;c < SHARD_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+#define EPOLL_CONNS		32
+
+// more connections than event loops, all sending before any reads its
+// reply: each keeps getting its own answers, and STATS EPOLL has every
+// loop's line and the loops add up to the summary. not the epoll backend:
+// STATS EPOLL is NO EXIST and only the keys are checked
+void epoll_testcase(const char *ip, unsigned short port, int count) {
+
+	int conns[EPOLL_CONNS];
+	char cmd[128] = {0};
+	char pattern[128] = {0};
+	char result[MAX_MAS_LENGTH] = {0};
+	int i = 0, c = 0;
+
+	for (c = 0;c < EPOLL_CONNS;c ++) {
+		conns[c] = connect_tcpserver(ip, port);
+		if (conns[c] < 0) {
+			printf("==> FAILED --> EpollConnectCase\n");
+			return ;
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < EPOLL_CONNS;c ++) {
+			snprintf(cmd, 128, "HSET Epoll-%d-%d v%d-%d", c, i, c, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < EPOLL_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			equals("SUCCESS", result, "EpollSETCase");
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < EPOLL_CONNS;c ++) {
+			snprintf(cmd, 128, "HGET Epoll-%d-%d", c, i);
+			send_msg(conns[c], cmd, strlen(cmd));
+		}
+		for (c = 0;c < EPOLL_CONNS;c ++) {
+			memset(result, 0, MAX_MAS_LENGTH);
+			recv_msg(conns[c], result, MAX_MAS_LENGTH);
+			snprintf(pattern, 128, "v%d-%d", c, i);
+			equals(pattern, result, "EpollGETCase");
+		}
+	}
+
+	memset(result, 0, MAX_MAS_LENGTH);
+	send_msg(conns[0], "STATS EPOLL", strlen("STATS EPOLL"));
+	recv_msg(conns[0], result, MAX_MAS_LENGTH);
+
+	if (strcmp(result, "NO EXIST") != 0) {
+		int loops = 0, connections = 0;
+		unsigned long accepted = 0, requests = 0;
+		if (sscanf(result, "epoll loops:%d connections:%d accepted:%lu requests:%lu",
+			&loops, &connections, &accepted, &requests) != 4 || loops < 1 || connections < EPOLL_CONNS) {
+			printf("==> FAILED --> EpollStatsCase, '%s'\n", result);
+		} else {
+			int lines = 0, sum = 0;
+			char *line = strchr(result, '\n');
+			while (line && line[1]) {
+				int id = -1, n = 0;
+				if (sscanf(line + 1, "loop:%d connections:%d", &id, &n) != 2 || id != lines) break;
+				sum += n;
+				lines ++;
+				line = strchr(line + 1, '\n');
+			}
+			// the reply is cut at the buffer with many loops
+			if (strlen(result) < MAX_MAS_LENGTH - 128 && (lines != loops || sum != connections)) {
+				printf("==> FAILED --> EpollLoopsCase, %d lines, %d connections, '%s'\n", lines, sum, result);
+			}
+		}
+	}
+
+	for (i = 0;i < count;i ++) {
+		for (c = 0;c < EPOLL_CONNS;c ++) {
+			snprintf(cmd, 128, "HDEL Epoll-%d-%d", c, i);
+			test_case(conns[c], cmd, "SUCCESS", "EpollDELCase");
+		}
+	}
+
+	for (c = 0;c < EPOLL_CONNS;c ++) {
+		close(conns[c]);
+	}
+}
+
+int main(int argc, char *argv[]) {
+
+	int ret = 0;
+
+	char ip[16] = {0};
+	int port = 0;
+	int mode = 1;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:p:m:?")) != -1) {
+
+		switch (opt) {
+
+			case 's':
+				strcpy(ip, optarg);
+				break;
+
+			case 'p':
+				port = atoi(optarg);
+				break;
+
+			case 'm':
+				mode = atoi(optarg);
+				break;
+
+			default:
+				return -1;
+		
+		}
+		
+	}
+
+	
+	int connfd = connect_tcpserver(ip, port);
+
+	if (mode & 0x1) { // array
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		array_testcase_10w(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("array testcase--> time_used: %d, qps: %d\n", time_used, 600000 * 1000 / time_used);
+	}
+
+	if (mode & 0x2) { // rbtree
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		//rbtree_testcase_10w(connfd);
+		
+		rbtree_testcase_5w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("rbtree testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+	
+	}
+
+	if (mode & 0x4) { // hash
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		//hash_testcase(connfd);
+		hash_testcase_5w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("hash testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+		
+	
+	}
+
+	if (mode & 0x8) { // skiptable
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		skiptable_testcase_5w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("skiptable testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+	}
+
+	if (mode & 0x10) { // btree
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		btree_testcase_5w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("btree testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+	}
+
+	if (mode & 0x20) { // cuckoo
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		cuckoo_testcase(connfd);
+		cuckoo_testcase_5w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("cuckoo testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+		// tail latency against the chained hash
+		latency_testcase(connfd, "H", 100000);
+		latency_testcase(connfd, "C", 100000);
+
+	}
+
+	if (mode & 0x40) { // lsm
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		lsm_testcase(connfd);
+		lsm_testcase_20w_node(connfd);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("lsm testcase-->  time_used: %d, qps: %d\n", time_used, 587154 * 1000 / time_used);
+
+	}
+
+	if (mode & 0x80) { // bloom
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		bloom_testcase(connfd, "R", 20000);
+		bloom_testcase(connfd, "S", 20000);
+		bloom_testcase(connfd, "B", 20000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("bloom testcase-->  time_used: %d, qps: %d\n", time_used, 270000 * 1000 / time_used);
 
-	struct sockaddr_in tcpserver_addr;
-	memset(&tcpserver_addr, 0, sizeof(struct sockaddr_in));
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS BLOOM", strlen("STATS BLOOM"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
-	tcpserver_addr.sin_family = AF_INET;
-	tcpserver_addr.sin_addr.s_addr = inet_addr(ip);
-	tcpserver_addr.sin_port = htons(port);
+	}
+
+	if (mode & 0x100) { // hot-key cache
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		cache_testcase(connfd, "R", 5000);
+		cache_testcase(connfd, "S", 5000);
+		cache_testcase(connfd, "B", 5000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("cache testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS CACHE", strlen("STATS CACHE"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
-	int ret = connect(connfd, (struct sockaddr*)&tcpserver_addr, sizeof(struct sockaddr_in));
-	if (ret) {
-		perror("connect");
-		return -1;
 	}
 
-	return connfd;
-}
+	if (mode & 0x200) { // maxmemory
 
-// array: 0x01, rbtree: 0x02, hash: 0x04, skiptable: 0x08, btree: 0x10
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+		
+		maxmemory_testcase(connfd, "H", 50000);
+		maxmemory_testcase(connfd, "R", 50000);
+		maxmemory_testcase(connfd, "C", 50000);
 
-// ./testcase -s 192.168.243.131 -p 9096 -m 1
-int main(int argc, char *argv[]) {
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
 
-	int ret = 0;
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+		
+		printf("maxmemory testcase-->  time_used: %d\n", time_used);
 
-	char ip[16] = {0};
-	int port = 0;
-	int mode = 1;
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS MEMORY", strlen("STATS MEMORY"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
-	int opt;
-	while ((opt = getopt(argc, argv, "s:p:m:?")) != -1) {
+	}
 
-		switch (opt) {
+	if (mode & 0x400) { // huge pages
 
-			case 's':
-				strcpy(ip, optarg);
-				break;
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
 
-			case 'p':
-				port = atoi(optarg);
-				break;
+		hugepage_testcase(connfd, "R", 50000);
 
-			case 'm':
-				mode = atoi(optarg);
-				break;
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("hugepage testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS SLAB", strlen("STATS SLAB"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
-			default:
-				return -1;
-		
-		}
-		
 	}
 
-	
-	int connfd = connect_tcpserver(ip, port);
+	if (mode & 0x800) { // defrag
 
-	if (mode & 0x1) { // array
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		defrag_testcase(connfd, "H", 30000);
+		defrag_testcase(connfd, "R", 30000);
+		defrag_testcase(connfd, "S", 30000);
+		defrag_testcase(connfd, "B", 30000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("defrag testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS DEFRAG", strlen("STATS DEFRAG"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x1000) { // inline keys and values
 
 		struct timeval tv_begin;
 		gettimeofday(&tv_begin, NULL);
-		
-		array_testcase_10w(connfd);
+
+		inline_testcase(connfd, "H", 20000);
+		inline_testcase(connfd, "R", 20000);
+		inline_testcase(connfd, "S", 20000);
+		inline_testcase(connfd, "B", 20000);
 
 		struct timeval tv_end;
 		gettimeofday(&tv_end, NULL);
 
 		int time_used = TIME_SUB_MS(tv_end, tv_begin);
-		
-		printf("array testcase--> time_used: %d, qps: %d\n", time_used, 600000 * 1000 / time_used);
+
+		printf("inline testcase-->  time_used: %d\n", time_used);
+
 	}
 
-	if (mode & 0x2) { // rbtree
+	if (mode & 0x2000) { // value compression
 
 		struct timeval tv_begin;
 		gettimeofday(&tv_begin, NULL);
-		
-		//rbtree_testcase_10w(connfd);
-		
-		rbtree_testcase_5w_node(connfd);
+
+		compression_testcase(connfd, "R", "rbtree", 10000);
+		compression_testcase(connfd, "H", "hash", 10000);
+		compression_testcase(connfd, "L", "lsm", 10000);
 
 		struct timeval tv_end;
 		gettimeofday(&tv_end, NULL);
 
 		int time_used = TIME_SUB_MS(tv_end, tv_begin);
-		
-		printf("rbtree testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
-	
+
+		printf("compression testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS COMPRESSION", strlen("STATS COMPRESSION"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
 	}
 
-	if (mode & 0x4) { // hash
+	if (mode & 0x4000) { // compact node references, memory per key
 
 		struct timeval tv_begin;
 		gettimeofday(&tv_begin, NULL);
-		
-		//hash_testcase(connfd);
-		hash_testcase_5w_node(connfd);
+
+		refs_testcase(connfd, "R", "rbtree", 100000, 60);
+		refs_testcase(connfd, "H", "hash", 100000, 50);
+		refs_testcase(connfd, "S", "skiptable", 100000, 70);
 
 		struct timeval tv_end;
 		gettimeofday(&tv_end, NULL);
 
 		int time_used = TIME_SUB_MS(tv_end, tv_begin);
-		
-		printf("hash testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
 
-		
-	
+		printf("refs testcase-->  time_used: %d\n", time_used);
+
 	}
 
-	if (mode & 0x8) { // skiptable
+	if (mode & 0x8000) { // value deduplication
 
 		struct timeval tv_begin;
 		gettimeofday(&tv_begin, NULL);
-		
-		skiptable_testcase_5w_node(connfd);
+
+		dedup_testcase(connfd, "RHSB", 10000);
+		dedup_flush_testcase(ip, port, 4000);
 
 		struct timeval tv_end;
 		gettimeofday(&tv_end, NULL);
 
 		int time_used = TIME_SUB_MS(tv_end, tv_begin);
-		
-		printf("skiptable testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+		printf("dedup testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS DEDUP", strlen("STATS DEDUP"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
 	}
 
-	if (mode & 0x10) { // btree
+	if (mode & 0x10000) { // log structured values
 
 		struct timeval tv_begin;
 		gettimeofday(&tv_begin, NULL);
-		
-		btree_testcase_5w_node(connfd);
+
+		vlog_testcase(connfd, "RHSB", 20000);
 
 		struct timeval tv_end;
 		gettimeofday(&tv_end, NULL);
 
 		int time_used = TIME_SUB_MS(tv_end, tv_begin);
-		
-		printf("btree testcase-->  time_used: %d, qps: %d\n", time_used, 200000 * 1000 / time_used);
+
+		printf("vlog testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS VLOG", strlen("STATS VLOG"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x20000) { // memory accounting by tag
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		memory_testcase(connfd, "RHSB", 10000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("memory testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "MEMORY STATS", strlen("MEMORY STATS"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x40000) { // keys across connections and shards
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		shard_testcase(ip, port, "RHSBC", 10000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("shard testcase-->  time_used: %d\n", time_used);
+
+	}
+
+	if (mode & 0x80000) { // range counts on the compute threads
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		range_testcase(ip, port, "R", "rbtree", 5000);
+		range_testcase(ip, port, "S", "skiptable", 5000);
+		range_testcase(ip, port, "B", "btree", 5000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("range testcase-->  time_used: %d\n", time_used);
+
+	}
+
+	if (mode & 0x100000) { // connections moving between workers
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		sched_testcase(ip, port, 2000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("sched testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS SCHED", strlen("STATS SCHED"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x200000) { // lockless tree reads across workers
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		rcu_testcase(ip, port, "RSB", 2000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("rcu testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS RCU", strlen("STATS RCU"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x400000) { // epoch-based reclamation
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		ebr_testcase(ip, port, "RSB", 2000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("ebr testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS EBR", strlen("STATS EBR"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x800000) { // worker placement
+
+		numa_testcase(connfd);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS NUMA", strlen("STATS NUMA"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x1000000) { // b-link tree written by every worker
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		blink_testcase(ip, port, 2000);
+		range_testcase(ip, port, "BL", "blink", 5000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("blink testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS BLINK", strlen("STATS BLINK"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x2000000) { // copy-on-write b+tree, snapshots and backup
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		cow_testcase(ip, port, 2000);
+		range_testcase(ip, port, "P", "cow", 5000);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("cow testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS COW", strlen("STATS COW"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
+
+	}
+
+	if (mode & 0x4000000) { // connections spread over the epoll loops
+
+		struct timeval tv_begin;
+		gettimeofday(&tv_begin, NULL);
+
+		epoll_testcase(ip, port, 500);
+
+		struct timeval tv_end;
+		gettimeofday(&tv_end, NULL);
+
+		int time_used = TIME_SUB_MS(tv_end, tv_begin);
+
+		printf("epoll testcase-->  time_used: %d\n", time_used);
+
+		char stats[MAX_MAS_LENGTH] = {0};
+		send_msg(connfd, "STATS EPOLL", strlen("STATS EPOLL"));
+		recv_msg(connfd, stats, MAX_MAS_LENGTH);
+		printf("%s", stats);
 
 	}
 